@@ -0,0 +1,228 @@
+/**
+ * @file compress_bench.c
+ * @brief Ratio, throughput and CPU cost of the codecs of compress.c, on text and on random data
+ * @details
+ * - The text corpus is made of words drawn with Zipf-like frequencies, the random one of random bytes, and the mixed
+ *   one alternates blocks of both
+ * - First round-trips every block of every corpus through every codec and checks it comes back identical, and that
+ *   the entropy probe skips the random corpus. Exits with 1 on a failure.
+ * - Then prints one CSV line per corpus and codec: compression ratio, compression and decompression throughput in MB/s
+ *   (of the compressed blocks, for decompression), CPU nanoseconds per byte to compress, and the throughput of a
+ *   transfer over links of 1 and 10 Gbit/s, taking the slower of compressing and sending. Codec "none" is the probe alone, what incompressible data costs.
+ * - Usage: ./compress_bench.out [-b bytes per corpus], by default 16 MiB
+ */
+
+#include "../common/headers.h"
+#include <getopt.h>
+
+#define VOCABULARY 4096
+#define MAX_WORD 12
+
+const char *codec_names[] = {"none", "fast", "high"};
+const double link_gbits[] = {1, 10};
+
+/**
+ * @brief Current time of a clock in nanoseconds
+ *
+ * @param clock CLOCK_MONOTONIC or CLOCK_PROCESS_CPUTIME_ID
+ * @return u64
+ */
+u64 now_ns(const clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Fill a buffer with words separated by spaces and newlines, the i-th most frequent word about 1/i as often
+ *
+ * @param buffer
+ * @param length
+ */
+void fill_text(u8 *buffer, const u64 length)
+{
+  static char words[VOCABULARY][MAX_WORD + 1];
+  for (i32 i = 0; i < VOCABULARY; ++i)
+  {
+    const i32 word_length = 2 + rand() % (MAX_WORD - 1);
+    for (i32 j = 0; j < word_length; ++j)
+      words[i][j] = 'a' + rand() % 26;
+    words[i][word_length] = '\0';
+  }
+  u64 position = 0;
+  while (position < length)
+  {
+    // 1/u over [1, VOCABULARY) is about Zipf distributed
+    const i32 word = (i32)(VOCABULARY / (1 + (double)rand() / RAND_MAX * (VOCABULARY - 1))) - 1;
+    for (const char *c = words[word]; *c != '\0' && position < length; ++c)
+      buffer[position++] = *c;
+    if (position < length)
+      buffer[position++] = rand() % 12 == 0 ? '\n' : ' ';
+  }
+}
+
+/**
+ * @brief Fill a buffer with random bytes
+ *
+ * @param buffer
+ * @param length
+ */
+void fill_random(u8 *buffer, const u64 length)
+{
+  for (u64 i = 0; i < length; ++i)
+    buffer[i] = rand();
+}
+
+/**
+ * @brief Round-trip every block of a corpus through a codec, as send_block would
+ *
+ * @param name of the corpus
+ * @param corpus
+ * @param length
+ * @param codec
+ * @return u32 number of blocks that did not come back identical
+ */
+u32 check_codec(const char *name, const u8 *corpus, const u64 length, const enum codec codec)
+{
+  u8 *compressed = malloc(compress_bound(TRANSFER_BLOCK_SIZE));
+  u8 *decompressed = malloc(TRANSFER_BLOCK_SIZE);
+  u32 failures = 0;
+  for (u64 offset = 0; offset < length; offset += TRANSFER_BLOCK_SIZE)
+  {
+    // odd sizes too, for the ends of blocks
+    const u32 size = length - offset < TRANSFER_BLOCK_SIZE ? length - offset : (u64)(TRANSFER_BLOCK_SIZE - rand() % 64);
+    const u32 compressed_size =
+      compress_block(codec, corpus + offset, size, compressed, compress_bound(TRANSFER_BLOCK_SIZE));
+    if (compressed_size == 0)
+      continue;
+    if (compressed_size >= size ||
+        decompress_block(compressed, compressed_size, decompressed, TRANSFER_BLOCK_SIZE) != size ||
+        memcmp(decompressed, corpus + offset, size) != 0)
+    {
+      fprintf(stderr, "%s block at %lu of %s did not round-trip\n", codec_names[codec], offset, name);
+      ++failures;
+    }
+    // a damaged block must be rejected or decompress within bounds, never overflow
+    compressed[rand() % compressed_size] ^= 1 << (rand() % 8);
+    decompress_block(compressed, compressed_size, decompressed, TRANSFER_BLOCK_SIZE);
+  }
+  free(compressed);
+  free(decompressed);
+  return failures;
+}
+
+/**
+ * @brief Compress and decompress a corpus block by block with a codec, probe included, and print the results
+ *
+ * @param name of the corpus
+ * @param corpus
+ * @param length
+ * @param codec CODEC_NONE for the probe alone
+ */
+void measure(const char *name, const u8 *corpus, const u64 length, const enum codec codec)
+{
+  const u64 blocks = (length + TRANSFER_BLOCK_SIZE - 1) / TRANSFER_BLOCK_SIZE;
+  u8 *compressed = malloc(blocks * compress_bound(TRANSFER_BLOCK_SIZE));
+  u32 *sizes = malloc(sizeof(u32) * blocks);
+  u8 *decompressed = malloc(TRANSFER_BLOCK_SIZE);
+  u64 wire = 0;
+
+  const u64 start = now_ns(CLOCK_MONOTONIC), cpu_start = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+  for (u64 i = 0; i < blocks; ++i)
+  {
+    const u8 *block = corpus + i * TRANSFER_BLOCK_SIZE;
+    const u32 size = length - i * TRANSFER_BLOCK_SIZE < TRANSFER_BLOCK_SIZE ? length - i * TRANSFER_BLOCK_SIZE
+                                                                            : TRANSFER_BLOCK_SIZE;
+    sizes[i] = 0;
+    if (!looks_incompressible(block, size))
+      sizes[i] = compress_block(codec, block, size, compressed + i * compress_bound(TRANSFER_BLOCK_SIZE),
+                                compress_bound(TRANSFER_BLOCK_SIZE));
+    wire += sizeof(block_header) + (sizes[i] > 0 ? sizes[i] : size);
+  }
+  const u64 compress_ns = now_ns(CLOCK_MONOTONIC) - start;
+  const u64 cpu_ns = now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+  u64 decompressed_bytes = 0;
+  const u64 decompress_start = now_ns(CLOCK_MONOTONIC);
+  for (u64 i = 0; i < blocks; ++i)
+  {
+    if (sizes[i] > 0)
+      decompressed_bytes += decompress_block(compressed + i * compress_bound(TRANSFER_BLOCK_SIZE), sizes[i], decompressed,
+                       TRANSFER_BLOCK_SIZE);
+  }
+  const u64 decompress_ns = now_ns(CLOCK_MONOTONIC) - decompress_start;
+
+  printf("%s,%s,%.3f,%.1f,%.1f,%.2f", name, codec_names[codec], (double)length / wire,
+         length * 1e3 / compress_ns, decompress_ns > 0 ? decompressed_bytes * 1e3 / decompress_ns : 0, (double)cpu_ns / length);
+  for (u32 i = 0; i < sizeof(link_gbits) / sizeof(link_gbits[0]); ++i)
+  {
+    // compression and sending overlap, so the slower of them sets the pace
+    const double send_ns = wire * 8 / link_gbits[i];
+    printf(",%.1f", length * 1e3 / (send_ns > compress_ns ? send_ns : compress_ns));
+  }
+  printf("\n");
+  fflush(stdout);
+  free(compressed);
+  free(sizes);
+  free(decompressed);
+}
+
+int main(int argc, char *argv[])
+{
+  u64 length = 16 << 20;
+  i32 opt;
+  while ((opt = getopt(argc, argv, "b:")) != -1)
+  {
+    if (opt == 'b' && strtoull(optarg, NULL, 10) > 0)
+      length = strtoull(optarg, NULL, 10);
+    else
+    {
+      fprintf(stderr, "Usage: %s [-b bytes per corpus]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  srand(42);
+  const char *names[] = {"text", "random", "mixed"};
+  u8 *corpora[3];
+  for (i32 i = 0; i < 3; ++i)
+    corpora[i] = malloc(length);
+  fill_text(corpora[0], length);
+  fill_random(corpora[1], length);
+  for (u64 offset = 0; offset < length; offset += TRANSFER_BLOCK_SIZE)
+  {
+    const u64 size = length - offset < TRANSFER_BLOCK_SIZE ? length - offset : TRANSFER_BLOCK_SIZE;
+    memcpy(corpora[2] + offset, corpora[(offset / TRANSFER_BLOCK_SIZE) % 2] + offset, size);
+  }
+
+  u32 failures = 0;
+  for (i32 i = 0; i < 3; ++i)
+  {
+    failures += check_codec(names[i], corpora[i], length, CODEC_FAST);
+    failures += check_codec(names[i], corpora[i], length, CODEC_HIGH);
+  }
+  if (length >= TRANSFER_BLOCK_SIZE && (!looks_incompressible(corpora[1], TRANSFER_BLOCK_SIZE) ||
+                                        looks_incompressible(corpora[0], TRANSFER_BLOCK_SIZE)))
+  {
+    fprintf(stderr, "The entropy probe misjudged the text or the random corpus\n");
+    ++failures;
+  }
+  if (failures > 0)
+  {
+    fprintf(stderr, "%u failures\n", failures);
+    for (i32 i = 0; i < 3; ++i)
+      free(corpora[i]);
+    return 1;
+  }
+
+  printf("corpus,codec,ratio,compress_mb_s,decompress_mb_s,cpu_ns_per_byte,link_1g_mb_s,link_10g_mb_s\n");
+  for (i32 i = 0; i < 3; ++i)
+  {
+    for (enum codec codec = CODEC_NONE; codec <= CODEC_HIGH; ++codec)
+      measure(names[i], corpora[i], length, codec);
+  }
+  for (i32 i = 0; i < 3; ++i)
+    free(corpora[i]);
+  return 0;
+}
@@ -0,0 +1,203 @@
+/**
+ * @file erasure_bench.c
+ * @brief Checks and throughput of every implementation of the erasure code of erasure.c
+ * @details
+ * - First checks, over random codes, lengths and erasures, that every implementation the CPU supports computes the
+ *   same parity as the portable one, and rebuilds the data shards lost from any k shards left. Exits with 1 on a
+ *   failure.
+ * - Then times encoding and rebuilding with each of them for a few codes, and prints one CSV line per measurement, in
+ *   GB/s of data
+ * - Usage: ./erasure_bench.out [-s shard bytes] [-b data bytes per measurement], by default 64 KiB and 1 GiB
+ */
+
+#include "../common/headers.h"
+#include <getopt.h>
+
+#define CHECK_ROUNDS 500
+#define CHECK_LENGTH 4096
+
+const u32 codes[][2] = {{2, 1}, {4, 2}, {6, 3}, {10, 4}};
+
+u32 failures = 0;
+
+/**
+ * @brief Current time of a monotonic clock in nanoseconds
+ *
+ * @return u64
+ */
+u64 now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Fill k + m shards with random data, and their parity with the portable implementation
+ *
+ * @param k
+ * @param m
+ * @param shards
+ * @param length
+ */
+void make_stripe(const u32 k, const u32 m, u8 **shards, const u64 length)
+{
+  for (u32 i = 0; i < k; ++i)
+  {
+    for (u64 j = 0; j < length; ++j)
+      shards[i][j] = rand();
+  }
+  for (u32 p = 0; p < m; ++p)
+    erasure_parity_with(KERNEL_PORTABLE, k, p, (const u8 *const *)shards, shards[k + p], length);
+}
+
+/**
+ * @brief Check every supported implementation against the portable one, and that lost data shards are rebuilt
+ */
+void check_kernels()
+{
+  u8 *shards[EC_MAX_SHARDS], *lost[EC_MAX_SHARDS], *parity = malloc(CHECK_LENGTH);
+  for (u32 i = 0; i < EC_MAX_SHARDS; ++i)
+  {
+    shards[i] = malloc(CHECK_LENGTH);
+    lost[i] = malloc(CHECK_LENGTH);
+  }
+  for (u32 round = 0; round < CHECK_ROUNDS; ++round)
+  {
+    const u32 k = 1 + rand() % (EC_MAX_SHARDS - 1);
+    const u32 m = 1 + rand() % (EC_MAX_SHARDS - k);
+    // lengths that are not a multiple of any vector size too
+    const u64 length = 1 + rand() % CHECK_LENGTH;
+    make_stripe(k, m, shards, length);
+
+    for (enum hash_kernel kernel = KERNEL_PORTABLE; kernel < NUM_HASH_KERNELS; ++kernel)
+    {
+      if (!erasure_has_kernel(kernel))
+        continue;
+      for (u32 p = 0; p < m; ++p)
+      {
+        erasure_parity_with(kernel, k, p, (const u8 *const *)shards, parity, length);
+        if (memcmp(parity, shards[k + p], length) != 0)
+        {
+          fprintf(stderr, "parity %u of %u+%u with %s on %lu bytes differs\n", p, k, m, hash_kernel_names[kernel],
+                  length);
+          ++failures;
+        }
+      }
+
+      // lose up to m random shards, the data ones are rebuilt into other buffers
+      bool present[EC_MAX_SHARDS];
+      u8 *stripe[EC_MAX_SHARDS];
+      for (u32 i = 0; i < k + m; ++i)
+      {
+        present[i] = true;
+        stripe[i] = shards[i];
+      }
+      for (u32 erased = rand() % (m + 1); erased > 0; --erased)
+      {
+        const u32 i = rand() % (k + m);
+        present[i] = false;
+        stripe[i] = lost[i];
+      }
+      if (!erasure_reconstruct_with(kernel, k, m, stripe, present, length))
+      {
+        fprintf(stderr, "%u+%u with %s could not rebuild with %u shards lost or fewer\n", k, m,
+                hash_kernel_names[kernel], m);
+        ++failures;
+        continue;
+      }
+      for (u32 i = 0; i < k; ++i)
+      {
+        if (!present[i] && memcmp(lost[i], shards[i], length) != 0)
+        {
+          fprintf(stderr, "data shard %u of %u+%u rebuilt with %s on %lu bytes differs\n", i, k, m,
+                  hash_kernel_names[kernel], length);
+          ++failures;
+        }
+      }
+    }
+  }
+  for (u32 i = 0; i < EC_MAX_SHARDS; ++i)
+  {
+    free(shards[i]);
+    free(lost[i]);
+  }
+  free(parity);
+}
+
+/**
+ * @brief Time encoding a stripe, and rebuilding it without its first m data shards, and print their throughput
+ *
+ * @param kernel
+ * @param k
+ * @param m
+ * @param length bytes of each shard
+ * @param total data bytes processed in all
+ */
+void measure(const enum hash_kernel kernel, const u32 k, const u32 m, const u64 length, const u64 total)
+{
+  u8 *shards[EC_MAX_SHARDS];
+  for (u32 i = 0; i < k + m; ++i)
+    shards[i] = malloc(length);
+  make_stripe(k, m, shards, length);
+  const u64 rounds = total / (k * length) > 0 ? total / (k * length) : 1;
+
+  u64 start = now_ns();
+  for (u64 round = 0; round < rounds; ++round)
+  {
+    for (u32 p = 0; p < m; ++p)
+      erasure_parity_with(kernel, k, p, (const u8 *const *)shards, shards[k + p], length);
+  }
+  printf("encode,%s,%u+%u,%lu,%.2f,GB/s\n", hash_kernel_names[kernel], k, m, length,
+         (double)(rounds * k * length) / (now_ns() - start));
+
+  bool present[EC_MAX_SHARDS];
+  for (u32 i = 0; i < k + m; ++i)
+    present[i] = i >= (m < k ? m : k);
+  start = now_ns();
+  for (u64 round = 0; round < rounds; ++round)
+    erasure_reconstruct_with(kernel, k, m, shards, present, length);
+  printf("rebuild,%s,%u+%u,%lu,%.2f,GB/s\n", hash_kernel_names[kernel], k, m, length,
+         (double)(rounds * k * length) / (now_ns() - start));
+  fflush(stdout);
+  for (u32 i = 0; i < k + m; ++i)
+    free(shards[i]);
+}
+
+int main(int argc, char *argv[])
+{
+  u64 length = EC_STRIPE_UNIT;
+  u64 total = 1ULL << 30;
+  i32 opt;
+  while ((opt = getopt(argc, argv, "s:b:")) != -1)
+  {
+    if (opt == 's' && strtoull(optarg, NULL, 10) > 0)
+      length = strtoull(optarg, NULL, 10);
+    else if (opt == 'b' && strtoull(optarg, NULL, 10) > 0)
+      total = strtoull(optarg, NULL, 10);
+    else
+    {
+      fprintf(stderr, "Usage: %s [-s shard bytes] [-b data bytes per measurement]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  srand(42);
+  check_kernels();
+  if (failures > 0)
+  {
+    fprintf(stderr, "%u failures\n", failures);
+    return 1;
+  }
+
+  printf("operation,kernel,code,shard_size,value,unit\n");
+  for (u32 i = 0; i < sizeof(codes) / sizeof(codes[0]); ++i)
+  {
+    for (enum hash_kernel kernel = KERNEL_PORTABLE; kernel < NUM_HASH_KERNELS; ++kernel)
+    {
+      if (erasure_has_kernel(kernel))
+        measure(kernel, codes[i][0], codes[i][1], length, total);
+    }
+  }
+  return 0;
+}
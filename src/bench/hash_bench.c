@@ -0,0 +1,178 @@
+/**
+ * @file hash_bench.c
+ * @brief Checks and throughput of every implementation of the functions of hash_kernels.c
+ * @details
+ * - First checks the implementations the CPU supports against known values and against the portable one, over random
+ *   lengths, alignments and seeds, and over CRCs continued across splits of a buffer. Exits with 1 on a mismatch.
+ * - Then times each of them on buffers of a few sizes and prints one CSV line per measurement, in GB/s
+ * - Usage: ./hash_bench.out [-s size]... [-b bytes hashed per measurement], by default 64 bytes to 1 MiB
+ */
+
+#include "../common/headers.h"
+#include <getopt.h>
+
+#define MAX_SIZES 16
+#define CHECK_BUFFER (1 << 20)
+#define CHECK_ROUNDS 2000
+
+u32 mismatches = 0;
+
+/**
+ * @brief Current time of a monotonic clock in nanoseconds
+ *
+ * @return u64
+ */
+u64 now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Report a result that differs from the expected one
+ *
+ * @param function
+ * @param kernel
+ * @param length
+ * @param offset
+ * @param got
+ * @param expected
+ */
+void mismatch(const char *function, const enum hash_kernel kernel, const u64 length, const u64 offset, const u64 got,
+              const u64 expected)
+{
+  fprintf(stderr, "%s with %s on %lu bytes at offset %lu: %lx instead of %lx\n", function, hash_kernel_names[kernel],
+          length, offset, got, expected);
+  ++mismatches;
+}
+
+/**
+ * @brief Check every supported implementation against known values and against the portable one
+ *
+ * @param buffer CHECK_BUFFER random bytes
+ */
+void check_kernels(const u8 *buffer)
+{
+  const char *known = "123456789";
+  for (enum hash_kernel kernel = KERNEL_PORTABLE; kernel < NUM_HASH_KERNELS; ++kernel)
+  {
+    if (!crc32c_has_kernel(kernel))
+      continue;
+    const u32 crc = crc32c_with(kernel, 0, known, strlen(known));
+    if (crc != 0xe3069283)
+      mismatch("crc32c", kernel, strlen(known), 0, crc, 0xe3069283);
+    if (crc32c_with(kernel, 0, known, 0) != 0)
+      mismatch("crc32c", kernel, 0, 0, crc32c_with(kernel, 0, known, 0), 0);
+  }
+
+  for (u32 round = 0; round < CHECK_ROUNDS; ++round)
+  {
+    // mostly short buffers, where the tails and alignment are handled, and some long enough for every block size
+    const u64 offset = rand() % 64;
+    const u64 length = round % 4 == 0 ? rand() % (CHECK_BUFFER - 64) : rand() % 2048;
+    const u64 split = length == 0 ? 0 : rand() % length;
+    const u64 seed = round % 2 == 0 ? 0 : ((u64)rand() << 32 | rand());
+    const u8 *data = buffer + offset;
+
+    const u32 expected_crc = crc32c_with(KERNEL_PORTABLE, 0, data, length);
+    const u64 expected_hash = fast_hash_with(KERNEL_PORTABLE, data, length, seed);
+    for (enum hash_kernel kernel = KERNEL_PORTABLE; kernel < NUM_HASH_KERNELS; ++kernel)
+    {
+      if (crc32c_has_kernel(kernel))
+      {
+        const u32 crc = crc32c_with(kernel, 0, data, length);
+        if (crc != expected_crc)
+          mismatch("crc32c", kernel, length, offset, crc, expected_crc);
+        const u32 chained = crc32c_with(kernel, crc32c_with(kernel, 0, data, split), data + split, length - split);
+        if (chained != expected_crc)
+          mismatch("crc32c continued", kernel, length, offset, chained, expected_crc);
+      }
+      if (fast_hash_has_kernel(kernel))
+      {
+        const u64 hash = fast_hash_with(kernel, data, length, seed);
+        if (hash != expected_hash)
+          mismatch("fast_hash", kernel, length, offset, hash, expected_hash);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Time one implementation and print its throughput
+ *
+ * @param function "crc32c" or "fast_hash"
+ * @param kernel
+ * @param buffer
+ * @param size bytes hashed per call
+ * @param total bytes hashed in all
+ */
+void measure(const char *function, const enum hash_kernel kernel, const u8 *buffer, const u64 size, const u64 total)
+{
+  const bool crc = strcmp(function, "crc32c") == 0;
+  const u64 calls = total / size > 0 ? total / size : 1;
+  volatile u64 sink = 0;
+  const u64 start = now_ns();
+  for (u64 i = 0; i < calls; ++i)
+    sink += crc ? crc32c_with(kernel, 0, buffer, size) : fast_hash_with(kernel, buffer, size, i);
+  const u64 elapsed = now_ns() - start;
+  (void)sink;
+  printf("%s,%s,%lu,%.2f,GB/s\n", function, hash_kernel_names[kernel], size, (double)(calls * size) / elapsed);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  u64 sizes[MAX_SIZES] = {64, 1024, 65536, 1 << 20};
+  u32 num_sizes = 4;
+  bool default_sizes = true;
+  u64 total = 1ULL << 30;
+  i32 opt;
+  while ((opt = getopt(argc, argv, "s:b:")) != -1)
+  {
+    if (opt == 's' && strtoull(optarg, NULL, 10) > 0)
+    {
+      if (default_sizes)
+        num_sizes = 0, default_sizes = false;
+      if (num_sizes < MAX_SIZES)
+        sizes[num_sizes++] = strtoull(optarg, NULL, 10);
+    }
+    else if (opt == 'b' && strtoull(optarg, NULL, 10) > 0)
+      total = strtoull(optarg, NULL, 10);
+    else
+    {
+      fprintf(stderr, "Usage: %s [-s size]... [-b bytes hashed per measurement]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  u64 largest = CHECK_BUFFER;
+  for (u32 i = 0; i < num_sizes; ++i)
+    largest = sizes[i] > largest ? sizes[i] : largest;
+  u8 *buffer = malloc(largest);
+  srand(42);
+  for (u64 i = 0; i < largest; ++i)
+    buffer[i] = rand();
+
+  check_kernels(buffer);
+  if (mismatches > 0)
+  {
+    fprintf(stderr, "%u mismatches between implementations\n", mismatches);
+    free(buffer);
+    return 1;
+  }
+
+  printf("function,kernel,size,value,unit\n");
+  for (u32 i = 0; i < num_sizes; ++i)
+  {
+    for (enum hash_kernel kernel = KERNEL_PORTABLE; kernel < NUM_HASH_KERNELS; ++kernel)
+    {
+      if (crc32c_has_kernel(kernel))
+        measure("crc32c", kernel, buffer, sizes[i], total);
+      if (fast_hash_has_kernel(kernel))
+        measure("fast_hash", kernel, buffer, sizes[i], total);
+    }
+  }
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,598 @@
+/**
+ * @file load_bench.c
+ * @brief Load generator measuring the throughput and latency of the whole system
+ * @details
+ * - Each thread is a client with a connection of its own to the naming server, and sends one request at a time
+ * - Operations are picked at random by the given mix, on files in a folder of the thread's own
+ * - The latency of a READ, WRITE or METADATA includes the storage server part of the request
+ * - Can start a naming server and storage servers of its own, in temporary directories
+ * - Usage: ./load_bench.out [-t threads] [-d seconds] [-m mix] [-s min-max] [-f files] [-l storage servers]
+ *   where the mix is like read=60,write=20,metadata=10,create=5,delete=5,copy=0
+ */
+
+#define _GNU_SOURCE
+#include "../common/headers.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+
+#define BENCH_OPS 6
+#define STARTUP_TIMEOUT 10 // seconds to wait for the servers to be ready
+
+const enum operation bench_ops[BENCH_OPS] = {READ, WRITE, METADATA, CREATE_FILE, DELETE_FILE, COPY_FILE};
+const char *bench_op_names[BENCH_OPS] = {"read", "write", "metadata", "create", "delete", "copy"};
+
+struct
+{
+  i32 threads;
+  i32 duration;
+  u32 weights[BENCH_OPS];
+  u32 min_size;
+  u32 max_size;
+  u32 files; // per thread, read, written and copied, and as many again created and deleted
+  i32 local_servers;
+} config = {8, 10, {60, 20, 10, 5, 5, 0}, 16, MAX_STR_LEN - 1, 32, 0};
+
+volatile bool stop = false;
+pthread_barrier_t started; // every client is set up, timing starts
+
+// State of one client thread
+typedef struct bench_client
+{
+  i32 index;
+  i32 nm_sockfd;
+  u32 next_id;
+  u32 seed;
+  char folder[MAX_NAME_LEN];
+  bool *created; // n<i> files of the folder that exist
+  bool *copied;  // f<i> files that have a copy in the copies folder
+  bool ready;    // setup went through
+} bench_client;
+
+/**
+ * @brief Current time of a monotonic clock in seconds
+ *
+ * @return double
+ */
+double now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Send a request to the naming server and wait for its response
+ *
+ * @param c
+ * @param op
+ * @param request
+ * @param response output, positioned after the status code
+ * @param id output, id of the request, may be NULL
+ * @return enum status status code of the response
+ */
+enum status nm_request(bench_client *c, const enum operation op, const message *request, message *response, u32 *id)
+{
+  const u32 request_id = c->next_id++;
+  CHECK(send_message(c->nm_sockfd, request_id, op, request), false);
+  request_header header;
+  CHECK(receive_message(c->nm_sockfd, &header, response), false);
+  if (id != NULL)
+    *id = request_id;
+  enum status code;
+  GET(response, code);
+  return code;
+}
+
+/**
+ * @brief Send a request on one or two paths that only involves the naming server
+ *
+ * @param c
+ * @param op
+ * @param path
+ * @param to_path second path of a COPY_FILE, NULL otherwise
+ * @return enum status
+ */
+enum status path_request(bench_client *c, const enum operation op, const char *path, const char *to_path)
+{
+  message request = {0}, response = {0};
+  char buffer[MAX_STR_LEN] = {0};
+  strncpy(buffer, path, MAX_STR_LEN - 1);
+  PUT(&request, buffer);
+  if (to_path != NULL)
+  {
+    memset(buffer, 0, MAX_STR_LEN);
+    strncpy(buffer, to_path, MAX_STR_LEN - 1);
+    PUT(&request, buffer);
+  }
+  const enum status code = nm_request(c, op, &request, &response, NULL);
+  message_free(&request);
+  message_free(&response);
+  return code;
+}
+
+/**
+ * @brief Pick a file size, log-uniformly between config.min_size and config.max_size so that every scale of size is
+ * as common
+ *
+ * @param c
+ * @return u32
+ */
+u32 random_size(bench_client *c)
+{
+  const u32 low = 31 - __builtin_clz(config.min_size | 1);
+  const u32 high = 31 - __builtin_clz(config.max_size | 1);
+  const u32 bits = low + rand_r(&c->seed) % (high - low + 1);
+  u32 size = (1u << bits) + rand_r(&c->seed) % (1u << bits);
+  size = size < config.min_size ? config.min_size : size;
+  return size > config.max_size ? config.max_size : size;
+}
+
+/**
+ * @brief Receive a file sent by send_file and drop it
+ *
+ * @param sockfd
+ * @return u64 bytes of the file received
+ */
+u64 receive_file(const i32 sockfd)
+{
+  char *buffer = malloc(TRANSFER_BLOCK_SIZE);
+  u64 total = 0;
+  u32 size;
+  while (receive_block(sockfd, buffer, TRANSFER_BLOCK_SIZE, &size) == SUCCESS && size > 0)
+    total += size;
+  free(buffer);
+  return total;
+}
+
+/**
+ * @brief Do a READ, WRITE or METADATA, from the lookup on the naming server to the ACK after the storage server
+ *
+ * @param c
+ * @param op
+ * @param path
+ * @return enum status
+ */
+enum status transfer_request(bench_client *c, const enum operation op, const char *path)
+{
+  message request = {0}, response = {0};
+  char buffer[MAX_STR_LEN] = {0};
+  strncpy(buffer, path, MAX_STR_LEN - 1);
+  PUT(&request, buffer);
+  u32 id;
+  enum status code = nm_request(c, op, &request, &response, &id);
+  i32 count = 0;
+  replica_location location;
+  GET(&response, count);
+  GET(&response, location);
+  message_free(&request);
+  message_free(&response);
+  if (code != SUCCESS)
+    return code;
+
+  transfer_report report = {location.port, location.port, 0};
+  const i32 ss_sockfd = try_connect_to_port(location.port);
+  if (ss_sockfd == -1)
+    code = UNAVAILABLE;
+  else
+  {
+    const i32 nodelay = 1;
+    setsockopt(ss_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    const enum codec codec = READ_CODEC;
+    SEND(ss_sockfd, op);
+    SEND(ss_sockfd, location.path);
+    SEND(ss_sockfd, codec);
+    if (recv(ss_sockfd, &code, sizeof(code), MSG_WAITALL) != sizeof(code))
+      code = UNAVAILABLE;
+  }
+
+  if (code == SUCCESS && op == READ)
+  {
+    report.bytes = receive_file(ss_sockfd);
+  }
+  else if (code == SUCCESS && op == WRITE)
+  {
+    memset(buffer, 0, MAX_STR_LEN);
+    const u32 size = random_size(c);
+    for (u32 i = 0; i < size; ++i)
+      buffer[i] = 'a' + rand_r(&c->seed) % 26;
+    if (send_block(ss_sockfd, buffer, size, READ_CODEC) == -1)
+      code = UNAVAILABLE;
+    report.bytes = size;
+  }
+  else if (code == SUCCESS && op == METADATA)
+  {
+    metadata meta;
+    if (recv(ss_sockfd, &meta, sizeof(meta), MSG_WAITALL) != sizeof(meta))
+      code = UNAVAILABLE;
+    report.bytes = sizeof(meta);
+  }
+  if (ss_sockfd != -1)
+    close(ss_sockfd);
+
+  message ack = {0};
+  PUT(&ack, report);
+  CHECK(send_message(c->nm_sockfd, id, ACK, &ack), false);
+  message_free(&ack);
+  return code;
+}
+
+/**
+ * @brief Pick a slot whose flag has the given value, starting from a random one
+ *
+ * @param c
+ * @param flags
+ * @param value
+ * @return i32 -1 if there is none
+ */
+i32 pick_slot(bench_client *c, const bool *flags, const bool value)
+{
+  const u32 first = rand_r(&c->seed) % config.files;
+  for (u32 i = 0; i < config.files; ++i)
+  {
+    const u32 slot = (first + i) % config.files;
+    if (flags[slot] == value)
+      return slot;
+  }
+  return -1;
+}
+
+/**
+ * @brief Do one operation of the mix and record its latency
+ *
+ * @param c
+ * @param kind index into bench_ops
+ */
+void run_operation(bench_client *c, u32 kind)
+{
+  char path[MAX_STR_LEN], to_path[MAX_STR_LEN];
+  // creates and deletes take turns when every slot is taken or free
+  if (bench_ops[kind] == CREATE_FILE && pick_slot(c, c->created, false) == -1)
+    kind = 4;
+  else if (bench_ops[kind] == DELETE_FILE && pick_slot(c, c->created, true) == -1)
+    kind = 3;
+  const enum operation op = bench_ops[kind];
+
+  const u32 file = rand_r(&c->seed) % config.files;
+  snprintf(path, MAX_STR_LEN, "%s/f%u", c->folder, file);
+  if (op == COPY_FILE && c->copied[file])
+  {
+    // not timed, the copy has to be gone for the next one to succeed
+    snprintf(to_path, MAX_STR_LEN, "%s/copies/f%u", c->folder, file);
+    path_request(c, DELETE_FILE, to_path, NULL);
+    c->copied[file] = false;
+  }
+
+  const u64 start = metrics_now_us();
+  enum status code;
+  if (op == READ || op == WRITE || op == METADATA)
+    code = transfer_request(c, op, path);
+  else if (op == COPY_FILE)
+  {
+    snprintf(to_path, MAX_STR_LEN, "%s/copies", c->folder);
+    code = path_request(c, op, path, to_path);
+    c->copied[file] = code == SUCCESS;
+  }
+  else
+  {
+    const i32 slot = pick_slot(c, c->created, op == DELETE_FILE);
+    snprintf(path, MAX_STR_LEN, "%s/n%i", c->folder, slot);
+    code = path_request(c, op, path, NULL);
+    if (code == SUCCESS)
+      c->created[slot] = op == CREATE_FILE;
+  }
+  metrics_record(op, metrics_now_us() - start, code != SUCCESS);
+}
+
+/**
+ * @brief Create the folder and files of a client, retrying while the storage servers are still registering
+ *
+ * @param c
+ * @return bool
+ */
+bool setup_client(bench_client *c)
+{
+  snprintf(c->folder, MAX_NAME_LEN, "load_bench_%i_%i", getpid(), c->index);
+  const double deadline = now_seconds() + STARTUP_TIMEOUT;
+  enum status code;
+  while ((code = path_request(c, CREATE_FOLDER, c->folder, NULL)) == NOT_FOUND && now_seconds() < deadline)
+    usleep(100000);
+  if (code != SUCCESS)
+  {
+    fprintf(stderr, "Unable to create %s, code %i\n", c->folder, code);
+    return false;
+  }
+
+  char path[MAX_STR_LEN];
+  snprintf(path, MAX_STR_LEN, "%s/copies", c->folder);
+  path_request(c, CREATE_FOLDER, path, NULL);
+  for (u32 i = 0; i < config.files; ++i)
+  {
+    snprintf(path, MAX_STR_LEN, "%s/f%u", c->folder, i);
+    if (path_request(c, CREATE_FILE, path, NULL) != SUCCESS || transfer_request(c, WRITE, path) != SUCCESS)
+    {
+      fprintf(stderr, "Unable to create %s\n", path);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Remove the folder of a client, along with its redundant copies
+ *
+ * @param c
+ */
+void teardown_client(bench_client *c)
+{
+  path_request(c, DELETE_FOLDER, c->folder, NULL);
+  for (i32 rd = 1; rd <= 3; ++rd)
+  {
+    char path[MAX_STR_LEN];
+    snprintf(path, MAX_STR_LEN, ".rd%i/%s", rd, c->folder);
+    path_request(c, DELETE_FOLDER, path, NULL);
+  }
+}
+
+/**
+ * @brief Thread of one client, sending operations of the mix until the benchmark is over
+ *
+ * @param arg bench_client
+ * @return void* NULL
+ */
+void *client_thread(void *arg)
+{
+  bench_client *c = arg;
+  c->nm_sockfd = connect_to_port(NM_CLIENT_PORT);
+  const i32 nodelay = 1;
+  setsockopt(c->nm_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  c->created = calloc(config.files, sizeof(bool));
+  c->copied = calloc(config.files, sizeof(bool));
+  c->ready = setup_client(c);
+  pthread_barrier_wait(&started);
+
+  u32 total_weight = 0;
+  for (i32 i = 0; i < BENCH_OPS; ++i)
+    total_weight += config.weights[i];
+  while (c->ready && !stop)
+  {
+    u32 pick = rand_r(&c->seed) % total_weight;
+    u32 kind = 0;
+    while (pick >= config.weights[kind])
+      pick -= config.weights[kind++];
+    run_operation(c, kind);
+  }
+
+  teardown_client(c);
+  message none = {0};
+  send_message(c->nm_sockfd, 0, DISCONNECT, &none);
+  close(c->nm_sockfd);
+  free(c->created);
+  free(c->copied);
+  return NULL;
+}
+
+/**
+ * @brief Start a server in a directory, with its output going to out.log there
+ *
+ * @param binary absolute path of the server
+ * @param dir
+ * @return pid_t
+ */
+pid_t spawn_server(const char *binary, const char *dir)
+{
+  i32 input[2];
+  CHECK(pipe(input), -1);
+  const pid_t pid = fork();
+  CHECK(pid, -1);
+  if (pid == 0)
+  {
+    CHECK(chdir(dir), -1);
+    const i32 out = open("out.log", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    dup2(input[0], STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+    close(input[0]);
+    close(input[1]);
+    execl(binary, binary, NULL);
+    _exit(127);
+  }
+  // a storage server asks for its inaccessible paths first, there are none
+  CHECK(write(input[1], "0\n", 2), -1);
+  close(input[0]);
+  close(input[1]);
+  return pid;
+}
+
+/**
+ * @brief Count the storage servers that answer the STATS of the naming server
+ *
+ * @return i32
+ */
+i32 count_storage_servers()
+{
+  bench_client probe = {.nm_sockfd = try_connect_to_port(NM_CLIENT_PORT)};
+  if (probe.nm_sockfd == -1)
+    return -1;
+  message request = {0}, response = {0};
+  i32 count = 0;
+  if (nm_request(&probe, STATS, &request, &response, NULL) == SUCCESS)
+  {
+    message_write(&response, "", 1);
+    const char *line = response.data + response.offset;
+    while ((line = strstr(line, "active_connections{server=\"storage\"")) != NULL)
+    {
+      ++count;
+      ++line;
+    }
+  }
+  message_free(&response);
+  message_free(&request);
+  send_message(probe.nm_sockfd, 0, DISCONNECT, &request);
+  close(probe.nm_sockfd);
+  return count;
+}
+
+i32 remove_entry(const char *path, const struct stat *st, i32 flag, struct FTW *ftw)
+{
+  (void)st;
+  (void)flag;
+  (void)ftw;
+  return remove(path);
+}
+
+/**
+ * @brief Parse a mix like read=60,write=20 into the weights of the operations. Operations left out get 0.
+ *
+ * @param mix
+ * @return bool false if it is invalid
+ */
+bool parse_mix(char *mix)
+{
+  memset(config.weights, 0, sizeof(config.weights));
+  u32 total = 0;
+  for (char *save, *part = strtok_r(mix, ",", &save); part != NULL; part = strtok_r(NULL, ",", &save))
+  {
+    char *value = strchr(part, '=');
+    if (value == NULL)
+      return false;
+    *value++ = '\0';
+    i32 kind = 0;
+    while (kind < BENCH_OPS && strcmp(bench_op_names[kind], part) != 0)
+      ++kind;
+    if (kind == BENCH_OPS)
+      return false;
+    config.weights[kind] = strtoul(value, NULL, 10);
+    total += config.weights[kind];
+  }
+  return total > 0;
+}
+
+void usage(const char *name)
+{
+  fprintf(stderr,
+          "Usage: %s [-t threads] [-d seconds] [-m mix] [-s min-max] [-f files] [-l storage servers]\n"
+          "  -m  weights of read, write, metadata, create, delete and copy, like read=60,write=20,metadata=10,"
+          "create=5,delete=5,copy=0\n"
+          "  -s  range of the sizes of written files in bytes, at most %i\n"
+          "  -l  start a naming server and this many storage servers instead of using running ones\n",
+          name, MAX_STR_LEN - 1);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  for (i32 opt; (opt = getopt(argc, argv, "t:d:m:s:f:l:")) != -1;)
+  {
+    switch (opt)
+    {
+    case 't':
+      config.threads = atoi(optarg);
+      break;
+    case 'd':
+      config.duration = atoi(optarg);
+      break;
+    case 'm':
+      if (!parse_mix(optarg))
+        usage(argv[0]);
+      break;
+    case 's':
+      if (sscanf(optarg, "%u-%u", &config.min_size, &config.max_size) != 2)
+        config.max_size = config.min_size;
+      break;
+    case 'f':
+      config.files = atoi(optarg);
+      break;
+    case 'l':
+      config.local_servers = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (config.threads < 1 || config.duration < 1 || config.files < 1 || config.min_size < 1 ||
+      config.min_size > config.max_size || config.max_size > MAX_STR_LEN - 1)
+    usage(argv[0]);
+  signal(SIGPIPE, SIG_IGN);
+
+  char root[] = "/tmp/load_bench_XXXXXX";
+  pid_t servers[MAX_STORAGE_SERVERS + 1];
+  i32 num_servers = 0;
+  if (config.local_servers > 0)
+  {
+    char binary[MAX_STR_LEN], dir[MAX_STR_LEN + 16];
+    CHECK(mkdtemp(root), NULL);
+    snprintf(dir, sizeof(dir), "%s/nm", root);
+    CHECK(mkdir(dir, 0755), -1);
+    CHECK(realpath("naming_server.out", binary), NULL);
+    servers[num_servers++] = spawn_server(binary, dir);
+    for (const double deadline = now_seconds() + STARTUP_TIMEOUT; count_storage_servers() == -1;)
+    {
+      if (now_seconds() > deadline)
+      {
+        fprintf(stderr, "Naming server did not start, see %s/out.log\n", dir);
+        exit(1);
+      }
+      usleep(100000);
+    }
+
+    CHECK(realpath("storage_server.out", binary), NULL);
+    for (i32 i = 0; i < config.local_servers && i < MAX_STORAGE_SERVERS; ++i)
+    {
+      snprintf(dir, sizeof(dir), "%s/ss%i", root, i);
+      CHECK(mkdir(dir, 0755), -1);
+      servers[num_servers++] = spawn_server(binary, dir);
+    }
+    const double deadline = now_seconds() + STARTUP_TIMEOUT;
+    while (count_storage_servers() < num_servers - 1 && now_seconds() < deadline)
+      usleep(100000);
+  }
+  printf("%i storage servers, %i threads, %i seconds, %u files per thread, %u-%u bytes per write\n",
+         count_storage_servers(), config.threads, config.duration, config.files, config.min_size, config.max_size);
+
+  bench_client *clients = calloc(config.threads, sizeof(bench_client));
+  pthread_t *threads = malloc(sizeof(pthread_t) * config.threads);
+  pthread_barrier_init(&started, NULL, config.threads + 1);
+  for (i32 i = 0; i < config.threads; ++i)
+  {
+    clients[i].index = i;
+    clients[i].seed = time(NULL) ^ (i * 2654435761u);
+    pthread_create(&threads[i], NULL, client_thread, &clients[i]);
+  }
+  pthread_barrier_wait(&started);
+  const double start = now_seconds();
+  sleep(config.duration);
+  stop = true;
+  const double elapsed = now_seconds() - start;
+  for (i32 i = 0; i < config.threads; ++i)
+    pthread_join(threads[i], NULL);
+
+  printf("%-10s %10s %8s %10s %10s %10s %10s\n", "op", "requests", "errors", "ops/s", "p50 (us)", "p99 (us)",
+         "p999 (us)");
+  u64 total = 0, errors = 0;
+  for (i32 kind = 0; kind < BENCH_OPS; ++kind)
+  {
+    op_summary summary;
+    metrics_summarize(bench_ops[kind], &summary);
+    if (summary.requests == 0)
+      continue;
+    total += summary.requests;
+    errors += summary.errors;
+    printf("%-10s %10lu %8lu %10.1f %10lu %10lu %10lu\n", bench_op_names[kind], summary.requests, summary.errors,
+           summary.requests / elapsed, summary.quantiles_us[0], summary.quantiles_us[2], summary.quantiles_us[3]);
+  }
+  printf("%-10s %10lu %8lu %10.1f\n", "total", total, errors, total / elapsed);
+
+  for (i32 i = num_servers - 1; i >= 0; --i)
+  {
+    kill(servers[i], SIGTERM);
+    waitpid(servers[i], NULL, 0);
+  }
+  if (num_servers > 0)
+    nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  free(clients);
+  free(threads);
+  return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file scan_bench.c
+ * @brief Benchmark of the storage server startup scan against the number of files
+ * @details
+ * - Builds directory trees of increasing size under a temporary directory, with FILES_PER_DIR files per directory
+ * - Times the serial ProcessWholeDir and the parallel ScanDirectory on each of them
+ * - Usage: ./scan_bench.out [file counts...], 1000 10000 100000 by default
+ */
+
+#define _GNU_SOURCE
+#include "../common/headers.h"
+#include <fcntl.h>
+#include <ftw.h>
+
+#define FILES_PER_DIR 100
+#define DIRS_PER_DIR 10
+#define RUNS 3
+
+/**
+ * @brief Current time of a monotonic clock in seconds
+ *
+ * @return double
+ */
+double now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Create a directory tree with a total of `files` files, spread FILES_PER_DIR to a directory and with
+ * DIRS_PER_DIR subdirectories per directory
+ *
+ * @param path directory to fill, already created
+ * @param files number of files still to create
+ * @return u64 number of files created
+ */
+u64 build_tree(const char *path, u64 files)
+{
+  u64 created = 0;
+  char child[MAX_STR_LEN];
+  for (; created < files && created < FILES_PER_DIR; ++created)
+  {
+    snprintf(child, MAX_STR_LEN, "%s/file%lu.txt", path, created);
+    const i32 fd = open(child, O_CREAT | O_WRONLY, 0644);
+    CHECK(fd, -1);
+    close(fd);
+  }
+
+  for (u32 i = 0; i < DIRS_PER_DIR && created < files; ++i)
+  {
+    snprintf(child, MAX_STR_LEN, "%s/dir%u", path, i);
+    CHECK(mkdir(child, 0755), -1);
+    const u64 remaining = files - created;
+    const u64 share = (remaining + DIRS_PER_DIR - 1 - i) / (DIRS_PER_DIR - i);
+    created += build_tree(child, share);
+  }
+  return created;
+}
+
+i32 remove_entry(const char *path, const struct stat *st, i32 flag, struct FTW *ftw)
+{
+  (void)st;
+  (void)flag;
+  (void)ftw;
+  return remove(path);
+}
+
+u64 count_nodes(Tree T)
+{
+  u64 count = 1;
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    count += count_nodes(trav);
+  }
+  return count;
+}
+
+/**
+ * @brief Best time out of RUNS scans of the current directory
+ *
+ * @param parallel use ScanDirectory instead of ProcessWholeDir
+ * @param nodes number of nodes in the scanned tree
+ * @return double seconds
+ */
+double time_scan(bool parallel, u64 *nodes)
+{
+  double best = 0;
+  for (i32 run = 0; run < RUNS; ++run)
+  {
+    Tree T = InitTree();
+    T->NodeInfo.IsFile = 0;
+    T->NodeInfo.Access = 1;
+
+    const double start = now_seconds();
+    if (parallel)
+      ScanDirectory(".", T);
+    else
+      ProcessWholeDir(".", T);
+    const double elapsed = now_seconds() - start;
+
+    if (run == 0 || elapsed < best)
+      best = elapsed;
+    *nodes = count_nodes(T);
+    DeleteTree(T);
+  }
+  return best;
+}
+
+int main(int argc, char *argv[])
+{
+  u64 default_counts[] = {1000, 10000, 100000};
+  const i32 num_counts = argc > 1 ? argc - 1 : 3;
+
+  char root[] = "/tmp/scan_bench_XXXXXX";
+  CHECK(mkdtemp(root), NULL);
+  char cwd[MAX_STR_LEN];
+  CHECK(getcwd(cwd, MAX_STR_LEN), NULL);
+
+  printf("%10s %10s %12s %12s %8s\n", "files", "nodes", "serial (s)", "parallel (s)", "speedup");
+  for (i32 i = 0; i < num_counts; ++i)
+  {
+    const u64 files = argc > 1 ? strtoull(argv[i + 1], NULL, 10) : default_counts[i];
+    char path[MAX_STR_LEN];
+    snprintf(path, MAX_STR_LEN, "%s/%lu", root, files);
+    CHECK(mkdir(path, 0755), -1);
+    build_tree(path, files);
+
+    CHECK(chdir(path), -1);
+    u64 serial_nodes, parallel_nodes;
+    const double serial = time_scan(false, &serial_nodes);
+    const double parallel = time_scan(true, &parallel_nodes);
+    CHECK(chdir(cwd), -1);
+
+    if (serial_nodes != parallel_nodes)
+      fprintf(stderr, "Scans disagree: %lu nodes serially, %lu in parallel\n", serial_nodes, parallel_nodes);
+    printf("%10lu %10lu %12.4f %12.4f %7.2fx\n", files, parallel_nodes, serial, parallel, serial / parallel);
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  }
+  rmdir(root);
+  return 0;
+}
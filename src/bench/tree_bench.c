@@ -0,0 +1,314 @@
+/**
+ * @file tree_bench.c
+ * @brief Microbenchmarks of the tree library
+ * @details
+ * - Builds synthetic trees with a given fan-out and depth, every leaf being a file
+ * - Times insertion, lookup, deletion, serialization, merging and the subtree locks, and measures memory per node
+ * - Prints one CSV line per measurement, so that runs before and after a change can be compared by a script
+ * - Usage: ./tree_bench.out [-f fanout -d depth]... [-n operations], by default a few shapes of 1000 to 100000 nodes
+ */
+
+#define _GNU_SOURCE
+#include "../common/headers.h"
+#include <getopt.h>
+#include <malloc.h>
+
+#define MAX_SHAPES 16
+#define PATH_POOL 4096 // distinct paths cycled through by the lookup benchmarks
+#define HOT_DIRECTORIES 16 // directories the paths of lookup_hot are in
+#define SERIALIZE_BUFFER (MAX_STR_LEN * 2000) // as big as storage_server_data.ss_tree
+
+char UUID[] = "tree_bench";
+
+typedef struct shape
+{
+  u32 fanout;
+  u32 depth;
+} shape;
+
+/**
+ * @brief Current time of a monotonic clock in nanoseconds
+ *
+ * @return u64
+ */
+u64 now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Print one measurement
+ *
+ * @param s
+ * @param nodes size of the tree the operations were done on
+ * @param benchmark
+ * @param value
+ * @param unit
+ */
+void report(const shape *s, const u64 nodes, const char *benchmark, const double value, const char *unit)
+{
+  printf("%u,%u,%lu,%s,%.1f,%s\n", s->fanout, s->depth, nodes, benchmark, value, unit);
+  fflush(stdout);
+}
+
+/**
+ * @brief Path of a node, numbered in breadth first order below the root from 0. Folders are named d<i> and the leaves
+ * f<i>, where i is the position among its siblings.
+ *
+ * @param s
+ * @param index
+ * @param path output
+ * @return u32 depth of the node, 1 for the children of the root
+ */
+u32 node_path(const shape *s, u64 index, char *path)
+{
+  u32 depth = 1;
+  u64 level_size = s->fanout;
+  while (index >= level_size)
+  {
+    index -= level_size;
+    level_size *= s->fanout;
+    ++depth;
+  }
+  // digits of index in base fanout, most significant first, are the positions on the way down
+  u32 positions[64];
+  for (u32 i = depth; i > 0; --i)
+  {
+    positions[i - 1] = index % s->fanout;
+    index /= s->fanout;
+  }
+  i32 length = 0;
+  for (u32 i = 0; i < depth; ++i)
+  {
+    length += snprintf(path + length, MAX_STR_LEN - length, i == 0 ? "%c%u" : "/%c%u", i + 1 == s->depth ? 'f' : 'd',
+                       positions[i]);
+  }
+  return depth;
+}
+
+u64 count_nodes(const shape *s)
+{
+  u64 nodes = 0, level_size = 1;
+  for (u32 i = 0; i < s->depth; ++i)
+  {
+    level_size *= s->fanout;
+    nodes += level_size;
+  }
+  return nodes;
+}
+
+u64 allocated_bytes()
+{
+  return mallinfo2().uordblks;
+}
+
+/**
+ * @brief Build the tree of a shape with AddFolder and AddFile, in breadth first order
+ *
+ * @param s
+ * @param nodes
+ * @return Tree
+ */
+Tree build_tree(const shape *s, const u64 nodes)
+{
+  Tree T = InitTree();
+  char path[MAX_STR_LEN];
+  for (u64 i = 0; i < nodes; ++i)
+  {
+    if (node_path(s, i, path) == s->depth)
+      AddFile(T, path, 1, UUID);
+    else
+      AddFolder(T, path, 1, UUID);
+  }
+  return T;
+}
+
+/**
+ * @brief Time a lookup function over random paths of the tree
+ *
+ * @param T
+ * @param paths
+ * @param num_paths number of paths to cycle through
+ * @param operations
+ * @param lookup
+ * @return double nanoseconds per lookup
+ */
+double time_lookups(Tree T, char (*paths)[MAX_STR_LEN], const u32 num_paths, const u32 operations,
+                    void *(*lookup)(Tree, const char *))
+{
+  volatile void *sink;
+  const u64 start = now_ns();
+  for (u32 i = 0; i < operations; ++i)
+    sink = lookup(T, paths[i % num_paths]);
+  (void)sink;
+  return (double)(now_ns() - start) / operations;
+}
+
+void *lookup_node(Tree T, const char *path)
+{
+  return GetTreeFromPath(T, path);
+}
+
+void *lookup_ssid(Tree T, const char *path)
+{
+  return (void *)(i64)GetPathSSID(T, path, false);
+}
+
+void *lookup_ssid_cached(Tree T, const char *path)
+{
+  return (void *)(i64)GetPathSSID(T, path, true);
+}
+
+/**
+ * @brief Run every benchmark on one shape of tree
+ *
+ * @param s
+ * @param operations number of lookups and lock operations to time
+ */
+void bench_shape(const shape *s, const u32 operations)
+{
+  const u64 nodes = count_nodes(s);
+  char(*paths)[MAX_STR_LEN] = malloc(sizeof(*paths) * PATH_POOL);
+
+  const u64 memory_before = allocated_bytes();
+  u64 start = now_ns();
+  Tree T = build_tree(s, nodes);
+  report(s, nodes, "insert", (double)(now_ns() - start) / nodes, "ns/op");
+  report(s, nodes, "memory", (double)(allocated_bytes() - memory_before) / nodes, "bytes/node");
+
+  // random leaves, and paths that miss at the last component
+  srand(nodes);
+  u64 leaves = 1;
+  for (u32 i = 0; i < s->depth; ++i)
+    leaves *= s->fanout;
+  const u64 first_leaf = nodes - leaves;
+  for (u32 i = 0; i < PATH_POOL; ++i)
+    node_path(s, first_leaf + rand() % leaves, paths[i]);
+  report(s, nodes, "lookup", time_lookups(T, paths, PATH_POOL, operations, lookup_node), "ns/op");
+  // the same leaves in a few directories, which the resolution of paths can start from once cached
+  const u64 hot = leaves / s->fanout < HOT_DIRECTORIES ? leaves / s->fanout : HOT_DIRECTORIES;
+  for (u32 i = 0; i < PATH_POOL; ++i)
+    node_path(s, first_leaf + (rand() % hot) * s->fanout + rand() % s->fanout, paths[i]);
+  report(s, nodes, "lookup_hot", time_lookups(T, paths, PATH_POOL, operations, lookup_node), "ns/op");
+  for (u32 i = 0; i < PATH_POOL; ++i)
+    node_path(s, first_leaf + rand() % leaves, paths[i]);
+  report(s, nodes, "get_path_ssid", time_lookups(T, paths, PATH_POOL, operations, lookup_ssid), "ns/op");
+  // few enough paths to all stay in the cache
+  report(s, nodes, "get_path_ssid_cached", time_lookups(T, paths, CACHE_SIZE, operations, lookup_ssid_cached),
+         "ns/op");
+  for (u32 i = 0; i < PATH_POOL; ++i)
+    strcat(paths[i], "x");
+  report(s, nodes, "lookup_miss", time_lookups(T, paths, PATH_POOL, operations, lookup_node), "ns/op");
+
+  // the last child of the root is the worst case of the linear scan of siblings
+  char last_child[MAX_NAME_LEN];
+  snprintf(last_child, MAX_NAME_LEN, "%c%u", s->depth == 1 ? 'f' : 'd', s->fanout - 1);
+  volatile Tree sink;
+  start = now_ns();
+  for (u32 i = 0; i < operations; ++i)
+    sink = FindChild(T, last_child, 0, 0);
+  (void)sink;
+  report(s, nodes, "find_child_last", (double)(now_ns() - start) / operations, "ns/op");
+
+  // locks of the subtree of a child of the root, which is what a request on a top level path locks
+  const char *top = T->ChildDirectoryLL->NodeInfo.DirectoryName;
+  const u64 subtree_nodes = nodes / s->fanout;
+  const u32 lock_operations = operations / subtree_nodes + 1;
+  start = now_ns();
+  for (u32 i = 0; i < lock_operations; ++i)
+  {
+    AcquireReaderLock(T, top);
+    ReleaseLock(T, top);
+  }
+  report(s, subtree_nodes, "subtree_read_lock", (double)(now_ns() - start) / lock_operations, "ns/op");
+  start = now_ns();
+  for (u32 i = 0; i < lock_operations; ++i)
+  {
+    AcquireWriterLock(T, top);
+    ReleaseLock(T, top);
+  }
+  report(s, subtree_nodes, "subtree_write_lock", (double)(now_ns() - start) / lock_operations, "ns/op");
+  start = now_ns();
+  for (u32 i = 0; i < lock_operations; ++i)
+  {
+    if (TryAcquireWriterLock(T, top))
+      ReleaseLock(T, top);
+  }
+  report(s, subtree_nodes, "subtree_try_write_lock", (double)(now_ns() - start) / lock_operations, "ns/op");
+
+  // serialization is limited by the buffer a storage server registers with, so the largest subtree that fits is used
+  char *buffer = malloc(SERIALIZE_BUFFER);
+  Tree Serialized = T;
+  u64 serialized_nodes = nodes + 1;
+  while (Serialized != NULL && serialized_nodes * (sizeof(struct Information) + 2) >= SERIALIZE_BUFFER)
+  {
+    Serialized = Serialized->ChildDirectoryLL;
+    serialized_nodes = (serialized_nodes - 1) / s->fanout;
+  }
+  if (Serialized != NULL && serialized_nodes > 1)
+  {
+    start = now_ns();
+    SendTreeData(Serialized, buffer);
+    report(s, serialized_nodes, "serialize", (double)(now_ns() - start) / serialized_nodes, "ns/node");
+    start = now_ns();
+    Tree Received = ReceiveTreeData(buffer);
+    report(s, serialized_nodes, "deserialize", (double)(now_ns() - start) / serialized_nodes, "ns/node");
+
+    Tree Merged = InitTree();
+    start = now_ns();
+    MergeTree(Merged, Received, 2, UUID);
+    report(s, serialized_nodes, "merge", (double)(now_ns() - start) / serialized_nodes, "ns/node");
+    DeleteTree(Merged);
+  }
+  free(buffer);
+
+  start = now_ns();
+  const u32 deleted = PATH_POOL < leaves ? PATH_POOL : leaves;
+  for (u32 i = 0; i < deleted; ++i)
+  {
+    node_path(s, first_leaf + i, paths[i]);
+    DeleteFile(T, paths[i]);
+  }
+  report(s, nodes, "delete_file", (double)(now_ns() - start) / deleted, "ns/op");
+
+  start = now_ns();
+  DeleteTree(T);
+  report(s, nodes, "delete_tree", (double)(now_ns() - start) / (nodes - deleted), "ns/node");
+  free(paths);
+}
+
+int main(int argc, char *argv[])
+{
+  shape shapes[MAX_SHAPES] = {{10, 3}, {32, 3}, {4, 8}, {100, 2}};
+  u32 num_shapes = 0, operations = 200000;
+  for (i32 opt; (opt = getopt(argc, argv, "f:d:n:")) != -1;)
+  {
+    if (opt == 'f' && num_shapes < MAX_SHAPES)
+      shapes[num_shapes].fanout = atoi(optarg);
+    else if (opt == 'd' && num_shapes < MAX_SHAPES)
+      shapes[num_shapes++].depth = atoi(optarg);
+    else if (opt == 'n')
+      operations = atoi(optarg);
+    else
+    {
+      fprintf(stderr, "Usage: %s [-f fanout -d depth]... [-n operations]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (num_shapes == 0)
+    num_shapes = 4;
+
+  printf("fanout,depth,nodes,benchmark,value,unit\n");
+  for (u32 i = 0; i < num_shapes; ++i)
+  {
+    if (shapes[i].fanout < 1 || shapes[i].depth < 1 || count_nodes(&shapes[i]) > 10000000)
+    {
+      fprintf(stderr, "Skipping fan-out %u and depth %u\n", shapes[i].fanout, shapes[i].depth);
+      continue;
+    }
+    bench_shape(&shapes[i], operations);
+  }
+  return 0;
+}
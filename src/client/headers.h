@@ -6,8 +6,14 @@ bool path_error(const char *path);
 void read_path(char *path_buffer);
 void print_error(enum status code);
 void print_mode(mode_t mode);
-void fill_rd_path(const i32 i, const char *path, char *buf);
-void delete_rd_paths(const i32 nm_sockfd, enum operation op, const char *path);
+u32 read_batch_entries(batch_entry *entries);
+u32 request_nm(const i32 nm_sockfd, const enum operation op, const message *request, message *response);
+void receive_response(const i32 nm_sockfd, const u32 id, message *response);
+void send_ack(const i32 nm_sockfd, const u32 id, transfer_report report);
+enum status send_batch(const i32 nm_sockfd, batch_entry *entries, u32 count, batch_result *results);
 void print_metadata(metadata meta);
+i32 start_read(const replica_location *location);
+i32 hedged_read(const replica_location *locations, const i32 count, enum status *code, i32 *served_by);
+enum status read_from_shards(const replica_location *locations, const i32 count, u64 *bytes);
 
 #endif
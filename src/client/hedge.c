@@ -0,0 +1,165 @@
+/**
+ * @file hedge.c
+ * @brief Hedged reads across the redundant copies of a file
+ * @details
+ * - Keeps a window of recent read latencies
+ * - Sends the read to the next copy whenever the pending ones are slower than a latency percentile
+ * - Uses whichever copy responds successfully first
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+#include <poll.h>
+
+struct
+{
+  i64 samples[HEDGE_SAMPLES];
+  i32 count;
+  i32 next;
+} read_latencies = {0};
+
+/**
+ * @brief Current time of a monotonic clock in milliseconds
+ *
+ * @return i64
+ */
+i64 now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Record the time a storage server took to respond to a read
+ *
+ * @param latency in milliseconds
+ */
+void record_read_latency(const i64 latency)
+{
+  read_latencies.samples[read_latencies.next] = latency;
+  read_latencies.next = (read_latencies.next + 1) % HEDGE_SAMPLES;
+  if (read_latencies.count < HEDGE_SAMPLES)
+    ++read_latencies.count;
+}
+
+i32 compare_latencies(const void *a, const void *b)
+{
+  const i64 x = *(const i64 *)a;
+  const i64 y = *(const i64 *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Time to wait on pending reads before hedging to another copy.
+ * It is the HEDGE_PERCENTILE of recent read latencies, or a default until enough reads have been seen.
+ *
+ * @return i64 delay in milliseconds
+ */
+i64 hedge_delay_ms()
+{
+  if (read_latencies.count < HEDGE_SAMPLES / 8)
+    return HEDGE_DEFAULT_DELAY_MS;
+
+  i64 sorted[HEDGE_SAMPLES];
+  memcpy(sorted, read_latencies.samples, sizeof(i64) * read_latencies.count);
+  qsort(sorted, read_latencies.count, sizeof(i64), compare_latencies);
+  const i64 delay = sorted[(read_latencies.count - 1) * HEDGE_PERCENTILE / 100];
+  return delay < HEDGE_MIN_DELAY_MS ? HEDGE_MIN_DELAY_MS : delay;
+}
+
+/**
+ * @brief Send a read request to a storage server
+ *
+ * @param location
+ * @return i32 socket of the storage server, -1 if it is unreachable
+ */
+i32 start_read(const replica_location *location)
+{
+  const i32 sockfd = try_connect_to_port(location->port);
+  if (sockfd == -1)
+    return -1;
+
+  const enum operation op = READ;
+  const enum codec codec = READ_CODEC;
+  SEND(sockfd, op);
+  CHECK(send(sockfd, location->path, MAX_STR_LEN, 0), -1);
+  SEND(sockfd, codec);
+  return sockfd;
+}
+
+/**
+ * @brief Read a file from whichever of its copies responds first.
+ * The copies are tried in order, and another one is added whenever the pending ones take longer than hedge_delay_ms.
+ * Copies that fail are dropped immediately in favour of the next one.
+ *
+ * @param locations copies of the file, primary first
+ * @param count number of copies
+ * @param code status of the last failure, if every copy fails
+ * @param served_by index of the copy that will be sent
+ * @return i32 socket of the storage server that will send the file, -1 if none could
+ */
+i32 hedged_read(const replica_location *locations, const i32 count, enum status *code, i32 *served_by)
+{
+  struct pollfd fds[MAX_REPLICAS];
+  i32 indices[MAX_REPLICAS];
+  i32 pending = 0;
+  i32 next = 0;
+  const i64 start = now_ms();
+  const i64 delay = hedge_delay_ms();
+  i64 deadline = start;
+  *code = NOT_FOUND;
+
+  while (1)
+  {
+    if (next < count && (pending == 0 || now_ms() >= deadline))
+    {
+      const i32 sockfd = start_read(&locations[next]);
+      if (sockfd != -1)
+      {
+        indices[pending] = next;
+        fds[pending].fd = sockfd;
+        fds[pending].events = POLLIN;
+        ++pending;
+        deadline = now_ms() + delay;
+      }
+      ++next;
+      continue;
+    }
+    if (pending == 0)
+      return -1;
+
+    const i64 remaining = deadline - now_ms();
+    const i32 ready = poll(fds, pending, next < count ? (remaining > 0 ? remaining : 0) : -1);
+    CHECK(ready, -1);
+
+    for (i32 i = 0; i < pending; ++i)
+    {
+      if (fds[i].revents == 0)
+        continue;
+
+      enum status res;
+      const i32 size = recv(fds[i].fd, &res, sizeof(res), 0);
+      if (size == sizeof(res) && res == SUCCESS)
+      {
+        const i32 sockfd = fds[i].fd;
+        for (i32 j = 0; j < pending; ++j)
+        {
+          if (j != i)
+            close(fds[j].fd);
+        }
+        record_read_latency(now_ms() - start);
+        *code = SUCCESS;
+        *served_by = indices[i];
+        return sockfd;
+      }
+      if (size == sizeof(res))
+        *code = res;
+
+      close(fds[i].fd);
+      --pending;
+      indices[i] = indices[pending];
+      fds[i--] = fds[pending];
+    }
+  }
+}
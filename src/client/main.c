@@ -8,87 +8,113 @@
 
 #include "../common/headers.h"
 #include "headers.h"
+#include <netinet/tcp.h>
 
 int main()
 {
   const i32 nm_sockfd = connect_to_port(NM_CLIENT_PORT);
+  const i32 nodelay = 1;
+  setsockopt(nm_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
   while (1)
   {
     const enum operation op = get_operation();
-    SEND(nm_sockfd, op);
+    message request = {0};
+    message response = {0};
     enum status code;
     if (op == READ || op == WRITE || op == METADATA)
     {
       char path[MAX_STR_LEN];
       read_path(path);
-      SEND(nm_sockfd, path);
-      RECV(nm_sockfd, code);
+      PUT(&request, path);
+      const u32 id = request_nm(nm_sockfd, op, &request, &response);
+      GET(&response, code);
 
-      if (op == READ)
+      if (code != SUCCESS)
       {
-        for (int i = 1; i <= 3 && code == NOT_FOUND; ++i)
-        {
-          char rdi_path[MAX_STR_LEN];
-          fill_rd_path(i, path, rdi_path);
-          SEND(nm_sockfd, op);
-          SEND(nm_sockfd, rdi_path);
-          RECV(nm_sockfd, code);
-
-          if (code != SUCCESS)
-            continue;
+        print_error(code);
+        message_free(&request);
+        message_free(&response);
+        continue;
+      }
 
-          bzero(path, sizeof(path));
-          strcpy(path, rdi_path);
-        }
+      i32 count;
+      replica_location locations[MAX_REPLICAS];
+      GET(&response, count);
+      for (i32 i = 0; i < count && i < MAX_REPLICAS; ++i)
+      {
+        GET(&response, locations[i]);
       }
+      message_free(&request);
+      message_free(&response);
 
-      if (code != SUCCESS)
+      i32 ss_sockfd;
+      i32 served_by = 0;
+      transfer_report report = {0};
+      if (op == READ && count > 0 && locations[0].shard.data_shards > 0)
       {
-        print_error(code);
+        // the primary copy is gone, and the redundancy is in shards
+        report.port = report.primary_port = locations[0].port;
+        code = read_from_shards(locations, count, &report.bytes);
+        send_ack(nm_sockfd, id, report);
+        if (code != SUCCESS)
+          print_error(code);
         continue;
       }
+      if (op == READ)
+      {
+        ss_sockfd = hedged_read(locations, count, &code, &served_by);
+      }
+      else
+      {
+        ss_sockfd = connect_to_port(locations[0].port);
+        const enum codec codec = READ_CODEC;
+        SEND(ss_sockfd, op);
+        SEND(ss_sockfd, locations[0].path);
+        SEND(ss_sockfd, codec);
+        RECV(ss_sockfd, code);
+      }
 
-      i32 port;
-      CHECK(recv(nm_sockfd, &port, sizeof(port), 0), -1);
-      const i32 ss_sockfd = connect_to_port(port);
-      SEND(ss_sockfd, op);
-      SEND(ss_sockfd, path);
-      RECV(ss_sockfd, code);
-
+      report.port = locations[served_by].port;
+      report.primary_port = locations[0].port;
       if (code != SUCCESS)
       {
+        if (ss_sockfd != -1)
+          close(ss_sockfd);
+        send_ack(nm_sockfd, id, report);
         print_error(code);
         continue;
       }
 
       if (op == READ)
       {
-        receive_and_print_file(ss_sockfd);
+        report.bytes = receive_and_print_file(ss_sockfd);
       }
       else if (op == WRITE)
       {
         char buffer[MAX_STR_LEN];
         fgets(buffer, MAX_STR_LEN, stdin);
         buffer[strcspn(buffer, "\n")] = 0;
-        SEND(ss_sockfd, buffer);
+        CHECK(send_block(ss_sockfd, buffer, strlen(buffer), READ_CODEC), -1);
+        report.bytes = strlen(buffer);
       }
       else if (op == METADATA)
       {
         struct metadata meta;
         RECV(ss_sockfd, meta);
         print_metadata(meta);
+        report.bytes = sizeof(meta);
       }
 
       close(ss_sockfd);
-      enum operation ack = ACK;
-      SEND(nm_sockfd, ack);
+      send_ack(nm_sockfd, id, report);
     }
     else if (op == CREATE_FILE || op == CREATE_FOLDER)
     {
       char path[MAX_STR_LEN];
       read_path(path);
-      SEND(nm_sockfd, path);
-      RECV(nm_sockfd, code);
+      PUT(&request, path);
+      request_nm(nm_sockfd, op, &request, &response);
+      GET(&response, code);
       if (code != SUCCESS)
         print_error(code);
       else
@@ -96,18 +122,15 @@ int main()
     }
     else if (op == DELETE_FILE || op == DELETE_FOLDER)
     {
-
       char path[MAX_STR_LEN];
       read_path(path);
-      SEND(nm_sockfd, path);
-      RECV(nm_sockfd, code);
+      PUT(&request, path);
+      request_nm(nm_sockfd, op, &request, &response);
+      GET(&response, code);
       if (code != SUCCESS)
         print_error(code);
       else
-      {
         printf(C_GREEN "Operation done successfully\n" C_RESET);
-        delete_rd_paths(nm_sockfd, op, path);
-      }
     }
     else if (op == COPY_FILE || op == COPY_FOLDER)
     {
@@ -116,10 +139,10 @@ int main()
       read_path(from_path);
       read_path(to_path);
 
-      SEND(nm_sockfd, from_path);
-      SEND(nm_sockfd, to_path);
-
-      RECV(nm_sockfd, code);
+      PUT(&request, from_path);
+      PUT(&request, to_path);
+      request_nm(nm_sockfd, op, &request, &response);
+      GET(&response, code);
       if (code == SUCCESS)
         printf("Copied successfully\n");
       else
@@ -130,22 +153,104 @@ int main()
       char path_of_subdir[MAX_STR_LEN];
       read_path(path_of_subdir);
 
-      SEND(nm_sockfd, path_of_subdir);
+      PUT(&request, path_of_subdir);
+      const u32 id = request_nm(nm_sockfd, op, &request, &response);
+      // the tree comes in chunks as it is rendered, up to the one marked last
+      bool last = false;
+      while (1)
+      {
+        GET(&response, code);
+        GET(&response, last);
+        if (code != SUCCESS)
+        {
+          print_error(code);
+          break;
+        }
+        if (last)
+        {
+          u64 next;
+          GET(&response, next);
+        }
+        fwrite(response.data + response.offset, 1, response.length - response.offset, stdout);
+        if (last)
+          break;
+        receive_response(nm_sockfd, id, &response);
+      }
+    }
+    else if (op == BATCH)
+    {
+      batch_entry *entries = malloc(sizeof(batch_entry) * MAX_BATCH_SIZE);
+      batch_result *results = malloc(sizeof(batch_result) * MAX_BATCH_SIZE);
+      const u32 count = read_batch_entries(entries);
+      code = send_batch(nm_sockfd, entries, count, results);
+      if (code != SUCCESS)
+        print_error(code);
 
-      RECV(nm_sockfd, code);
-      if (code == SUCCESS)
+      for (u32 i = 0; code == SUCCESS && i < count; ++i)
+      {
+        printf(C_YELLOW "%s: " C_RESET, entries[i].path);
+        if (results[i].code != SUCCESS)
+        {
+          print_error(results[i].code);
+          continue;
+        }
+        printf(C_GREEN "Operation done successfully\n" C_RESET);
+        if (entries[i].op == METADATA)
+          print_metadata(results[i].meta);
+      }
+      free(entries);
+      free(results);
+    }
+    else if (op == STATS)
+    {
+      request_nm(nm_sockfd, op, &request, &response);
+      GET(&response, code);
+      if (code == SUCCESS && response.offset < response.length)
       {
-        char printed_tree[200 * MAX_STR_LEN];
-        receive_data_in_packets(printed_tree, nm_sockfd, sizeof(printed_tree));
-        printf("%s", printed_tree);
+        response.data[response.length - 1] = '\0';
+        printf("%s", response.data + response.offset);
       }
       else
         print_error(code);
     }
+    else if (op == LIST)
+    {
+      char path[MAX_STR_LEN];
+      read_path(path);
+      // a page at a time, each request resuming from the cursor the previous one returned
+      u64 cursor = 0;
+      const u32 limit = 0;
+      do
+      {
+        PUT(&request, path);
+        PUT(&request, cursor);
+        PUT(&request, limit);
+        request_nm(nm_sockfd, op, &request, &response);
+        u32 count = 0;
+        GET(&response, code);
+        GET(&response, count);
+        for (u32 i = 0; i < count; ++i)
+        {
+          list_entry entry;
+          GET(&response, entry);
+          printf("%s%s" C_RESET "\t%s\tss %u\n", entry.is_file ? C_GREEN : C_BLUE, entry.name,
+                 entry.is_file ? "file" : "folder", entry.ss_id);
+        }
+        cursor = 0;
+        GET(&response, cursor);
+        message_free(&request);
+        message_free(&response);
+      } while (code == SUCCESS && cursor != 0);
+      if (code != SUCCESS)
+        print_error(code);
+    }
     else
     {
+      CHECK(send_message(nm_sockfd, 0, DISCONNECT, &request), false);
       break;
     }
+    message_free(&request);
+    message_free(&response);
   }
   close(nm_sockfd);
 
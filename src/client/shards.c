@@ -0,0 +1,157 @@
+/**
+ * @file shards.c
+ * @brief Degraded reads, rebuilding a file from the shards of its erasure code when its primary copy is gone
+ * @details
+ * - Shards are opened in order until k of them answer with a valid header for the same version of the file, so the
+ *   data shards are used first and nothing is decoded while they are all there
+ * - The file is rebuilt one stripe at a time as the shards come in, and printed right away
+ * - The whole file is checked against the checksum it had when the shards were made
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+
+// A shard being received from a storage server, block by block
+typedef struct shard_stream
+{
+  i32 sockfd;
+  u8 *buffer; // TRANSFER_BLOCK_SIZE bytes
+  u32 length; // bytes of the last block
+  u32 offset; // bytes of it already read
+} shard_stream;
+
+/**
+ * @brief Read the next bytes of a shard
+ *
+ * @param stream
+ * @param data output
+ * @param length
+ * @return bool false if the shard ended or failed its checks first
+ */
+bool shard_stream_read(shard_stream *stream, void *data, u64 length)
+{
+  u8 *out = data;
+  while (length > 0)
+  {
+    if (stream->offset == stream->length)
+    {
+      stream->offset = 0;
+      if (receive_block(stream->sockfd, stream->buffer, TRANSFER_BLOCK_SIZE, &stream->length) != SUCCESS ||
+          stream->length == 0)
+        return false;
+    }
+    const u64 size = length < stream->length - stream->offset ? length : stream->length - stream->offset;
+    memcpy(out, stream->buffer + stream->offset, size);
+    stream->offset += size;
+    out += size;
+    length -= size;
+  }
+  return true;
+}
+
+/**
+ * @brief Check that a shard header is usable, and belongs to the same version of the file as another one
+ *
+ * @param header
+ * @param location the shard was asked for at
+ * @param first header of the first shard opened, NULL if this is the first one
+ * @return bool
+ */
+bool shard_header_valid(const shard_header *header, const replica_location *location, const shard_header *first)
+{
+  const shard_spec spec = header->spec;
+  if (header->magic != SHARD_MAGIC || spec.data_shards == 0 || spec.data_shards + spec.parity_shards > EC_MAX_SHARDS ||
+      spec.index != location->shard.index || header->stripe_unit == 0 || header->stripe_unit > EC_STRIPE_UNIT)
+    return false;
+  return first == NULL ||
+         (spec.data_shards == first->spec.data_shards && spec.parity_shards == first->spec.parity_shards &&
+          header->stripe_unit == first->stripe_unit && header->file_size == first->file_size &&
+          header->file_crc == first->file_crc);
+}
+
+/**
+ * @brief Read a file from the shards of its erasure code, and print it
+ *
+ * @param locations shards of the file, in order of their index
+ * @param count
+ * @param bytes output, bytes of the file printed
+ * @return enum status UNAVAILABLE if fewer than k shards could be read, CORRUPTED if the file is not the one the shards
+ * were made from
+ */
+enum status read_from_shards(const replica_location *locations, const i32 count, u64 *bytes)
+{
+  shard_stream streams[EC_MAX_SHARDS];
+  bool present[EC_MAX_SHARDS] = {false};
+  shard_header first = {0}, header;
+  u32 used = 0;
+  *bytes = 0;
+  for (i32 i = 0; i < count && (used == 0 || used < first.spec.data_shards); ++i)
+  {
+    const i32 sockfd = start_read(&locations[i]);
+    if (sockfd == -1)
+      continue;
+    enum status res;
+    shard_stream stream = {sockfd, malloc(TRANSFER_BLOCK_SIZE), 0, 0};
+    if (recv(sockfd, &res, sizeof(res), MSG_WAITALL) != sizeof(res) || res != SUCCESS ||
+        !shard_stream_read(&stream, &header, sizeof(header)) ||
+        !shard_header_valid(&header, &locations[i], used == 0 ? NULL : &first) || present[header.spec.index])
+    {
+      close(sockfd);
+      free(stream.buffer);
+      continue;
+    }
+    if (used++ == 0)
+      first = header;
+    present[header.spec.index] = true;
+    streams[header.spec.index] = stream;
+  }
+
+  const u32 k = first.spec.data_shards, m = first.spec.parity_shards, unit = first.stripe_unit;
+  enum status code = used > 0 && used >= k ? SUCCESS : UNAVAILABLE;
+  u8 *units[EC_MAX_SHARDS] = {NULL};
+  for (u32 i = 0; code == SUCCESS && i < k + m; ++i)
+  {
+    if (i < k || present[i])
+      units[i] = malloc(unit);
+  }
+
+  const u64 stripes = code == SUCCESS ? (first.file_size + (u64)k * unit - 1) / ((u64)k * unit) : 0;
+  u64 remaining = first.file_size;
+  u32 crc = 0;
+  for (u64 stripe = 0; code == SUCCESS && stripe < stripes; ++stripe)
+  {
+    bool complete = true;
+    for (u32 i = 0; i < k + m; ++i)
+    {
+      if (present[i] && !shard_stream_read(&streams[i], units[i], unit))
+        code = CORRUPTED;
+      complete &= i >= k || present[i];
+    }
+    if (code != SUCCESS || (!complete && !erasure_reconstruct(k, m, units, present, unit)))
+    {
+      code = CORRUPTED;
+      break;
+    }
+    for (u32 j = 0; j < k && remaining > 0; ++j)
+    {
+      const u64 size = remaining < unit ? remaining : unit;
+      fwrite(units[j], 1, size, stdout);
+      crc = crc32c(crc, units[j], size);
+      remaining -= size;
+      *bytes += size;
+    }
+  }
+  if (code == SUCCESS && crc != first.file_crc)
+    code = CORRUPTED;
+
+  for (u32 i = 0; i < EC_MAX_SHARDS; ++i)
+  {
+    free(units[i]);
+    if (present[i])
+    {
+      close(streams[i].sockfd);
+      free(streams[i].buffer);
+    }
+  }
+  return code;
+}
@@ -19,8 +19,8 @@ i8 get_operation()
   printf(C_YELLOW "\nOperations:-\n" C_CYAN "1.Read\n"
                   "2.Write\n"
                   "3.Metadata\n" C_GREEN "4.Create file\n" C_RED "5.Delete file\n" C_GREEN "6.Create folder\n" C_RED
-                  "7.Delete folder\n" C_WHITE "8.Copy file\n" C_WHITE "9.Copy folder\n" C_BLUE "10.Print Tree\n" C_BLACK
-                  "11.Exit\n");
+                  "7.Delete folder\n" C_WHITE "8.Copy file\n" C_WHITE "9.Copy folder\n" C_BLUE "10.Print Tree\n" C_MAGENTA
+                  "11.Batch\n" C_BLUE "12.Stats\n" C_BLUE "13.List\n" C_BLACK "14.Exit\n");
   i8 op_int = -1;
   while (op_int < 1 || op_int >= END_OPERATION)
   {
@@ -124,6 +124,12 @@ void print_error(enum status code)
   case ALREADY_EXISTS:
     printf("The path already exists!");
     break;
+  case INVALID_CURSOR:
+    printf("The listing changed, start it again!");
+    break;
+  case CORRUPTED:
+    printf("The data was damaged in transfer!");
+    break;
   }
   printf("\n" C_RESET);
 }
@@ -188,36 +194,113 @@ void print_mode(mode_t mode)
 }
 
 /**
- * @brief Prepend the path with the corresponding redundancy number
+ * @brief Read the entries of a batch, one `<operation number> <path>` per line, until an empty line
  *
- * @param i redundancy number
- * @param path path to prepend to
- * @param buf output path
+ * @param entries output, MAX_BATCH_SIZE entries long
+ * @return u32 number of entries read
  */
-void fill_rd_path(const i32 i, const char *path, char *buf)
+u32 read_batch_entries(batch_entry *entries)
 {
-  sprintf(buf, ".rd%i/", i);
-  strcat(buf, path);
+  printf(C_YELLOW "Enter one operation number (3-7) and path per line, empty line to finish:\n" C_RESET);
+  u32 count = 0;
+  char buf[MAX_STR_LEN + 8];
+  while (count < MAX_BATCH_SIZE && fgets(buf, sizeof(buf), stdin) != NULL)
+  {
+    buf[strcspn(buf, "\n")] = 0;
+    if (buf[0] == '\0')
+      break;
+
+    char *path;
+    const i32 op_int = strtol(buf, &path, 10);
+    while (isspace(*path))
+      ++path;
+    if (op_int < METADATA + 1 || op_int > DELETE_FOLDER + 1 || path_error(path) || strlen(path) >= MAX_STR_LEN)
+    {
+      printf(C_RED "Invalid entry, skipped\n" C_RESET);
+      continue;
+    }
+    entries[count].op = op_int - 1;
+    entries[count].parents = false;
+    strcpy(entries[count].path, path);
+    ++count;
+  }
+  return count;
 }
 
 /**
- * @brief Delete redundancies given a path
+ * @brief Send a request to the naming server and wait for its response.
+ * Responses to other requests are not expected, as requests are sent one at a time.
  *
  * @param nm_sockfd
  * @param op
- * @param path
+ * @param request payload
+ * @param response output, to be freed with message_free
+ * @return u32 id of the request
+ */
+u32 request_nm(const i32 nm_sockfd, const enum operation op, const message *request, message *response)
+{
+  static u32 next_id = 0;
+  const u32 id = next_id++;
+  CHECK(send_message(nm_sockfd, id, op, request), false);
+  receive_response(nm_sockfd, id, response);
+  return id;
+}
+
+/**
+ * @brief Wait for the next response to a request, for the requests that are answered in several parts
+ *
+ * @param nm_sockfd
+ * @param id
+ * @param response output, freed first
  */
-void delete_rd_paths(const i32 nm_sockfd, enum operation op, const char *path)
+void receive_response(const i32 nm_sockfd, const u32 id, message *response)
 {
-  for (int i = 1; i <= 3; ++i)
+  request_header header;
+  do
   {
-    char rd_path[MAX_STR_LEN];
-    fill_rd_path(i, path, rd_path);
-    SEND(nm_sockfd, op);
-    SEND(nm_sockfd, rd_path);
-    enum status code;
-    RECV(nm_sockfd, code);
-  }
+    message_free(response);
+    CHECK(receive_message(nm_sockfd, &header, response), false);
+  } while (header.id != id);
+}
+
+/**
+ * @brief Tell the naming server that the storage server part of a request is over
+ *
+ * @param nm_sockfd
+ * @param id id of the READ, WRITE or METADATA request
+ * @param report
+ */
+void send_ack(const i32 nm_sockfd, const u32 id, transfer_report report)
+{
+  message ack = {0};
+  PUT(&ack, report);
+  CHECK(send_message(nm_sockfd, id, ACK, &ack), false);
+  message_free(&ack);
+}
+
+/**
+ * @brief Send the entries of a batch to the naming server and receive the result of each.
+ *
+ * @param nm_sockfd
+ * @param entries
+ * @param count
+ * @param results output, count results long
+ * @return enum status SUCCESS if the batch was accepted
+ */
+enum status send_batch(const i32 nm_sockfd, batch_entry *entries, u32 count, batch_result *results)
+{
+  message request = {0}, response = {0};
+  PUT(&request, count);
+  message_write(&request, entries, sizeof(batch_entry) * count);
+  request_nm(nm_sockfd, BATCH, &request, &response);
+
+  enum status code;
+  GET(&response, code);
+  if (code == SUCCESS)
+    message_read(&response, results, sizeof(batch_result) * count);
+  message_free(&request);
+  message_free(&response);
+  return code;
 }
 
 /**
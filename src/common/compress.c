@@ -0,0 +1,410 @@
+/**
+ * @file compress.c
+ * @brief Compression of the blocks of file transfers, in the LZ4 block format
+ * @details
+ * - CODEC_FAST finds matches through a table of the last position of every hash of 4 bytes, skipping ahead faster
+ *   the longer it goes without one, like LZ4
+ * - CODEC_HIGH follows chains of all earlier positions with the same hash, HIGH_SEARCH_DEPTH deep, and looks one byte
+ *   ahead for a longer match before taking one, like LZ4HC. Slower to compress, as fast to decompress.
+ * - Both write the same format, which one decompressor reads. It checks every length and offset, as blocks come from
+ *   the network.
+ * - looks_incompressible estimates how many distinct bytes a block effectively uses from a sample of it, so that
+ *   compressed or random data is sent as it is without trying
+ */
+
+#include "headers.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // a block ends with at least this many literals
+#define MATCH_LIMIT 12  // and its last match starts at least this many bytes before its end
+#define MAX_OFFSET 65535
+#define FAST_HASH_LOG 12
+#define HIGH_HASH_LOG 15
+#define HIGH_SEARCH_DEPTH 64
+#define SKIP_TRIGGER 6 // the fast search moves one more byte at a time every 2^this bytes without a match
+#define PROBE_SAMPLES 4096
+#define PROBE_MAX_SYMBOLS 200 // of 256, effective number of distinct bytes above which a block is not compressed
+
+/**
+ * @brief Read 4 bytes at any alignment
+ *
+ * @param p
+ * @return u32
+ */
+u32 read32(const u8 *p)
+{
+  u32 value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+/**
+ * @brief Hash the 4 bytes at a position
+ *
+ * @param p
+ * @param bits
+ * @return u32
+ */
+u32 hash4(const u8 *p, const i32 bits)
+{
+  return (read32(p) * 2654435761U) >> (32 - bits);
+}
+
+/**
+ * @brief Length of the common prefix of two positions
+ *
+ * @param p
+ * @param match earlier position
+ * @param limit end of the bytes p may extend to
+ * @return u32
+ */
+u32 common_length(const u8 *p, const u8 *match, const u8 *limit)
+{
+  const u8 *start = p;
+  while (p + sizeof(u64) <= limit)
+  {
+    u64 a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, match, sizeof(b));
+    if (a != b)
+      return p - start + __builtin_ctzll(a ^ b) / 8;
+    p += sizeof(u64);
+    match += sizeof(u64);
+  }
+  while (p < limit && *p == *match)
+  {
+    ++p;
+    ++match;
+  }
+  return p - start;
+}
+
+/**
+ * @brief Write a length that did not fit in its 4 bits of the token, 255 at a time
+ *
+ * @param op
+ * @param length what is left of it
+ * @return u8* position after it
+ */
+u8 *write_length(u8 *op, u32 length)
+{
+  for (; length >= 255; length -= 255)
+    *op++ = 255;
+  *op++ = length;
+  return op;
+}
+
+/**
+ * @brief Append a sequence, literals followed by a match, or only literals for the last one
+ *
+ * @param op output position, updated
+ * @param end end of the output
+ * @param literals
+ * @param num_literals
+ * @param offset distance back to the match
+ * @param match_length 0 for the last sequence
+ * @return bool false if the output is full
+ */
+bool write_sequence(u8 **op, const u8 *end, const u8 *literals, const u32 num_literals, const u32 offset,
+                    const u32 match_length)
+{
+  u8 *p = *op;
+  // token, lengths, literals and offset at most
+  if ((u64)(end - p) < 1 + num_literals / 255 + 1 + num_literals + 2 + match_length / 255 + 1)
+    return false;
+  u8 *token = p++;
+  *token = (num_literals >= 15 ? 15 : num_literals) << 4;
+  if (num_literals >= 15)
+    p = write_length(p, num_literals - 15);
+  memcpy(p, literals, num_literals);
+  p += num_literals;
+  if (match_length > 0)
+  {
+    *p++ = offset & 0xff;
+    *p++ = offset >> 8;
+    const u32 stored = match_length - MIN_MATCH;
+    *token |= stored >= 15 ? 15 : stored;
+    if (stored >= 15)
+      p = write_length(p, stored - 15);
+  }
+  *op = p;
+  return true;
+}
+
+/**
+ * @brief Compress with one probe of a hash table per position
+ *
+ * @param src
+ * @param length
+ * @param dst
+ * @param capacity
+ * @return u32 compressed length, 0 if it does not fit
+ */
+u32 compress_fast(const u8 *src, const u32 length, u8 *dst, const u32 capacity)
+{
+  u32 table[1 << FAST_HASH_LOG] = {0};
+  const u8 *ip = src, *anchor = src;
+  const u8 *match_limit = src + length - MATCH_LIMIT, *end_limit = src + length - LAST_LITERALS;
+  u8 *op = dst;
+  const u8 *end = dst + capacity;
+  u32 misses = 0;
+  while (length > MATCH_LIMIT && ip < match_limit)
+  {
+    const u32 hash = hash4(ip, FAST_HASH_LOG);
+    const u8 *match = src + table[hash];
+    table[hash] = ip - src;
+    if (match >= ip || ip - match > MAX_OFFSET || read32(match) != read32(ip))
+    {
+      ip += 1 + (misses++ >> SKIP_TRIGGER);
+      continue;
+    }
+    misses = 0;
+    while (ip > anchor && match > src && ip[-1] == match[-1])
+    {
+      --ip;
+      --match;
+    }
+    const u32 match_length = MIN_MATCH + common_length(ip + MIN_MATCH, match + MIN_MATCH, end_limit);
+    if (!write_sequence(&op, end, anchor, ip - anchor, ip - match, match_length))
+      return 0;
+    ip += match_length;
+    anchor = ip;
+    if (ip < match_limit)
+      table[hash4(ip - 2, FAST_HASH_LOG)] = ip - 2 - src;
+  }
+  if (!write_sequence(&op, end, anchor, src + length - anchor, 0, 0))
+    return 0;
+  return op - dst;
+}
+
+/**
+ * @brief Longest match at a position among the earlier ones with the same hash
+ *
+ * @param src
+ * @param ip
+ * @param head last position of each hash
+ * @param chain previous position with the same hash, of each position
+ * @param limit end of the bytes a match may extend to
+ * @param best_match output
+ * @return u32 length of the match, 0 if there is none
+ */
+u32 longest_match(const u8 *src, const u8 *ip, const i32 *head, const i32 *chain, const u8 *limit,
+                  const u8 **best_match)
+{
+  u32 best = 0;
+  i32 candidate = head[hash4(ip, HIGH_HASH_LOG)];
+  for (i32 depth = 0; candidate >= 0 && depth < HIGH_SEARCH_DEPTH; ++depth, candidate = chain[candidate])
+  {
+    const u8 *match = src + candidate;
+    if (ip - match > MAX_OFFSET)
+      break;
+    if (match[best] != ip[best] || read32(match) != read32(ip))
+      continue;
+    const u32 match_length = MIN_MATCH + common_length(ip + MIN_MATCH, match + MIN_MATCH, limit);
+    if (match_length > best)
+    {
+      best = match_length;
+      *best_match = match;
+    }
+  }
+  return best;
+}
+
+/**
+ * @brief Add a position to the hash chains
+ *
+ * @param src
+ * @param position
+ * @param head
+ * @param chain
+ */
+void insert_position(const u8 *src, const u32 position, i32 *head, i32 *chain)
+{
+  const u32 hash = hash4(src + position, HIGH_HASH_LOG);
+  chain[position] = head[hash];
+  head[hash] = position;
+}
+
+/**
+ * @brief Compress searching hash chains for the longest matches
+ *
+ * @param src
+ * @param length
+ * @param dst
+ * @param capacity
+ * @return u32 compressed length, 0 if it does not fit
+ */
+u32 compress_high(const u8 *src, const u32 length, u8 *dst, const u32 capacity)
+{
+  i32 *head = malloc(sizeof(i32) << HIGH_HASH_LOG);
+  i32 *chain = malloc(sizeof(i32) * (length + 1));
+  memset(head, -1, sizeof(i32) << HIGH_HASH_LOG);
+  const u8 *ip = src, *anchor = src;
+  const u8 *match_limit = src + length - MATCH_LIMIT, *end_limit = src + length - LAST_LITERALS;
+  u8 *op = dst;
+  const u8 *end = dst + capacity;
+  u32 inserted = 0; // positions below this are in the chains
+  bool full = false;
+  while (length > MATCH_LIMIT && ip < match_limit)
+  {
+    for (; inserted < (u32)(ip - src); ++inserted)
+      insert_position(src, inserted, head, chain);
+    const u8 *match;
+    const u32 match_length = longest_match(src, ip, head, chain, end_limit, &match);
+    if (match_length == 0)
+    {
+      ++ip;
+      continue;
+    }
+    // a longer match one byte later is worth a literal
+    insert_position(src, inserted++, head, chain);
+    const u8 *next_match;
+    if (ip + 1 < match_limit &&
+        longest_match(src, ip + 1, head, chain, end_limit, &next_match) > match_length + 1)
+    {
+      ++ip;
+      continue;
+    }
+    if (!write_sequence(&op, end, anchor, ip - anchor, ip - match, match_length))
+    {
+      full = true;
+      break;
+    }
+    ip += match_length;
+    anchor = ip;
+  }
+  free(head);
+  free(chain);
+  if (full || !write_sequence(&op, end, anchor, src + length - anchor, 0, 0))
+    return 0;
+  return op - dst;
+}
+
+/**
+ * @brief Largest compressed size of a block, for data that does not compress at all
+ *
+ * @param length
+ * @return u32
+ */
+u32 compress_bound(const u32 length)
+{
+  return length + length / 255 + 16;
+}
+
+/**
+ * @brief Compress a block
+ *
+ * @param codec CODEC_FAST or CODEC_HIGH
+ * @param src
+ * @param length
+ * @param dst
+ * @param capacity
+ * @return u32 compressed length, 0 if it would not be smaller than the block
+ */
+u32 compress_block(const enum codec codec, const void *src, const u32 length, void *dst, const u32 capacity)
+{
+  if (length == 0 || codec == CODEC_NONE)
+    return 0;
+  const u32 limit = capacity < length ? capacity : length - 1;
+  return codec == CODEC_HIGH ? compress_high(src, length, dst, limit) : compress_fast(src, length, dst, limit);
+}
+
+/**
+ * @brief Decompress a block, which may come from anywhere
+ *
+ * @param src
+ * @param length
+ * @param dst
+ * @param capacity
+ * @return i64 decompressed length, -1 if the block is malformed or does not fit
+ */
+i64 decompress_block(const void *src, const u32 length, void *dst, const u32 capacity)
+{
+  const u8 *ip = src, *end = ip + length;
+  u8 *op = dst;
+  const u8 *out_end = op + capacity;
+  while (ip < end)
+  {
+    const u8 token = *ip++;
+    u64 num_literals = token >> 4;
+    if (num_literals == 15)
+    {
+      u8 byte;
+      do
+      {
+        if (ip == end)
+          return -1;
+        byte = *ip++;
+        num_literals += byte;
+      } while (byte == 255);
+    }
+    if (num_literals > (u64)(end - ip) || num_literals > (u64)(out_end - op))
+      return -1;
+    memcpy(op, ip, num_literals);
+    ip += num_literals;
+    op += num_literals;
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return -1;
+    const u32 offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op - (u8 *)dst)
+      return -1;
+    u64 match_length = token & 15;
+    if (match_length == 15)
+    {
+      u8 byte;
+      do
+      {
+        if (ip == end)
+          return -1;
+        byte = *ip++;
+        match_length += byte;
+      } while (byte == 255);
+    }
+    match_length += MIN_MATCH;
+    if (match_length > (u64)(out_end - op))
+      return -1;
+    const u8 *match = op - offset;
+    if (offset >= sizeof(u64) && (u64)(out_end - op) >= match_length + sizeof(u64))
+    {
+      // 8 bytes at a time, writing past the match into space later sequences overwrite
+      for (u64 i = 0; i < match_length; i += sizeof(u64))
+        memcpy(op + i, match + i, sizeof(u64));
+    }
+    else if (offset >= match_length)
+      memcpy(op, match, match_length);
+    else
+    {
+      // overlapping, the match repeats the bytes it is copying
+      for (u64 i = 0; i < match_length; ++i)
+        op[i] = match[i];
+    }
+    op += match_length;
+  }
+  return op - (u8 *)dst;
+}
+
+/**
+ * @brief Guess from a sample whether a block would not compress, as most bytes values are about as frequent
+ *
+ * @param data
+ * @param length
+ * @return bool
+ */
+bool looks_incompressible(const void *data, const u32 length)
+{
+  const u8 *bytes = data;
+  u32 counts[256] = {0};
+  const u32 stride = length / PROBE_SAMPLES > 0 ? length / PROBE_SAMPLES : 1;
+  u64 samples = 0;
+  for (u32 i = 0; i < length; i += stride, ++samples)
+    ++counts[bytes[i]];
+  // samples^2 / sum of the squared counts is the number of equally frequent values with the same spread
+  u64 squares = 0;
+  for (i32 i = 0; i < 256; ++i)
+    squares += (u64)counts[i] * counts[i];
+  return samples * samples > PROBE_MAX_SYMBOLS * squares;
+}
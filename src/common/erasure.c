@@ -0,0 +1,343 @@
+/**
+ * @file erasure.c
+ * @brief Reed–Solomon erasure coding over GF(2^8), for redundancy in shards instead of full copies
+ * @details
+ * - A stripe of k data shards gets m parity shards, and any k of the k + m shards give back the data
+ * - The code is systematic: data shards are the data itself, parity shard i is the sum over the data shards j of
+ *   1 / (x_i + y_j) times shard j, with x_i = k + i and y_j = j. Every square submatrix of such a Cauchy matrix is
+ *   invertible, so any k rows of it together with the identity are too.
+ * - Multiplying a buffer by a constant is the only operation on bytes, done with two lookups of 4 bits each:
+ *   - portable, one table of 256 products per constant
+ *   - SSSE3 (on CPUs with SSE 4.2), 16 bytes at a time with pshufb
+ *   - AVX2, 32 bytes at a time
+ * - The implementations give the same results, the fastest one the CPU supports is picked on first use, like in
+ *   hash_kernels.c
+ */
+
+#include "headers.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define GF_POLYNOMIAL 0x11d // x^8 + x^4 + x^3 + x^2 + 1
+
+typedef void (*gf_kernel)(u8 *dst, const u8 *src, u8 constant, u64 length);
+
+u8 gf_exp[512];
+u8 gf_log[256];
+// Products of every constant with every low and every high half byte
+u8 gf_low[256][16];
+u8 gf_high[256][16];
+gf_kernel gf_kernels[NUM_HASH_KERNELS] = {NULL};
+enum hash_kernel gf_best = KERNEL_PORTABLE;
+pthread_once_t erasure_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Multiply two elements
+ *
+ * @param a
+ * @param b
+ * @return u8
+ */
+u8 gf_mul(const u8 a, const u8 b)
+{
+  return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+/**
+ * @brief Inverse of a non zero element
+ *
+ * @param a
+ * @return u8
+ */
+u8 gf_inverse(const u8 a)
+{
+  return gf_exp[255 - gf_log[a]];
+}
+
+/**
+ * @brief Add a buffer times a constant to another, with the tables
+ *
+ * @param dst
+ * @param src
+ * @param constant
+ * @param length
+ */
+void gf_mul_add_portable(u8 *dst, const u8 *src, const u8 constant, u64 length)
+{
+  u8 products[256];
+  for (i32 i = 0; i < 256; ++i)
+    products[i] = gf_low[constant][i & 15] ^ gf_high[constant][i >> 4];
+  for (u64 i = 0; i < length; ++i)
+    dst[i] ^= products[src[i]];
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Add a buffer times a constant to another, 16 bytes at a time
+ *
+ * @param dst
+ * @param src
+ * @param constant
+ * @param length
+ */
+__attribute__((target("sse4.2"))) void gf_mul_add_ssse3(u8 *dst, const u8 *src, const u8 constant, u64 length)
+{
+  const __m128i low = _mm_loadu_si128((const __m128i *)gf_low[constant]);
+  const __m128i high = _mm_loadu_si128((const __m128i *)gf_high[constant]);
+  const __m128i mask = _mm_set1_epi8(15);
+  u64 i = 0;
+  for (; i + 16 <= length; i += 16)
+  {
+    const __m128i data = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(data, mask)),
+                                          _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(data, 4), mask)));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), product));
+  }
+  gf_mul_add_portable(dst + i, src + i, constant, length - i);
+}
+
+/**
+ * @brief Add a buffer times a constant to another, 32 bytes at a time
+ *
+ * @param dst
+ * @param src
+ * @param constant
+ * @param length
+ */
+__attribute__((target("avx2"))) void gf_mul_add_avx2(u8 *dst, const u8 *src, const u8 constant, u64 length)
+{
+  const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_low[constant]));
+  const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_high[constant]));
+  const __m256i mask = _mm256_set1_epi8(15);
+  u64 i = 0;
+  for (; i + 32 <= length; i += 32)
+  {
+    const __m256i data = _mm256_loadu_si256((const __m256i *)(src + i));
+    const __m256i product =
+      _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(data, mask)),
+                       _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(data, 4), mask)));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), product));
+  }
+  gf_mul_add_portable(dst + i, src + i, constant, length - i);
+}
+#endif
+
+/**
+ * @brief Build the tables of the field, and pick the fastest implementation the CPU supports
+ */
+void erasure_init()
+{
+  u32 x = 1;
+  for (i32 i = 0; i < 255; ++i)
+  {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= GF_POLYNOMIAL;
+  }
+  // products of logarithms up to 2 * 254 without a modulo
+  for (i32 i = 255; i < 512; ++i)
+    gf_exp[i] = gf_exp[i - 255];
+  for (i32 c = 0; c < 256; ++c)
+  {
+    for (i32 i = 0; i < 16; ++i)
+    {
+      gf_low[c][i] = gf_mul(c, i);
+      gf_high[c][i] = gf_mul(c, i << 4);
+    }
+  }
+
+  gf_kernels[KERNEL_PORTABLE] = gf_mul_add_portable;
+#if defined(__x86_64__)
+  gf_kernels[KERNEL_SSE42] = gf_mul_add_ssse3;
+  gf_kernels[KERNEL_AVX2] = gf_mul_add_avx2;
+#endif
+  for (enum hash_kernel kernel = KERNEL_PORTABLE; kernel < NUM_HASH_KERNELS; ++kernel)
+  {
+    if (gf_kernels[kernel] != NULL && hash_kernel_supported(kernel))
+      gf_best = kernel;
+  }
+}
+
+/**
+ * @brief Check whether the functions taking an implementation can use one on this CPU
+ *
+ * @param kernel
+ * @return true
+ * @return false
+ */
+bool erasure_has_kernel(const enum hash_kernel kernel)
+{
+  pthread_once(&erasure_once, erasure_init);
+  return kernel < NUM_HASH_KERNELS && gf_kernels[kernel] != NULL && hash_kernel_supported(kernel);
+}
+
+/**
+ * @brief Coefficient of a data shard in a parity shard
+ *
+ * @param data_shards k
+ * @param parity index of the parity shard, from 0
+ * @param data index of the data shard
+ * @return u8
+ */
+u8 parity_coefficient(const u32 data_shards, const u32 parity, const u32 data)
+{
+  return gf_inverse((data_shards + parity) ^ data);
+}
+
+/**
+ * @brief erasure_parity with a given implementation, which erasure_has_kernel must have accepted
+ *
+ * @param kernel
+ * @param data_shards k
+ * @param parity index of the parity shard to compute, from 0
+ * @param data k buffers
+ * @param out output
+ * @param length bytes of each buffer
+ */
+void erasure_parity_with(const enum hash_kernel kernel, const u32 data_shards, const u32 parity, const u8 *const *data,
+                         u8 *out, const u64 length)
+{
+  pthread_once(&erasure_once, erasure_init);
+  memset(out, 0, length);
+  for (u32 j = 0; j < data_shards; ++j)
+    gf_kernels[kernel](out, data[j], parity_coefficient(data_shards, parity, j), length);
+}
+
+/**
+ * @brief Compute one parity shard of a stripe
+ *
+ * @param data_shards k, at most EC_MAX_SHARDS
+ * @param parity index of the parity shard to compute, from 0
+ * @param data k buffers
+ * @param out output
+ * @param length bytes of each buffer
+ */
+void erasure_parity(const u32 data_shards, const u32 parity, const u8 *const *data, u8 *out, const u64 length)
+{
+  pthread_once(&erasure_once, erasure_init);
+  erasure_parity_with(gf_best, data_shards, parity, data, out, length);
+}
+
+/**
+ * @brief Invert a square matrix in place by Gauss-Jordan elimination
+ *
+ * @param matrix size * size, row by row
+ * @param size
+ * @return bool false if it is singular
+ */
+bool gf_invert(u8 *matrix, const u32 size)
+{
+  u8 inverse[EC_MAX_SHARDS * EC_MAX_SHARDS] = {0};
+  for (u32 i = 0; i < size; ++i)
+    inverse[i * size + i] = 1;
+  for (u32 col = 0; col < size; ++col)
+  {
+    u32 pivot = col;
+    while (pivot < size && matrix[pivot * size + col] == 0)
+      ++pivot;
+    if (pivot == size)
+      return false;
+    for (u32 j = 0; j < size; ++j)
+    {
+      u8 swap = matrix[col * size + j];
+      matrix[col * size + j] = matrix[pivot * size + j];
+      matrix[pivot * size + j] = swap;
+      swap = inverse[col * size + j];
+      inverse[col * size + j] = inverse[pivot * size + j];
+      inverse[pivot * size + j] = swap;
+    }
+    const u8 scale = gf_inverse(matrix[col * size + col]);
+    for (u32 j = 0; j < size; ++j)
+    {
+      matrix[col * size + j] = gf_mul(matrix[col * size + j], scale);
+      inverse[col * size + j] = gf_mul(inverse[col * size + j], scale);
+    }
+    for (u32 row = 0; row < size; ++row)
+    {
+      const u8 factor = matrix[row * size + col];
+      if (row == col || factor == 0)
+        continue;
+      for (u32 j = 0; j < size; ++j)
+      {
+        matrix[row * size + j] ^= gf_mul(factor, matrix[col * size + j]);
+        inverse[row * size + j] ^= gf_mul(factor, inverse[col * size + j]);
+      }
+    }
+  }
+  memcpy(matrix, inverse, size * size);
+  return true;
+}
+
+/**
+ * @brief erasure_reconstruct with a given implementation, which erasure_has_kernel must have accepted
+ *
+ * @param kernel
+ * @param data_shards k
+ * @param parity_shards m
+ * @param shards k + m buffers, the missing data shards are written
+ * @param present k + m flags
+ * @param length bytes of each buffer
+ * @return bool false if fewer than k shards are present
+ */
+bool erasure_reconstruct_with(const enum hash_kernel kernel, const u32 data_shards, const u32 parity_shards,
+                              u8 **shards, const bool *present, const u64 length)
+{
+  pthread_once(&erasure_once, erasure_init);
+  // the first k shards present, and the rows of the code that gave them
+  u32 used[EC_MAX_SHARDS];
+  u32 count = 0;
+  for (u32 i = 0; i < data_shards + parity_shards && count < data_shards; ++i)
+  {
+    if (present[i])
+      used[count++] = i;
+  }
+  if (count < data_shards)
+    return false;
+
+  u8 matrix[EC_MAX_SHARDS * EC_MAX_SHARDS];
+  for (u32 row = 0; row < data_shards; ++row)
+  {
+    for (u32 j = 0; j < data_shards; ++j)
+    {
+      matrix[row * data_shards + j] = used[row] < data_shards ? used[row] == j
+                                                              : parity_coefficient(data_shards, used[row] - data_shards, j);
+    }
+  }
+  if (!gf_invert(matrix, data_shards))
+    return false;
+
+  for (u32 missing = 0; missing < data_shards; ++missing)
+  {
+    if (present[missing])
+      continue;
+    memset(shards[missing], 0, length);
+    for (u32 j = 0; j < data_shards; ++j)
+    {
+      const u8 coefficient = matrix[missing * data_shards + j];
+      if (coefficient != 0)
+        gf_kernels[kernel](shards[missing], shards[used[j]], coefficient, length);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Rebuild the missing data shards of a stripe from any k of its shards. Missing parity shards are not rebuilt.
+ *
+ * @param data_shards k, at most EC_MAX_SHARDS
+ * @param parity_shards m, with k + m at most EC_MAX_SHARDS
+ * @param shards k + m buffers, the missing data shards are written
+ * @param present k + m flags
+ * @param length bytes of each buffer
+ * @return bool false if fewer than k shards are present
+ */
+bool erasure_reconstruct(const u32 data_shards, const u32 parity_shards, u8 **shards, const bool *present,
+                         const u64 length)
+{
+  pthread_once(&erasure_once, erasure_init);
+  return erasure_reconstruct_with(gf_best, data_shards, parity_shards, shards, present, length);
+}
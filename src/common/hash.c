@@ -0,0 +1,82 @@
+/**
+ * @file hash.c
+ * @brief Contains all the hash functions.
+ * @details
+ *    - Functions for hashing buffers and strings into 64 bit values, in one go or in parts.
+ */
+
+#include "headers.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/**
+ * @brief Start hashing a buffer in parts, with hash_continue for each of them and hash_finish at the end, so that
+ * the hash of every prefix ending at a part can be had along the way. Gives the same hashes as hash_bytes.
+ *
+ * @param seed
+ * @return u64 state of the hash
+ */
+u64 hash_start(const u64 seed)
+{
+  return FNV_OFFSET ^ seed;
+}
+
+/**
+ * @brief Add the next part of a buffer to a hash, with 64 bit FNV-1a
+ *
+ * @param hash state from hash_start or hash_continue
+ * @param data
+ * @param length
+ * @return u64 state of the hash
+ */
+u64 hash_continue(u64 hash, const void *data, const u64 length)
+{
+  const u8 *bytes = data;
+  for (u64 i = 0; i < length; ++i)
+  {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * @brief Get the hash of what was added so far, through a finalizer so that similar inputs spread over all bits
+ *
+ * @param hash state from hash_continue
+ * @return u64 hash
+ */
+u64 hash_finish(u64 hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/**
+ * @brief Hash a buffer with 64 bit FNV-1a, followed by a finalizer so that similar inputs spread over all bits
+ *
+ * @param data buffer to hash
+ * @param length length of the buffer in bytes
+ * @param seed different seeds give independent hashes of the same data
+ * @return u64 hash
+ */
+u64 hash_bytes(const void *data, const u64 length, const u64 seed)
+{
+  return hash_finish(hash_continue(hash_start(seed), data, length));
+}
+
+/**
+ * @brief Hash a null terminated string
+ *
+ * @param str
+ * @return u64 hash
+ */
+u64 hash_string(const char *str)
+{
+  return hash_bytes(str, strlen(str), 0);
+}
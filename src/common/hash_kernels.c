@@ -0,0 +1,429 @@
+/**
+ * @file hash_kernels.c
+ * @brief Checksums and fast hashes of buffers, with an implementation for each instruction set extension that speeds
+ * them up
+ * @details
+ * - CRC-32C (Castagnoli), of the data sent between servers and stored with files:
+ *   - a portable table driven implementation, slicing by 8 bytes
+ *   - the crc32 instruction of SSE 4.2, 8 bytes at a time
+ *   - the crc32 instruction on three streams at once, hiding its latency, merged with carry-less multiplications
+ * - fast_hash, a 64 bit hash in the style of xxHash for deduplication and the like, never stored with data:
+ *   - portable 64 bit arithmetic on eight accumulators
+ *   - AVX2, the eight accumulators in two registers
+ * - Every implementation of a function gives the same results, the fastest one the CPU supports is picked on first
+ *   use. The others stay callable through crc32c_with and fast_hash_with, for benchmarks and checks.
+ */
+
+#include "headers.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82f63b78 // reversed bit order
+
+// Bytes of each of the three streams of crc32c_pclmul, for long buffers and for what is left of them
+#define CRC32C_LONG_BLOCK 4096
+#define CRC32C_SHORT_BLOCK 256
+
+#define PRIME32_1 0x9e3779b1ULL
+#define PRIME32_2 0x85ebca77ULL
+#define PRIME32_3 0xc2b2ae3dULL
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+#define PRIME64_5 0x27d4eb2f165667c5ULL
+
+// Bytes consumed by fast_hash at a time, one 64 bit word per accumulator, and stripes between two scrambles
+#define STRIPE_LENGTH 64
+#define STRIPES_PER_BLOCK 16
+
+const char *hash_kernel_names[NUM_HASH_KERNELS] = {"portable", "sse4.2", "pclmul", "avx2"};
+
+typedef u32 (*crc32c_kernel)(u32 crc, const u8 *data, u64 length);
+typedef void (*stripes_kernel)(u64 *acc, const u8 *data, u64 stripes, const u64 *key);
+
+u32 crc32c_table[8][256];
+// x^(8n-33) mod P in reversed bit order, for n one and two blocks of crc32c_pclmul
+u32 crc32c_long_shifts[2];
+u32 crc32c_short_shifts[2];
+crc32c_kernel crc32c_kernels[NUM_HASH_KERNELS] = {NULL};
+stripes_kernel stripes_kernels[NUM_HASH_KERNELS] = {NULL};
+enum hash_kernel crc32c_best = KERNEL_PORTABLE;
+enum hash_kernel fast_hash_best = KERNEL_PORTABLE;
+pthread_once_t hash_kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Update a CRC with the tables, 8 bytes at a time
+ *
+ * @param crc current value, inverted
+ * @param data
+ * @param length
+ * @return u32 new value, inverted
+ */
+u32 crc32c_portable(u32 crc, const u8 *data, u64 length)
+{
+  for (; length > 0 && ((uintptr_t)data & 7) != 0; --length)
+    crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  for (; length >= 8; length -= 8, data += 8)
+  {
+    u64 word;
+    memcpy(&word, data, 8);
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^ crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^ crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^ crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+  }
+  for (; length > 0; --length)
+    crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Update a CRC with the crc32 instruction of SSE 4.2
+ *
+ * @param crc current value, inverted
+ * @param data
+ * @param length
+ * @return u32 new value, inverted
+ */
+__attribute__((target("sse4.2"))) u32 crc32c_sse42(u32 crc, const u8 *data, u64 length)
+{
+  for (; length > 0 && ((uintptr_t)data & 7) != 0; --length)
+    crc = _mm_crc32_u8(crc, *data++);
+  u64 crc64 = crc;
+  for (; length >= 8; length -= 8, data += 8)
+  {
+    u64 word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; length > 0; --length)
+    crc = _mm_crc32_u8(crc, *data++);
+  return crc;
+}
+
+/**
+ * @brief Move a CRC past zero bytes, multiplying it by x^(8n) modulo the polynomial
+ *
+ * @param crc
+ * @param shift x^(8n-33) mod P, the crc32 instruction multiplying by the remaining x^33
+ * @return u32
+ */
+__attribute__((target("sse4.2,pclmul"))) u32 crc32c_shift(const u32 crc, const u32 shift)
+{
+  const __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(shift), 0);
+  return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+/**
+ * @brief Update a CRC over three consecutive blocks, as three independent streams of crc32 instructions. The CRCs of
+ * the second and third block start from 0, the first two are then moved past the blocks after them.
+ *
+ * @param crc current value, inverted
+ * @param data 8 byte aligned
+ * @param block length of each block, a multiple of 8
+ * @param shifts x^(8n-33) mod P for n one and two blocks
+ * @return u32 new value, inverted
+ */
+__attribute__((target("sse4.2,pclmul"))) u32 crc32c_three_way(const u32 crc, const u8 *data, const u64 block,
+                                                             const u32 *shifts)
+{
+  u64 crc_a = crc, crc_b = 0, crc_c = 0;
+  for (u64 i = 0; i < block; i += 8)
+  {
+    u64 word_a, word_b, word_c;
+    memcpy(&word_a, data + i, 8);
+    memcpy(&word_b, data + block + i, 8);
+    memcpy(&word_c, data + 2 * block + i, 8);
+    crc_a = _mm_crc32_u64(crc_a, word_a);
+    crc_b = _mm_crc32_u64(crc_b, word_b);
+    crc_c = _mm_crc32_u64(crc_c, word_c);
+  }
+  return crc32c_shift(crc_a, shifts[1]) ^ crc32c_shift(crc_b, shifts[0]) ^ crc_c;
+}
+
+/**
+ * @brief Update a CRC with the crc32 instruction on three streams at once, for buffers long enough to split
+ *
+ * @param crc current value, inverted
+ * @param data
+ * @param length
+ * @return u32 new value, inverted
+ */
+__attribute__((target("sse4.2,pclmul"))) u32 crc32c_pclmul(u32 crc, const u8 *data, u64 length)
+{
+  for (; length > 0 && ((uintptr_t)data & 7) != 0; --length)
+    crc = _mm_crc32_u8(crc, *data++);
+  for (; length >= 3 * CRC32C_LONG_BLOCK; length -= 3 * CRC32C_LONG_BLOCK, data += 3 * CRC32C_LONG_BLOCK)
+    crc = crc32c_three_way(crc, data, CRC32C_LONG_BLOCK, crc32c_long_shifts);
+  for (; length >= 3 * CRC32C_SHORT_BLOCK; length -= 3 * CRC32C_SHORT_BLOCK, data += 3 * CRC32C_SHORT_BLOCK)
+    crc = crc32c_three_way(crc, data, CRC32C_SHORT_BLOCK, crc32c_short_shifts);
+  return crc32c_sse42(crc, data, length);
+}
+#endif
+
+/**
+ * @brief Accumulate stripes of 64 bytes into the eight accumulators of fast_hash, scrambling them after every
+ * STRIPES_PER_BLOCK stripes
+ *
+ * @param acc eight accumulators
+ * @param data
+ * @param stripes
+ * @param key eight words derived from the seed
+ */
+void stripes_portable(u64 *acc, const u8 *data, u64 stripes, const u64 *key)
+{
+  for (u64 stripe = 1; stripe <= stripes; ++stripe, data += STRIPE_LENGTH)
+  {
+    for (i32 i = 0; i < 8; ++i)
+    {
+      u64 word;
+      memcpy(&word, data + 8 * i, 8);
+      const u64 keyed = word ^ key[i];
+      acc[i ^ 1] += word;
+      acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+    }
+    if (stripe % STRIPES_PER_BLOCK == 0)
+    {
+      for (i32 i = 0; i < 8; ++i)
+        acc[i] = (acc[i] ^ (acc[i] >> 47) ^ key[i]) * PRIME32_1;
+    }
+  }
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief stripes_portable with AVX2, the accumulators being in two registers of four words
+ *
+ * @param acc eight accumulators
+ * @param data
+ * @param stripes
+ * @param key eight words derived from the seed
+ */
+__attribute__((target("avx2"))) void stripes_avx2(u64 *acc, const u8 *data, u64 stripes, const u64 *key)
+{
+  __m256i acc_low = _mm256_loadu_si256((const __m256i *)acc);
+  __m256i acc_high = _mm256_loadu_si256((const __m256i *)(acc + 4));
+  const __m256i key_low = _mm256_loadu_si256((const __m256i *)key);
+  const __m256i key_high = _mm256_loadu_si256((const __m256i *)(key + 4));
+  const __m256i prime = _mm256_set1_epi64x(PRIME32_1);
+  for (u64 stripe = 1; stripe <= stripes; ++stripe, data += STRIPE_LENGTH)
+  {
+    const __m256i data_low = _mm256_loadu_si256((const __m256i *)data);
+    const __m256i data_high = _mm256_loadu_si256((const __m256i *)(data + 32));
+    const __m256i keyed_low = _mm256_xor_si256(data_low, key_low);
+    const __m256i keyed_high = _mm256_xor_si256(data_high, key_high);
+    // the words swapped in pairs, as acc[i ^ 1] += word
+    acc_low = _mm256_add_epi64(acc_low, _mm256_shuffle_epi32(data_low, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc_high = _mm256_add_epi64(acc_high, _mm256_shuffle_epi32(data_high, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc_low = _mm256_add_epi64(acc_low, _mm256_mul_epu32(keyed_low, _mm256_srli_epi64(keyed_low, 32)));
+    acc_high = _mm256_add_epi64(acc_high, _mm256_mul_epu32(keyed_high, _mm256_srli_epi64(keyed_high, 32)));
+    if (stripe % STRIPES_PER_BLOCK == 0)
+    {
+      // a 64 bit product by a 32 bit prime, from the products of its two halves
+      __m256i mixed = _mm256_xor_si256(_mm256_xor_si256(acc_low, _mm256_srli_epi64(acc_low, 47)), key_low);
+      acc_low = _mm256_add_epi64(_mm256_mul_epu32(mixed, prime),
+                                 _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(mixed, 32), prime), 32));
+      mixed = _mm256_xor_si256(_mm256_xor_si256(acc_high, _mm256_srli_epi64(acc_high, 47)), key_high);
+      acc_high = _mm256_add_epi64(_mm256_mul_epu32(mixed, prime),
+                                  _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(mixed, 32), prime), 32));
+    }
+  }
+  _mm256_storeu_si256((__m256i *)acc, acc_low);
+  _mm256_storeu_si256((__m256i *)(acc + 4), acc_high);
+}
+#endif
+
+/**
+ * @brief Check with CPUID whether the CPU, and the operating system for AVX2, support an implementation
+ *
+ * @param kernel
+ * @return true
+ * @return false
+ */
+bool hash_kernel_supported(const enum hash_kernel kernel)
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  switch (kernel)
+  {
+  case KERNEL_PORTABLE:
+    return true;
+  case KERNEL_SSE42:
+    return __builtin_cpu_supports("sse4.2");
+  case KERNEL_PCLMUL:
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+  case KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+  default:
+    return false;
+  }
+#else
+  return kernel == KERNEL_PORTABLE;
+#endif
+}
+
+/**
+ * @brief Build the tables and constants, and pick the fastest implementations the CPU supports
+ */
+void hash_kernels_init()
+{
+  for (u32 i = 0; i < 256; ++i)
+  {
+    u32 crc = i;
+    for (i32 bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+    crc32c_table[0][i] = crc;
+  }
+  for (u32 i = 0; i < 256; ++i)
+  {
+    for (i32 slice = 1; slice < 8; ++slice)
+      crc32c_table[slice][i] = crc32c_table[0][crc32c_table[slice - 1][i] & 0xff] ^ (crc32c_table[slice - 1][i] >> 8);
+  }
+
+  // x^0 is the top bit in reversed order, every multiplication by x a shift right
+  u32 power = 0x80000000;
+  for (u64 exponent = 1; exponent <= 16 * CRC32C_LONG_BLOCK - 33; ++exponent)
+  {
+    power = (power >> 1) ^ (power & 1 ? CRC32C_POLYNOMIAL : 0);
+    if (exponent == 8 * CRC32C_SHORT_BLOCK - 33)
+      crc32c_short_shifts[0] = power;
+    if (exponent == 16 * CRC32C_SHORT_BLOCK - 33)
+      crc32c_short_shifts[1] = power;
+    if (exponent == 8 * CRC32C_LONG_BLOCK - 33)
+      crc32c_long_shifts[0] = power;
+  }
+  crc32c_long_shifts[1] = power;
+
+  crc32c_kernels[KERNEL_PORTABLE] = crc32c_portable;
+  stripes_kernels[KERNEL_PORTABLE] = stripes_portable;
+#if defined(__x86_64__)
+  crc32c_kernels[KERNEL_SSE42] = crc32c_sse42;
+  crc32c_kernels[KERNEL_PCLMUL] = crc32c_pclmul;
+  stripes_kernels[KERNEL_AVX2] = stripes_avx2;
+#endif
+  for (enum hash_kernel kernel = KERNEL_PORTABLE; kernel < NUM_HASH_KERNELS; ++kernel)
+  {
+    if (!hash_kernel_supported(kernel))
+      continue;
+    if (crc32c_kernels[kernel] != NULL)
+      crc32c_best = kernel;
+    if (stripes_kernels[kernel] != NULL)
+      fast_hash_best = kernel;
+  }
+}
+
+/**
+ * @brief Check whether crc32c_with can use an implementation on this CPU
+ *
+ * @param kernel
+ * @return true
+ * @return false
+ */
+bool crc32c_has_kernel(const enum hash_kernel kernel)
+{
+  pthread_once(&hash_kernels_once, hash_kernels_init);
+  return kernel < NUM_HASH_KERNELS && crc32c_kernels[kernel] != NULL && hash_kernel_supported(kernel);
+}
+
+/**
+ * @brief crc32c with a given implementation, which crc32c_has_kernel must have accepted
+ *
+ * @param kernel
+ * @param crc 0 to start, or the CRC of the data before
+ * @param data
+ * @param length
+ * @return u32
+ */
+u32 crc32c_with(const enum hash_kernel kernel, const u32 crc, const void *data, const u64 length)
+{
+  pthread_once(&hash_kernels_once, hash_kernels_init);
+  return ~crc32c_kernels[kernel](~crc, data, length);
+}
+
+/**
+ * @brief Compute the CRC-32C of a buffer, or continue one over data that follows what it was computed on
+ *
+ * @param crc 0 to start, or the CRC of the data before
+ * @param data
+ * @param length
+ * @return u32
+ */
+u32 crc32c(const u32 crc, const void *data, const u64 length)
+{
+  pthread_once(&hash_kernels_once, hash_kernels_init);
+  return ~crc32c_kernels[crc32c_best](~crc, data, length);
+}
+
+/**
+ * @brief Check whether fast_hash_with can use an implementation on this CPU
+ *
+ * @param kernel
+ * @return true
+ * @return false
+ */
+bool fast_hash_has_kernel(const enum hash_kernel kernel)
+{
+  pthread_once(&hash_kernels_once, hash_kernels_init);
+  return kernel < NUM_HASH_KERNELS && stripes_kernels[kernel] != NULL && hash_kernel_supported(kernel);
+}
+
+/**
+ * @brief fast_hash with a given implementation, which fast_hash_has_kernel must have accepted
+ *
+ * @param kernel
+ * @param data
+ * @param length
+ * @param seed
+ * @return u64
+ */
+u64 fast_hash_with(const enum hash_kernel kernel, const void *data, const u64 length, const u64 seed)
+{
+  pthread_once(&hash_kernels_once, hash_kernels_init);
+  const u8 *bytes = data;
+  u64 acc[8] = {PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1};
+  u64 key[8];
+  for (i32 i = 0; i < 8; ++i)
+    key[i] = (PRIME64_1 * (i + 1)) ^ (seed * PRIME64_2);
+
+  const u64 stripes = length / STRIPE_LENGTH;
+  stripes_kernels[kernel](acc, bytes, stripes, key);
+  // the last bytes, as a stripe padded with zeros
+  if (length % STRIPE_LENGTH != 0)
+  {
+    u8 last[STRIPE_LENGTH] = {0};
+    memcpy(last, bytes + stripes * STRIPE_LENGTH, length % STRIPE_LENGTH);
+    stripes_portable(acc, last, 1, key);
+  }
+
+  u64 hash = length * PRIME64_1 + seed;
+  for (i32 i = 0; i < 8; ++i)
+  {
+    hash ^= acc[i] * PRIME64_2;
+    hash = ((hash << 31) | (hash >> 33)) * PRIME64_1;
+  }
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+/**
+ * @brief Hash a buffer into 64 bits, much faster than hash_bytes on long buffers. Not meant to resist attacks, nor to
+ * be stored, as later versions may change it.
+ *
+ * @param data
+ * @param length
+ * @param seed different seeds give independent hashes of the same data
+ * @return u64
+ */
+u64 fast_hash(const void *data, const u64 length, const u64 seed)
+{
+  pthread_once(&hash_kernels_once, hash_kernels_init);
+  return fast_hash_with(fast_hash_best, data, length, seed);
+}
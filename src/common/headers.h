@@ -7,12 +7,14 @@
 #include <errno.h>
 #include <netinet/in.h>
 #include <semaphore.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -22,12 +24,20 @@
 #include "inc/defs.h"
 #include "inc/tree.h"
 
+typedef struct ss_heartbeat
+{
+  u64 free_bytes;
+  u64 free_inodes;
+  i32 active_requests;
+} ss_heartbeat;
+
 typedef struct storage_server_data
 {
   i32 port_for_client;
   i32 port_for_nm;
   i32 port_for_alive;
   char UUID[MAX_STR_LEN];
+  ss_heartbeat heartbeat;
   char ss_tree[MAX_STR_LEN * 2000];
 } storage_server_data;
 
@@ -40,6 +50,40 @@ typedef struct metadata
   mode_t mode;
 } metadata;
 
+// What a redundant copy holds of a file: all of it, or one shard of its erasure code
+typedef struct shard_spec
+{
+  u8 data_shards;   // k, 0 for a full copy
+  u8 parity_shards; // m
+  u8 index;         // of the shard, the parity shards come after the data shards
+} shard_spec;
+
+// Start of every shard file. It is followed by the part of every stripe of the file the shard holds, stripe_unit
+// bytes each, and by the CRC-32C of everything before.
+typedef struct shard_header
+{
+  u32 magic; // SHARD_MAGIC
+  shard_spec spec;
+  u32 stripe_unit; // EC_STRIPE_UNIT, or less for files smaller than a stripe
+  u64 file_size;
+  u32 file_crc;
+} shard_header;
+
+typedef struct replica_location
+{
+  i32 port;
+  shard_spec shard;
+  char path[MAX_STR_LEN];
+} replica_location;
+
+// Sent by a client with the ACK of a READ, WRITE or METADATA once it is done with the storage server
+typedef struct transfer_report
+{
+  i32 port;         // storage server that served the request
+  i32 primary_port; // first location sent by the naming server, which the request was counted against
+  u64 bytes;
+} transfer_report;
+
 enum operation
 {
   READ,
@@ -52,6 +96,10 @@ enum operation
   COPY_FILE,
   COPY_FOLDER,
   PRINT_TREE,
+  BATCH,
+  STATS,
+  LIST,
+  CHECKSUM,
   ACK,
   DISCONNECT,
   END_OPERATION
@@ -72,26 +120,225 @@ enum status
   CREATE_PERMISSION_DENIED,
   DELETE_PERMISSION_DENIED,
   UNKNOWN_PERMISSION_DENIED,
+  INVALID_CURSOR,
+  CORRUPTED,
+};
+
+typedef struct batch_entry
+{
+  enum operation op; // METADATA, CREATE_FILE, DELETE_FILE, CREATE_FOLDER or DELETE_FOLDER
+  bool parents;      // create missing parent folders first, only set by the naming server
+  char path[MAX_STR_LEN];
+} batch_entry;
+
+typedef struct batch_result
+{
+  enum status code;
+  metadata meta; // only for METADATA
+} batch_result;
+
+// Child of a directory in a LIST response
+typedef struct list_entry
+{
+  char name[MAX_NAME_LEN];
+  bool is_file;
+  u32 ss_id; // storage server holding it
+} list_entry;
+
+// Prefix of every request from a client to the naming server, and of every response to one.
+// A client can have many requests in flight on one connection, responses come back in any order.
+typedef struct request_header
+{
+  u32 id;             // chosen by the client, echoed in the response
+  enum operation op;  // in a response, the operation of the request
+  u32 length;         // bytes of payload following the header
+} request_header;
+
+// Longest payload of a request or response, a full BATCH, so that a bogus length is refused before it is allocated
+#define MAX_MESSAGE_LENGTH (MAX_BATCH_SIZE * sizeof(batch_entry) + MAX_STR_LEN)
+
+// Payload of a request or response, written and read in order
+typedef struct message
+{
+  char *data;
+  u32 length;
+  u32 capacity;
+  u32 offset; // next byte to read
+} message;
+
+// Counters and gauges kept by metrics.c, besides the per operation request counts and latencies
+enum metric
+{
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_CONNECTIONS,
+  METRIC_IN_FLIGHT,
+  METRIC_CACHE_HITS,
+  METRIC_CACHE_MISSES,
+  METRIC_COPY_BYTES_RECEIVED, // bytes of copied files that came over the network
+  METRIC_COPY_BYTES_REUSED,   // bytes of copied files found in the chunk store instead
+  METRIC_WIRE_BYTES_SAVED,    // bytes compression kept off the wire
+  NUM_METRICS
 };
 
+// Requests of one operation recorded so far, summed over all threads
+typedef struct op_summary
+{
+  u64 requests;
+  u64 errors;
+  u64 quantiles_us[METRICS_QUANTILES]; // latency upper bound at each of metrics_quantiles
+} op_summary;
+
+// Compression of the blocks of a stream. The receiver of a stream asks for one, and every receiver reads them all.
+enum codec
+{
+  CODEC_NONE,
+  CODEC_FAST, // for speed
+  CODEC_HIGH  // for size, slower to compress only
+};
+
+// Sent before each block of a stream, which is wire_length bytes long and compressed if that is less than length
+typedef struct block_header
+{
+  u32 length;
+  u32 wire_length;
+  u32 crc; // of the data as it was before compression
+} block_header;
+
+// A chunk of a file being copied. Chunks are cut where the content says, so files that share content share chunks.
+typedef struct chunk_ref
+{
+  u64 hash[2];
+  u32 length;
+  u32 crc;
+} chunk_ref;
+
 enum copy_type
 {
   SENDER,
   RECEIVER
 };
 
+// First thing sent on every connection from a storage server to NM_SS_PORT
+enum ss_message
+{
+  SS_REGISTER,
+  SS_TREE_DELTA,
+  SS_RECONNECT
+};
+
+// Sent with SS_RECONNECT in place of storage_server_data, the tree is then compared one directory at a time
+typedef struct ss_reconnect_request
+{
+  i32 port_for_client;
+  i32 port_for_nm;
+  i32 port_for_alive;
+  char UUID[MAX_STR_LEN];
+  ss_heartbeat heartbeat;
+  u64 tree_hash;
+} ss_reconnect_request;
+
+// One child of a directory, as listed by a storage server during SS_RECONNECT
+typedef struct tree_summary_entry
+{
+  char name[MAX_NAME_LEN];
+  bool is_file;
+  u64 hash;
+} tree_summary_entry;
+
+enum delta_type
+{
+  DELTA_ADD,
+  DELTA_REMOVE,
+  DELTA_RENAME
+};
+
+// A change to the files of a storage server made outside the protocol
+typedef struct tree_delta
+{
+  enum delta_type type;
+  bool is_file;
+  char path[MAX_STR_LEN];
+  char new_path[MAX_STR_LEN]; // DELTA_RENAME only
+} tree_delta;
+
+typedef struct tree_delta_header
+{
+  i32 ss_id;
+  u32 count;
+} tree_delta_header;
+
+// Implementations of the functions of hash_kernels.c, the fastest one the CPU supports is used unless asked otherwise
+enum hash_kernel
+{
+  KERNEL_PORTABLE, // every function
+  KERNEL_SSE42,    // crc32c, erasure coding with its SSSE3 shuffles
+  KERNEL_PCLMUL,   // crc32c
+  KERNEL_AVX2,     // fast_hash, erasure coding
+  NUM_HASH_KERNELS
+};
+
+// compress.c
+u32 compress_bound(const u32 length);
+u32 compress_block(const enum codec codec, const void *src, const u32 length, void *dst, const u32 capacity);
+i64 decompress_block(const void *src, const u32 length, void *dst, const u32 capacity);
+bool looks_incompressible(const void *data, const u32 length);
+
+// erasure.c
+bool erasure_has_kernel(const enum hash_kernel kernel);
+void erasure_parity_with(const enum hash_kernel kernel, const u32 data_shards, const u32 parity, const u8 *const *data,
+                         u8 *out, const u64 length);
+void erasure_parity(const u32 data_shards, const u32 parity, const u8 *const *data, u8 *out, const u64 length);
+bool erasure_reconstruct_with(const enum hash_kernel kernel, const u32 data_shards, const u32 parity_shards,
+                              u8 **shards, const bool *present, const u64 length);
+bool erasure_reconstruct(const u32 data_shards, const u32 parity_shards, u8 **shards, const bool *present,
+                         const u64 length);
+
+// hash_kernels.c
+extern const char *hash_kernel_names[NUM_HASH_KERNELS];
+bool hash_kernel_supported(const enum hash_kernel kernel);
+bool crc32c_has_kernel(const enum hash_kernel kernel);
+u32 crc32c_with(const enum hash_kernel kernel, const u32 crc, const void *data, const u64 length);
+u32 crc32c(const u32 crc, const void *data, const u64 length);
+bool fast_hash_has_kernel(const enum hash_kernel kernel);
+u64 fast_hash_with(const enum hash_kernel kernel, const void *data, const u64 length, const u64 seed);
+u64 fast_hash(const void *data, const u64 length, const u64 seed);
+
+// hash.c
+u64 hash_start(const u64 seed);
+u64 hash_continue(u64 hash, const void *data, const u64 length);
+u64 hash_finish(u64 hash);
+u64 hash_bytes(const void *data, const u64 length, const u64 seed);
+u64 hash_string(const char *str);
+
+// metrics.c
+extern const char *operation_names[END_OPERATION];
+extern const double metrics_quantiles[METRICS_QUANTILES];
+u64 metrics_now_us();
+void metrics_add(const enum metric metric, const i64 delta);
+void metrics_record(const enum operation op, const u64 latency_us, const bool failed);
+void metrics_summarize(const enum operation op, op_summary *summary);
+void metrics_render(message *out, const char *labels);
+
 // network.c
 i32 connect_to_port(const i32 port);
+i32 try_connect_to_port(const i32 port);
 i32 bind_to_port(const i32 port);
 i32 get_port(const i32 fd);
-void send_file(FILE *f, const i32 sockfd);
-void receive_and_print_file(const i32 sockfd);
+i64 send_block(const i32 sockfd, const void *data, const u32 length, const enum codec codec);
+enum status receive_block(const i32 sockfd, void *data, const u32 capacity, u32 *length);
+enum status relay_block(const i32 from_sockfd, const i32 to_sockfd, const u32 length, const u32 crc);
+i64 send_file(FILE *f, const i32 sockfd, const enum codec codec);
+u64 receive_and_print_file(const i32 sockfd);
 
-void transmit_file_for_writing(FILE *f, const i32 sockfd);
-void receive_and_transmit_file(const i32 from_sockfd, const i32 to_sockfd);
-void receive_and_write_file(const i32 from_sockfd, FILE *f);
+enum status receive_and_transmit_chunks(const i32 from_sockfd, const i32 to_sockfd);
 void send_data_in_packets(void *buffer, const i32 sockfd, u32 buffer_length);
 void receive_data_in_packets(void *buffer, const i32 sockfd, u32 buffer_length);
+void message_write(message *msg, const void *data, const u32 length);
+bool message_read(message *msg, void *data, const u32 length);
+void message_free(message *msg);
+bool send_message(const i32 sockfd, const u32 id, const enum operation op, const message *msg);
+bool receive_message(const i32 sockfd, request_header *header, message *msg);
 
 #define CHECK(actual_value, error_value)                                                                               \
   if ((actual_value) == error_value)                                                                                   \
@@ -102,5 +349,7 @@ void receive_data_in_packets(void *buffer, const i32 sockfd, u32 buffer_length);
 
 #define RECV(sockfd, data) CHECK(recv(sockfd, &data, sizeof(data), 0), -1)
 #define SEND(sockfd, data) CHECK(send(sockfd, &data, sizeof(data), 0), -1)
+#define PUT(msg, data) message_write(msg, &data, sizeof(data))
+#define GET(msg, data) message_read(msg, &data, sizeof(data))
 
 #endif
@@ -12,10 +12,35 @@
 #define MAX_NAME_LEN 128
 #define MAX_CONNECTIONS 16
 #define CACHE_SIZE 16
-
-#define RD1 "/home/praneeth/Repos/final-project-027/buckets/1"
-#define RD2 "/home/praneeth/Repos/final-project-027/buckets/2"
-#define RD3 "/home/praneeth/Repos/final-project-027/buckets/3"
+#define PREFIX_CACHE_SIZE 1024 // paths whose node is remembered, to resolve the paths below them from there
+#define PREFIX_CACHE_DEPTH 64 // deepest components of a path looked up in the prefix cache
+#define MAX_REPLICAS EC_MAX_SHARDS // locations of a path sent for a read: its copies, or the shards of its erasure code
+#define MAX_STORAGE_SERVERS 64
+#define HEDGE_SAMPLES 64
+#define HEDGE_PERCENTILE 95
+#define HEDGE_DEFAULT_DELAY_MS 50
+#define HEDGE_MIN_DELAY_MS 5
+#define SCAN_MAX_THREADS 8
+#define SCAN_BUFFER_SIZE 32768
+#define MAX_BATCH_SIZE 4096
+#define WRITE_TEMP_PREFIX ".write." // of the files storage servers write new versions of files to
+#define TRASH_DIR ".trash"           // folder at the root of a storage server where deleted folders wait to be removed
+#define CHUNK_STORE_DIR ".chunks"     // folder at the root of a storage server holding copied files by their content
+#define CHUNK_MIN_SIZE 2048           // content defined chunks of files being copied, see storage_server/dedup.c
+#define CHUNK_AVG_SIZE 8192
+#define CHUNK_MAX_SIZE 65536
+#define CHUNK_MAX_PER_FILE (1 << 22)
+#define TRANSFER_BLOCK_SIZE 65536         // bytes of a file read at a time and sent as one block, see send_block
+#define READ_CODEC CODEC_FAST             // of files read by clients, and of writes
+#define COPY_CODEC CODEC_FAST             // of files copied by clients and moved between storage servers
+#define REPLICATION_CODEC CODEC_HIGH      // of redundant copies, sent in the background
+#define EC_MAX_SHARDS 16                  // data and parity shards of an erasure code at most, see common/erasure.c
+#define EC_STRIPE_UNIT 65536              // bytes of a file each data shard holds of every stripe, at most
+#define SHARD_SUFFIX ".ec"                // of the redundant copy of a top level node holding one of its shards
+#define SHARD_MAGIC 0x64726873            // first bytes of every shard file
+#define METRICS_SUB_BUCKET_BITS 3 // latency histogram buckets per power of two are 2^this
+#define METRICS_BUCKETS 312       // latencies up to about 2^40 microseconds
+#define METRICS_QUANTILES 5       // 0.5, 0.9, 0.99, 0.999 and 1
 
 typedef int8_t i8;
 typedef int16_t i16;
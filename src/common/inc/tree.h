@@ -11,6 +11,9 @@ struct Information
   bool IsFile;
   bool Access;
   u32 ss_id;
+  u64 Version;  // top level nodes only: bumped on every change to the subtree, or copied from the primary by replicas
+  u64 Verified; // redundant copies only: when last found or made identical to their original, 0 if never
+  u64 Hash;     // summary of the name, type and subtree of the node, set by ComputeTreeHash
   char UUID[MAX_STR_LEN];
   pthread_rwlock_t rwlock;
   /*
@@ -25,37 +28,67 @@ struct TreeNode
   struct TreeNode *PrevSibling;
   struct TreeNode *ChildDirectoryLL; // LL - > Linked List
   struct TreeNode *Parent;
+  u64 Generation; // unique to the node, and renewed whenever one of its children is removed
 };
 
 typedef struct TreeNode *Tree;
 
+// Destination of a rendered tree. Lines are gathered in Buffer and handed to Flush whenever it is full,
+// so that a tree of any size is rendered with Capacity bytes of memory.
+typedef struct TreeWriter
+{
+  char *Buffer;
+  u32 Length;
+  u32 Capacity; // at least MAX_STR_LEN, the longest line
+  u64 Skip;     // nodes left out before the first one written, for pagination
+  u64 Limit;    // nodes written at most, 0 for no limit
+  u64 Seen;     // nodes visited, including the skipped ones
+  u64 Written;
+  bool More;                                // stopped at Limit with nodes left
+  bool (*Flush)(struct TreeWriter *Writer); // empties the buffer, false to stop rendering
+  void *Context;
+} TreeWriter;
+
 Tree InitTree();
+struct TreeNode *FindChild(Tree T, const char *ChildName, bool CreateFlag, bool NoNameFlag);
+struct TreeNode *PrependChild(Tree T, const char *ChildName);
 
 void AddAccessibleDir(char *DirPath, Tree Parent);
 void InitDirectory(Tree Parent);
+void ProcessWholeDir(char *DirPath, Tree Parent);
+void ScanDirectory(const char *DirPath, Tree Parent);
+i32 DeleteTree(Tree T);
 void RemoveInaccessiblePath(Tree Parent, const char *DirPath);
 int SendTreeData(Tree T, char *buffer);
 Tree ReceiveTreeData(char *buffer);
 void MergeTree(Tree T1, Tree T2, u32 ss_id, char *UUID);
+u64 ComputeTreeHash(Tree T);
+Tree CopyServerTree(Tree T, u32 ss_id);
 
 void RemoveServerPath(Tree T, u32 ss_id);
+void SetCacheObserver(void (*observer)(bool hit));
 i32 GetPathSSID(Tree T, const char *path, bool cache_flag);
+u32 GetSubtreeOwners(Tree T, u32 *ss_ids, u32 max);
 char *GetParent(const char *path);
 Tree GetTreeFromPath(Tree T, const char *path);
+Tree GetTopLevelNode(Tree T, const char *path);
+void BumpVersion(Tree T, const char *path);
 i8 IsFile(Tree T, const char *path);
 
 void AddFile(Tree T, const char *path, i32 port_ss_nm, char *UUID);
 void AddFolder(Tree T, const char *path, i32 port_ss_nm, char *UUID);
 void DeleteFile(Tree T, const char *path);
 void DeleteFolder(Tree T, const char *path);
+i32 RenameNode(Tree T, const char *OldPath, const char *NewPath);
 i8 Ancestor(Tree T, const char *from_path, const char *to_path);
 
 void AcquireReaderLock(Tree T, const char *path);
 void AcquireWriterLock(Tree T, const char *path);
+bool TryAcquireWriterLock(Tree T, const char *path);
 void ReleaseLock(Tree T, const char *path);
 
 void PrintTree(Tree T, u32 indent);
-void GetPrintedSubtree(Tree T, const char *path, char *printedtree);
+bool GetPrintedSubtree(Tree T, const char *path, u32 MaxDepth, TreeWriter *Writer);
 
 
 #endif
@@ -0,0 +1,270 @@
+/**
+ * @file metrics.c
+ * @brief Counters and latency histograms of a server
+ * @details
+ * - Every thread records into a shard of its own, so recording never waits for or contends with other threads
+ * - The shards are only summed up when the metrics are read, by the STATS operation
+ * - Shards of threads that have exited are handed to new threads, so their counts are kept and memory stays bounded
+ * - Latencies are kept in log-linear (HDR style) histograms with 2^METRICS_SUB_BUCKET_BITS buckets per power of two
+ */
+
+#include "headers.h"
+
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+typedef struct metrics_shard
+{
+  u64 counters[NUM_METRICS]; // gauges are sums of increments and decrements, which may happen in different shards
+  u64 requests[END_OPERATION];
+  u64 errors[END_OPERATION];
+  u64 latency[END_OPERATION][METRICS_BUCKETS];
+  struct metrics_shard *next;      // in the list of all shards
+  struct metrics_shard *next_free; // in the list of shards of exited threads
+} metrics_shard;
+
+const char *operation_names[END_OPERATION] = {
+  "READ",          "WRITE",        "METADATA",    "CREATE_FILE", "DELETE_FILE", "CREATE_FOLDER", "DELETE_FOLDER",
+  "COPY_FILE",     "COPY_FOLDER",  "PRINT_TREE",  "BATCH",       "STATS",       "LIST",          "CHECKSUM",
+  "ACK",           "DISCONNECT",
+};
+
+const double metrics_quantiles[METRICS_QUANTILES] = {0.5, 0.9, 0.99, 0.999, 1};
+
+const char *metric_names[NUM_METRICS] = {
+  "bytes_in_total", "bytes_out_total", "active_connections", "requests_in_flight", "cache_hits_total",
+  "cache_misses_total", "copy_bytes_received_total", "copy_bytes_reused_total",
+  "wire_bytes_saved_total",
+};
+
+struct
+{
+  metrics_shard *all;
+  metrics_shard *free;
+  pthread_mutex_t lock; // only taken when a thread records for the first time, exits, or metrics are read
+  pthread_once_t once;
+  pthread_key_t key;
+} metrics = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, 0};
+
+__thread metrics_shard *local_shard = NULL;
+
+/**
+ * @brief Give the shard of an exiting thread to the next new thread
+ *
+ * @param shard
+ */
+void retire_shard(void *shard)
+{
+  pthread_mutex_lock(&metrics.lock);
+  ((metrics_shard *)shard)->next_free = metrics.free;
+  metrics.free = shard;
+  pthread_mutex_unlock(&metrics.lock);
+}
+
+void create_shard_key()
+{
+  pthread_key_create(&metrics.key, retire_shard);
+}
+
+/**
+ * @brief Get the shard of the calling thread
+ *
+ * @return metrics_shard*
+ */
+metrics_shard *get_shard()
+{
+  if (local_shard != NULL)
+    return local_shard;
+
+  pthread_once(&metrics.once, create_shard_key);
+  pthread_mutex_lock(&metrics.lock);
+  if (metrics.free != NULL)
+  {
+    local_shard = metrics.free;
+    metrics.free = local_shard->next_free;
+  }
+  else
+  {
+    local_shard = calloc(1, sizeof(metrics_shard));
+    local_shard->next = metrics.all;
+    metrics.all = local_shard;
+  }
+  pthread_mutex_unlock(&metrics.lock);
+  pthread_setspecific(metrics.key, local_shard);
+  return local_shard;
+}
+
+/**
+ * @brief Add to a counter of the calling thread's shard. Only the owning thread writes a shard, so a relaxed load and
+ * store are enough, and readers see either the old or the new value.
+ *
+ * @param counter
+ * @param value
+ */
+void shard_add(u64 *counter, const u64 value)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Current time of a monotonic clock in microseconds
+ *
+ * @return u64
+ */
+u64 metrics_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Add to a counter or gauge
+ *
+ * @param metric
+ * @param delta negative to decrease a gauge
+ */
+void metrics_add(const enum metric metric, const i64 delta)
+{
+  shard_add(&get_shard()->counters[metric], (u64)delta);
+}
+
+/**
+ * @brief Find the histogram bucket of a latency
+ *
+ * @param us
+ * @return u32
+ */
+u32 latency_bucket(const u64 us)
+{
+  if (us < METRICS_SUB_BUCKETS)
+    return us;
+  const u32 exponent = 63 - __builtin_clzll(us);
+  const u32 sub_bucket = (us >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+  const u32 bucket = (exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub_bucket;
+  return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/**
+ * @brief Largest latency that falls into a histogram bucket
+ *
+ * @param bucket
+ * @return u64
+ */
+u64 bucket_upper_bound(const u32 bucket)
+{
+  if (bucket < METRICS_SUB_BUCKETS)
+    return bucket;
+  const u32 exponent = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS - 1;
+  const u64 sub_bucket = bucket % METRICS_SUB_BUCKETS;
+  return ((METRICS_SUB_BUCKETS + sub_bucket + 1) << (exponent - METRICS_SUB_BUCKET_BITS)) - 1;
+}
+
+/**
+ * @brief Record a request that was handled
+ *
+ * @param op
+ * @param latency_us time taken to handle it
+ * @param failed
+ */
+void metrics_record(const enum operation op, const u64 latency_us, const bool failed)
+{
+  if (op >= END_OPERATION)
+    return;
+  metrics_shard *shard = get_shard();
+  shard_add(&shard->requests[op], 1);
+  if (failed)
+    shard_add(&shard->errors[op], 1);
+  shard_add(&shard->latency[op][latency_bucket(latency_us)], 1);
+}
+
+/**
+ * @brief Append a line of text to a message
+ *
+ * @param out
+ * @param fmt
+ */
+void append_line(message *out, const char *fmt, ...)
+{
+  char line[MAX_STR_LEN];
+  va_list args;
+  va_start(args, fmt);
+  const i32 length = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  message_write(out, line, length < (i32)sizeof(line) ? length : (i32)sizeof(line) - 1);
+}
+
+/**
+ * @brief Sum up the requests of one operation recorded by every thread
+ *
+ * @param op
+ * @param summary output, with a latency upper bound for each of metrics_quantiles
+ */
+void metrics_summarize(const enum operation op, op_summary *summary)
+{
+  u64 *latency = calloc(METRICS_BUCKETS, sizeof(u64));
+  *summary = (op_summary){0};
+  pthread_mutex_lock(&metrics.lock);
+  for (metrics_shard *shard = metrics.all; shard != NULL; shard = shard->next)
+  {
+    summary->requests += __atomic_load_n(&shard->requests[op], __ATOMIC_RELAXED);
+    summary->errors += __atomic_load_n(&shard->errors[op], __ATOMIC_RELAXED);
+    for (i32 b = 0; b < METRICS_BUCKETS; ++b)
+      latency[b] += __atomic_load_n(&shard->latency[op][b], __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&metrics.lock);
+
+  // the histogram may be a little ahead of the request count, as they are read at slightly different times
+  u64 total = 0;
+  for (i32 b = 0; b < METRICS_BUCKETS; ++b)
+    total += latency[b];
+  u64 seen = 0;
+  i32 b = 0;
+  for (i32 q = 0; q < METRICS_QUANTILES && total > 0; ++q)
+  {
+    u64 rank = metrics_quantiles[q] * total + 0.5;
+    rank = rank == 0 ? 1 : rank > total ? total : rank;
+    while (b < METRICS_BUCKETS - 1 && seen + latency[b] < rank)
+      seen += latency[b++];
+    summary->quantiles_us[q] = bucket_upper_bound(b);
+  }
+  free(latency);
+}
+
+/**
+ * @brief Write all metrics as text, one `name{labels} value` per line.
+ * Latency quantiles are upper bounds of their histogram bucket, in microseconds.
+ *
+ * @param out
+ * @param labels added to every line, such as server="naming"
+ */
+void metrics_render(message *out, const char *labels)
+{
+  u64 counters[NUM_METRICS] = {0};
+  pthread_mutex_lock(&metrics.lock);
+  for (metrics_shard *shard = metrics.all; shard != NULL; shard = shard->next)
+  {
+    for (i32 i = 0; i < NUM_METRICS; ++i)
+      counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&metrics.lock);
+
+  for (i32 i = 0; i < NUM_METRICS; ++i)
+  {
+    append_line(out, "%s{%s} %li\n", metric_names[i], labels, (i64)counters[i]);
+  }
+
+  for (i32 op = 0; op < END_OPERATION; ++op)
+  {
+    op_summary summary;
+    metrics_summarize(op, &summary);
+    if (summary.requests == 0)
+      continue;
+    append_line(out, "requests_total{%s,op=\"%s\"} %lu\n", labels, operation_names[op], summary.requests);
+    append_line(out, "request_errors_total{%s,op=\"%s\"} %lu\n", labels, operation_names[op], summary.errors);
+    for (i32 q = 0; q < METRICS_QUANTILES; ++q)
+    {
+      append_line(out, "request_latency_us{%s,op=\"%s\",quantile=\"%g\"} %lu\n", labels, operation_names[op],
+                  metrics_quantiles[q], summary.quantiles_us[q]);
+    }
+  }
+}
@@ -30,6 +30,31 @@ i32 connect_to_port(const i32 port)
   return sockfd;
 }
 
+/**
+ * @brief Establish a connection to a server using TCP, without exiting on failure
+ *
+ * @param port A server may be bound and listening to this
+ * @return i32 file descriptor, or -1 if the server could not be reached
+ */
+i32 try_connect_to_port(const i32 port)
+{
+  const i32 sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(sockfd, -1);
+
+  struct sockaddr_in addr;
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr(LOCALHOST);
+  if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    close(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
+
 /**
  * @brief Establish a server using TCP
  *
@@ -69,24 +94,136 @@ i32 get_port(const i32 fd)
 }
 
 /**
- * @brief Send a file in chunks of char arrays
+ * @brief Send a block of a stream, compressed unless it looks incompressible or does not get smaller
+ *
+ * @param sockfd
+ * @param data
+ * @param length at most TRANSFER_BLOCK_SIZE, 0 ends a stream
+ * @param codec asked for by the receiver
+ * @return i64 bytes put on the wire, -1 if the connection broke
+ */
+i64 send_block(const i32 sockfd, const void *data, const u32 length, const enum codec codec)
+{
+  u8 *frame = malloc(sizeof(block_header) + compress_bound(length));
+  block_header header = {length, 0, crc32c(0, data, length)};
+  if (codec != CODEC_NONE && !looks_incompressible(data, length))
+    header.wire_length = compress_block(codec, data, length, frame + sizeof(header), compress_bound(length));
+  if (header.wire_length == 0)
+  {
+    header.wire_length = length;
+    memcpy(frame + sizeof(header), data, length);
+  }
+  memcpy(frame, &header, sizeof(header));
+  const i64 size = sizeof(header) + header.wire_length;
+  const i64 sent = send(sockfd, frame, size, MSG_NOSIGNAL);
+  free(frame);
+  return sent == size ? size : -1;
+}
+
+/**
+ * @brief Receive the rest of a block whose header was received, and decompress it
+ *
+ * @param sockfd
+ * @param header
+ * @param data output
+ * @param capacity of data
+ * @param wire output, the block as it was received, compress_bound(capacity) long
+ * @return enum status CORRUPTED if it fails its check, UNAVAILABLE if the rest of the stream can not be read
+ */
+enum status receive_block_data(const i32 sockfd, const block_header *header, void *data, const u32 capacity, u8 *wire)
+{
+  if (header->length > capacity || header->wire_length > compress_bound(capacity) ||
+      header->wire_length > header->length)
+    return UNAVAILABLE;
+  if (recv(sockfd, wire, header->wire_length, MSG_WAITALL) != header->wire_length)
+    return UNAVAILABLE;
+  if (header->wire_length == header->length)
+    memcpy(data, wire, header->length);
+  else if (decompress_block(wire, header->wire_length, data, header->length) != header->length)
+    return CORRUPTED;
+  return crc32c(0, data, header->length) == header->crc ? SUCCESS : CORRUPTED;
+}
+
+/**
+ * @brief Receive a block of a stream sent by send_block
+ *
+ * @param sockfd
+ * @param data output
+ * @param capacity of data
+ * @param length output, 0 at the end of a stream
+ * @return enum status CORRUPTED if it fails its check, UNAVAILABLE if the rest of the stream can not be read
+ */
+enum status receive_block(const i32 sockfd, void *data, const u32 capacity, u32 *length)
+{
+  block_header header;
+  *length = 0;
+  if (recv(sockfd, &header, sizeof(header), MSG_WAITALL) != sizeof(header))
+    return UNAVAILABLE;
+  u8 *wire = malloc(compress_bound(capacity));
+  const enum status code = receive_block_data(sockfd, &header, data, capacity, wire);
+  free(wire);
+  *length = header.length;
+  return code;
+}
+
+/**
+ * @brief Pass a block of a stream on as it was received, checking it on the way. A block that can not be read is
+ * replaced by one of the expected length that fails its check, and the sending socket must not be used anymore.
+ *
+ * @param from_sockfd -1 to only send the replacement
+ * @param to_sockfd
+ * @param length expected length of the block
+ * @param crc expected CRC-32C of the block
+ * @return enum status CORRUPTED if it fails its check, UNAVAILABLE if the sending socket can not be read anymore
+ */
+enum status relay_block(const i32 from_sockfd, const i32 to_sockfd, const u32 length, const u32 crc)
+{
+  block_header header;
+  u8 *data = malloc(length + 1);
+  u8 *wire = malloc(sizeof(header) + compress_bound(length));
+  enum status code = UNAVAILABLE;
+  if (recv(from_sockfd, &header, sizeof(header), MSG_WAITALL) == sizeof(header) && header.length == length)
+    code = receive_block_data(from_sockfd, &header, data, length, wire + sizeof(header));
+  if (code == SUCCESS && header.crc != crc)
+    code = CORRUPTED;
+  if (code == UNAVAILABLE)
+  {
+    header = (block_header){length, length, ~crc};
+    memset(wire + sizeof(header), 0, length);
+  }
+  memcpy(wire, &header, sizeof(header));
+  CHECK(send(to_sockfd, wire, sizeof(header) + header.wire_length, 0), -1)
+  free(data);
+  free(wire);
+  return code;
+}
+
+/**
+ * @brief Send a file in blocks of TRANSFER_BLOCK_SIZE, followed by an empty block
  *
  * @param f file pointer of the file to be sent
  * @param sockfd socket to which the file is to be sent
+ * @param codec asked for by the receiver
+ * @return i64 bytes put on the wire, -1 if the connection broke
  */
-void send_file(FILE *f, const i32 sockfd)
+i64 send_file(FILE *f, const i32 sockfd, const enum codec codec)
 {
-  char buffer[MAX_STR_LEN] = {0};
-  while (fgets(buffer, MAX_STR_LEN, f) != NULL)
+  char *buffer = malloc(TRANSFER_BLOCK_SIZE);
+  i64 total = 0, sent;
+  u32 size;
+  do
   {
-    CHECK(send(sockfd, buffer, sizeof(buffer), 0), -1)
-    bzero(buffer, MAX_STR_LEN);
-  }
+    size = fread(buffer, 1, TRANSFER_BLOCK_SIZE, f);
+    sent = send_block(sockfd, buffer, size, codec);
+    total += sent;
+  } while (size > 0 && sent != -1);
+  free(buffer);
+  return sent == -1 ? -1 : total;
 }
 
 void send_data_in_packets(void *buffer, const i32 sockfd, u32 buffer_length)
 {
-  i16 numpackets = buffer_length/MAX_STR_LEN;
+  i32 numpackets = buffer_length/MAX_STR_LEN;
   for (i32 i=0; i<numpackets; i++)
   {
     CHECK(send(sockfd, buffer + MAX_STR_LEN*i, MAX_STR_LEN, 0), -1);
@@ -99,134 +236,228 @@ void send_data_in_packets(void *buffer, const i32 sockfd, u32 buffer_length)
 
 void receive_data_in_packets(void *buffer, const i32 sockfd, u32 buffer_length)
 {
-  i16 numpackets = buffer_length/MAX_STR_LEN;
+  i32 numpackets = buffer_length/MAX_STR_LEN;
   for (i32 i=0; i<numpackets; i++)
   {
-    CHECK(recv(sockfd, buffer + MAX_STR_LEN*i, MAX_STR_LEN, 0), -1);
+    CHECK(recv(sockfd, buffer + MAX_STR_LEN*i, MAX_STR_LEN, MSG_WAITALL), -1);
   }
   if (buffer_length % MAX_STR_LEN != 0)
   {
-    CHECK(recv(sockfd, buffer + MAX_STR_LEN*numpackets, buffer_length % MAX_STR_LEN, 0), -1);
+    CHECK(recv(sockfd, buffer + MAX_STR_LEN*numpackets, buffer_length % MAX_STR_LEN, MSG_WAITALL), -1);
   }
 }
 
 /**
- * @brief Receive a file and print it to stdout
+ * @brief Receive a file sent by send_file and print it to stdout, stopping at the first block that fails its check
  *
  * @param sockfd socket from which the file is to be received
+ * @return u64 number of bytes received
  */
-void receive_and_print_file(const i32 sockfd)
+u64 receive_and_print_file(const i32 sockfd)
 {
-  char buffer[MAX_STR_LEN];
-  while (1)
+  char *buffer = malloc(TRANSFER_BLOCK_SIZE);
+  u64 total = 0;
+  u32 size;
+  enum status code;
+  while ((code = receive_block(sockfd, buffer, TRANSFER_BLOCK_SIZE, &size)) == SUCCESS && size > 0)
   {
-    const i32 size = recv(sockfd, buffer, sizeof(buffer), 0);
-    CHECK(size, -1);
-    if (size == 0)
-      return;
-    printf("%s", buffer);
-    bzero(buffer, MAX_STR_LEN);
+    fwrite(buffer, 1, size, stdout);
+    total += size;
   }
+  if (code != SUCCESS)
+    fprintf(stderr, "\nThe file was damaged in transfer, stopped after %lu bytes\n", total);
+  free(buffer);
+  return total;
 }
 
-
 /**
- * @brief transmit file in small packets.
- * 
- * @param f File that is to be sent.
- * @param sockfd socket that is being sent to.
+ * @brief Relay a file being copied from the storage server sending it to the one receiving it, checking every chunk on
+ * the way. Only the chunks the receiver does not have are sent:
+ * - the sender sends the number of chunks, the chunk_ref of each and the CRC-32C of the whole file
+ * - the receiver answers with the number of chunks it is missing, their indices in increasing order and the codec it
+ *   wants them in
+ * - the sender sends each of them as a block, see send_block, and the receiver its status once the file is in place
+ * A chunk list of an impossible size means the rest of the stream can not be read, so the receiver is told to drop the
+ * file with a count of UINT32_MAX, and the sending socket must not be used anymore. So does a block that can not be
+ * read, which is replaced along with the ones after it by blocks failing their checks.
+ *
+ * @param from_sockfd the socket that the file is being sent from.
+ * @param to_sockfd the socket that the file has to be sent to.
+ * @return enum status CORRUPTED if a check failed here or at the receiver
  */
-void transmit_file_for_writing(FILE *f, const i32 sockfd)
+enum status receive_and_transmit_chunks(const i32 from_sockfd, const i32 to_sockfd)
 {
-  char buffer[MAX_STR_LEN] = {0};
-  i32 num_bytes_read = 0;
-  i32 i = 0;
-  while (1)
+  u32 count, file_crc, num_missing;
+  enum status code = SUCCESS, receiver_code;
+  CHECK(recv(from_sockfd, &count, sizeof(count), MSG_WAITALL), -1)
+  chunk_ref *chunks = count > CHUNK_MAX_PER_FILE ? NULL : malloc(sizeof(chunk_ref) * (count + 1));
+  if (chunks != NULL)
   {
-    if (i == 100)
+    CHECK(recv(from_sockfd, chunks, sizeof(chunk_ref) * count, MSG_WAITALL), -1)
+    CHECK(recv(from_sockfd, &file_crc, sizeof(file_crc), MSG_WAITALL), -1)
+    for (u32 i = 0; i < count; ++i)
     {
-      i = 0;
-      CHECK(recv(sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
+      if (chunks[i].length == 0 || chunks[i].length > CHUNK_MAX_SIZE)
+      {
+        free(chunks);
+        chunks = NULL;
+        break;
+      }
     }
-    num_bytes_read = fread(buffer, 1, MAX_STR_LEN, f);
-    CHECK(num_bytes_read, -1);
-    CHECK(send(sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
-    if (num_bytes_read == 0)
-      break;
-
-    CHECK(send(sockfd, buffer, num_bytes_read, 0), -1)
-    bzero(buffer, MAX_STR_LEN);
-    i++;
   }
-  CHECK(recv(sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
+  if (chunks == NULL)
+  {
+    count = UINT32_MAX;
+    CHECK(send(to_sockfd, &count, sizeof(count), 0), -1)
+    CHECK(recv(to_sockfd, &receiver_code, sizeof(receiver_code), MSG_WAITALL), -1)
+    return CORRUPTED;
+  }
+  CHECK(send(to_sockfd, &count, sizeof(count), 0), -1)
+  CHECK(send(to_sockfd, chunks, sizeof(chunk_ref) * count, 0), -1)
+  CHECK(send(to_sockfd, &file_crc, sizeof(file_crc), 0), -1)
+
+  enum codec codec;
+  CHECK(recv(to_sockfd, &num_missing, sizeof(num_missing), MSG_WAITALL), -1)
+  num_missing = num_missing < count ? num_missing : count;
+  u32 *missing = malloc(sizeof(u32) * (num_missing + 1));
+  CHECK(recv(to_sockfd, missing, sizeof(u32) * num_missing, MSG_WAITALL), -1)
+  CHECK(recv(to_sockfd, &codec, sizeof(codec), MSG_WAITALL), -1)
+  CHECK(send(from_sockfd, &num_missing, sizeof(num_missing), 0), -1)
+  CHECK(send(from_sockfd, missing, sizeof(u32) * num_missing, 0), -1)
+  CHECK(send(from_sockfd, &codec, sizeof(codec), 0), -1)
+
+  // once a block can not be read, the rest are replaced without reading them
+  i32 sockfd = from_sockfd;
+  for (u32 i = 0; i < num_missing; ++i)
+  {
+    const chunk_ref *chunk = &chunks[missing[i] < count ? missing[i] : 0];
+    const enum status block_code = relay_block(sockfd, to_sockfd, chunk->length, chunk->crc);
+    if (block_code != SUCCESS)
+      code = CORRUPTED;
+    if (block_code == UNAVAILABLE)
+      sockfd = -1;
+  }
+  free(missing);
+  free(chunks);
+
+  CHECK(recv(to_sockfd, &receiver_code, sizeof(receiver_code), MSG_WAITALL), -1)
+  if (code == SUCCESS)
+    code = receiver_code;
+  CHECK(send(from_sockfd, &code, sizeof(code), 0), -1)
+  return code;
 }
 
 /**
- * @brief Receive file from one socket and send it to other.
- * 
- * @param from_sockfd the socket that the file is being sent from.
- * @param to_sockfd the socket that the file has to be sent to.
+ * @brief Append data to a message, growing it as needed
+ *
+ * @param msg
+ * @param data
+ * @param length number of bytes to append
  */
-void receive_and_transmit_file(const i32 from_sockfd, const i32 to_sockfd)
+void message_write(message *msg, const void *data, const u32 length)
 {
-  char buffer[MAX_STR_LEN];
-  i32 num_bytes_read = 0;
-  i32 i = 0;
-  while (1)
+  if (msg->length + length > msg->capacity)
   {
-    if (i == 100)
-    {
-      i = 0;
-      CHECK(recv(to_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
-      CHECK(send(from_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
-    }
-    CHECK(recv(from_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
-    if (num_bytes_read > MAX_STR_LEN || num_bytes_read < 0)
-      num_bytes_read = MAX_STR_LEN;
-    CHECK(send(to_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
-    if (num_bytes_read == 0)
-      break;
-
-    CHECK(recv(from_sockfd, buffer, num_bytes_read, 0), -1)
-    CHECK(send(to_sockfd, buffer, num_bytes_read, 0), -1)
-
-    bzero(buffer, MAX_STR_LEN);
-    i++;
+    msg->capacity = msg->length + length > 2 * msg->capacity ? msg->length + length : 2 * msg->capacity;
+    msg->data = realloc(msg->data, msg->capacity);
   }
-  CHECK(recv(to_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
-  CHECK(send(from_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
+  memcpy(msg->data + msg->length, data, length);
+  msg->length += length;
 }
 
 /**
- * @brief Receive file content from a socket and write it into a file.
- * 
- * @param from_sockfd The socket that the file content is being received from.
- * @param f The file that has to be written to.
+ * @brief Read the next bytes of a message. Missing bytes are filled with zeroes.
+ *
+ * @param msg
+ * @param data output
+ * @param length number of bytes to read
+ * @return bool false if the message was too short
  */
-void receive_and_write_file(const i32 from_sockfd, FILE* f)
+bool message_read(message *msg, void *data, const u32 length)
 {
-  char buffer[MAX_STR_LEN];
-  i32 num_bytes_read = 0;
-  i32 i = 0;
-  while (1)
+  const u32 available = msg->length - msg->offset < length ? msg->length - msg->offset : length;
+  memcpy(data, msg->data + msg->offset, available);
+  memset((char *)data + available, 0, length - available);
+  msg->offset += available;
+  return available == length;
+}
+
+/**
+ * @brief Free the data of a message and empty it
+ *
+ * @param msg
+ */
+void message_free(message *msg)
+{
+  free(msg->data);
+  *msg = (message){0};
+}
+
+/**
+ * @brief Send a request or response with its header in one go.
+ * Does not exit if the other side is gone, as requests on a connection outlive each other.
+ *
+ * @param sockfd
+ * @param id request id
+ * @param op operation of the request, or of the request being responded to
+ * @param msg payload
+ * @return bool false if the connection is broken
+ */
+bool send_message(const i32 sockfd, const u32 id, const enum operation op, const message *msg)
+{
+  const request_header header = {id, op, msg->length};
+  struct iovec parts[2] = {{(void *)&header, sizeof(header)}, {msg->data, msg->length}};
+  struct msghdr hdr = {.msg_iov = parts, .msg_iovlen = msg->length == 0 ? 1 : 2};
+  u64 remaining = sizeof(header) + msg->length;
+  while (remaining > 0)
   {
-    if (i == 100)
+    const i64 sent = sendmsg(sockfd, &hdr, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return false;
+    remaining -= sent;
+    // skip what was sent, in case of a short write
+    for (u64 skip = sent; skip > 0;)
     {
-      i = 0;
-      CHECK(send(from_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
+      const u64 part = skip < hdr.msg_iov->iov_len ? skip : hdr.msg_iov->iov_len;
+      hdr.msg_iov->iov_base = (char *)hdr.msg_iov->iov_base + part;
+      hdr.msg_iov->iov_len -= part;
+      skip -= part;
+      if (hdr.msg_iov->iov_len == 0 && hdr.msg_iovlen > 1)
+      {
+        ++hdr.msg_iov;
+        --hdr.msg_iovlen;
+      }
     }
-    CHECK(recv(from_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1)
-    if (num_bytes_read > MAX_STR_LEN || num_bytes_read < 0)
-      num_bytes_read = MAX_STR_LEN;
-    if (num_bytes_read == 0)
-      break;
-
-    CHECK(recv(from_sockfd, buffer, num_bytes_read, 0), -1);
-    fwrite(buffer, num_bytes_read, 1, f);
+  }
+  return true;
+}
 
-    bzero(buffer, MAX_STR_LEN);
-    i++;
+/**
+ * @brief Receive a request or response and its payload
+ *
+ * @param sockfd
+ * @param header output
+ * @param msg output, to be freed with message_free
+ * @return bool false if the connection was closed, or its payload is longer than MAX_MESSAGE_LENGTH or could not be
+ * allocated, after which the connection can not be used anymore
+ */
+bool receive_message(const i32 sockfd, request_header *header, message *msg)
+{
+  *msg = (message){0};
+  if (recv(sockfd, header, sizeof(*header), MSG_WAITALL) != sizeof(*header))
+    return false;
+  if (header->length == 0)
+    return true;
+  if (header->length > MAX_MESSAGE_LENGTH)
+    return false;
+  msg->data = malloc(header->length);
+  if (msg->data == NULL)
+    return false;
+  msg->capacity = msg->length = header->length;
+  if (recv(sockfd, msg->data, header->length, MSG_WAITALL) != (i64)header->length)
+  {
+    message_free(msg);
+    return false;
   }
-  fclose(f);
-  CHECK(send(from_sockfd, &num_bytes_read, sizeof(num_bytes_read), 0), -1);
+  return true;
 }
@@ -8,6 +8,9 @@
  */
 
 #include "headers.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 const i32 MaxBufferLength = MAX_STR_LEN * 2000;
 
@@ -37,16 +40,72 @@ struct
   i32 length;
 } cache_head = {0};
 
+// told about every lookup of GetPathSSID in the cache, so that its owner can count hits without the tree depending on it
+void (*cache_observer)(bool hit) = NULL;
+
+u64 last_generation = 0;
+u64 last_removal = 0; // generation of the last node freed or moved, prefixes cached before it may be stale
+
+// Directory reached by a path, so that resolving a path below it can start there instead of at the root
+typedef struct prefix_entry
+{
+  Tree Root;
+  Tree Node;
+  u64 Removal; // last_removal when the entry was made, the entry is valid while it is the same
+  u64 Hash;
+  u32 Length;
+} prefix_entry;
+
+struct
+{
+  prefix_entry entries[PREFIX_CACHE_SIZE]; // a new prefix replaces the one in its slot
+  char paths[PREFIX_CACHE_SIZE][MAX_STR_LEN]; // apart from the entries, which stay in a few cache lines
+  pthread_mutex_t lock;
+} prefix_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief Get a generation that no node had before. A node whose generation is unchanged still has all the
+ * children it had, so pointers to them stay valid.
+ *
+ * @return u64
+ */
+u64 NewGeneration()
+{
+  return __atomic_add_fetch(&last_generation, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Renew the generation of a node that is losing a child, before the child is freed or moved.
+ * Every cached prefix becomes stale, as it may lead through the child.
+ *
+ * @param Parent NULL for a node without parent
+ */
+void ChildRemoved(Tree Parent)
+{
+  const u64 Generation = NewGeneration();
+  if (Parent != NULL)
+    Parent->Generation = Generation;
+  __atomic_store_n(&last_removal, Generation, __ATOMIC_RELEASE);
+}
+
 struct TreeNode *InitNode(const char *Name, struct TreeNode *Parent)
 {
   struct TreeNode *Node = malloc(sizeof(struct TreeNode));
   strcpy(Node->NodeInfo.DirectoryName, Name);
   Node->NodeInfo.NumChild = 0;
+  Node->NodeInfo.IsFile = 0;
+  Node->NodeInfo.Access = 0;
+  Node->NodeInfo.Version = 0;
+  Node->NodeInfo.Verified = 0;
+  Node->NodeInfo.Hash = 0;
+  Node->NodeInfo.ss_id = 0;
+  Node->NodeInfo.UUID[0] = '\0';
   pthread_rwlock_init(&Node->NodeInfo.rwlock, NULL);
   Node->Parent = Parent;
   Node->ChildDirectoryLL = NULL;
   Node->NextSibling = NULL;
   Node->PrevSibling = NULL;
+  Node->Generation = NewGeneration();
   if (Parent != NULL)
   {
     Parent->NodeInfo.NumChild++;
@@ -209,29 +268,53 @@ void PrintTree(Tree T, u32 indent)
   }
 }
 
-void GetPrintedSubtreeDriver(Tree T, char *printedtree, u32 indent)
+/**
+ * @brief Append a line to the buffer of a tree writer, flushing the buffer first if the line does not fit
+ *
+ * @param Writer
+ * @param Line
+ * @param Length at most the capacity of the writer
+ * @return bool false if the flush failed and rendering has to stop
+ */
+bool WriteTreeLine(TreeWriter *Writer, const char *Line, u32 Length)
+{
+  if (Writer->Length + Length > Writer->Capacity && !Writer->Flush(Writer))
+    return false;
+  memcpy(Writer->Buffer + Writer->Length, Line, Length);
+  Writer->Length += Length;
+  return true;
+}
+
+bool GetPrintedSubtreeDriver(Tree T, TreeWriter *Writer, u32 indent, u32 MaxDepth)
 {
   if (strstr(T->NodeInfo.DirectoryName, ".rd") == T->NodeInfo.DirectoryName)
-    return;
-  for (u32 i = 0; i < indent; i++)
+    return true;
+  if (Writer->Seen++ >= Writer->Skip)
   {
-    strcat(printedtree, "\t");
+    if (Writer->Limit != 0 && Writer->Written == Writer->Limit)
+    {
+      Writer->More = true;
+      return false;
+    }
+    char line[MAX_STR_LEN];
+    const char *color = T->NodeInfo.Access == 0 ? C_BLACK : T->NodeInfo.IsFile ? C_BLUE : C_YELLOW;
+    // deep nodes lose some of their indentation rather than their name
+    const u32 tabs = indent < MAX_STR_LEN - MAX_NAME_LEN - 32 ? indent : MAX_STR_LEN - MAX_NAME_LEN - 32;
+    memset(line, '\t', tabs);
+    const u32 length = tabs + snprintf(line + tabs, MAX_STR_LEN - tabs, "%s%s\n" C_RESET, color,
+                                       T->NodeInfo.DirectoryName);
+    if (!WriteTreeLine(Writer, line, length))
+      return false;
+    ++Writer->Written;
   }
-  if (T->NodeInfo.Access == 0)
-    strcat(printedtree, C_BLACK);
-  else if (T->NodeInfo.IsFile)
-    strcat(printedtree, C_BLUE);
-  else
-    strcat(printedtree, C_YELLOW);
-  strcat(printedtree, T->NodeInfo.DirectoryName);
-  strcat(printedtree, "\n");
-  strcat(printedtree, C_RESET);
-  struct TreeNode *trav = T->ChildDirectoryLL;
-  while (trav != NULL)
+  if (MaxDepth != 0 && indent + 1 >= MaxDepth)
+    return true;
+  for (struct TreeNode *trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
   {
-    GetPrintedSubtreeDriver(trav, printedtree, indent + 1);
-    trav = trav->NextSibling;
+    if (!GetPrintedSubtreeDriver(trav, Writer, indent + 1, MaxDepth))
+      return false;
   }
+  return true;
 }
 
 i32 DeleteTree(Tree T)
@@ -246,6 +329,7 @@ i32 DeleteTree(Tree T)
     trav = next;
   }
 
+  ChildRemoved(T->Parent);
   if (T->Parent != NULL)
   {
     T->Parent->NodeInfo.NumChild--;
@@ -266,7 +350,54 @@ i32 DeleteTree(Tree T)
 }
 
 /**
- * @brief finds the tree node with the given path
+ * @brief Find a cached prefix of a path. Must be called with prefix_cache.lock held.
+ *
+ * @param T root the prefix was resolved from
+ * @param Path
+ * @param Length of the prefix
+ * @param Hash hash_bytes of the prefix
+ * @return Tree the node at the prefix, NULL if it is not cached
+ */
+Tree FindPrefix(Tree T, const char *Path, u32 Length, u64 Hash)
+{
+  const u32 Slot = (Hash ^ (Hash >> 32)) % PREFIX_CACHE_SIZE;
+  const prefix_entry *Entry = &prefix_cache.entries[Slot];
+  if (Entry->Node == NULL || Entry->Root != T || Entry->Hash != Hash || Entry->Length != Length ||
+      Entry->Removal != __atomic_load_n(&last_removal, __ATOMIC_ACQUIRE) ||
+      memcmp(prefix_cache.paths[Slot], Path, Length) != 0)
+    return NULL;
+  return Entry->Node;
+}
+
+/**
+ * @brief Remember the node a prefix of a path leads to
+ *
+ * @param T root the prefix was resolved from
+ * @param Path
+ * @param Length of the prefix
+ * @param Hash hash_bytes of the prefix
+ * @param Node
+ * @param Removal last_removal from before the walk that found the node, so that the entry is stale right away if a
+ * node was freed or moved during the walk
+ */
+void CachePrefix(Tree T, const char *Path, u32 Length, u64 Hash, Tree Node, u64 Removal)
+{
+  pthread_mutex_lock(&prefix_cache.lock);
+  const u32 Slot = (Hash ^ (Hash >> 32)) % PREFIX_CACHE_SIZE;
+  prefix_entry *Entry = &prefix_cache.entries[Slot];
+  Entry->Root = T;
+  Entry->Node = Node;
+  Entry->Removal = Removal;
+  Entry->Hash = Hash;
+  Entry->Length = Length;
+  memcpy(prefix_cache.paths[Slot], Path, Length);
+  pthread_mutex_unlock(&prefix_cache.lock);
+}
+
+/**
+ * @brief finds the tree node with the given path.
+ * The walk starts from the deepest directory on the path found in the prefix cache, so resolving paths in the same
+ * directories again only looks at the components below it. The node found and its parent are cached afterwards.
  *
  * @param DirPath the path of the required node relative to T
  * @param T the root node of the tree
@@ -279,8 +410,46 @@ struct TreeNode *ProcessDirPath(const char *DirPath, Tree T, bool CreateFlag)
   struct TreeNode *Cur = T;
   if (T == NULL)
     return NULL;
+  const u64 Removal = __atomic_load_n(&last_removal, __ATOMIC_ACQUIRE);
+
+  // ends of the components of the path and the hashes of the prefixes up to them, of the deepest
+  // PREFIX_CACHE_DEPTH ones if there are more
+  u32 Ends[PREFIX_CACHE_DEPTH];
+  u64 Hashes[PREFIX_CACHE_DEPTH];
+  u32 NumPrefixes = 0;
+  u64 Hash = hash_start(0);
+  u32 Hashed = 0;
+  for (u32 Length = 0; DirPath[Length] != '\0'; ++Length)
+  {
+    const char Next = DirPath[Length + 1];
+    if (DirPath[Length] != '/' && DirPath[Length] != '\\' && (Next == '/' || Next == '\\' || Next == '\0'))
+    {
+      Hash = hash_continue(Hash, DirPath + Hashed, Length + 1 - Hashed);
+      Hashed = Length + 1;
+      Ends[NumPrefixes % PREFIX_CACHE_DEPTH] = Hashed;
+      Hashes[NumPrefixes % PREFIX_CACHE_DEPTH] = hash_finish(Hash);
+      ++NumPrefixes;
+    }
+  }
+
+  u32 Start = 0;
+  i32 Cached = -1;
+  pthread_mutex_lock(&prefix_cache.lock);
+  for (i32 i = NumPrefixes - 1; i >= 0 && i >= (i32)NumPrefixes - PREFIX_CACHE_DEPTH; --i)
+  {
+    Tree Node = FindPrefix(T, DirPath, Ends[i % PREFIX_CACHE_DEPTH], Hashes[i % PREFIX_CACHE_DEPTH]);
+    if (Node != NULL)
+    {
+      Cur = Node;
+      Start = Ends[i % PREFIX_CACHE_DEPTH];
+      Cached = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&prefix_cache.lock);
+
   char DirPathCopy[MAX_STR_LEN];
-  strcpy(DirPathCopy, DirPath);
+  strcpy(DirPathCopy, DirPath + Start);
   char *Delim = "/\\";
   char *token = strtok(DirPathCopy, Delim);
   while (token != NULL)
@@ -296,13 +465,35 @@ struct TreeNode *ProcessDirPath(const char *DirPath, Tree T, bool CreateFlag)
       return NULL;
     token = strtok(NULL, Delim);
   }
+
+  // the node itself, and the directory it is in for the paths next to it
+  const i32 Last = NumPrefixes - 1;
+  if (Last > Cached)
+    CachePrefix(T, DirPath, Ends[Last % PREFIX_CACHE_DEPTH], Hashes[Last % PREFIX_CACHE_DEPTH], Cur, Removal);
+  if (Last - 1 > Cached && Cur->Parent != NULL)
+    CachePrefix(T, DirPath, Ends[(Last - 1) % PREFIX_CACHE_DEPTH], Hashes[(Last - 1) % PREFIX_CACHE_DEPTH], Cur->Parent,
+                Removal);
   return Cur;
 }
 
-void GetPrintedSubtree(Tree T, const char *path, char *printedtree)
+/**
+ * @brief Render the subtree at a path in pre-order, one line per node, indented by depth and colored by type.
+ * Takes time linear in the number of nodes visited and no more memory than the buffer of the writer, which is flushed
+ * whenever it fills up. What is left in the buffer at the end is not flushed.
+ *
+ * @param T
+ * @param path
+ * @param MaxDepth levels to render, 1 for the node itself, 0 for all of them
+ * @param Writer with Skip and Limit set for the page wanted, Seen, Written and More are updated
+ * @return bool false if there is no node at the path
+ */
+bool GetPrintedSubtree(Tree T, const char *path, u32 MaxDepth, TreeWriter *Writer)
 {
   Tree temp = ProcessDirPath(path, T, 0);
-  GetPrintedSubtreeDriver(temp, printedtree, 0);
+  if (temp == NULL)
+    return false;
+  GetPrintedSubtreeDriver(temp, Writer, 0, MaxDepth);
+  return true;
 }
 
 bool IsDirectory(const char *location)
@@ -355,6 +546,264 @@ void ProcessWholeDir(char *DirPath, Tree Parent)
   free(files);
 }
 
+/*
+Parallel scan of a directory into a tree.
+
+Every directory is a task holding its tree node and its path relative to the root of the scan.
+Each worker owns a deque of tasks: it pushes the subdirectories it finds and pops from the same end,
+so it goes depth first, while idle workers steal the oldest tasks, which are the largest subtrees, from the other end.
+Only the task of a directory inserts into its node, so the tree itself needs no locking.
+*/
+
+typedef struct scan_task
+{
+  Tree Node;
+  char *Path;
+} scan_task;
+
+typedef struct scan_deque
+{
+  scan_task *tasks;
+  u32 head; // oldest task, stolen by other workers
+  u32 tail; // newest task, popped by the owner
+  u32 capacity;
+  pthread_mutex_t lock;
+} scan_deque;
+
+typedef struct scan_pool
+{
+  scan_deque deques[SCAN_MAX_THREADS];
+  u32 num_workers;
+  i32 root_fd;
+  i64 pending; // tasks queued or being scanned
+} scan_pool;
+
+typedef struct scan_worker
+{
+  scan_pool *pool;
+  u32 id;
+} scan_worker;
+
+void PushScanTask(scan_deque *deque, scan_task task)
+{
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail == deque->capacity)
+  {
+    deque->capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+    deque->tasks = realloc(deque->tasks, sizeof(scan_task) * deque->capacity);
+  }
+  deque->tasks[deque->tail++] = task;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+bool PopScanTask(scan_deque *deque, scan_task *task, bool steal)
+{
+  pthread_mutex_lock(&deque->lock);
+  const bool found = deque->head < deque->tail;
+  if (found)
+    *task = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+  if (deque->head == deque->tail)
+    deque->head = deque->tail = 0;
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+/**
+ * @brief Insert a new child at the front of the children of T, without checking for an existing one with the same name
+ *
+ * @param T
+ * @param ChildName
+ * @return struct TreeNode* the new child
+ */
+struct TreeNode *PrependChild(Tree T, const char *ChildName)
+{
+  struct TreeNode *Node = InitNode(ChildName, T);
+  Node->NextSibling = T->ChildDirectoryLL;
+  if (T->ChildDirectoryLL != NULL)
+    T->ChildDirectoryLL->PrevSibling = Node;
+  T->ChildDirectoryLL = Node;
+  return Node;
+}
+
+/**
+ * @brief Add an entry found while scanning a directory to the tree, and queue it if it is a directory itself
+ *
+ * @param worker
+ * @param task task of the directory containing the entry
+ * @param dir_fd open file descriptor of that directory
+ * @param name
+ * @param type d_type of the entry, DT_UNKNOWN if the filesystem does not report it
+ */
+void AddScannedEntry(scan_worker *worker, const scan_task *task, i32 dir_fd, const char *name, u8 type)
+{
+  if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    return;
+  // unfinished writes, deleted folders and the chunk store of a storage server
+  if (strncmp(name, WRITE_TEMP_PREFIX, strlen(WRITE_TEMP_PREFIX)) == 0 ||
+      ((strcmp(name, TRASH_DIR) == 0 || strcmp(name, CHUNK_STORE_DIR) == 0) && strcmp(task->Path, ".") == 0))
+    return;
+  if (strlen(name) >= MAX_NAME_LEN)
+  {
+    fprintf(stderr, "Skipping %s/%s as its name is too long\n", task->Path, name);
+    return;
+  }
+
+  if (type == DT_UNKNOWN)
+  {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+      return;
+    type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+  }
+
+  struct TreeNode *T = PrependChild(task->Node, name);
+  T->NodeInfo.Access = 1;
+  T->NodeInfo.IsFile = type != DT_DIR;
+  if (T->NodeInfo.IsFile)
+    return;
+
+  char path[MAX_STR_LEN];
+  if (snprintf(path, MAX_STR_LEN, "%s/%s", task->Path, name) >= MAX_STR_LEN)
+  {
+    fprintf(stderr, "Not scanning %s/%s as its path is too long\n", task->Path, name);
+    return;
+  }
+  __atomic_add_fetch(&worker->pool->pending, 1, __ATOMIC_ACQ_REL);
+  PushScanTask(&worker->pool->deques[worker->id], (scan_task){T, strdup(path)});
+}
+
+#ifdef SYS_getdents64
+struct linux_dirent64
+{
+  u64 d_ino;
+  i64 d_off;
+  u16 d_reclen;
+  u8 d_type;
+  char d_name[];
+};
+#endif
+
+/**
+ * @brief Read all the entries of one directory.
+ * Uses getdents64 directly when the kernel provides it, to read many entries per system call, and readdir otherwise.
+ *
+ * @param worker
+ * @param task
+ */
+void ScanOneDirectory(scan_worker *worker, const scan_task *task)
+{
+  const i32 fd = openat(worker->pool->root_fd, task->Path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+  {
+    fprintf(stderr, "Unable to open directory: %s\n", task->Path);
+    return;
+  }
+
+#ifdef SYS_getdents64
+  char buffer[SCAN_BUFFER_SIZE] __attribute__((aligned(8)));
+  i64 size;
+  while ((size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0)
+  {
+    for (i64 offset = 0; offset < size;)
+    {
+      const struct linux_dirent64 *entry = (const struct linux_dirent64 *)&buffer[offset];
+      AddScannedEntry(worker, task, fd, entry->d_name, entry->d_type);
+      offset += entry->d_reclen;
+    }
+  }
+  if (size == 0 || errno != ENOSYS)
+  {
+    if (size == -1)
+      fprintf(stderr, "Unable to read directory: %s\n", task->Path);
+    close(fd);
+    return;
+  }
+#endif
+
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL)
+  {
+    close(fd);
+    return;
+  }
+  for (struct dirent *en = readdir(dir); en != NULL; en = readdir(dir))
+  {
+    AddScannedEntry(worker, task, fd, en->d_name, en->d_type);
+  }
+  closedir(dir);
+}
+
+void *ScanWorker(void *arg)
+{
+  scan_worker *worker = arg;
+  scan_pool *pool = worker->pool;
+  scan_task task;
+  while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0)
+  {
+    bool found = PopScanTask(&pool->deques[worker->id], &task, false);
+    for (u32 i = 1; i < pool->num_workers && !found; ++i)
+    {
+      found = PopScanTask(&pool->deques[(worker->id + i) % pool->num_workers], &task, true);
+    }
+    if (!found)
+    {
+      sched_yield();
+      continue;
+    }
+
+    ScanOneDirectory(worker, &task);
+    free(task.Path);
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Add everything under a directory to the tree, scanning its subdirectories in parallel.
+ * Equivalent to ProcessWholeDir, except for the order of siblings.
+ *
+ * @param DirPath directory to scan
+ * @param Parent node of the directory, without children
+ */
+void ScanDirectory(const char *DirPath, Tree Parent)
+{
+  scan_pool pool = {.pending = 1};
+  pool.root_fd = open(DirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (pool.root_fd == -1)
+  {
+    fprintf(stderr, "Unable to open directory: %s\n", DirPath);
+    return;
+  }
+
+  const i64 cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pool.num_workers = cpus < 1 ? 1 : (cpus > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : cpus);
+  for (u32 i = 0; i < pool.num_workers; ++i)
+  {
+    pool.deques[i] = (scan_deque){NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+  }
+  PushScanTask(&pool.deques[0], (scan_task){Parent, strdup(".")});
+
+  pthread_t threads[SCAN_MAX_THREADS];
+  scan_worker workers[SCAN_MAX_THREADS];
+  for (u32 i = 0; i < pool.num_workers; ++i)
+  {
+    workers[i] = (scan_worker){&pool, i};
+    if (i > 0)
+      pthread_create(&threads[i], NULL, ScanWorker, &workers[i]);
+  }
+  ScanWorker(&workers[0]);
+  for (u32 i = 1; i < pool.num_workers; ++i)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (u32 i = 0; i < pool.num_workers; ++i)
+  {
+    free(pool.deques[i].tasks);
+  }
+  close(pool.root_fd);
+}
+
 bool CheckIfFile(char *DirPath)
 {
   struct stat stats;
@@ -385,7 +834,7 @@ void InitDirectory(Tree Parent)
 {
   Parent->NodeInfo.IsFile = 0;
   Parent->NodeInfo.Access = 1;
-  ProcessWholeDir(".", Parent);
+  ScanDirectory(".", Parent);
 }
 
 void RemoveInaccessiblePath(Tree Parent, const char *DirPath)
@@ -397,40 +846,141 @@ void RemoveInaccessiblePath(Tree Parent, const char *DirPath)
 }
 
 /**
- * @brief Merge Tree T1 with T2.
- * 
- * @param T1 
- * @param T2 
- * @param ss_id 
- * @param UUID 
+ * @brief Record the storage server with the given ssid as the owner of every node in the subtree.
+ *
+ * @param T
+ * @param ss_id
+ * @param UUID
  */
-void MergeTree(Tree T1, Tree T2, u32 ss_id, char *UUID)
+void SetOwner(Tree T, u32 ss_id, char *UUID)
+{
+  T->NodeInfo.ss_id = ss_id;
+  strcpy(T->NodeInfo.UUID, UUID);
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    SetOwner(trav, ss_id, UUID);
+  }
+}
+
+/**
+ * @brief Move the children of Src under Dest, merging directories present in both.
+ * Nodes that are new to Dest become owned by the given storage server, while directories already in Dest keep
+ * their owner. Files already in Dest win over incoming nodes with the same name.
+ *
+ * @param Dest
+ * @param Src
+ * @param ss_id
+ * @param UUID
+ */
+void MergeChildren(Tree Dest, Tree Src, u32 ss_id, char *UUID)
 {
-  Tree trav = T1->ChildDirectoryLL;
+  Tree tail = Dest->ChildDirectoryLL;
+  while (tail != NULL && tail->NextSibling != NULL)
+  {
+    tail = tail->NextSibling;
+  }
 
-  if (trav != NULL)
+  Tree trav = Src->ChildDirectoryLL;
+  Src->ChildDirectoryLL = NULL;
+  while (trav != NULL)
   {
-    while (trav->NextSibling != NULL)
+    Tree next = trav->NextSibling;
+    trav->NextSibling = NULL;
+    trav->PrevSibling = NULL;
+    trav->Parent = NULL;
+
+    Tree Existing = FindChild(Dest, trav->NodeInfo.DirectoryName, 0, 0);
+    if (Existing == NULL)
+    {
+      SetOwner(trav, ss_id, UUID);
+      if (Dest->Parent == NULL)
+        trav->NodeInfo.Version = 1;
+      trav->Parent = Dest;
+      trav->PrevSibling = tail;
+      if (tail == NULL)
+        Dest->ChildDirectoryLL = trav;
+      else
+        tail->NextSibling = trav;
+      tail = trav;
+      Dest->NodeInfo.NumChild++;
+    }
+    else if (!Existing->NodeInfo.IsFile && !trav->NodeInfo.IsFile)
+    {
+      MergeChildren(Existing, trav, ss_id, UUID);
+      DeleteTree(trav);
+    }
+    else
     {
-      trav = trav->NextSibling;
+      DeleteTree(trav);
     }
-    trav->NextSibling = T2->ChildDirectoryLL;
+    trav = next;
   }
-  else
+}
+
+/**
+ * @brief Merge Tree T2 into T1, recording the storage server with the given ssid as the owner of its nodes.
+ * T2 is consumed.
+ *
+ * @param T1
+ * @param T2
+ * @param ss_id
+ * @param UUID
+ */
+void MergeTree(Tree T1, Tree T2, u32 ss_id, char *UUID)
+{
+  MergeChildren(T1, T2, ss_id, UUID);
+  ChildRemoved(NULL);
+  free(T2);
+}
+
+/**
+ * @brief Compute the Merkle hash of every node of a tree.
+ * The hash of a node covers its name and type, and for a directory the hashes of all its children. Children are
+ * combined by addition so that their order does not matter, as it differs between the storage server and the naming
+ * server. Two subtrees with the same hash can be assumed to be identical.
+ *
+ * @param T
+ * @return u64 hash of T
+ */
+u64 ComputeTreeHash(Tree T)
+{
+  u64 parts[2] = {hash_bytes(T->NodeInfo.DirectoryName, strlen(T->NodeInfo.DirectoryName), T->NodeInfo.IsFile), 0};
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
   {
-    T1->ChildDirectoryLL = T2->ChildDirectoryLL;
+    parts[1] += ComputeTreeHash(trav);
   }
-  if (T2->ChildDirectoryLL != NULL)
-    T2->ChildDirectoryLL->PrevSibling = trav;
-  trav = T2->ChildDirectoryLL;
-  while (trav != NULL)
+  T->NodeInfo.Hash = T->NodeInfo.IsFile ? parts[0] : hash_bytes(parts, sizeof(parts), 0);
+  return T->NodeInfo.Hash;
+}
+
+Tree CopyServerTreeDriver(Tree T, u32 ss_id, Tree Parent)
+{
+  Tree Copy = Parent == NULL ? InitTree() : PrependChild(Parent, T->NodeInfo.DirectoryName);
+  Copy->NodeInfo.IsFile = Parent == NULL ? 0 : T->NodeInfo.IsFile;
+  Copy->NodeInfo.Access = 1;
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
   {
-    trav->NodeInfo.ss_id = ss_id;
-    strcpy(trav->NodeInfo.UUID, UUID);
-    trav->Parent = T1;
-    trav = trav->NextSibling;
+    Tree Child = CopyServerTreeDriver(trav, ss_id, Copy);
+    // directories of other storage servers are only kept if they lead to nodes of this one
+    if (trav->NodeInfo.ss_id != ss_id && Child->ChildDirectoryLL == NULL)
+      DeleteTree(Child);
   }
-  free(T2);
+  return Copy;
+}
+
+/**
+ * @brief Copy the part of the tree that is stored on a storage server, with the directories leading to it,
+ * and compute its hashes
+ *
+ * @param T
+ * @param ss_id
+ * @return Tree
+ */
+Tree CopyServerTree(Tree T, u32 ss_id)
+{
+  Tree Copy = CopyServerTreeDriver(T, ss_id, NULL);
+  ComputeTreeHash(Copy);
+  return Copy;
 }
 
 /**
@@ -461,35 +1011,42 @@ void DeleteFromCacheWithSSID(u32 ss_id)
   }
 }
 
-/**
- * @brief Remove all the directory nodes from the tree of server with the given ssid.
- * 
- * @param T 
- * @param ss_id 
- */
-void RemoveServerPath(Tree T, u32 ss_id)
+void RemoveServerPathDriver(Tree T, u32 ss_id)
 {
-  DeleteFromCacheWithSSID(ss_id);
   Tree trav = T->ChildDirectoryLL;
   while (trav != NULL)
   {
+    Tree next = trav->NextSibling;
+    RemoveServerPathDriver(trav, ss_id);
     if (trav->NodeInfo.ss_id == ss_id)
     {
-      if (trav->NextSibling == NULL)
+      if (trav->ChildDirectoryLL == NULL)
       {
         DeleteTree(trav);
-        return;
       }
-      trav = trav->NextSibling;
-      DeleteTree(trav->PrevSibling);
-    }
-    else
-    {
-      trav = trav->NextSibling;
+      else
+      {
+        trav->NodeInfo.ss_id = trav->ChildDirectoryLL->NodeInfo.ss_id;
+        strcpy(trav->NodeInfo.UUID, trav->ChildDirectoryLL->NodeInfo.UUID);
+      }
     }
+    trav = next;
   }
 }
 
+/**
+ * @brief Remove all the directory nodes from the tree of server with the given ssid.
+ * Directories that still hold nodes of other servers are kept, and handed over to one of them.
+ *
+ * @param T
+ * @param ss_id
+ */
+void RemoveServerPath(Tree T, u32 ss_id)
+{
+  DeleteFromCacheWithSSID(ss_id);
+  RemoveServerPathDriver(T, ss_id);
+}
+
 /**
  * @brief Checks if path is cached
  * 
@@ -549,7 +1106,18 @@ void InsertIntoCache(const char *path, i32 ssid)
 }
 
 /**
- * @brief Get the SSID of the SS from the path.
+ * @brief Set the function told whether each lookup of GetPathSSID in the cache was a hit. Must be set before the tree
+ * is used by other threads.
+ *
+ * @param observer NULL for none
+ */
+void SetCacheObserver(void (*observer)(bool hit))
+{
+  cache_observer = observer;
+}
+
+/**
+ * @brief Get the SSID of the SS that stores the node at the path.
  * 
  * @param T 
  * @param path 
@@ -561,24 +1129,50 @@ i32 GetPathSSID(Tree T, const char *path, bool cache_flag)
   if (strncmp(path, ".rd", 3) != 0)
   {
     i32 req_ssid = CheckCache(path);
+    if (cache_observer != NULL)
+      cache_observer(req_ssid != -1);
     if (req_ssid != -1)
       return req_ssid;
   }
-  char pathcopy[MAX_STR_LEN];
-  Tree temp = ProcessDirPath(path, T, 0);
-  if (temp == NULL || temp->NodeInfo.Access == 0)
-    return -1;
-  strcpy(pathcopy, path);
-  char *Delim = "/\\";
-  char *token = strtok(pathcopy, Delim);
-  Tree RetT = FindChild(T, token, 0, 0);
-  if (RetT == NULL)
+  Tree RetT = ProcessDirPath(path, T, 0);
+  if (RetT == NULL || RetT->NodeInfo.Access == 0)
     return -1;
   if (cache_flag)
     InsertIntoCache(path, RetT->NodeInfo.ss_id);
   return RetT->NodeInfo.ss_id;
 }
 
+void GetSubtreeOwnersDriver(Tree T, u32 *ss_ids, u32 max, u32 *count)
+{
+  bool seen = false;
+  for (u32 i = 0; i < *count && !seen; ++i)
+  {
+    seen = ss_ids[i] == T->NodeInfo.ss_id;
+  }
+  if (!seen && *count < max)
+    ss_ids[(*count)++] = T->NodeInfo.ss_id;
+
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    GetSubtreeOwnersDriver(trav, ss_ids, max, count);
+  }
+}
+
+/**
+ * @brief Collect the distinct SSIDs of the storage servers that store a part of the subtree, owner of T first.
+ *
+ * @param T
+ * @param ss_ids output array
+ * @param max size of the output array
+ * @return u32 number of SSIDs collected
+ */
+u32 GetSubtreeOwners(Tree T, u32 *ss_ids, u32 max)
+{
+  u32 count = 0;
+  GetSubtreeOwnersDriver(T, ss_ids, max, &count);
+  return count;
+}
+
 char *GetParent(const char *path)
 {
   char path_copy[MAX_STR_LEN];
@@ -608,24 +1202,6 @@ char *GetParent(const char *path)
   return NULL;
 }
 
-void AddFile(Tree T, const char *path, i32 port_ss_nm, char *UUID)
-{
-  Tree temp = ProcessDirPath(path, T, 1);
-  temp->NodeInfo.Access = 1;
-  temp->NodeInfo.IsFile = 1;
-  temp->NodeInfo.ss_id = port_ss_nm;
-  strcpy(temp->NodeInfo.UUID, UUID);
-}
-
-void AddFolder(Tree T, const char *path, i32 port_ss_nm, char *UUID)
-{
-  Tree temp = ProcessDirPath(path, T, 1);
-  temp->NodeInfo.Access = 1;
-  temp->NodeInfo.IsFile = 0;
-  temp->NodeInfo.ss_id = port_ss_nm;
-  strcpy(temp->NodeInfo.UUID, UUID);
-}
-
 /**
  * @brief Deletes node with given path from cache
  * 
@@ -655,6 +1231,143 @@ void DeleteFromCache(const char *path)
   }
 }
 
+/**
+ * @brief Deletes the node with the given path and all its descendants from cache
+ *
+ * @param path
+ */
+void DeleteSubtreeFromCache(const char *path)
+{
+  const size_t length = strlen(path);
+  node *prev = NULL;
+  node *curr = cache_head.ll;
+  while (curr != NULL)
+  {
+    if (strncmp(curr->path, path, length) == 0 && (curr->path[length] == '\0' || curr->path[length] == '/'))
+    {
+      node *next = curr->next;
+      if (prev == NULL)
+        cache_head.ll = next;
+      else
+        prev->next = next;
+      cache_head.length--;
+      free(curr);
+      curr = next;
+      continue;
+    }
+    prev = curr;
+    curr = curr->next;
+  }
+}
+
+/**
+ * @brief Check that every component of a path fits in the name of a node
+ *
+ * @param path
+ * @return bool
+ */
+bool NamesFit(const char *path)
+{
+  for (const char *Name = path; *Name != '\0'; Name += strspn(Name, "/"))
+  {
+    const u64 Length = strcspn(Name, "/");
+    if (Length >= MAX_NAME_LEN)
+      return false;
+    Name += Length;
+  }
+  return true;
+}
+
+/**
+ * @brief Move the node at OldPath, with its subtree, to NewPath. The parent of NewPath is created if it is missing,
+ * once the rename is known to go ahead.
+ *
+ * @param T
+ * @param OldPath
+ * @param NewPath
+ * @return i32 0 on success, -1 if OldPath does not exist, NewPath already does, is inside OldPath or has a name too
+ * long, and nothing is changed then
+ */
+i32 RenameNode(Tree T, const char *OldPath, const char *NewPath)
+{
+  Tree Node = ProcessDirPath(OldPath, T, 0);
+  if (Node == NULL || Node == T || ProcessDirPath(NewPath, T, 0) != NULL)
+    return -1;
+
+  if (!NamesFit(NewPath))
+    return -1;
+
+  // the parent may not exist yet: the deepest folder of the new path that does must not be the node or inside it,
+  // and the missing ones are only created once the rename goes ahead
+  char Deepest[MAX_STR_LEN];
+  strcpy(Deepest, NewPath);
+  Tree Existing = NULL;
+  while (Existing == NULL)
+  {
+    char *Slash = strrchr(Deepest, '/');
+    if (Slash == NULL)
+      Existing = T;
+    else
+    {
+      *Slash = '\0';
+      Existing = ProcessDirPath(Deepest, T, 0);
+    }
+  }
+  for (Tree trav = Existing; trav != NULL; trav = trav->Parent)
+  {
+    if (trav == Node)
+      return -1;
+  }
+
+  char *ParentPath = GetParent(NewPath);
+  Tree NewParent = ParentPath == NULL ? T : ProcessDirPath(ParentPath, T, 1);
+  free(ParentPath);
+
+  const char *NewName = strrchr(NewPath, '/') == NULL ? NewPath : strrchr(NewPath, '/') + 1;
+
+  if (Node->Parent->ChildDirectoryLL == Node)
+    Node->Parent->ChildDirectoryLL = Node->NextSibling;
+  if (Node->NextSibling != NULL)
+    Node->NextSibling->PrevSibling = Node->PrevSibling;
+  if (Node->PrevSibling != NULL)
+    Node->PrevSibling->NextSibling = Node->NextSibling;
+  ChildRemoved(Node->Parent);
+  Node->Parent->NodeInfo.NumChild--;
+
+  strcpy(Node->NodeInfo.DirectoryName, NewName);
+  Node->Parent = NewParent;
+  Node->PrevSibling = NULL;
+  Node->NextSibling = NewParent->ChildDirectoryLL;
+  if (NewParent->ChildDirectoryLL != NULL)
+    NewParent->ChildDirectoryLL->PrevSibling = Node;
+  NewParent->ChildDirectoryLL = Node;
+  NewParent->NodeInfo.NumChild++;
+
+  DeleteSubtreeFromCache(OldPath);
+  DeleteSubtreeFromCache(NewPath);
+  return 0;
+}
+
+void AddFile(Tree T, const char *path, i32 port_ss_nm, char *UUID)
+{
+  Tree temp = ProcessDirPath(path, T, 1);
+  temp->NodeInfo.Access = 1;
+  temp->NodeInfo.IsFile = 1;
+  temp->NodeInfo.ss_id = port_ss_nm;
+  strcpy(temp->NodeInfo.UUID, UUID);
+  DeleteFromCache(path);
+}
+
+void AddFolder(Tree T, const char *path, i32 port_ss_nm, char *UUID)
+{
+  Tree temp = ProcessDirPath(path, T, 1);
+  temp->NodeInfo.Access = 1;
+  temp->NodeInfo.IsFile = 0;
+  temp->NodeInfo.ss_id = port_ss_nm;
+  strcpy(temp->NodeInfo.UUID, UUID);
+  DeleteFromCache(path);
+}
+
 void DeleteFile(Tree T, const char *path)
 {
   Tree temp = ProcessDirPath(path, T, 0);
@@ -682,6 +1395,39 @@ Tree GetTreeFromPath(Tree T, const char *path)
   return temp;
 }
 
+/**
+ * @brief Get the top level node that the path lies under
+ *
+ * @param T
+ * @param path
+ * @return Tree NULL if there is no such node
+ */
+Tree GetTopLevelNode(Tree T, const char *path)
+{
+  char pathcopy[MAX_STR_LEN];
+  strcpy(pathcopy, path);
+  char *Delim = "/\\";
+  char *token = strtok(pathcopy, Delim);
+  if (token == NULL)
+    return NULL;
+  return FindChild(T, token, 0, 0);
+}
+
+/**
+ * @brief Mark the subtree of the given path as changed, making its redundant copies outdated.
+ *
+ * @param T
+ * @param path
+ */
+void BumpVersion(Tree T, const char *path)
+{
+  if (strncmp(path, ".rd", 3) == 0)
+    return;
+  Tree Top = GetTopLevelNode(T, path);
+  if (Top != NULL)
+    ++Top->NodeInfo.Version;
+}
+
 /**
  * @brief Checks if the current path is empty or directory or a file.
  *
@@ -767,6 +1513,43 @@ void AcquireWriterLock(Tree T, const char *path)
   AcquireWriterLockDriver(temp);
 }
 
+void ReleaseLockDriver(Tree T);
+
+bool TryAcquireWriterLockDriver(Tree T)
+{
+  if (pthread_rwlock_trywrlock(&T->NodeInfo.rwlock) != 0)
+    return false;
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    if (!TryAcquireWriterLockDriver(trav))
+    {
+      for (Tree locked = T->ChildDirectoryLL; locked != trav; locked = locked->NextSibling)
+      {
+        ReleaseLockDriver(locked);
+      }
+      pthread_rwlock_unlock(&T->NodeInfo.rwlock);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Acquire writer lock of subtree of directory with the given path, without waiting.
+ * Nothing is left locked if any node of the subtree is in use.
+ *
+ * @param T
+ * @param path
+ * @return bool whether the whole subtree was locked
+ */
+bool TryAcquireWriterLock(Tree T, const char *path)
+{
+  Tree temp = ProcessDirPath(path, T, 0);
+  if (temp == NULL)
+    return false;
+  return TryAcquireWriterLockDriver(temp);
+}
+
 void ReleaseLockDriver(Tree T)
 {
   pthread_rwlock_unlock(&T->NodeInfo.rwlock);
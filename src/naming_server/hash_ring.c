@@ -0,0 +1,141 @@
+/**
+ * @file hash_ring.c
+ * @brief Consistent hash ring of the connected storage servers
+ * @details
+ * - Every storage server is placed on the ring at VIRTUAL_NODES points derived from its UUID
+ * - A path belongs to the storage server owning the first point at or after the hash of the path
+ * - Adding or removing a storage server only changes the owner of the paths next to its points
+ * - Walking on from the owner gives the other storage servers in an order that is just as stable, for the redundant
+ *   copies of the path, see placement.c
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+
+typedef struct ring_point
+{
+  u64 hash;
+  u32 ss_id;
+} ring_point;
+
+struct
+{
+  ring_point *points;
+  u32 length;
+  pthread_mutex_t lock;
+} hash_ring = {NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+i32 compare_ring_points(const void *a, const void *b)
+{
+  const u64 x = ((const ring_point *)a)->hash;
+  const u64 y = ((const ring_point *)b)->hash;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Place a storage server on the ring.
+ * Its points only depend on its UUID, so it gets back the same paths when it reconnects.
+ *
+ * @param ss_id
+ * @param UUID
+ */
+void ring_add_server(const u32 ss_id, const char *UUID)
+{
+  pthread_mutex_lock(&hash_ring.lock);
+  hash_ring.points = realloc(hash_ring.points, sizeof(ring_point) * (hash_ring.length + VIRTUAL_NODES));
+  for (u32 i = 0; i < VIRTUAL_NODES; ++i)
+  {
+    hash_ring.points[hash_ring.length + i].hash = hash_bytes(UUID, strlen(UUID), i);
+    hash_ring.points[hash_ring.length + i].ss_id = ss_id;
+  }
+  hash_ring.length += VIRTUAL_NODES;
+  qsort(hash_ring.points, hash_ring.length, sizeof(ring_point), compare_ring_points);
+  pthread_mutex_unlock(&hash_ring.lock);
+}
+
+/**
+ * @brief Remove all the points of a storage server from the ring
+ *
+ * @param ss_id
+ */
+void ring_remove_server(const u32 ss_id)
+{
+  pthread_mutex_lock(&hash_ring.lock);
+  u32 kept = 0;
+  for (u32 i = 0; i < hash_ring.length; ++i)
+  {
+    if (hash_ring.points[i].ss_id != ss_id)
+      hash_ring.points[kept++] = hash_ring.points[i];
+  }
+  hash_ring.length = kept;
+  pthread_mutex_unlock(&hash_ring.lock);
+}
+
+/**
+ * @brief Find the storage server that owns a path on the ring
+ *
+ * @param path
+ * @return i32 ssid of the owner, -1 if the ring is empty
+ */
+i32 ring_lookup(const char *path)
+{
+  const u64 hash = hash_string(path);
+  pthread_mutex_lock(&hash_ring.lock);
+  if (hash_ring.length == 0)
+  {
+    pthread_mutex_unlock(&hash_ring.lock);
+    return -1;
+  }
+
+  u32 low = 0;
+  u32 high = hash_ring.length;
+  while (low < high)
+  {
+    const u32 mid = low + (high - low) / 2;
+    if (hash_ring.points[mid].hash < hash)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  const i32 ss_id = hash_ring.points[low == hash_ring.length ? 0 : low].ss_id;
+  pthread_mutex_unlock(&hash_ring.lock);
+  return ss_id;
+}
+
+/**
+ * @brief Find the storage servers met walking the ring from a path, each once, in order.
+ * The first one is the owner of the path, see ring_lookup.
+ *
+ * @param path
+ * @param ss_ids output
+ * @param max size of the output array
+ * @return u32 number of storage servers found
+ */
+u32 ring_walk(const char *path, u32 *ss_ids, const u32 max)
+{
+  const u64 hash = hash_string(path);
+  pthread_mutex_lock(&hash_ring.lock);
+  u32 low = 0;
+  u32 high = hash_ring.length;
+  while (low < high)
+  {
+    const u32 mid = low + (high - low) / 2;
+    if (hash_ring.points[mid].hash < hash)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  u32 count = 0;
+  for (u32 i = 0; i < hash_ring.length && count < max; ++i)
+  {
+    const u32 ss_id = hash_ring.points[(low + i) % hash_ring.length].ss_id;
+    bool seen = false;
+    for (u32 j = 0; j < count && !seen; ++j)
+      seen = ss_ids[j] == ss_id;
+    if (!seen)
+      ss_ids[count++] = ss_id;
+  }
+  pthread_mutex_unlock(&hash_ring.lock);
+  return count;
+}
@@ -3,6 +3,82 @@
 
 #include "../common/headers.h"
 
+enum placement_policy
+{
+  PLACEMENT_WEIGHTED,
+  PLACEMENT_TWO_CHOICES
+};
+
+#define PLACEMENT_POLICY PLACEMENT_TWO_CHOICES
+#define PLACEMENT_MIN_FREE_INODES 16
+
+// Place every new file and folder by consistent hashing of its whole path instead of by its top level directory
+#define SHARDED_PLACEMENT false
+#define VIRTUAL_NODES 64
+
+// Redundancy of every top level file and folder on the other storage servers: full copies, or the shards of a
+// Reed–Solomon code with data and parity shards, spread over them in turn. Read from PLACEMENT_CONFIG, see placement.c.
+enum redundancy_mode
+{
+  REDUNDANCY_COPIES,
+  REDUNDANCY_ERASURE
+};
+
+typedef struct redundancy_config
+{
+  u32 replication_factor; // copies of every top level node, the primary one included, for REDUNDANCY_COPIES
+  enum redundancy_mode mode;
+  u32 data_shards; // for REDUNDANCY_ERASURE
+  u32 parity_shards;
+} redundancy_config;
+
+#define PLACEMENT_CONFIG "placement.conf" // in the working directory of the naming server, read again when it changes
+#define DEFAULT_REPLICATION_FACTOR 3
+#define DEFAULT_REDUNDANCY_MODE REDUNDANCY_COPIES
+#define DEFAULT_EC_DATA_SHARDS 2
+#define DEFAULT_EC_PARITY_SHARDS 1
+#define ORPHAN_GRACE 300 // seconds after starting before copies of unknown nodes are deleted, for servers to register
+#define REDUNDANCY_INTERVAL 15 // seconds between redundancy passes
+#define ALIVE_CHECK_TIMEOUT 5  // seconds a storage server has to send its heartbeat when checked
+
+// Rebalancing of data between storage servers
+#define REBALANCE_INTERVAL 30      // seconds between migration plans
+#define REBALANCE_MAX_MOVES 16     // migrations per plan
+#define REBALANCE_MOVES_PER_SECOND 2
+#define REBALANCE_MIN_IMBALANCE 8 // difference in number of files between storage servers that is tolerated
+
+// Requests of one client connection handled at the same time
+#define MAX_REQUESTS_IN_FLIGHT 64
+// Seconds a client may take with a storage server before its transfer is no longer waited for, see transfers.c
+#define TRANSFER_TIMEOUT 60
+
+// Bytes of metrics a storage server may send for STATS, the metrics of one sending more are left out
+#define SS_STATS_MAX_LENGTH 65536
+
+// Bytes of rendered tree sent to a client at a time by PRINT_TREE
+#define PRINT_TREE_CHUNK 65536
+
+// Entries of a directory sent at most in one LIST response, and listings that can be resumed at the same time
+#define LIST_MAX_ENTRIES 1024
+#define LIST_CURSORS 1024
+
+// Changes reported by storage servers to nodes that clients are using
+#define TREE_DELTA_RETRIES 50
+#define TREE_DELTA_RETRY_MS 20
+
+/**
+ * @brief Storage servers sending files for a copy. With SHARDED_PLACEMENT the files of a folder can come from
+ * several of them.
+ */
+typedef struct copy_sources
+{
+  enum operation op;
+  shard_spec shard; // of every file, for the redundancy in shards
+  u32 length;
+  u32 ss_ids[MAX_STORAGE_SERVERS];
+  i32 sockfds[MAX_STORAGE_SERVERS];
+} copy_sources;
+
 #define LOG(fmt, args...)                                                                                              \
   do                                                                                                                   \
   {                                                                                                                    \
@@ -26,18 +102,66 @@
   LOG("Sent " #data " to " #sockfd "\n");
 
 // nm_to_ss.c
-void add_connected_storage_server(storage_server_data data);
+void add_connected_storage_server(storage_server_data *data);
 void *storage_server_init(void *arg);
+void *tree_delta_relay(void *arg);
 void *alive_checker(void *arg);
+void *redundancy_refresher(void *arg);
 i32 ss_client_port_from_path(const char *path);
 i32 ss_nm_port_from_path(const char *path);
+i32 primary_location_from_path(const char *path, replica_location *locations);
+i32 replica_locations_from_path(const char *path, replica_location *locations);
+void ss_request_started(const i32 port);
+void ss_request_ended(const i32 port);
+void ss_request_finished(const transfer_report report);
 i32 ss_nm_port_new();
+void count_cache_lookup(bool hit);
 storage_server_data *ss_from_path(const char *path, bool cache_flag);
-storage_server_data *MinSizeStorageServer();
+storage_server_data *ss_from_ssid(const i32 ssid);
+void ss_release(const storage_server_data *ss);
+bool ss_connected(const i32 ssid);
+storage_server_data *ss_for_new_path(const char *path);
+u32 connected_ss_ids(u32 *ss_ids, u32 max);
+void render_replication_lag(message *out);
+void render_storage_server_stats(message *out);
+storage_server_data *PlaceStorageServer();
+
+// hash_ring.c
+void ring_add_server(const u32 ss_id, const char *UUID);
+void ring_remove_server(const u32 ss_id);
+i32 ring_lookup(const char *path);
+u32 ring_walk(const char *path, u32 *ss_ids, const u32 max);
+
+// placement.c
+void placement_reload();
+redundancy_config get_redundancy_config();
+u32 redundant_copies_per_node(const redundancy_config *config);
+bool redundancy_folder(const u32 ss_id, char *folder);
+u32 replica_set(const Tree T, const u32 wanted, u32 *ss_ids, char (*folders)[MAX_NAME_LEN]);
 
 // nm_to_client.c
 void *client_relay(void *arg);
 void *client_init(void *arg);
+enum status ss_path_operation(const storage_server_data *ss, const enum operation op, const char *path);
+enum status create_parent_folders(const storage_server_data *ss, const char *path);
+i32 copy_source_socket(copy_sources *sources, const u32 ss_id);
+void close_copy_sources(copy_sources *sources);
+void copy_file_or_folder(Tree CopyTree, const char *from_path, const char *dest_path, copy_sources *sources,
+                         const i32 to_sockfd, const i32 to_port, char *UUID);
+
+// rebalancer.c
+void *rebalancer(void *arg);
+
+// transfers.c
+void original_path(const char *path, char *original);
+u64 transfer_begin(const void *conn, const u32 request_id, const enum operation op, const char *path);
+void transfer_counted(const u64 seq, const i32 port);
+void transfer_end(const u64 seq);
+void transfer_acknowledged(const void *conn, const u32 request_id);
+void transfers_closed(const void *conn);
+void wait_for_transfers(const char *path);
+void hold_writes(const char *path);
+void release_writes(const char *path);
 
 extern Tree NM_Tree;
 extern pthread_mutex_t tree_lock;
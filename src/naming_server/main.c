@@ -5,7 +5,11 @@
  * Initialize threads for:
  * - Receiving initial information from storage servers
  * - Periodically checking if each of those storage servers is alive
+ * - Keeping the redundant copies of every top level file and folder up to date
  * - Receiving connections from clients
+ * - Moving data between storage servers when they join or leave
+ *
+ * The placement of redundant copies is read from PLACEMENT_CONFIG first, see placement.c.
  */
 
 #include "../common/headers.h"
@@ -17,16 +21,23 @@ pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
 int main()
 {
   NM_Tree = InitTree();
-  pthread_t storage_server_init_thread, alive_checker_thread;
-  pthread_t client_relay_thread;
+  SetCacheObserver(count_cache_lookup);
+  srandom(time(NULL));
+  placement_reload();
+  pthread_t storage_server_init_thread, alive_checker_thread, redundancy_refresher_thread;
+  pthread_t client_relay_thread, rebalancer_thread;
 
   pthread_create(&storage_server_init_thread, NULL, storage_server_init, NULL);
   pthread_create(&alive_checker_thread, NULL, alive_checker, NULL);
+  pthread_create(&redundancy_refresher_thread, NULL, redundancy_refresher, NULL);
   pthread_create(&client_relay_thread, NULL, client_init, NULL);
+  pthread_create(&rebalancer_thread, NULL, rebalancer, NULL);
 
   pthread_join(storage_server_init_thread, NULL);
   pthread_join(alive_checker_thread, NULL);
+  pthread_join(redundancy_refresher_thread, NULL);
   pthread_join(client_relay_thread, NULL);
+  pthread_join(rebalancer_thread, NULL);
 
   return 0;
 }
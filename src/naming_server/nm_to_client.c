@@ -3,109 +3,240 @@
  * @brief Communication between the naming server and clients
  * @details
  * - Receives initial client connections and spawns a new thread for each client
+ * - Reads the requests of a client as they come, and handles each of them in a thread of its own, so that a client
+ *   can have many requests in flight on one connection
  * - Handles all operations sent to the naming server from the client
  * - Forwards requests to the storage server whenever needed
  */
 
 #include "../common/headers.h"
 #include "headers.h"
+#include <netinet/tcp.h>
+
+// Connection to a client, shared by the thread reading its requests and the threads handling them
+typedef struct client_connection
+{
+  i32 fd;
+  pthread_mutex_t send_lock; // held while a response is being sent
+  pthread_mutex_t lock;      // protects everything below
+  pthread_cond_t changed;
+  u32 in_flight; // requests being handled
+  u32 refs;      // reader and handlers still using the connection
+} client_connection;
+
+typedef struct client_request
+{
+  client_connection *conn;
+  request_header header;
+  message payload;
+} client_request;
+
+// Where a LIST of a directory stopped. Clients only get the token, so the pointers never leave the naming server.
+typedef struct list_cursor
+{
+  u64 token;
+  Tree dir;
+  u64 generation; // of dir when the cursor was made, next is only still a child of dir while it is the same
+  Tree next;      // child to list first on the next page
+} list_cursor;
+
+// Cursors of the listings in progress, a new one takes the place of the oldest. Protected by tree_lock.
+struct
+{
+  list_cursor slots[LIST_CURSORS];
+  u64 issued;
+} list_cursors = {0};
+
+/**
+ * @brief Send the response to a request. A client that is gone is ignored, its reader notices it too.
+ *
+ * @param req
+ * @param response
+ * @return bool false if the client is gone
+ */
+bool respond(client_request *req, const message *response)
+{
+  pthread_mutex_lock(&req->conn->send_lock);
+  const bool sent = send_message(req->conn->fd, req->header.id, req->header.op, response);
+  if (!sent)
+    LOG("Unable to send response to request %u\n", req->header.id);
+  pthread_mutex_unlock(&req->conn->send_lock);
+  return sent;
+}
+
+/**
+ * @brief Stop using a connection, closing it once nothing uses it anymore
+ *
+ * @param conn
+ */
+void release_connection(client_connection *conn)
+{
+  pthread_mutex_lock(&conn->lock);
+  const bool last = --conn->refs == 0;
+  pthread_mutex_unlock(&conn->lock);
+  if (!last)
+    return;
+
+  close(conn->fd);
+  pthread_mutex_destroy(&conn->send_lock);
+  pthread_mutex_destroy(&conn->lock);
+  pthread_cond_destroy(&conn->changed);
+  free(conn);
+}
 
 /**
- * @brief Receive path from client and send the corresponding storage server's port
+ * @brief Receive path from client and send the locations it can be accessed at.
+ * For READ and METADATA, every up to date redundant copy is sent along with the primary one, least loaded first,
+ * so that the client can spread and hedge its reads.
+ * No lock is held while the client talks to the storage server, the storage server keeps concurrent writes apart
+ * with its write leases. The transfer is recorded until the client acknowledges it instead, for deletes and
+ * migrations to wait for, see transfers.c. A WRITE marks the redundant copies out of date right away, so that reads
+ * go to the primary copy from then on.
  *
- * @param clientfd file descriptor of the client socket
+ * @param req
+ * @param response
  */
-void send_client_port(const i32 clientfd, const enum operation op)
+void send_client_port(client_request *req, message *response)
 {
+  const enum operation op = req->header.op;
   char path[MAX_STR_LEN];
 
-  LOG_RECV(clientfd, path);
-  LOG("Finding storage server client port for path %s\n", path);
-  const i32 port = ss_client_port_from_path(path);
+  GET(&req->payload, path);
+  LOG("Finding storage server client ports for path %s\n", path);
+  const u64 seq = transfer_begin(req->conn, req->header.id, op, path);
+  replica_location locations[MAX_REPLICAS];
+  const i32 count =
+    op == WRITE ? primary_location_from_path(path, locations) : replica_locations_from_path(path, locations);
   enum status code = SUCCESS;
 
-  if (port == -1)
+  if (count == 0)
   {
     code = NOT_FOUND;
     LOG("Not found storage server client port for path %s\n", path);
-    LOG_SEND(clientfd, code);
+    transfer_end(seq);
+    PUT(response, code);
     return;
   }
 
-  if (op != METADATA && IsFile(NM_Tree, path) == 0)
+  if (op != METADATA && IsFile(NM_Tree, locations[0].path) == 0)
   {
     code = INVALID_TYPE;
     LOG("Can't do operation %d on directory %s\n", op, path);
-    LOG_SEND(clientfd, code);
+    transfer_end(seq);
+    PUT(response, code);
     return;
   }
 
-  if (op == READ || op == METADATA)
-    AcquireReaderLock(NM_Tree, path);
-  else
-    AcquireWriterLock(NM_Tree, path);
+  if (op == WRITE)
+  {
+    pthread_mutex_lock(&tree_lock);
+    BumpVersion(NM_Tree, path);
+    pthread_mutex_unlock(&tree_lock);
+  }
+
+  LOG("Found %i storage server locations for path %s\n", count, path);
+  // counted until the client reports back with an ACK, disconnects or takes longer than TRANSFER_TIMEOUT
+  transfer_counted(seq, locations[0].port);
+  PUT(response, code);
+  PUT(response, count);
+  for (i32 i = 0; i < count; ++i)
+  {
+    PUT(response, locations[i]);
+  }
+}
+
+/**
+ * @brief Perform a single operation on a path on a storage server
+ *
+ * @param ss storage server to perform the operation on
+ * @param op
+ * @param path
+ * @return enum status status code sent back by the storage server
+ */
+enum status ss_path_operation(const storage_server_data *ss, const enum operation op, const char *path)
+{
+  char path_copy[MAX_STR_LEN] = {0};
+  strcpy(path_copy, path);
+  const i32 sockfd = connect_to_port(ss->port_for_nm);
+  LOG_SEND(sockfd, op);
+  LOG_SEND(sockfd, path_copy);
+  enum status code;
+  LOG_RECV(sockfd, code);
+  close(sockfd);
+  return code;
+}
 
-  LOG("Found storage server client port %i for path %s\n", port, path);
-  LOG_SEND(clientfd, code);
-  LOG_SEND(clientfd, port);
-  enum operation ack;
-  LOG_RECV(clientfd, ack);
+/**
+ * @brief Create the missing ancestors of a path on a storage server that does not own them.
+ * Needed with SHARDED_PLACEMENT, where the contents of a folder are spread over storage servers.
+ *
+ * @param ss
+ * @param path
+ * @return enum status
+ */
+enum status create_parent_folders(const storage_server_data *ss, const char *path)
+{
+  char prefix[MAX_STR_LEN];
+  for (const char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+  {
+    strncpy(prefix, path, slash - path);
+    prefix[slash - path] = '\0';
+    Tree Ancestor = GetTreeFromPath(NM_Tree, prefix);
+    if (Ancestor == NULL)
+      return NOT_FOUND;
+    if (Ancestor->NodeInfo.ss_id == (u32)ss->port_for_nm)
+      continue;
 
-  ReleaseLock(NM_Tree, path);
+    const enum status code = ss_path_operation(ss, CREATE_FOLDER, prefix);
+    if (code != SUCCESS && code != ALREADY_EXISTS)
+      return code;
+  }
+  return SUCCESS;
 }
 
 /**
  * @brief Receive path from client, perform create operation on storage server and send the status code
  *
- * @param clientfd file descriptor of the client socket
- * @param op specified operation
+ * @param req
+ * @param response
  */
-void create_operations(const i32 clientfd, const enum operation op)
+void create_operations(client_request *req, message *response)
 {
+  const enum operation op = req->header.op;
   char path[MAX_STR_LEN];
-  LOG_RECV(clientfd, path);
+  GET(&req->payload, path);
 
   enum status code;
   i32 port;
-  storage_server_data *temp = NULL;
-  char *parent = GetParent(path);
-  if (parent == NULL)
-  {
-    temp = MinSizeStorageServer();
-  }
-  else
-  {
-    temp = ss_from_path(parent, true);
-    free(parent);
-  }
+  storage_server_data *temp = ss_for_new_path(path);
   if (temp == NULL)
   {
     LOG("Not found storage server - naming server port corresponding to the path %s\n", path);
     code = NOT_FOUND;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
     return;
   }
   port = temp->port_for_nm;
 
   LOG("Found storage server - naming server port %i corresponding to the path %s\n", port, path);
-  const i32 sockfd = connect_to_port(port);
-  LOG_SEND(sockfd, op);
-  LOG_SEND(sockfd, path);
+  code = SHARDED_PLACEMENT ? create_parent_folders(temp, path) : SUCCESS;
+  if (code == SUCCESS)
+    code = ss_path_operation(temp, op, path);
 
   // send status code received from ss to client
-  LOG_RECV(sockfd, code);
-  LOG_SEND(clientfd, code);
-  close(sockfd);
+  PUT(response, code);
 
   if (code != SUCCESS)
   {
     LOG("Operation failed with code %i\n", code);
+    ss_release(temp);
     return;
   }
   if (op == CREATE_FILE)
   {
     pthread_mutex_lock(&tree_lock);
     AddFile(NM_Tree, path, port, temp->UUID);
+    BumpVersion(NM_Tree, path);
     pthread_mutex_unlock(&tree_lock);
     LOG("Added file %s to NM Tree\n", path);
   }
@@ -113,21 +244,78 @@ void create_operations(const i32 clientfd, const enum operation op)
   {
     pthread_mutex_lock(&tree_lock);
     AddFolder(NM_Tree, path, port, temp->UUID);
+    BumpVersion(NM_Tree, path);
     pthread_mutex_unlock(&tree_lock);
     LOG("Added folder %s to NM Tree\n", path);
   }
+  ss_release(temp);
+}
+
+/**
+ * @brief Delete the redundant copies of a path that was deleted, full ones and shards, from the storage servers
+ * holding them and from the tree. The redundancy pass removes the ones left over later.
+ *
+ * @param op DELETE_FILE or DELETE_FOLDER
+ * @param path
+ */
+void delete_redundant_copies(const enum operation op, const char *path)
+{
+  const char *rest = path + strcspn(path, "/");
+  char copies[MAX_STORAGE_SERVERS][MAX_STR_LEN];
+  u32 ss_ids[MAX_STORAGE_SERVERS];
+  u32 length = 0;
+  pthread_mutex_lock(&tree_lock);
+  for (Tree R = NM_Tree->ChildDirectoryLL; R != NULL; R = R->NextSibling)
+  {
+    if (strncmp(R->NodeInfo.DirectoryName, ".rd", 3) != 0)
+      continue;
+    for (Tree C = R->ChildDirectoryLL; C != NULL && length < MAX_STORAGE_SERVERS; C = C->NextSibling)
+    {
+      char top[MAX_STR_LEN], original[MAX_STR_LEN];
+      snprintf(top, sizeof(top), "%s/%s", R->NodeInfo.DirectoryName, C->NodeInfo.DirectoryName);
+      original_path(top, original);
+      if (strlen(original) != (u64)(rest - path) || strncmp(original, path, rest - path) != 0)
+        continue;
+      snprintf(copies[length], MAX_STR_LEN, "%s%s", top, rest);
+      Tree Copy = GetTreeFromPath(NM_Tree, copies[length]);
+      if (Copy != NULL)
+        ss_ids[length++] = Copy->NodeInfo.ss_id;
+    }
+  }
+  pthread_mutex_unlock(&tree_lock);
+
+  for (u32 i = 0; i < length; ++i)
+  {
+    storage_server_data *ss = ss_from_ssid(ss_ids[i]);
+    AcquireWriterLock(NM_Tree, copies[i]);
+    const enum status code = ss == NULL ? NOT_FOUND : ss_path_operation(ss, op, copies[i]);
+    ss_release(ss);
+    if (code != SUCCESS)
+    {
+      ReleaseLock(NM_Tree, copies[i]);
+      LOG("Deleting redundant copy %s failed with code %i\n", copies[i], code);
+      continue;
+    }
+    pthread_mutex_lock(&tree_lock);
+    if (op == DELETE_FILE)
+      DeleteFile(NM_Tree, copies[i]);
+    else
+      DeleteFolder(NM_Tree, copies[i]);
+    pthread_mutex_unlock(&tree_lock);
+  }
 }
 
 /**
  * @brief receive path from client, perform delete operation on storage server and send the status code
  *
- * @param clientfd file descriptor of the client socket
- * @param op specified operation
+ * @param req
+ * @param response
  */
-void delete_operations(const i32 clientfd, const enum operation op)
+void delete_operations(client_request *req, message *response)
 {
+  const enum operation op = req->header.op;
   char path[MAX_STR_LEN];
-  RECV(clientfd, path);
+  GET(&req->payload, path);
 
   enum status code;
   LOG("Finding storage server - naming server port corresponding to the path %s\n", path);
@@ -137,7 +325,7 @@ void delete_operations(const i32 clientfd, const enum operation op)
   {
     LOG("Not found storage server - naming server port corresponding to the path %s\n", path);
     code = NOT_FOUND;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
     return;
   }
 
@@ -145,21 +333,39 @@ void delete_operations(const i32 clientfd, const enum operation op)
   if ((op == DELETE_FILE && !is_file) || (op == DELETE_FOLDER && is_file))
   {
     code = INVALID_TYPE;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
     return;
   }
 
   LOG("Found storage server - naming server port %i corresponding to the path %s\n", port, path);
+  AcquireWriterLock(NM_Tree, path);
+  // clients may still be reading or writing it on the storage servers
+  wait_for_transfers(path);
+
   const i32 sockfd = connect_to_port(port);
   SEND(sockfd, op);
   SEND(sockfd, path);
+  RECV(sockfd, code);
+  close(sockfd);
 
-  AcquireWriterLock(NM_Tree, path);
+  // parts of a folder may be stored on other storage servers too
+  if (code == SUCCESS && op == DELETE_FOLDER)
+  {
+    u32 owners[MAX_STORAGE_SERVERS];
+    const u32 num_owners = GetSubtreeOwners(GetTreeFromPath(NM_Tree, path), owners, MAX_STORAGE_SERVERS);
+    for (u32 i = 0; i < num_owners; ++i)
+    {
+      storage_server_data *owner = ss_from_ssid(owners[i]);
+      const enum status owner_code =
+        owner == NULL || owner->port_for_nm == port ? SUCCESS : ss_path_operation(owner, op, path);
+      ss_release(owner);
+      if (owner_code != SUCCESS && owner_code != NOT_FOUND)
+        LOG("Deleting %s from storage server %i failed with code %i\n", path, owners[i], owner_code);
+    }
+  }
 
   // send status code received from ss to client
-  RECV(sockfd, code);
-  SEND(clientfd, code);
-  close(sockfd);
+  PUT(response, code);
 
   if (code != SUCCESS)
   {
@@ -171,6 +377,7 @@ void delete_operations(const i32 clientfd, const enum operation op)
   if (op == DELETE_FILE)
   {
     pthread_mutex_lock(&tree_lock);
+    BumpVersion(NM_Tree, path);
     DeleteFile(NM_Tree, path);
     pthread_mutex_unlock(&tree_lock);
     LOG("Deleted file %s from NM Tree\n", path);
@@ -178,10 +385,86 @@ void delete_operations(const i32 clientfd, const enum operation op)
   else if (op == DELETE_FOLDER)
   {
     pthread_mutex_lock(&tree_lock);
+    BumpVersion(NM_Tree, path);
     DeleteFolder(NM_Tree, path);
     pthread_mutex_unlock(&tree_lock);
     LOG("Deleted folder %s from NM Tree\n", path);
   }
+  if (strncmp(path, ".rd", 3) != 0)
+    delete_redundant_copies(op, path);
+}
+
+/**
+ * @brief Get the socket of the storage server sending the files it stores, connecting to it on first use
+ *
+ * @param sources
+ * @param ss_id
+ * @return i32 socket, -1 if the storage server is not connected
+ */
+i32 copy_source_socket(copy_sources *sources, const u32 ss_id)
+{
+  for (u32 i = 0; i < sources->length; ++i)
+  {
+    if (sources->ss_ids[i] == ss_id)
+      return sources->sockfds[i];
+  }
+
+  storage_server_data *ss = ss_from_ssid(ss_id);
+  if (ss == NULL || sources->length == MAX_STORAGE_SERVERS)
+  {
+    ss_release(ss);
+    return -1;
+  }
+
+  const i32 sockfd = connect_to_port(ss->port_for_nm);
+  ss_release(ss);
+  const enum copy_type ch = SENDER;
+  SEND(sockfd, sources->op);
+  SEND(sockfd, ch);
+
+  sources->ss_ids[sources->length] = ss_id;
+  sources->sockfds[sources->length] = sockfd;
+  ++sources->length;
+  return sockfd;
+}
+
+/**
+ * @brief Disconnect from a storage server sending files for a copy whose stream can not be trusted anymore, without
+ * ending the copy on its side. It is connected to again for the next file it stores.
+ *
+ * @param sources
+ * @param sockfd
+ */
+void drop_copy_source(copy_sources *sources, const i32 sockfd)
+{
+  for (u32 i = 0; i < sources->length; ++i)
+  {
+    if (sources->sockfds[i] != sockfd)
+      continue;
+    close(sockfd);
+    --sources->length;
+    sources->ss_ids[i] = sources->ss_ids[sources->length];
+    sources->sockfds[i] = sources->sockfds[sources->length];
+    return;
+  }
+}
+
+/**
+ * @brief Tell every storage server that sent files for a copy that it is over, and disconnect from them
+ *
+ * @param sources
+ */
+void close_copy_sources(copy_sources *sources)
+{
+  const i8 is_file = 2;
+  for (u32 i = 0; i < sources->length; ++i)
+  {
+    enum status code;
+    SEND(sources->sockfds[i], is_file);
+    RECV(sources->sockfds[i], code);
+    close(sources->sockfds[i]);
+  }
+  sources->length = 0;
 }
 
 /**
@@ -190,28 +473,49 @@ void delete_operations(const i32 clientfd, const enum operation op)
  * @param CopyTree The tree being copied from
  * @param from_path current file/folder path being copied
  * @param dest_path destination path
- * @param from_sockfd socket of the storage server being copied from
+ * @param sources storage servers sending the files being copied
  * @param to_sockfd socket of the storage server being copied to
  * @param to_port nm port for the `to` storage server
  * @param UUID unique identifier of the `to` storage server
  */
-void copy_file_or_folder(Tree CopyTree, const char *from_path, const char *dest_path, const i32 from_sockfd,
+void copy_file_or_folder(Tree CopyTree, const char *from_path, const char *dest_path, copy_sources *sources,
                          const i32 to_sockfd, const i32 to_port, char *UUID)
 {
   enum status code;
   i8 is_file = CopyTree->NodeInfo.IsFile;
-  CHECK(send(to_sockfd, &is_file, sizeof(is_file), 0), -1);
-  CHECK(send(to_sockfd, dest_path, MAX_STR_LEN, 0), -1);
 
   if (is_file)
   {
-    CHECK(send(from_sockfd, &is_file, sizeof(is_file), 0), -1);
+    const i32 from_sockfd = copy_source_socket(sources, CopyTree->NodeInfo.ss_id);
+    if (from_sockfd == -1)
+    {
+      LOG("Skipping %s as its storage server is not connected\n", from_path);
+      return;
+    }
+    // 3 asks for a shard of the file instead
+    const i8 what = sources->shard.data_shards > 0 ? 3 : 1;
+    CHECK(send(from_sockfd, &what, sizeof(what), 0), -1);
     CHECK(send(from_sockfd, from_path, MAX_STR_LEN, 0), -1);
-
+    if (what == 3)
+      CHECK(send(from_sockfd, &sources->shard, sizeof(sources->shard), 0), -1);
     CHECK(recv(from_sockfd, &code, sizeof(code), 0), -1);
+    if (code != SUCCESS)
+    {
+      LOG("Skipping %s as it could not be read, code %i\n", from_path, code);
+      return;
+    }
+
+    CHECK(send(to_sockfd, &is_file, sizeof(is_file), 0), -1);
+    CHECK(send(to_sockfd, dest_path, MAX_STR_LEN, 0), -1);
     CHECK(recv(to_sockfd, &code, sizeof(code), 0), -1);
 
-    receive_and_transmit_file(from_sockfd, to_sockfd);
+    code = receive_and_transmit_chunks(from_sockfd, to_sockfd);
+    if (code != SUCCESS)
+    {
+      LOG("Copy of %s to %s failed its checksums, code %i\n", from_path, dest_path, code);
+      drop_copy_source(sources, from_sockfd);
+      return;
+    }
 
     pthread_mutex_lock(&tree_lock);
     AddFile(NM_Tree, dest_path, to_port, UUID);
@@ -220,8 +524,10 @@ void copy_file_or_folder(Tree CopyTree, const char *from_path, const char *dest_
   }
   else
   {
+    CHECK(send(to_sockfd, &is_file, sizeof(is_file), 0), -1);
+    CHECK(send(to_sockfd, dest_path, MAX_STR_LEN, 0), -1);
     CHECK(recv(to_sockfd, &code, sizeof(code), 0), -1);
-    pthread_mutex_unlock(&tree_lock);
+    pthread_mutex_lock(&tree_lock);
     AddFolder(NM_Tree, dest_path, to_port, UUID);
     pthread_mutex_unlock(&tree_lock);
   }
@@ -238,24 +544,28 @@ void copy_file_or_folder(Tree CopyTree, const char *from_path, const char *dest_
     strcat(to_path_copy, "/");
     strcat(to_path_copy, trav->NodeInfo.DirectoryName);
 
-    copy_file_or_folder(trav, from_path_copy, to_path_copy, from_sockfd, to_sockfd, to_port, UUID);
+    copy_file_or_folder(trav, from_path_copy, to_path_copy, sources, to_sockfd, to_port, UUID);
   }
 }
 
 /**
  * @brief Receive 2 paths from client, perform copy operation on storage server and send the status code
  *
- * @param clientfd file descriptor of the client socket
- * @param op specified operation
+ * @param req
+ * @param response
  */
-void copy_operation(const i32 clientfd, const enum operation op)
+void copy_operation(client_request *req, message *response)
 {
+  const enum operation op = req->header.op;
   enum status code = SUCCESS;
 
   char from_path[MAX_STR_LEN];
   char to_path[MAX_STR_LEN];
-  RECV(clientfd, from_path);
-  RECV(clientfd, to_path);
+  // the redundancy scrubber may ask for one shard of every file instead, in one more field
+  shard_spec shard;
+  GET(&req->payload, from_path);
+  GET(&req->payload, to_path);
+  message_read(&req->payload, &shard, sizeof(shard));
   bool cache_flag = true;
   if (strncmp(from_path, ".rd", 3) * strncmp(to_path, ".rd", 3) == 0)
     cache_flag = false;
@@ -267,11 +577,11 @@ void copy_operation(const i32 clientfd, const enum operation op)
   {
     LOG("Not found storage server - naming server port corresponding to the path %s\n", from_path);
     code = NOT_FOUND;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
     return;
   }
+  ss_release(from_ss);
   LOG("Found storage server - naming server port corresponding to path %s\n", from_path);
-  const i32 from_port = from_ss->port_for_nm;
 
   LOG("Finding storage server - naming server port corresponding to path %s\n", to_path);
   storage_server_data *to_ss = ss_from_path(to_path, cache_flag);
@@ -279,16 +589,19 @@ void copy_operation(const i32 clientfd, const enum operation op)
   {
     LOG("Not found storage server - naming server port corresponding to the path %s\n", to_path);
     code = NOT_FOUND;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
     return;
   }
   const i32 to_port = to_ss->port_for_nm;
+  char to_UUID[MAX_STR_LEN];
+  strcpy(to_UUID, to_ss->UUID);
+  ss_release(to_ss);
 
   if (Ancestor(NM_Tree, from_path, to_path))
   {
     LOG("from_path Ancestor of to_path - naming server port corresponding to the path %s\n", to_path);
     code = RECURSIVE_COPY;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
     return;
   }
 
@@ -296,7 +609,7 @@ void copy_operation(const i32 clientfd, const enum operation op)
   {
     LOG("Not found storage server - naming server port corresponding to the path %s\n", from_path);
     code = INVALID_TYPE;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
     return;
   }
   LOG("Found storage server - naming server port corresponding to path %s\n", to_path);
@@ -306,61 +619,432 @@ void copy_operation(const i32 clientfd, const enum operation op)
   Tree CopyTree = GetTreeFromPath(NM_Tree, from_path);
   strcat(to_path, "/");
   strcat(to_path, CopyTree->NodeInfo.DirectoryName);
+  if (shard.data_shards > 0)
+    sprintf(to_path + strlen(to_path), SHARD_SUFFIX "%u", shard.index);
 
   if (IsFile(NM_Tree, to_path) != -1)
   {
     LOG("File already exists - naming server port corresponding to the path %s\n", from_path);
     code = ALREADY_EXISTS;
-    LOG_SEND(clientfd, code);
+    PUT(response, code);
+    ReleaseLock(NM_Tree, from_path);
     return;
   }
 
-  const i32 from_sockfd = connect_to_port(from_port);
+  copy_sources sources = {.op = op, .shard = shard, .length = 0};
   const i32 to_sockfd = connect_to_port(to_port);
 
-  enum copy_type ch = SENDER;
-
-  SEND(from_sockfd, op);
-  SEND(from_sockfd, ch);
-
-  ch = RECEIVER;
+  enum copy_type ch = RECEIVER;
 
   SEND(to_sockfd, op);
   SEND(to_sockfd, ch);
 
-  copy_file_or_folder(CopyTree, from_path, to_path, from_sockfd, to_sockfd, to_port, to_ss->UUID);
+  copy_file_or_folder(CopyTree, from_path, to_path, &sources, to_sockfd, to_port, to_UUID);
 
   i8 is_file = 2;
   SEND(to_sockfd, is_file);
-  SEND(from_sockfd, is_file);
+  close_copy_sources(&sources);
 
-  RECV(from_sockfd, code);
   RECV(to_sockfd, code);
 
-  SEND(clientfd, code);
+  PUT(response, code);
+
+  pthread_mutex_lock(&tree_lock);
+  BumpVersion(NM_Tree, to_path);
+  pthread_mutex_unlock(&tree_lock);
 
   ReleaseLock(NM_Tree, from_path);
 
-  close(from_sockfd);
   close(to_sockfd);
 }
 
-void send_tree_for_printing(const i32 clientfd)
+// Entries of a batch that go to the same storage server
+typedef struct ss_batch
+{
+  storage_server_data *ss;
+  u32 length;
+  u32 *indices; // position of each entry in the client's batch
+  batch_entry *entries;
+  i32 sockfd;
+} ss_batch;
+
+/**
+ * @brief Find the storage server an entry of a batch has to be sent to, and lock the paths being deleted.
+ * Must be called with tree_lock held.
+ * A path may be created inside a folder created earlier in the same batch. Deleting a folder after deleting something
+ * inside it in the same batch gives UNAVAILABLE, as the earlier delete still holds its lock.
+ *
+ * @param entries
+ * @param targets storage servers already found for the earlier entries
+ * @param index entry to resolve
+ * @param ss output, storage server to send the entry to, to be released with ss_release
+ * @return enum status SUCCESS if the entry has to be sent to the storage server
+ */
+enum status resolve_batch_entry(batch_entry *entries, storage_server_data **targets, const u32 index,
+                                storage_server_data **ss)
+{
+  batch_entry *entry = &entries[index];
+  entry->parents = false;
+  *ss = NULL;
+
+  if (entry->op == METADATA)
+  {
+    *ss = ss_from_path(entry->path, true);
+    return *ss == NULL ? NOT_FOUND : SUCCESS;
+  }
+
+  if (entry->op == CREATE_FILE || entry->op == CREATE_FOLDER)
+  {
+    *ss = ss_for_new_path(entry->path);
+    if (*ss == NULL)
+    {
+      char *parent = GetParent(entry->path);
+      for (u32 i = index; parent != NULL && i-- > 0;)
+      {
+        if (entries[i].op == CREATE_FOLDER && targets[i] != NULL && strcmp(entries[i].path, parent) == 0)
+        {
+          *ss = ss_from_ssid(SHARDED_PLACEMENT ? ring_lookup(entry->path) : targets[i]->port_for_nm);
+          break;
+        }
+      }
+      free(parent);
+    }
+    // with SHARDED_PLACEMENT the storage server creates the folders it does not have on its own
+    entry->parents = SHARDED_PLACEMENT;
+    return *ss == NULL ? NOT_FOUND : SUCCESS;
+  }
+
+  if (entry->op == DELETE_FILE || entry->op == DELETE_FOLDER)
+  {
+    const i8 is_file = IsFile(NM_Tree, entry->path);
+    if (is_file == -1)
+      return NOT_FOUND;
+    if ((entry->op == DELETE_FILE) != (is_file == 1))
+      return INVALID_TYPE;
+    *ss = ss_from_path(entry->path, true);
+    if (*ss == NULL)
+      return NOT_FOUND;
+    // waiting for a client would stall every other entry of the batch
+    if (!TryAcquireWriterLock(NM_Tree, entry->path))
+    {
+      ss_release(*ss);
+      *ss = NULL;
+      return UNAVAILABLE;
+    }
+    return SUCCESS;
+  }
+
+  return INVALID_OPERATION;
+}
+
+/**
+ * @brief Receive a batch of creates, deletes and metadata requests from the client, perform them on the storage
+ * servers and send back the result of each.
+ * The entries are grouped by storage server, so every storage server involved is contacted once, and the tree is
+ * updated under a single acquisition of tree_lock.
+ *
+ * @param req
+ * @param response
+ */
+void batch_operations(client_request *req, message *response)
+{
+  u32 count;
+  GET(&req->payload, count);
+  enum status code = count > MAX_BATCH_SIZE ? INVALID_OPERATION : SUCCESS;
+  PUT(response, code);
+  if (code != SUCCESS)
+    return;
+
+  batch_entry *entries = malloc(sizeof(batch_entry) * (count + 1));
+  batch_result *results = calloc(count + 1, sizeof(batch_result));
+  storage_server_data **targets = calloc(count + 1, sizeof(storage_server_data *));
+  message_read(&req->payload, entries, sizeof(batch_entry) * count);
+  LOG("Received batch of %u operations\n", count);
+
+  ss_batch batches[MAX_STORAGE_SERVERS];
+  u32 num_batches = 0;
+  pthread_mutex_lock(&tree_lock);
+  for (u32 i = 0; i < count; ++i)
+  {
+    results[i].code = resolve_batch_entry(entries, targets, i, &targets[i]);
+    if (results[i].code != SUCCESS)
+      continue;
+
+    u32 b = 0;
+    while (b < num_batches && batches[b].ss != targets[i])
+      ++b;
+    if (b == num_batches)
+    {
+      batches[b] = (ss_batch){targets[i], 0, malloc(sizeof(u32) * count), malloc(sizeof(batch_entry) * count), -1};
+      ++num_batches;
+    }
+    batches[b].indices[batches[b].length] = i;
+    batches[b].entries[batches[b].length] = entries[i];
+    ++batches[b].length;
+  }
+  pthread_mutex_unlock(&tree_lock);
+  for (u32 i = 0; i < count; ++i)
+  {
+    if (results[i].code == SUCCESS && (entries[i].op == DELETE_FILE || entries[i].op == DELETE_FOLDER))
+      wait_for_transfers(entries[i].path);
+  }
+
+  // every storage server works on its part at the same time
+  const enum operation op = BATCH;
+  for (u32 b = 0; b < num_batches; ++b)
+  {
+    batches[b].sockfd = connect_to_port(batches[b].ss->port_for_nm);
+    SEND(batches[b].sockfd, op);
+    SEND(batches[b].sockfd, batches[b].length);
+    send_data_in_packets(batches[b].entries, batches[b].sockfd, sizeof(batch_entry) * batches[b].length);
+  }
+  batch_result *ss_results = malloc(sizeof(batch_result) * (count + 1));
+  for (u32 b = 0; b < num_batches; ++b)
+  {
+    receive_data_in_packets(ss_results, batches[b].sockfd, sizeof(batch_result) * batches[b].length);
+    RECV(batches[b].sockfd, code);
+    close(batches[b].sockfd);
+    for (u32 k = 0; k < batches[b].length; ++k)
+    {
+      results[batches[b].indices[k]] = ss_results[k];
+    }
+    LOG("Storage server %i finished %u operations of the batch\n", batches[b].ss->port_for_nm, batches[b].length);
+  }
+  free(ss_results);
+
+  // parts of a folder may be stored on other storage servers too
+  for (u32 i = 0; i < count; ++i)
+  {
+    if (entries[i].op != DELETE_FOLDER || results[i].code != SUCCESS)
+      continue;
+    u32 owners[MAX_STORAGE_SERVERS];
+    pthread_mutex_lock(&tree_lock);
+    const u32 num_owners = GetSubtreeOwners(GetTreeFromPath(NM_Tree, entries[i].path), owners, MAX_STORAGE_SERVERS);
+    pthread_mutex_unlock(&tree_lock);
+    for (u32 j = 0; j < num_owners; ++j)
+    {
+      storage_server_data *owner = ss_from_ssid(owners[j]);
+      if (owner != NULL && owner != targets[i])
+        ss_path_operation(owner, DELETE_FOLDER, entries[i].path);
+      ss_release(owner);
+    }
+  }
+
+  pthread_mutex_lock(&tree_lock);
+  for (u32 i = 0; i < count; ++i)
+  {
+    const batch_entry *entry = &entries[i];
+    const bool is_delete = entry->op == DELETE_FILE || entry->op == DELETE_FOLDER;
+    if (targets[i] == NULL)
+      continue;
+    if (results[i].code != SUCCESS)
+    {
+      if (is_delete)
+        ReleaseLock(NM_Tree, entry->path);
+      continue;
+    }
+
+    if (entry->op == CREATE_FILE)
+      AddFile(NM_Tree, entry->path, targets[i]->port_for_nm, targets[i]->UUID);
+    else if (entry->op == CREATE_FOLDER)
+      AddFolder(NM_Tree, entry->path, targets[i]->port_for_nm, targets[i]->UUID);
+    if (entry->op != METADATA)
+      BumpVersion(NM_Tree, entry->path);
+    if (entry->op == DELETE_FILE)
+      DeleteFile(NM_Tree, entry->path);
+    else if (entry->op == DELETE_FOLDER)
+      DeleteFolder(NM_Tree, entry->path);
+  }
+  pthread_mutex_unlock(&tree_lock);
+  for (u32 i = 0; i < count; ++i)
+  {
+    if (results[i].code == SUCCESS && (entries[i].op == DELETE_FILE || entries[i].op == DELETE_FOLDER) &&
+        strncmp(entries[i].path, ".rd", 3) != 0)
+      delete_redundant_copies(entries[i].op, entries[i].path);
+  }
+
+  message_write(response, results, sizeof(batch_result) * count);
+  LOG("Sent results of batch of %u operations\n", count);
+
+  for (u32 b = 0; b < num_batches; ++b)
+  {
+    free(batches[b].indices);
+    free(batches[b].entries);
+  }
+  for (u32 i = 0; i < count; ++i)
+    ss_release(targets[i]);
+  free(entries);
+  free(results);
+  free(targets);
+}
+
+/**
+ * @brief Flush of the tree writer of PRINT_TREE: stop rendering once the buffer is full, so that it is sent after
+ * tree_lock is released
+ *
+ * @param Writer its context is the flag set when the buffer is full
+ * @return bool false
+ */
+bool stop_tree_chunk(TreeWriter *Writer)
+{
+  *(bool *)Writer->Context = true;
+  return false;
+}
+
+/**
+ * @brief Receive a path with an optional depth limit and page, and stream the rendered subtree to the client.
+ * The subtree is rendered PRINT_TREE_CHUNK bytes at a time under tree_lock, each time skipping the nodes already
+ * sent, and each chunk is sent once the lock is released, as a response with the request's id whose last flag is
+ * false. No lock is held while the client reads. The final response has it set and the offset of the next page, 0 if
+ * the subtree was rendered to the end.
+ *
+ * @param req payload: path, then optionally u32 depth (0 for all), u64 offset and u64 limit (0 for no limit)
+ * @param response code, last flag, next offset and the rest of the lines
+ */
+void send_tree_for_printing(client_request *req, message *response)
 {
   enum status code = SUCCESS;
+  const bool last = true;
   char path[MAX_STR_LEN];
-  RECV(clientfd, path);
-  if (IsFile(NM_Tree, path) == -1)
+  u32 max_depth;
+  u64 skip, limit;
+  GET(&req->payload, path);
+  GET(&req->payload, max_depth);
+  GET(&req->payload, skip);
+  GET(&req->payload, limit);
+
+  bool full;
+  TreeWriter writer = {.Buffer = malloc(PRINT_TREE_CHUNK), .Capacity = PRINT_TREE_CHUNK, .Flush = stop_tree_chunk,
+                       .Context = &full};
+  u64 written = 0;
+  while (1)
   {
-    LOG("Not found storage server - naming server port corresponding to the path %s\n", path);
+    full = false;
+    writer.Length = 0;
+    writer.Seen = writer.Written = 0;
+    writer.More = false;
+    writer.Skip = skip + written;
+    writer.Limit = limit != 0 ? limit - written : 0;
+    pthread_mutex_lock(&tree_lock);
+    const bool found = GetPrintedSubtree(NM_Tree, path, max_depth, &writer);
+    pthread_mutex_unlock(&tree_lock);
+    written += writer.Written;
+    if (!found)
+    {
+      LOG("Not found storage server - naming server port corresponding to the path %s\n", path);
+      code = written == 0 ? INVALID_TYPE : NOT_FOUND;
+      break;
+    }
+    if (!full)
+      break;
+
+    message chunk = {0};
+    const bool more = false;
+    PUT(&chunk, code);
+    PUT(&chunk, more);
+    message_write(&chunk, writer.Buffer, writer.Length);
+    const bool sent = respond(req, &chunk);
+    message_free(&chunk);
+    if (!sent)
+      break;
+  }
+
+  const u64 next = writer.More ? skip + written : 0;
+  PUT(response, code);
+  PUT(response, last);
+  if (code == SUCCESS)
+  {
+    PUT(response, next);
+    message_write(response, writer.Buffer, writer.Length);
+  }
+  free(writer.Buffer);
+}
+
+/**
+ * @brief Send the metrics of the naming server and of every connected storage server as text, one value per line
+ *
+ * @param req
+ * @param response
+ */
+void send_stats(client_request *req, message *response)
+{
+  (void)req;
+  const enum status code = SUCCESS;
+  PUT(response, code);
+  metrics_render(response, "server=\"naming\"");
+  render_replication_lag(response);
+  render_storage_server_stats(response);
+  message_write(response, "", 1);
+}
+
+/**
+ * @brief Send a page of the children of a directory, resuming where the previous page stopped.
+ * A page takes time proportional to its size only, however big the directory is, as the cursor points right at the
+ * next child. Children added during a listing may be missed, and a listing can not be resumed once a child was removed
+ * from the directory or its cursor was replaced by LIST_CURSORS newer ones.
+ *
+ * @param req payload: path ("." for the root), then optionally u64 cursor (0 to start) and u32 limit (0 for
+ * LIST_MAX_ENTRIES)
+ * @param response code, u32 count, the entries, and u64 cursor of the next page, 0 after the last one
+ */
+void list_directory(client_request *req, message *response)
+{
+  enum status code = SUCCESS;
+  char path[MAX_STR_LEN];
+  u64 cursor;
+  u32 limit;
+  GET(&req->payload, path);
+  GET(&req->payload, cursor);
+  GET(&req->payload, limit);
+  path[MAX_STR_LEN - 1] = '\0';
+  if (limit == 0 || limit > LIST_MAX_ENTRIES)
+    limit = LIST_MAX_ENTRIES;
+
+  list_entry *entries = malloc(sizeof(list_entry) * limit);
+  u32 count = 0;
+  u64 next_cursor = 0;
+  pthread_mutex_lock(&tree_lock);
+  Tree dir = GetTreeFromPath(NM_Tree, strcmp(path, ".") == 0 ? "" : path);
+  Tree trav = NULL;
+  if (dir == NULL)
+    code = NOT_FOUND;
+  else if (dir->NodeInfo.IsFile)
     code = INVALID_TYPE;
-    LOG_SEND(clientfd, code);
-    return;
+  else if (cursor == 0)
+    trav = dir->ChildDirectoryLL;
+  else
+  {
+    const list_cursor *slot = &list_cursors.slots[cursor % LIST_CURSORS];
+    if (slot->token != cursor || slot->dir != dir || slot->generation != dir->Generation)
+      code = INVALID_CURSOR;
+    else
+      trav = slot->next;
   }
-  SEND(clientfd, code);
-  char printed_tree[200 * MAX_STR_LEN] = {0};
-  GetPrintedSubtree(NM_Tree, path, printed_tree);
-  send_data_in_packets(printed_tree, clientfd, sizeof(printed_tree));
+
+  for (; trav != NULL && count < limit; trav = trav->NextSibling)
+  {
+    // redundant copies are hidden, like in PRINT_TREE
+    if (strncmp(trav->NodeInfo.DirectoryName, ".rd", 3) == 0)
+      continue;
+    strcpy(entries[count].name, trav->NodeInfo.DirectoryName);
+    entries[count].is_file = trav->NodeInfo.IsFile;
+    entries[count].ss_id = trav->NodeInfo.ss_id;
+    ++count;
+  }
+  if (trav != NULL)
+  {
+    next_cursor = ++list_cursors.issued;
+    list_cursors.slots[next_cursor % LIST_CURSORS] = (list_cursor){next_cursor, dir, dir->Generation, trav};
+  }
+  pthread_mutex_unlock(&tree_lock);
+
+  if (code != SUCCESS)
+    LOG("Unable to list %s, code %i\n", path, code);
+  PUT(response, code);
+  PUT(response, count);
+  message_write(response, entries, sizeof(list_entry) * count);
+  PUT(response, next_cursor);
+  free(entries);
 }
 
 /**
@@ -382,6 +1066,9 @@ void *client_init(void *arg)
     i32 *clientfd = malloc(sizeof(i32));
     *clientfd = accept(serverfd, (struct sockaddr *)&client_addr, &addr_size);
     CHECK(*clientfd, -1);
+    // responses are small and must not wait for the ones before them to be acknowledged
+    const i32 nodelay = 1;
+    setsockopt(*clientfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
     pthread_t client_relay_thread;
     pthread_create(&client_relay_thread, NULL, client_relay, clientfd);
@@ -394,53 +1081,134 @@ void *client_init(void *arg)
 }
 
 /**
- * @brief Receives all operations from the client.
- * In case of READ, WRITE and METADATA, sends the port number of the corresponding storage server to the client.
+ * @brief Handles a single request of a client and sends the response.
+ * In case of READ, WRITE and METADATA, sends the ports of the corresponding storage servers to the client.
  * In other cases, performs the operation and sends the status code to the client
+ *
+ * @param arg client_request
+ * @return void* NULL
+ */
+void *request_handler(void *arg)
+{
+  client_request *req = arg;
+  message response = {0};
+  const u64 start = metrics_now_us();
+  switch (req->header.op)
+  {
+  case READ:
+  case WRITE:
+  case METADATA:
+    send_client_port(req, &response);
+    break;
+  case CREATE_FILE:
+  case CREATE_FOLDER:
+    create_operations(req, &response);
+    break;
+  case DELETE_FILE:
+  case DELETE_FOLDER:
+    delete_operations(req, &response);
+    break;
+  case COPY_FILE:
+  case COPY_FOLDER:
+    copy_operation(req, &response);
+    break;
+  case PRINT_TREE:
+    send_tree_for_printing(req, &response);
+    break;
+  case BATCH:
+    batch_operations(req, &response);
+    break;
+  case STATS:
+    send_stats(req, &response);
+    break;
+  case LIST:
+    list_directory(req, &response);
+    break;
+  default:
+  {
+    LOG("Received invalid operation: %d\n", req->header.op);
+    const enum status code = INVALID_OPERATION;
+    PUT(&response, code);
+    break;
+  }
+  }
+  respond(req, &response);
+
+  enum status code = SUCCESS;
+  GET(&response, code);
+  metrics_record(req->header.op, metrics_now_us() - start, code != SUCCESS);
+  metrics_add(METRIC_BYTES_OUT, sizeof(request_header) + response.length);
+  metrics_add(METRIC_IN_FLIGHT, -1);
+
+  client_connection *conn = req->conn;
+  pthread_mutex_lock(&conn->lock);
+  --conn->in_flight;
+  pthread_cond_broadcast(&conn->changed);
+  pthread_mutex_unlock(&conn->lock);
+  message_free(&response);
+  message_free(&req->payload);
+  free(req);
+  release_connection(conn);
+  return NULL;
+}
+
+/**
+ * @brief Reads the requests of a client, and starts a handler for each of them without waiting for the earlier ones
+ * to finish. At most MAX_REQUESTS_IN_FLIGHT requests of a client are handled at once.
+ *
  * @param arg integer pointer to the client file descriptor
  * @return void* NULL
  */
 void *client_relay(void *arg)
 {
-  const i32 clientfd = *(i32 *)arg;
+  client_connection *conn = calloc(1, sizeof(client_connection));
+  conn->fd = *(i32 *)arg;
+  conn->refs = 1;
   free(arg);
-  bool disconnect = false;
-  while (!disconnect)
+  pthread_mutex_init(&conn->send_lock, NULL);
+  pthread_mutex_init(&conn->lock, NULL);
+  pthread_cond_init(&conn->changed, NULL);
+  metrics_add(METRIC_CONNECTIONS, 1);
+
+  while (1)
   {
-    enum operation op;
-    LOG_RECV(clientfd, op);
-    switch (op)
+    request_header header;
+    message payload;
+    if (!receive_message(conn->fd, &header, &payload) || header.op == DISCONNECT)
     {
-    case READ:
-    case WRITE:
-    case METADATA:
-      send_client_port(clientfd, op);
-      break;
-    case CREATE_FILE:
-    case CREATE_FOLDER:
-      create_operations(clientfd, op);
-      break;
-    case DELETE_FILE:
-    case DELETE_FOLDER:
-      delete_operations(clientfd, op);
-      break;
-    case COPY_FILE:
-    case COPY_FOLDER:
-      copy_operation(clientfd, op);
-      break;
-    case PRINT_TREE:
-      send_tree_for_printing(clientfd);
-      break;
-    case DISCONNECT:
-      disconnect = true;
+      message_free(&payload);
       LOG("Client disconnected\n");
       break;
-    default:
-      disconnect = true;
-      LOG("Received invalid operation: %d\n", op);
-      break;
     }
+    metrics_add(METRIC_BYTES_IN, sizeof(request_header) + header.length);
+    if (header.op == ACK)
+    {
+      // only a load report, it has no response
+      transfer_report report;
+      GET(&payload, report);
+      transfer_acknowledged(conn, header.id);
+      ss_request_finished(report);
+      message_free(&payload);
+      continue;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    while (conn->in_flight >= MAX_REQUESTS_IN_FLIGHT)
+      pthread_cond_wait(&conn->changed, &conn->lock);
+    ++conn->in_flight;
+    ++conn->refs;
+    pthread_mutex_unlock(&conn->lock);
+    metrics_add(METRIC_IN_FLIGHT, 1);
+
+    client_request *req = malloc(sizeof(client_request));
+    *req = (client_request){conn, header, payload};
+    pthread_t request_thread;
+    pthread_create(&request_thread, NULL, request_handler, req);
+    pthread_detach(request_thread);
   }
 
+  metrics_add(METRIC_CONNECTIONS, -1);
+  transfers_closed(conn);
+  release_connection(conn);
   return NULL;
 }
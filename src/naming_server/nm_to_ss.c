@@ -13,14 +13,30 @@
 typedef struct connected_storage_server_node
 {
   storage_server_data data;
+  i32 in_flight;    // clients sent to this storage server whose transfer is not over yet, see transfers.c
+  u64 bytes_served; // bytes clients reported transferring with this storage server
+  u32 refs;         // callers still using its data, and one while it is in the list
   struct connected_storage_server_node *next;
 } connected_storage_server_node;
 
+// Storage servers are connected and disconnected under lock. The list itself and the references to its nodes are
+// protected by list_lock, which is never held while taking another lock, so it can be taken with tree_lock held.
+// A node that is disconnected is freed once the last caller using it releases it with ss_release.
 struct
 {
   u32 length;
   connected_storage_server_node *first;
-} connected_storage_servers = {0};
+  pthread_mutex_t lock;
+  pthread_mutex_t list_lock;
+} connected_storage_servers = {0, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+
+// Trees of the storage servers that disconnected, to compare against when they reconnect
+struct
+{
+  char UUID[MAX_STORAGE_SERVERS][MAX_STR_LEN];
+  Tree trees[MAX_STORAGE_SERVERS];
+  u32 length;
+} departed_storage_servers = {0};
 
 /**
  * @brief Initialize a new storage server node with data
@@ -28,45 +44,390 @@ struct
  * @param data
  * @return connected_storage_server_node*
  */
-connected_storage_server_node *init_connected_storage_server_node(storage_server_data data)
+connected_storage_server_node *init_connected_storage_server_node(const storage_server_data *data)
 {
   connected_storage_server_node *n = malloc(sizeof(connected_storage_server_node));
-  n->data = data;
+  n->data = *data;
+  n->in_flight = 0;
+  n->bytes_served = 0;
+  n->refs = 1;
   n->next = NULL;
 
   return n;
 }
 
 /**
- * @brief Add a connected storage server to the linked list and merge accessible paths
+ * @brief Remember the tree of a storage server that disconnected, replacing an older one with the same UUID.
+ * The oldest tree is forgotten once MAX_STORAGE_SERVERS are remembered.
+ * Must be called with connected_storage_servers.lock held.
+ *
+ * @param UUID
+ * @param T
+ */
+void save_departed_tree(const char *UUID, Tree T)
+{
+  u32 i = 0;
+  while (i < departed_storage_servers.length && strcmp(departed_storage_servers.UUID[i], UUID) != 0)
+    ++i;
+  if (i == MAX_STORAGE_SERVERS)
+  {
+    DeleteTree(departed_storage_servers.trees[0]);
+    memmove(departed_storage_servers.UUID[0], departed_storage_servers.UUID[1], MAX_STR_LEN * (MAX_STORAGE_SERVERS - 1));
+    memmove(&departed_storage_servers.trees[0], &departed_storage_servers.trees[1], sizeof(Tree) * (MAX_STORAGE_SERVERS - 1));
+    i = --departed_storage_servers.length;
+  }
+  if (i == departed_storage_servers.length)
+    ++departed_storage_servers.length;
+  else
+    DeleteTree(departed_storage_servers.trees[i]);
+  strcpy(departed_storage_servers.UUID[i], UUID);
+  departed_storage_servers.trees[i] = T;
+}
+
+/**
+ * @brief Take the remembered tree of a storage server out of the departed ones.
+ * Must be called with connected_storage_servers.lock held.
+ *
+ * @param UUID
+ * @return Tree NULL if the storage server is not remembered
+ */
+Tree take_departed_tree(const char *UUID)
+{
+  for (u32 i = 0; i < departed_storage_servers.length; ++i)
+  {
+    if (strcmp(departed_storage_servers.UUID[i], UUID) != 0)
+      continue;
+    Tree T = departed_storage_servers.trees[i];
+    --departed_storage_servers.length;
+    strcpy(departed_storage_servers.UUID[i], departed_storage_servers.UUID[departed_storage_servers.length]);
+    departed_storage_servers.trees[i] = departed_storage_servers.trees[departed_storage_servers.length];
+    return T;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Remove a storage server from the linked list and its paths from the tree, remembering its tree.
+ * Must be called with connected_storage_servers.lock held.
+ *
+ * @param cur storage server to remove
+ * @param prev the one before it in the list, NULL if it is the first
+ */
+void disconnect_storage_server(connected_storage_server_node *cur, connected_storage_server_node *prev)
+{
+  pthread_mutex_lock(&tree_lock);
+  save_departed_tree(cur->data.UUID, CopyServerTree(NM_Tree, cur->data.port_for_nm));
+  RemoveServerPath(NM_Tree, cur->data.port_for_nm);
+  pthread_mutex_unlock(&tree_lock);
+  ring_remove_server(cur->data.port_for_nm);
+
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  if (prev == NULL)
+    connected_storage_servers.first = cur->next;
+  else
+    prev->next = cur->next;
+  --connected_storage_servers.length;
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+  ss_release(&cur->data);
+}
+
+/**
+ * @brief Stop using the data of a storage server found by ss_from_ssid, ss_from_path, ss_for_new_path or
+ * PlaceStorageServer, freeing it if it has been disconnected meanwhile
+ *
+ * @param ss may be NULL
+ */
+void ss_release(const storage_server_data *ss)
+{
+  if (ss == NULL)
+    return;
+  // data is the first member of the node
+  connected_storage_server_node *n = (connected_storage_server_node *)ss;
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  const bool last = --n->refs == 0;
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+  if (last)
+    free(n);
+}
+
+/**
+ * @brief Disconnect the storage server with the given UUID if it is still connected,
+ * for when it registers again before it was found to have crashed
+ *
+ * @param UUID
+ */
+void disconnect_storage_server_by_uuid(const char *UUID)
+{
+  pthread_mutex_lock(&connected_storage_servers.lock);
+  connected_storage_server_node *prev = NULL;
+  for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; prev = cur, cur = cur->next)
+  {
+    if (strcmp(cur->data.UUID, UUID) == 0)
+    {
+      LOG("Storage server with UUID %s registered again, replacing ssid %i\n", UUID, cur->data.port_for_nm);
+      disconnect_storage_server(cur, prev);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&connected_storage_servers.lock);
+}
+
+/**
+ * @brief Add a connected storage server to the linked list and merge its tree
  *
  * @param data
+ * @param T tree of the storage server, consumed
  */
-void add_connected_storage_server(storage_server_data data)
+void connect_storage_server(const storage_server_data *data, Tree T)
 {
+  pthread_mutex_lock(&connected_storage_servers.lock);
+  connected_storage_server_node *n = init_connected_storage_server_node(data);
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
   if (connected_storage_servers.length == 0)
   {
-    connected_storage_servers.first = init_connected_storage_server_node(data);
+    connected_storage_servers.first = n;
   }
   else
   {
     connected_storage_server_node *cur;
     for (cur = connected_storage_servers.first; cur->next != NULL; cur = cur->next)
       ;
-    cur->next = init_connected_storage_server_node(data);
+    cur->next = n;
   }
-
   ++connected_storage_servers.length;
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+  pthread_mutex_unlock(&connected_storage_servers.lock);
+  ring_add_server(data->port_for_nm, data->UUID);
 
-  Tree temp = ReceiveTreeData(data.ss_tree);
+  char UUID[MAX_STR_LEN];
+  strcpy(UUID, data->UUID);
   pthread_mutex_lock(&tree_lock);
-  MergeTree(NM_Tree, temp, data.port_for_nm, data.UUID);
+  MergeTree(NM_Tree, T, data->port_for_nm, UUID);
   pthread_mutex_unlock(&tree_lock);
   PrintTree(NM_Tree, 0);
 }
 
 /**
- * @brief Receive initial port and accessible paths from all new storage servers
+ * @brief Add a connected storage server to the linked list and merge accessible paths
+ *
+ * @param data
+ */
+void add_connected_storage_server(storage_server_data *data)
+{
+  disconnect_storage_server_by_uuid(data->UUID);
+  connect_storage_server(data, ReceiveTreeData(data->ss_tree));
+}
+
+i32 compare_tree_nodes(const void *a, const void *b)
+{
+  return strcmp((*(const Tree *)a)->NodeInfo.DirectoryName, (*(const Tree *)b)->NodeInfo.DirectoryName);
+}
+
+i32 compare_summary_entries(const void *a, const void *b)
+{
+  return strcmp(((const tree_summary_entry *)a)->name, ((const tree_summary_entry *)b)->name);
+}
+
+/**
+ * @brief Make the children of a directory of a remembered tree match the ones the storage server lists now,
+ * and do the same for every child directory whose hash differs
+ *
+ * @param sockfd socket of the storage server
+ * @param Saved directory of the remembered tree
+ * @param path path of the directory
+ * @return u32 number of directories compared
+ */
+u32 reconcile_children(const i32 sockfd, Tree Saved, const char *path)
+{
+  const i8 more = 1;
+  char path_copy[MAX_STR_LEN] = {0};
+  strcpy(path_copy, path);
+  SEND(sockfd, more);
+  SEND(sockfd, path_copy);
+  u32 count;
+  RECV(sockfd, count);
+  tree_summary_entry *entries = malloc(sizeof(tree_summary_entry) * (count + 1));
+  receive_data_in_packets(entries, sockfd, sizeof(tree_summary_entry) * count);
+  qsort(entries, count, sizeof(tree_summary_entry), compare_summary_entries);
+
+  u32 num_saved = 0;
+  for (Tree trav = Saved->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+    ++num_saved;
+  Tree *saved = malloc(sizeof(Tree) * (num_saved + 1));
+  num_saved = 0;
+  for (Tree trav = Saved->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+    saved[num_saved++] = trav;
+  qsort(saved, num_saved, sizeof(Tree), compare_tree_nodes);
+
+  // both lists are sorted by name, so they can be walked together
+  u32 compared = 1;
+  u32 i = 0, j = 0;
+  while (i < num_saved || j < count)
+  {
+    const i32 order = i == num_saved ? 1 : j == count ? -1 : strcmp(saved[i]->NodeInfo.DirectoryName, entries[j].name);
+    if (order < 0 || (order == 0 && saved[i]->NodeInfo.IsFile != entries[j].is_file))
+    {
+      DeleteTree(saved[i++]);
+      continue;
+    }
+
+    Tree Child = order == 0 ? saved[i++] : NULL;
+    if (Child == NULL)
+    {
+      Child = PrependChild(Saved, entries[j].name);
+      Child->NodeInfo.IsFile = entries[j].is_file;
+      Child->NodeInfo.Access = 1;
+    }
+    if (!Child->NodeInfo.IsFile && Child->NodeInfo.Hash != entries[j].hash)
+    {
+      char child_path[MAX_STR_LEN];
+      snprintf(child_path, MAX_STR_LEN, path[0] == '\0' ? "%s%s" : "%s/%s", path, entries[j].name);
+      compared += reconcile_children(sockfd, Child, child_path);
+    }
+    Child->NodeInfo.Hash = entries[j++].hash;
+  }
+
+  free(saved);
+  free(entries);
+  return compared;
+}
+
+/**
+ * @brief Register a storage server that the naming server knew before, by comparing the tree remembered from when it
+ * disconnected with its current one. Only the directories whose hashes differ are listed by the storage server,
+ * so the time taken depends on how much changed rather than on how many files it has.
+ *
+ * @param clientfd socket of the storage server
+ */
+void reconnect_storage_server(const i32 clientfd)
+{
+  ss_reconnect_request request;
+  receive_data_in_packets(&request, clientfd, sizeof(request));
+  LOG("Received reconnection of storage server with UUID %s\n", request.UUID);
+
+  disconnect_storage_server_by_uuid(request.UUID);
+  pthread_mutex_lock(&connected_storage_servers.lock);
+  Tree Saved = take_departed_tree(request.UUID);
+  pthread_mutex_unlock(&connected_storage_servers.lock);
+
+  enum status code = Saved == NULL ? NOT_FOUND : SUCCESS;
+  LOG_SEND(clientfd, code);
+  if (Saved == NULL)
+    return;
+
+  const u32 compared = Saved->NodeInfo.Hash == request.tree_hash ? 0 : reconcile_children(clientfd, Saved, "");
+  const i8 more = 0;
+  SEND(clientfd, more);
+  LOG("Compared %u directories with storage server with UUID %s\n", compared, request.UUID);
+
+  storage_server_data *data = malloc(sizeof(storage_server_data));
+  data->port_for_client = request.port_for_client;
+  data->port_for_nm = request.port_for_nm;
+  data->port_for_alive = request.port_for_alive;
+  data->heartbeat = request.heartbeat;
+  strcpy(data->UUID, request.UUID);
+  data->ss_tree[0] = '\0';
+  connect_storage_server(data, Saved);
+  free(data);
+}
+
+/**
+ * @brief Apply one change reported by a storage server to the tree.
+ * Additions of nodes that already exist and changes to nodes that are not entirely owned by the storage server are
+ * ignored, so changes the naming server made itself are not applied twice.
+ *
+ * @param ss storage server that reported the change
+ * @param delta
+ * @return bool false if the node is in use by a client and the change has to be retried
+ */
+bool apply_tree_delta(storage_server_data *ss, const tree_delta *delta)
+{
+  bool applied = true;
+  pthread_mutex_lock(&tree_lock);
+  Tree Node = GetTreeFromPath(NM_Tree, delta->path);
+  if (delta->type == DELTA_ADD)
+  {
+    if (Node == NULL)
+    {
+      if (delta->is_file)
+        AddFile(NM_Tree, delta->path, ss->port_for_nm, ss->UUID);
+      else
+        AddFolder(NM_Tree, delta->path, ss->port_for_nm, ss->UUID);
+      BumpVersion(NM_Tree, delta->path);
+    }
+  }
+  else if (Node != NULL)
+  {
+    u32 owners[2];
+    const bool owned = GetSubtreeOwners(Node, owners, 2) == 1 && owners[0] == (u32)ss->port_for_nm;
+    if (owned && !TryAcquireWriterLock(NM_Tree, delta->path))
+      applied = false;
+    else if (owned)
+    {
+      BumpVersion(NM_Tree, delta->path);
+      if (delta->type == DELTA_RENAME && RenameNode(NM_Tree, delta->path, delta->new_path) == 0)
+      {
+        BumpVersion(NM_Tree, delta->new_path);
+        ReleaseLock(NM_Tree, delta->new_path);
+      }
+      else
+      {
+        // also when the new path of a rename is taken, as the old one is gone from the storage server either way
+        DeleteFolder(NM_Tree, delta->path);
+      }
+    }
+  }
+  pthread_mutex_unlock(&tree_lock);
+  return applied;
+}
+
+/**
+ * @brief Receive a batch of changes made on the disk of a storage server and apply them to the tree in order.
+ * The storage server waits for the status code before sending the next batch.
+ *
+ * @param arg pointer to the socket of the storage server
+ * @return void* NULL
+ */
+void *tree_delta_relay(void *arg)
+{
+  const i32 sockfd = *(i32 *)arg;
+  free(arg);
+
+  tree_delta_header header;
+  LOG_RECV(sockfd, header);
+  tree_delta *deltas = malloc(sizeof(tree_delta) * header.count);
+  receive_data_in_packets(deltas, sockfd, sizeof(tree_delta) * header.count);
+
+  enum status code = SUCCESS;
+  storage_server_data *ss = ss_from_ssid(header.ss_id);
+  if (ss == NULL)
+    code = NOT_FOUND;
+  for (u32 i = 0; i < header.count && ss != NULL; ++i)
+  {
+    bool applied = apply_tree_delta(ss, &deltas[i]);
+    for (u32 tries = 1; !applied && tries < TREE_DELTA_RETRIES; ++tries)
+    {
+      usleep(TREE_DELTA_RETRY_MS * 1000);
+      applied = apply_tree_delta(ss, &deltas[i]);
+    }
+    if (!applied)
+    {
+      LOG("Gave up applying change to %s from storage server %i\n", deltas[i].path, header.ss_id);
+      code = UNAVAILABLE;
+    }
+  }
+  LOG("Applied %u changes from storage server %i\n", header.count, header.ss_id);
+  ss_release(ss);
+
+  LOG_SEND(sockfd, code);
+  free(deltas);
+  close(sockfd);
+  return NULL;
+}
+
+/**
+ * @brief Receive initial port and accessible paths from all new storage servers,
+ * and the changes to their files afterwards
  *
  * @param arg NULL
  * @return void* NULL
@@ -86,94 +447,428 @@ void *storage_server_init(void *arg)
     const i32 clientfd = accept(serverfd, (struct sockaddr *)&client_addr, &addr_size);
     CHECK(clientfd, -1);
     LOG("Accepted connection on socket FD\n");
-    storage_server_data resp;
-    receive_data_in_packets(&resp, clientfd, sizeof(resp));
-    LOG("Received initial information of storage server with UUID %s\n", resp.UUID);
+    enum ss_message message;
+    LOG_RECV(clientfd, message);
+    if (message == SS_TREE_DELTA)
+    {
+      i32 *sockfd = malloc(sizeof(i32));
+      *sockfd = clientfd;
+      pthread_t tree_delta_thread;
+      pthread_create(&tree_delta_thread, NULL, tree_delta_relay, sockfd);
+      pthread_detach(tree_delta_thread);
+      continue;
+    }
+
+    if (message == SS_RECONNECT)
+    {
+      reconnect_storage_server(clientfd);
+      CHECK(close(clientfd), -1);
+      continue;
+    }
+
+    storage_server_data *resp = malloc(sizeof(storage_server_data));
+    receive_data_in_packets(resp, clientfd, sizeof(storage_server_data));
+    LOG("Received initial information of storage server with UUID %s\n", resp->UUID);
 
     CHECK(close(clientfd), -1);
     add_connected_storage_server(resp);
+    free(resp);
   }
 
   CHECK(close(serverfd), -1);
   return NULL;
 }
 
+// A redundant copy of a top level file or folder being refreshed, or one being removed
+typedef struct redundancy_job
+{
+  bool is_file;
+  u64 version;
+  char from_path[MAX_STR_LEN];
+  char to_path[MAX_STR_LEN];
+  char replica_path[MAX_STR_LEN];
+  shard_spec shard;  // of every file the copy holds
+  bool delete_only;  // the copy is of a node that is gone, or of the other redundancy mode
+  bool copying;      // the old copy is gone and the copy request has been sent
+} redundancy_job;
+
+// When issue_redundancy_commands last finished, 0 if it never has
+time_t last_redundancy_refresh = 0;
+// When the redundancy passes started, for ORPHAN_GRACE
+time_t redundancy_start = 0;
+// Redundant copies found to match their original by checksum, and copies made again, since the start
+u64 replicas_verified = 0, replicas_recopied = 0;
+
 /**
- * @brief Deletes and copies redundancies. Is called periodically
+ * @brief Add a job refreshing the redundant copy of a top level node
  *
- * @param T root node to delete redundancies of
- * @param rd_num redundancy number to copy to
- * @param nm_sockfd socket of the naming server
- * @return enum status
+ * @param jobs
+ * @param length
+ * @param T
+ * @param folder redundancy folder to copy to
+ * @param shard of every file the copy holds
+ */
+void add_redundancy_job(redundancy_job *jobs, u32 *length, const Tree T, const char *folder, const shard_spec shard)
+{
+  redundancy_job *job = &jobs[(*length)++];
+  job->is_file = T->NodeInfo.IsFile;
+  job->version = T->NodeInfo.Version;
+  job->shard = shard;
+  job->delete_only = false;
+  job->copying = false;
+  strcpy(job->from_path, T->NodeInfo.DirectoryName);
+  strcpy(job->to_path, folder);
+  snprintf(job->replica_path, MAX_STR_LEN, "%s/%s", folder, T->NodeInfo.DirectoryName);
+  if (shard.data_shards > 0)
+    sprintf(job->replica_path + strlen(job->replica_path), SHARD_SUFFIX "%u", shard.index);
+}
+
+/**
+ * @brief Add the jobs refreshing every redundant copy of a top level node: a full copy on every storage server of its
+ * replica set, or its shards spread over them in turn. Must be called with tree_lock held.
+ *
+ * @param jobs redundant_copies_per_node() free entries at least
+ * @param length
+ * @param T
  */
-enum status delete_and_copy(const Tree T, const i32 rd_num, const i32 nm_sockfd)
+void add_redundancy_jobs(redundancy_job *jobs, u32 *length, const Tree T)
 {
-  char from_path[MAX_STR_LEN] = {0};
-  strcpy(from_path, T->NodeInfo.DirectoryName);
+  if (strncmp(T->NodeInfo.DirectoryName, ".rd", 3) == 0)
+    return;
+  const redundancy_config config = get_redundancy_config();
+  const u32 copies = redundant_copies_per_node(&config);
+  u32 ss_ids[EC_MAX_SHARDS];
+  char folders[EC_MAX_SHARDS][MAX_NAME_LEN];
+  const u32 targets = replica_set(T, copies, ss_ids, folders);
+  for (u32 i = 0; targets > 0 && i < copies; ++i)
+  {
+    if (config.mode == REDUNDANCY_COPIES && i == targets)
+      break;
+    const shard_spec shard = config.mode == REDUNDANCY_ERASURE
+                               ? (shard_spec){config.data_shards, config.parity_shards, i}
+                               : (shard_spec){0, 0, 0};
+    add_redundancy_job(jobs, length, T, folders[i % targets], shard);
+  }
+}
 
-  char to_path[MAX_STR_LEN] = {0};
-  sprintf(to_path, ".rd%i", rd_num);
+/**
+ * @brief Check if a storage server that disconnected had a top level node.
+ * Must be called with connected_storage_servers.lock held.
+ *
+ * @param name
+ * @return bool
+ */
+bool departed_node_exists(const char *name)
+{
+  for (u32 i = 0; i < departed_storage_servers.length; ++i)
+  {
+    if (GetTreeFromPath(departed_storage_servers.trees[i], name) != NULL)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Check if a copy in a redundancy folder is still needed: it is in the replica set of its top level node, or
+ * that node is being copied again and the copy may be the only good one until then, or the node is on a storage
+ * server that disconnected. Copies of unknown nodes are kept for ORPHAN_GRACE seconds after the start, for the storage
+ * servers holding them to register. Must be called with connected_storage_servers.lock and tree_lock held.
+ *
+ * @param folder
+ * @param name of the copy in the folder
+ * @param stale jobs of the copies being made again
+ * @param length
+ * @return bool
+ */
+bool redundant_copy_wanted(const char *folder, const char *name, const redundancy_job *stale, const u32 length)
+{
+  char base[MAX_STR_LEN];
+  strcpy(base, name);
+  u64 end = strlen(base);
+  while (end > 0 && isdigit(base[end - 1]))
+    --end;
+  const u64 suffix = strlen(SHARD_SUFFIX);
+  if (end < strlen(base) && end > suffix && strncmp(base + end - suffix, SHARD_SUFFIX, suffix) == 0)
+    base[end - suffix] = '\0';
+
+  Tree T = GetTreeFromPath(NM_Tree, base);
+  if (T == NULL)
+    return departed_node_exists(base) || time(NULL) < redundancy_start + ORPHAN_GRACE;
+  for (u32 i = 0; i < length; ++i)
+  {
+    if (strcmp(stale[i].from_path, base) == 0)
+      return true;
+  }
+  redundancy_job jobs[EC_MAX_SHARDS];
+  u32 count = 0;
+  add_redundancy_jobs(jobs, &count, T);
+  char path[MAX_STR_LEN];
+  snprintf(path, sizeof(path), "%s/%s", folder, name);
+  for (u32 i = 0; i < count; ++i)
+  {
+    if (strcmp(jobs[i].replica_path, path) == 0)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Add jobs deleting the redundant copies no top level node needs anymore
+ *
+ * @param jobs the first length of them are of the copies being made again
+ * @param length
+ * @param capacity
+ */
+void add_cleanup_jobs(redundancy_job **jobs, u32 *length, u32 *capacity)
+{
+  const u32 stale = *length;
+  pthread_mutex_lock(&connected_storage_servers.lock);
+  pthread_mutex_lock(&tree_lock);
+  for (Tree R = NM_Tree->ChildDirectoryLL; R != NULL; R = R->NextSibling)
+  {
+    if (strncmp(R->NodeInfo.DirectoryName, ".rd", 3) != 0)
+      continue;
+    for (Tree T = R->ChildDirectoryLL; T != NULL; T = T->NextSibling)
+    {
+      if (redundant_copy_wanted(R->NodeInfo.DirectoryName, T->NodeInfo.DirectoryName, *jobs, stale))
+        continue;
+      if (*length == *capacity)
+      {
+        *capacity *= 2;
+        *jobs = realloc(*jobs, sizeof(redundancy_job) * *capacity);
+      }
+      redundancy_job *job = &(*jobs)[(*length)++];
+      memset(job, 0, sizeof(*job));
+      job->is_file = T->NodeInfo.IsFile;
+      job->delete_only = true;
+      snprintf(job->replica_path, MAX_STR_LEN, "%s/%s", R->NodeInfo.DirectoryName, T->NodeInfo.DirectoryName);
+    }
+  }
+  pthread_mutex_unlock(&tree_lock);
+  pthread_mutex_unlock(&connected_storage_servers.lock);
+}
 
-  char delete_path[MAX_STR_LEN] = {0};
-  sprintf(delete_path, ".rd%i/%s", rd_num, T->NodeInfo.DirectoryName);
+/**
+ * @brief Send the request of a job to delete the old copy, or to copy the new one once the old one is gone.
+ * The index of the job is used as the request id.
+ *
+ * @param nm_sockfd
+ * @param jobs
+ * @param index
+ */
+void send_redundancy_request(const i32 nm_sockfd, const redundancy_job *jobs, const u32 index)
+{
+  const redundancy_job *job = &jobs[index];
+  message request = {0};
+  enum operation op;
+  if (!job->copying)
+  {
+    op = job->is_file ? DELETE_FILE : DELETE_FOLDER;
+    PUT(&request, job->replica_path);
+  }
+  else
+  {
+    op = job->is_file ? COPY_FILE : COPY_FOLDER;
+    PUT(&request, job->from_path);
+    PUT(&request, job->to_path);
+    PUT(&request, job->shard);
+  }
+  CHECK(send_message(nm_sockfd, index, op, &request), false);
+  message_free(&request);
+}
 
-  enum operation op = T->NodeInfo.IsFile ? DELETE_FILE : DELETE_FOLDER;
-  SEND(nm_sockfd, op);
-  SEND(nm_sockfd, delete_path);
+/**
+ * @brief Ask a storage server for the checksum of a file or folder
+ *
+ * @param ss
+ * @param path
+ * @param crc output
+ * @return enum status
+ */
+enum status ss_checksum(const storage_server_data *ss, const char *path, u32 *crc)
+{
+  char path_copy[MAX_STR_LEN] = {0};
+  strcpy(path_copy, path);
+  const i32 sockfd = connect_to_port(ss->port_for_nm);
+  const enum operation op = CHECKSUM;
+  SEND(sockfd, op);
+  SEND(sockfd, path_copy);
+  CHECK(recv(sockfd, crc, sizeof(*crc), MSG_WAITALL), -1);
   enum status code;
-  RECV(nm_sockfd, code);
-  if (code != SUCCESS && code != NOT_FOUND)
-    return code;
-
-  op = T->NodeInfo.IsFile ? COPY_FILE : COPY_FOLDER;
-  SEND(nm_sockfd, op);
-  SEND(nm_sockfd, from_path);
-  SEND(nm_sockfd, to_path);
-  RECV(nm_sockfd, code);
+  RECV(sockfd, code);
+  close(sockfd);
   return code;
 }
 
 /**
- * @brief Ensure redundancy of every tree storage server in two others at all times
- * Update old copies with new updated ones.
+ * @brief Check if the redundant copy of a job has the same contents as the original, by their checksums.
+ * Originals spread over several storage servers are never taken to match.
+ *
+ * @param job
+ * @return bool
+ */
+bool replica_matches(const redundancy_job *job)
+{
+  u32 owners[2];
+  pthread_mutex_lock(&tree_lock);
+  Tree Original = GetTreeFromPath(NM_Tree, job->from_path);
+  Tree Replica = GetTreeFromPath(NM_Tree, job->replica_path);
+  const bool comparable = Original != NULL && Replica != NULL && Original->NodeInfo.IsFile == Replica->NodeInfo.IsFile &&
+                          GetSubtreeOwners(Original, owners, 2) == 1;
+  const storage_server_data *from_ss = comparable ? ss_from_ssid(owners[0]) : NULL;
+  const storage_server_data *to_ss = comparable ? ss_from_ssid(Replica->NodeInfo.ss_id) : NULL;
+  pthread_mutex_unlock(&tree_lock);
+
+  u32 crc, replica_crc;
+  const bool matches = from_ss != NULL && to_ss != NULL && ss_checksum(from_ss, job->from_path, &crc) == SUCCESS &&
+                       ss_checksum(to_ss, job->replica_path, &replica_crc) == SUCCESS && crc == replica_crc;
+  ss_release(from_ss);
+  ss_release(to_ss);
+  return matches;
+}
+
+/**
+ * @brief Record in the tree that the redundant copy of a job holds the version of the node it was copied from, as of
+ * now
+ *
+ * @param job
+ */
+void mark_replica_fresh(const redundancy_job *job)
+{
+  pthread_mutex_lock(&tree_lock);
+  Tree Replica = GetTreeFromPath(NM_Tree, job->replica_path);
+  if (Replica != NULL)
+  {
+    Replica->NodeInfo.Version = job->version;
+    Replica->NodeInfo.Verified = time(NULL);
+  }
+  pthread_mutex_unlock(&tree_lock);
+}
+
+/**
+ * @brief Ensure redundancy of every top level node on the storage servers of its replica set, see placement.c
+ * Copies whose checksum matches the original are kept, the others are replaced with new ones. Shards count as matching
+ * when they are intact and were made from the current original.
+ * Copies no replica set has, of the redundancy mode not in use or of nodes that are gone, are deleted once the copies
+ * of their node are all good.
+ * All deletes are sent at once over the connection, and each copy as soon as its delete is done.
  *
  * @param nm_sockfd socket of the naming server
  */
 void issue_redundancy_commands(const i32 nm_sockfd)
 {
-  if (connected_storage_servers.length < 3)
+  u32 ss_ids[2];
+  if (connected_ss_ids(ss_ids, 2) < 2)
     return;
 
+  const redundancy_config config = get_redundancy_config();
+  u32 length = 0, capacity = 16;
+  redundancy_job *jobs = malloc(sizeof(redundancy_job) * capacity);
+  pthread_mutex_lock(&tree_lock);
   for (Tree T = NM_Tree->ChildDirectoryLL; T != NULL; T = T->NextSibling)
   {
-    if (strcmp(T->NodeInfo.UUID, RD1) == 0)
+    while (length + redundant_copies_per_node(&config) > capacity)
     {
-      if (strstr(T->NodeInfo.DirectoryName, ".rd1") == T->NodeInfo.DirectoryName)
-        continue;
-      delete_and_copy(T, 2, nm_sockfd);
-      delete_and_copy(T, 3, nm_sockfd);
+      capacity *= 2;
+      jobs = realloc(jobs, sizeof(redundancy_job) * capacity);
     }
-    else if (strcmp(T->NodeInfo.UUID, RD2) == 0)
+    add_redundancy_jobs(jobs, &length, T);
+  }
+  pthread_mutex_unlock(&tree_lock);
+
+  u32 stale = 0;
+  for (u32 i = 0; i < length; ++i)
+  {
+    if (replica_matches(&jobs[i]))
+      mark_replica_fresh(&jobs[i]);
+    else
+      jobs[stale++] = jobs[i];
+  }
+  replicas_verified += length - stale;
+  replicas_recopied += stale;
+  length = stale;
+  add_cleanup_jobs(&jobs, &length, &capacity);
+
+  for (u32 i = 0; i < length; ++i)
+  {
+    send_redundancy_request(nm_sockfd, jobs, i);
+  }
+
+  // every job gets a response to its delete, and then one to its copy if that was sent
+  for (u32 remaining = length; remaining > 0; --remaining)
+  {
+    request_header header;
+    message response;
+    CHECK(receive_message(nm_sockfd, &header, &response), false);
+    enum status code;
+    GET(&response, code);
+    message_free(&response);
+    if (header.id >= length)
+      continue;
+
+    redundancy_job *job = &jobs[header.id];
+    if (!job->copying && !job->delete_only && (code == SUCCESS || code == NOT_FOUND))
     {
-      if (strstr(T->NodeInfo.DirectoryName, ".rd2") == T->NodeInfo.DirectoryName)
-        continue;
-      delete_and_copy(T, 1, nm_sockfd);
-      delete_and_copy(T, 3, nm_sockfd);
+      job->copying = true;
+      send_redundancy_request(nm_sockfd, jobs, header.id);
+      ++remaining;
     }
-    else
+    else if (job->copying && code == SUCCESS)
+      mark_replica_fresh(job);
+  }
+  free(jobs);
+  last_redundancy_refresh = time(NULL);
+}
+
+/**
+ * @brief Periodically issue redundant delete and copy commands, after reading the placement configuration again if it
+ * changed. Runs apart from alive_checker, as a pass can take longer than storage servers wait for alive checks.
+ *
+ * @param arg NULL
+ * @return void* NULL
+ */
+void *redundancy_refresher(void *arg)
+{
+  (void)arg;
+  redundancy_start = time(NULL);
+  sleep(5);
+  const i32 nm_sockfd = connect_to_port(NM_CLIENT_PORT);
+  while (1)
+  {
+    sleep(REDUNDANCY_INTERVAL);
+    placement_reload();
+    issue_redundancy_commands(nm_sockfd);
+  }
+  close(nm_sockfd);
+  return NULL;
+}
+
+/**
+ * @brief Disconnect a storage server found to have crashed, unless it was disconnected meanwhile
+ *
+ * @param ss pinned by the caller
+ */
+void disconnect_crashed_storage_server(const storage_server_data *ss)
+{
+  pthread_mutex_lock(&connected_storage_servers.lock);
+  connected_storage_server_node *prev = NULL;
+  for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; prev = cur, cur = cur->next)
+  {
+    if (&cur->data == ss)
     {
-      if (strstr(T->NodeInfo.DirectoryName, ".rd3") == T->NodeInfo.DirectoryName)
-        continue;
-      delete_and_copy(T, 1, nm_sockfd);
-      delete_and_copy(T, 2, nm_sockfd);
+      printf("Storage server with ssid %i has disconnected!\n", cur->data.port_for_nm);
+      LOG("Storage server with ssid %i disconnected\n", cur->data.port_for_nm);
+      disconnect_storage_server(cur, prev);
+      break;
     }
   }
+  pthread_mutex_unlock(&connected_storage_servers.lock);
 }
 
 /**
- * @brief Periodically check if each storage server is still alive.
- * Disconnect the ones that have crashed.
- * Issue redundant delete and copy commands.
+ * @brief Periodically check if each storage server is still alive, and record its heartbeat.
+ * Disconnect the ones that have crashed. No lock is held while a storage server is asked, and one that does not answer
+ * within ALIVE_CHECK_TIMEOUT seconds keeps its last heartbeat.
  *
  * @param arg NULL
  * @return void* NULL
@@ -182,47 +877,29 @@ void *alive_checker(void *arg)
 {
   (void)arg;
   sleep(5);
-  const i32 nm_sockfd = connect_to_port(NM_CLIENT_PORT);
   while (1)
   {
     sleep(15);
-    connected_storage_server_node *cur = connected_storage_servers.first;
-    connected_storage_server_node *prev = NULL;
-    while (cur != NULL)
+    u32 ss_ids[MAX_STORAGE_SERVERS];
+    const u32 length = connected_ss_ids(ss_ids, MAX_STORAGE_SERVERS);
+    for (u32 i = 0; i < length; ++i)
     {
+      storage_server_data *ss = ss_from_ssid(ss_ids[i]);
+      if (ss == NULL)
+        continue;
       const i32 sockfd = socket(AF_INET, SOCK_STREAM, 0);
       CHECK(sockfd, -1);
+      const struct timeval timeout = {ALIVE_CHECK_TIMEOUT, 0};
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
       struct sockaddr_in addr;
       memset(&addr, '\0', sizeof(addr));
       addr.sin_family = AF_INET;
-      addr.sin_port = htons(cur->data.port_for_alive);
+      addr.sin_port = htons(ss->port_for_alive);
       addr.sin_addr.s_addr = inet_addr(LOCALHOST);
       if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
       {
         if (errno == 111) // Connection refused
-        {
-          printf("Storage server with ssid %i has disconnected!\n", cur->data.port_for_nm);
-          LOG("Storage server with ssid %i disconnected\n", cur->data.port_for_nm);
-
-          pthread_mutex_lock(&tree_lock);
-          RemoveServerPath(NM_Tree, cur->data.port_for_nm);
-          pthread_mutex_unlock(&tree_lock);
-
-          if (prev == NULL)
-          {
-            connected_storage_servers.first = cur->next;
-          }
-          else
-          {
-            prev->next = cur->next;
-          }
-          connected_storage_server_node *temp = cur->next;
-          free(cur);
-          cur = temp;
-          --connected_storage_servers.length;
-          CHECK(close(sockfd), -1);
-          continue;
-        }
+          disconnect_crashed_storage_server(ss);
         else
         {
           ERROR_PRINT("failed with errno %i (%s)\n", errno, strerror(errno));
@@ -231,42 +908,131 @@ void *alive_checker(void *arg)
       }
       else
       {
-        // ok
+        ss_heartbeat heartbeat;
+        if (recv(sockfd, &heartbeat, sizeof(heartbeat), MSG_WAITALL) == sizeof(heartbeat))
+        {
+          pthread_mutex_lock(&connected_storage_servers.list_lock);
+          ss->heartbeat = heartbeat;
+          pthread_mutex_unlock(&connected_storage_servers.list_lock);
+        }
       }
 
       CHECK(close(sockfd), -1);
-
-      prev = cur;
-      cur = cur->next;
+      ss_release(ss);
     }
-
-    issue_redundancy_commands(nm_sockfd);
   }
-  close(nm_sockfd);
   return NULL;
 }
 
 /**
- * @brief Find the minimum size storage server and return it.
+ * @brief How desirable a storage server is for new data, from its last heartbeat and requests in flight.
+ * Storage servers without free space or inodes score 0. Must be called with connected_storage_servers.list_lock held.
  *
- * @return storage_server_data*
+ * @param ss
+ * @return double
  */
-storage_server_data *MinSizeStorageServer()
+double placement_score(const connected_storage_server_node *ss)
 {
-  connected_storage_server_node *BestSS = connected_storage_servers.first;
-  size_t minsize = strlen(connected_storage_servers.first->data.ss_tree);
+  const ss_heartbeat heartbeat = ss->data.heartbeat;
+  if (heartbeat.free_bytes == 0 || heartbeat.free_inodes < PLACEMENT_MIN_FREE_INODES)
+    return 0;
+  const i32 load = __atomic_load_n(&ss->in_flight, __ATOMIC_RELAXED) + heartbeat.active_requests;
+  return (double)heartbeat.free_bytes / (1 + load);
+}
+
+/**
+ * @brief Choose a storage server at random, with probability proportional to its placement score.
+ * Must be called with connected_storage_servers.list_lock held.
+ *
+ * @return connected_storage_server_node*
+ */
+connected_storage_server_node *weighted_storage_server()
+{
+  double total = 0;
   for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; cur = cur->next)
   {
-    if (strlen(cur->data.ss_tree) < minsize)
-    {
-      minsize = strlen(cur->data.ss_tree);
-      BestSS = cur;
-    }
+    total += placement_score(cur);
   }
-  if (BestSS == NULL)
+  if (total == 0)
     return NULL;
-  else
-    return &BestSS->data;
+
+  double target = total * random() / RAND_MAX;
+  connected_storage_server_node *chosen = NULL;
+  for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; cur = cur->next)
+  {
+    const double score = placement_score(cur);
+    if (score == 0)
+      continue;
+    chosen = cur;
+    if (target < score)
+      break;
+    target -= score;
+  }
+  return chosen;
+}
+
+/**
+ * @brief Pick two storage servers at random and choose the one with the higher placement score.
+ * Must be called with connected_storage_servers.list_lock held.
+ *
+ * @return connected_storage_server_node*
+ */
+connected_storage_server_node *two_choices_storage_server()
+{
+  const u32 length = connected_storage_servers.length;
+  if (length == 0)
+    return NULL;
+
+  const u32 first = random() % length;
+  u32 second = length > 1 ? random() % (length - 1) : 0;
+  if (length > 1 && second >= first)
+    ++second;
+
+  connected_storage_server_node *a = NULL;
+  connected_storage_server_node *b = NULL;
+  u32 i = 0;
+  for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; cur = cur->next, ++i)
+  {
+    if (i == first)
+      a = cur;
+    if (i == second)
+      b = cur;
+  }
+  if (a == NULL || b == NULL)
+    return a != NULL ? a : b;
+
+  const double score_a = placement_score(a);
+  const double score_b = placement_score(b);
+  if (score_a == 0 && score_b == 0)
+    return weighted_storage_server();
+  return score_a >= score_b ? a : b;
+}
+
+/**
+ * @brief Choose the storage server that new top level files and folders are placed on,
+ * according to PLACEMENT_POLICY.
+ *
+ * @return storage_server_data* NULL if no storage server can take new data, to be released with ss_release
+ */
+storage_server_data *PlaceStorageServer()
+{
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  connected_storage_server_node *chosen =
+    PLACEMENT_POLICY == PLACEMENT_WEIGHTED ? weighted_storage_server() : two_choices_storage_server();
+  if (chosen != NULL)
+    ++chosen->refs;
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+  return chosen == NULL ? NULL : &chosen->data;
+}
+
+/**
+ * @brief Count a lookup of the path cache of the tree in the metrics, see SetCacheObserver
+ *
+ * @param hit
+ */
+void count_cache_lookup(bool hit)
+{
+  metrics_add(hit ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, 1);
 }
 
 /**
@@ -274,23 +1040,98 @@ storage_server_data *MinSizeStorageServer()
  *
  * @param path
  * @param cache_flag
- * @return storage_server_data
+ * @return storage_server_data* NULL if it is not connected, to be released with ss_release
  */
 storage_server_data *ss_from_path(const char *path, bool cache_flag)
 {
   cache_flag &= strncmp(path, ".rd", 3) != 0;
-  i32 ssid = GetPathSSID(NM_Tree, path, cache_flag);
-  if (ssid != -1)
+  return ss_from_ssid(GetPathSSID(NM_Tree, path, cache_flag));
+}
+
+/**
+ * @brief Finds the connected storage server with the given ssid and returns its data
+ *
+ * @param ssid
+ * @return storage_server_data* NULL if it is not connected, to be released with ss_release
+ */
+storage_server_data *ss_from_ssid(const i32 ssid)
+{
+  if (ssid == -1)
+    return NULL;
+  storage_server_data *found = NULL;
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; cur = cur->next)
   {
-    for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; cur = cur->next)
+    if (cur->data.port_for_nm == ssid)
     {
-      if (cur->data.port_for_nm == ssid)
-      {
-        return &cur->data;
-      }
+      ++cur->refs;
+      found = &cur->data;
+      break;
     }
   }
-  return NULL;
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+  return found;
+}
+
+/**
+ * @brief Check if the storage server with the given ssid is connected
+ *
+ * @param ssid
+ * @return bool
+ */
+bool ss_connected(const i32 ssid)
+{
+  storage_server_data *ss = ss_from_ssid(ssid);
+  ss_release(ss);
+  return ss != NULL;
+}
+
+/**
+ * @brief Collect the ssids of all connected storage servers
+ *
+ * @param ss_ids output array
+ * @param max size of the output array
+ * @return u32 number of ssids collected
+ */
+u32 connected_ss_ids(u32 *ss_ids, u32 max)
+{
+  u32 count = 0;
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL && count < max;
+       cur = cur->next)
+  {
+    ss_ids[count++] = cur->data.port_for_nm;
+  }
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+  return count;
+}
+
+/**
+ * @brief Finds the storage server that a new file or folder at the path should be created on.
+ * With SHARDED_PLACEMENT, it is the owner of the path on the hash ring.
+ * Otherwise, top level paths are placed by PlaceStorageServer and the rest go with their parent.
+ *
+ * @param path
+ * @return storage_server_data* NULL if the parent does not exist or no storage server is available, to be released
+ * with ss_release
+ */
+storage_server_data *ss_for_new_path(const char *path)
+{
+  char *parent = GetParent(path);
+  const bool top_level = parent == NULL;
+  storage_server_data *parent_ss = top_level ? NULL : ss_from_path(parent, true);
+  free(parent);
+  if (!top_level && parent_ss == NULL)
+    return NULL;
+
+  if (SHARDED_PLACEMENT)
+  {
+    ss_release(parent_ss);
+    return ss_from_ssid(ring_lookup(path));
+  }
+  if (top_level)
+    return PlaceStorageServer();
+  return parent_ss;
 }
 
 /**
@@ -306,7 +1147,232 @@ i32 ss_client_port_from_path(const char *path)
   {
     return -1;
   }
-  return ss_info->port_for_client;
+  const i32 port = ss_info->port_for_client;
+  ss_release(ss_info);
+  return port;
+}
+
+/**
+ * @brief Finds the location of the primary copy of a path
+ *
+ * @param path
+ * @param locations output array, filled with at most one location
+ * @return i32 number of locations found
+ */
+i32 primary_location_from_path(const char *path, replica_location *locations)
+{
+  pthread_mutex_lock(&tree_lock);
+  storage_server_data *ss_info = ss_from_path(path, true);
+  pthread_mutex_unlock(&tree_lock);
+  if (ss_info == NULL)
+    return 0;
+
+  locations[0].port = ss_info->port_for_client;
+  locations[0].shard = (shard_spec){0, 0, 0};
+  strcpy(locations[0].path, path);
+  ss_release(ss_info);
+  return 1;
+}
+
+/**
+ * @brief Finds the connected storage server listening for clients on the given port.
+ * Must be called with connected_storage_servers.list_lock held.
+ *
+ * @param port
+ * @return connected_storage_server_node* NULL if it is not connected
+ */
+connected_storage_server_node *ss_node_from_client_port(const i32 port)
+{
+  for (connected_storage_server_node *cur = connected_storage_servers.first; cur != NULL; cur = cur->next)
+  {
+    if (cur->data.port_for_client == port)
+      return cur;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Record that a client has been sent to the storage server at the given client port
+ *
+ * @param port
+ */
+void ss_request_started(const i32 port)
+{
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  connected_storage_server_node *ss = ss_node_from_client_port(port);
+  if (ss != NULL)
+    __atomic_add_fetch(&ss->in_flight, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+}
+
+/**
+ * @brief Record that a client sent to the storage server at the given client port is done with it, or is not waited
+ * for anymore
+ *
+ * @param port
+ */
+void ss_request_ended(const i32 port)
+{
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  connected_storage_server_node *ss = ss_node_from_client_port(port);
+  // the storage server may have registered again since the request started
+  if (ss != NULL && __atomic_load_n(&ss->in_flight, __ATOMIC_RELAXED) > 0)
+    __atomic_sub_fetch(&ss->in_flight, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+}
+
+/**
+ * @brief Record the bytes a client reports having transferred with a storage server
+ *
+ * @param report
+ */
+void ss_request_finished(const transfer_report report)
+{
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  connected_storage_server_node *ss = ss_node_from_client_port(report.port);
+  if (ss != NULL)
+    __atomic_add_fetch(&ss->bytes_served, report.bytes, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+}
+
+/**
+ * @brief Check if the storage server at location a has less load than the one at location b.
+ * Load is measured in requests in flight first, and bytes served to break ties.
+ * Must be called with connected_storage_servers.list_lock held.
+ *
+ * @param a
+ * @param b
+ * @return true
+ * @return false
+ */
+bool ss_less_loaded(const replica_location *a, const replica_location *b)
+{
+  connected_storage_server_node *x = ss_node_from_client_port(a->port);
+  connected_storage_server_node *y = ss_node_from_client_port(b->port);
+  if (x == NULL || y == NULL)
+    return x != NULL;
+
+  const i32 x_in_flight = __atomic_load_n(&x->in_flight, __ATOMIC_RELAXED);
+  const i32 y_in_flight = __atomic_load_n(&y->in_flight, __ATOMIC_RELAXED);
+  if (x_in_flight != y_in_flight)
+    return x_in_flight < y_in_flight;
+  return __atomic_load_n(&x->bytes_served, __ATOMIC_RELAXED) < __atomic_load_n(&y->bytes_served, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sort locations so that the least loaded storage server comes first
+ *
+ * @param locations
+ * @param count
+ */
+void sort_locations_by_load(replica_location *locations, const i32 count)
+{
+  pthread_mutex_lock(&connected_storage_servers.list_lock);
+  for (i32 i = 1; i < count; ++i)
+  {
+    replica_location cur = locations[i];
+    i32 j = i - 1;
+    for (; j >= 0 && ss_less_loaded(&cur, &locations[j]); --j)
+    {
+      locations[j + 1] = locations[j];
+    }
+    locations[j + 1] = cur;
+  }
+  pthread_mutex_unlock(&connected_storage_servers.list_lock);
+}
+
+/**
+ * @brief Finds the shards a file can be rebuilt from, in order of their index
+ *
+ * @param path
+ * @param locations output array of size MAX_REPLICAS
+ * @return i32 number of shards found
+ */
+i32 shard_locations_from_path(const char *path, replica_location *locations)
+{
+  const char *rest = strchr(path, '/') != NULL ? strchr(path, '/') : path + strlen(path);
+  const redundancy_config config = get_redundancy_config();
+  i32 count = 0;
+  pthread_mutex_lock(&tree_lock);
+  // shards made before the code was changed are found too, the client reads the code from their headers
+  for (u32 i = 0; i < EC_MAX_SHARDS && count < MAX_REPLICAS; ++i)
+  {
+    for (Tree R = NM_Tree->ChildDirectoryLL; R != NULL; R = R->NextSibling)
+    {
+      if (strncmp(R->NodeInfo.DirectoryName, ".rd", 3) != 0)
+        continue;
+      char shard_path[MAX_STR_LEN];
+      snprintf(shard_path, sizeof(shard_path), "%s/%.*s" SHARD_SUFFIX "%u%s", R->NodeInfo.DirectoryName,
+               (i32)(rest - path), path, i, rest);
+      storage_server_data *ss_info = ss_from_path(shard_path, false);
+      if (ss_info == NULL)
+        continue;
+      locations[count].port = ss_info->port_for_client;
+      locations[count].shard = (shard_spec){config.data_shards, config.parity_shards, i};
+      strcpy(locations[count++].path, shard_path);
+      ss_release(ss_info);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&tree_lock);
+  return count;
+}
+
+/**
+ * @brief Finds every location a path can be read from in one go, least loaded first.
+ * A redundant copy is only used alongside the primary one if it was copied from the primary's current version.
+ * If the primary copy is gone, every redundant copy is used regardless, and without full copies the shards are, as
+ * the file has to be rebuilt from them.
+ *
+ * @param path
+ * @param locations output array of size MAX_REPLICAS
+ * @return i32 number of locations found
+ */
+i32 replica_locations_from_path(const char *path, replica_location *locations)
+{
+  i32 count = primary_location_from_path(path, locations);
+  if (strncmp(path, ".rd", 3) == 0)
+    return count;
+
+  replica_location stale[MAX_REPLICAS];
+  i32 stale_count = 0;
+  pthread_mutex_lock(&tree_lock);
+  const Tree Top = GetTopLevelNode(NM_Tree, path);
+  for (Tree R = NM_Tree->ChildDirectoryLL; R != NULL && count + stale_count < MAX_REPLICAS; R = R->NextSibling)
+  {
+    if (strncmp(R->NodeInfo.DirectoryName, ".rd", 3) != 0)
+      continue;
+    char rd_path[MAX_STR_LEN];
+    snprintf(rd_path, sizeof(rd_path), "%s/%s", R->NodeInfo.DirectoryName, path);
+    storage_server_data *ss_info = ss_from_path(rd_path, false);
+    if (ss_info == NULL)
+      continue;
+
+    bool fresh = false;
+    if (count > 0 && Top != NULL)
+    {
+      char rd_top_path[MAX_STR_LEN];
+      snprintf(rd_top_path, sizeof(rd_top_path), "%s/%s", R->NodeInfo.DirectoryName, Top->NodeInfo.DirectoryName);
+      const Tree ReplicaTop = GetTreeFromPath(NM_Tree, rd_top_path);
+      fresh = ReplicaTop != NULL && ReplicaTop->NodeInfo.Version == Top->NodeInfo.Version;
+    }
+
+    replica_location *location = fresh ? &locations[count++] : &stale[stale_count++];
+    location->port = ss_info->port_for_client;
+    ss_release(ss_info);
+    location->shard = (shard_spec){0, 0, 0};
+    strcpy(location->path, rd_path);
+  }
+  pthread_mutex_unlock(&tree_lock);
+
+  sort_locations_by_load(locations, count);
+  if (count == 0)
+  {
+    sort_locations_by_load(stale, stale_count);
+    memcpy(locations, stale, sizeof(replica_location) * stale_count);
+    count = stale_count;
+  }
+  return count > 0 ? count : shard_locations_from_path(path, locations);
 }
 
 /**
@@ -322,18 +1388,109 @@ i32 ss_nm_port_from_path(const char *path)
   {
     return -1;
   }
-  return ss_info->port_for_nm;
+  const i32 port = ss_info->port_for_nm;
+  ss_release(ss_info);
+  return port;
 }
 
 /**
- * @brief Finds the storage server nm port of minimum size
+ * @brief Finds the storage server nm port that new data should be placed on
  *
  * @return i32
  */
 i32 ss_nm_port_new()
 {
-  storage_server_data *new_ss = MinSizeStorageServer();
+  storage_server_data *new_ss = PlaceStorageServer();
   if (new_ss == NULL)
     return -1;
-  return new_ss->port_for_nm;
+  const i32 port = new_ss->port_for_nm;
+  ss_release(new_ss);
+  return port;
+}
+
+/**
+ * @brief Write how far the redundant copies are behind: the copies of top level nodes that are missing, older than
+ * the node or never checked, the ones no storage server could be found for, the seconds since the least recently
+ * checked one was found good, and since they were last refreshed
+ *
+ * @param out
+ */
+void render_replication_lag(message *out)
+{
+  const redundancy_config config = get_redundancy_config();
+  const time_t now = time(NULL);
+  u32 total = 0, stale = 0, unplaced = 0;
+  i64 oldest = -1;
+  pthread_mutex_lock(&tree_lock);
+  for (Tree T = NM_Tree->ChildDirectoryLL; T != NULL; T = T->NextSibling)
+  {
+    if (strncmp(T->NodeInfo.DirectoryName, ".rd", 3) == 0)
+      continue;
+    redundancy_job jobs[EC_MAX_SHARDS];
+    u32 length = 0;
+    add_redundancy_jobs(jobs, &length, T);
+    unplaced += redundant_copies_per_node(&config) - length;
+    for (u32 i = 0; i < length; ++i)
+    {
+      Tree Replica = GetTreeFromPath(NM_Tree, jobs[i].replica_path);
+      ++total;
+      if (Replica == NULL || Replica->NodeInfo.Version != T->NodeInfo.Version || Replica->NodeInfo.Verified == 0)
+        ++stale;
+      else if ((i64)(now - Replica->NodeInfo.Verified) > oldest)
+        oldest = now - Replica->NodeInfo.Verified;
+    }
+  }
+  pthread_mutex_unlock(&tree_lock);
+
+  char line[MAX_STR_LEN];
+  const i32 length = snprintf(line, MAX_STR_LEN,
+                              "replicas_total{server=\"naming\"} %u\n"
+                              "replicas_stale{server=\"naming\"} %u\n"
+                              "replicas_unplaced{server=\"naming\"} %u\n"
+                              "replica_oldest_verified_seconds{server=\"naming\"} %li\n"
+                              "replication_age_seconds{server=\"naming\"} %li\n"
+                              "replicas_verified_total{server=\"naming\"} %lu\n"
+                              "replicas_recopied_total{server=\"naming\"} %lu\n",
+                              total, stale, unplaced, oldest,
+                              last_redundancy_refresh == 0 ? -1 : (i64)(now - last_redundancy_refresh),
+                              replicas_verified, replicas_recopied);
+  message_write(out, line, length);
+}
+
+/**
+ * @brief Fetch the metrics of every connected storage server. The ones that do not answer, or send more than
+ * SS_STATS_MAX_LENGTH bytes, are skipped.
+ *
+ * @param out
+ */
+void render_storage_server_stats(message *out)
+{
+  u32 ss_ids[MAX_STORAGE_SERVERS];
+  const u32 count = connected_ss_ids(ss_ids, MAX_STORAGE_SERVERS);
+  for (u32 i = 0; i < count; ++i)
+  {
+    const i32 sockfd = try_connect_to_port(ss_ids[i]);
+    if (sockfd == -1)
+      continue;
+    const enum operation op = STATS;
+    u32 length;
+    enum status code;
+    LOG_SEND(sockfd, op);
+    // a length that is too long is not trusted, nor anything after it
+    if (recv(sockfd, &length, sizeof(length), MSG_WAITALL) != sizeof(length) || length > SS_STATS_MAX_LENGTH)
+    {
+      LOG("Skipping the stats of storage server with ssid %u\n", ss_ids[i]);
+      close(sockfd);
+      continue;
+    }
+    char *stats = malloc(length + 1);
+    if (stats != NULL)
+    {
+      receive_data_in_packets(stats, sockfd, length);
+      if (recv(sockfd, &code, sizeof(code), MSG_WAITALL) == sizeof(code) && code == SUCCESS)
+        message_write(out, stats, length);
+      free(stats);
+    }
+    close(sockfd);
+  }
 }
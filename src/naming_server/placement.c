@@ -0,0 +1,231 @@
+/**
+ * @file placement.c
+ * @brief Where the redundant copies of every top level file and folder are kept
+ * @details
+ * - The replication factor, the redundancy mode and the failure domains of storage servers are read from
+ *   PLACEMENT_CONFIG, and read again before every redundancy pass if it changed. Without it every top level node has
+ *   DEFAULT_REPLICATION_FACTOR copies, and every storage server is its own failure domain.
+ * - Every storage server keeps the copies it holds for others in a folder at its root whose name starts with ".rd"
+ * - The replica set of a node is found walking the hash ring from its name, so it only changes for a few nodes when a
+ *   storage server joins or leaves. Storage servers in failure domains that hold no copy of the node yet are taken
+ *   first.
+ *
+ * The configuration has one setting per line, and # starts a comment:
+ * - replication_factor <copies>, the primary one included
+ * - redundancy copies, or redundancy erasure <data shards> <parity shards>
+ * - domain <tag> <UUID>, the UUID being the working directory of the storage server, spaces included
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+
+struct
+{
+  redundancy_config config;
+  u32 domains_length;
+  char domain_uuids[MAX_STORAGE_SERVERS][MAX_STR_LEN];
+  char domain_tags[MAX_STORAGE_SERVERS][MAX_NAME_LEN];
+  struct timespec modified; // of the configuration last read, 0 if there was none
+  bool loaded;
+  pthread_mutex_t lock;
+} placement = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief Apply one line of the configuration
+ *
+ * @param line without its comment
+ * @return bool false if the line is not a valid setting, which is then ignored
+ */
+bool parse_placement_line(char *line)
+{
+  char key[MAX_NAME_LEN], value[MAX_NAME_LEN];
+  i32 offset = 0;
+  if (sscanf(line, "%127s %127s %n", key, value, &offset) != 2)
+    return false;
+
+  if (strcmp(key, "replication_factor") == 0)
+  {
+    const i32 factor = atoi(value);
+    if (factor < 1 || factor > MAX_REPLICAS)
+      return false;
+    placement.config.replication_factor = factor;
+  }
+  else if (strcmp(key, "redundancy") == 0 && strcmp(value, "copies") == 0)
+    placement.config.mode = REDUNDANCY_COPIES;
+  else if (strcmp(key, "redundancy") == 0 && strcmp(value, "erasure") == 0)
+  {
+    u32 data_shards, parity_shards;
+    if (sscanf(line + offset, "%u %u", &data_shards, &parity_shards) != 2 || data_shards == 0 ||
+        parity_shards == 0 || data_shards + parity_shards > EC_MAX_SHARDS)
+      return false;
+    placement.config.mode = REDUNDANCY_ERASURE;
+    placement.config.data_shards = data_shards;
+    placement.config.parity_shards = parity_shards;
+  }
+  else if (strcmp(key, "domain") == 0)
+  {
+    char *UUID = line + offset;
+    u64 end = strlen(UUID);
+    while (end > 0 && isspace(UUID[end - 1]))
+      UUID[--end] = '\0';
+    if (end == 0 || placement.domains_length == MAX_STORAGE_SERVERS)
+      return false;
+    strcpy(placement.domain_tags[placement.domains_length], value);
+    strcpy(placement.domain_uuids[placement.domains_length++], UUID);
+  }
+  else
+    return false;
+  return true;
+}
+
+/**
+ * @brief Read PLACEMENT_CONFIG if it changed since it was last read, or for the first time
+ */
+void placement_reload()
+{
+  struct stat st;
+  const struct timespec modified = stat(PLACEMENT_CONFIG, &st) == 0 ? st.st_mtim : (struct timespec){0, 0};
+  pthread_mutex_lock(&placement.lock);
+  if (placement.loaded && modified.tv_sec == placement.modified.tv_sec &&
+      modified.tv_nsec == placement.modified.tv_nsec)
+  {
+    pthread_mutex_unlock(&placement.lock);
+    return;
+  }
+
+  placement.config = (redundancy_config){DEFAULT_REPLICATION_FACTOR, DEFAULT_REDUNDANCY_MODE, DEFAULT_EC_DATA_SHARDS,
+                                         DEFAULT_EC_PARITY_SHARDS};
+  placement.domains_length = 0;
+  placement.modified = modified;
+  placement.loaded = true;
+  FILE *file = fopen(PLACEMENT_CONFIG, "r");
+  if (file != NULL)
+  {
+    char line[MAX_STR_LEN];
+    for (u32 number = 1; fgets(line, sizeof(line), file) != NULL; ++number)
+    {
+      line[strcspn(line, "#\n")] = '\0';
+      char first;
+      if (sscanf(line, " %c", &first) == 1 && !parse_placement_line(line))
+        LOG("Ignoring line %u of %s\n", number, PLACEMENT_CONFIG);
+    }
+    fclose(file);
+  }
+  const redundancy_config config = placement.config;
+  LOG("Placement: %s, replication factor %u, erasure code %u+%u, %u storage servers in failure domains\n",
+      config.mode == REDUNDANCY_COPIES ? "copies" : "erasure", config.replication_factor, config.data_shards,
+      config.parity_shards, placement.domains_length);
+  pthread_mutex_unlock(&placement.lock);
+}
+
+/**
+ * @brief Get the redundancy settings in use
+ *
+ * @return redundancy_config
+ */
+redundancy_config get_redundancy_config()
+{
+  pthread_mutex_lock(&placement.lock);
+  const redundancy_config config = placement.config;
+  pthread_mutex_unlock(&placement.lock);
+  return config;
+}
+
+/**
+ * @brief Number of redundant copies of every top level node, full or shards
+ *
+ * @param config
+ * @return u32
+ */
+u32 redundant_copies_per_node(const redundancy_config *config)
+{
+  return config->mode == REDUNDANCY_ERASURE ? config->data_shards + config->parity_shards
+                                            : config->replication_factor - 1;
+}
+
+/**
+ * @brief Find the failure domain of a storage server. Must be called with placement.lock held.
+ *
+ * @param UUID
+ * @param domain output, MAX_STR_LEN long: its tag, or its UUID if it has none
+ */
+void failure_domain(const char *UUID, char *domain)
+{
+  for (u32 i = 0; i < placement.domains_length; ++i)
+  {
+    if (strcmp(placement.domain_uuids[i], UUID) == 0)
+    {
+      // tags can not be mistaken for UUIDs, which are absolute paths
+      strcpy(domain, placement.domain_tags[i]);
+      return;
+    }
+  }
+  strcpy(domain, UUID);
+}
+
+/**
+ * @brief Find the folder a storage server keeps redundant copies in. Must be called with tree_lock held.
+ *
+ * @param ss_id
+ * @param folder output
+ * @return bool false if it has none
+ */
+bool redundancy_folder(const u32 ss_id, char *folder)
+{
+  for (Tree R = NM_Tree->ChildDirectoryLL; R != NULL; R = R->NextSibling)
+  {
+    if (strncmp(R->NodeInfo.DirectoryName, ".rd", 3) == 0 && !R->NodeInfo.IsFile && R->NodeInfo.ss_id == ss_id)
+    {
+      strcpy(folder, R->NodeInfo.DirectoryName);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Choose the storage servers holding the redundant copies of a top level node, never its own one.
+ * Walking the ring from its name, the ones in failure domains without a copy yet come first, and the others make up
+ * the number when there are not enough domains. Must be called with tree_lock held.
+ *
+ * @param T
+ * @param wanted number of storage servers, EC_MAX_SHARDS at most
+ * @param ss_ids output
+ * @param folders output, the redundancy folder of each of them
+ * @return u32 number of storage servers chosen, fewer than wanted if not enough are connected
+ */
+u32 replica_set(const Tree T, const u32 wanted, u32 *ss_ids, char (*folders)[MAX_NAME_LEN])
+{
+  u32 ring[MAX_STORAGE_SERVERS];
+  const u32 length = ring_walk(T->NodeInfo.DirectoryName, ring, MAX_STORAGE_SERVERS);
+  bool taken[MAX_STORAGE_SERVERS] = {false};
+  // of the node itself, then of every copy
+  char domains[EC_MAX_SHARDS + 1][MAX_STR_LEN];
+  u32 count = 0;
+
+  pthread_mutex_lock(&placement.lock);
+  failure_domain(T->NodeInfo.UUID, domains[0]);
+  for (u32 pass = 0; pass < 2; ++pass)
+  {
+    for (u32 i = 0; i < length && count < wanted; ++i)
+    {
+      const storage_server_data *ss = ss_from_ssid(ring[i]);
+      if (taken[i] || ring[i] == T->NodeInfo.ss_id || ss == NULL || !redundancy_folder(ring[i], folders[count]))
+      {
+        ss_release(ss);
+        continue;
+      }
+      failure_domain(ss->UUID, domains[count + 1]);
+      ss_release(ss);
+      bool spread = true;
+      for (u32 j = 0; j <= count && spread; ++j)
+        spread = strcmp(domains[j], domains[count + 1]) != 0;
+      if (pass == 0 && !spread)
+        continue;
+      ss_ids[count++] = ring[i];
+      taken[i] = true;
+    }
+  }
+  pthread_mutex_unlock(&placement.lock);
+  return count;
+}
@@ -0,0 +1,327 @@
+/**
+ * @file rebalancer.c
+ * @brief Background migration of data between storage servers
+ * @details
+ * - Periodically plans a bounded number of migrations from the current tree
+ * - With SHARDED_PLACEMENT, files are moved to the storage server that owns their path on the hash ring
+ * - Otherwise whole top level directories are moved from the fullest to the emptiest storage server
+ * - Each migration holds back new writes while it copies the data, flips the owner of each file as soon as it is on
+ *   the new storage server, and then deletes the old copy once the transfers of clients with it are over
+ * - Migrations are rate limited to REBALANCE_MOVES_PER_SECOND
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+
+typedef struct migration
+{
+  char path[MAX_STR_LEN];
+  u32 from;
+  u32 to;
+} migration;
+
+typedef struct migration_plan
+{
+  migration moves[REBALANCE_MAX_MOVES];
+  u32 length;
+} migration_plan;
+
+/**
+ * @brief Check if a top level name belongs to the redundant copies
+ *
+ * @param name
+ * @return bool
+ */
+bool is_redundant_root(const char *name)
+{
+  return strncmp(name, ".rd", 3) == 0;
+}
+
+/**
+ * @brief Count the files of a subtree owned by each storage server
+ *
+ * @param T
+ * @param ss_ids storage servers to count for
+ * @param counts output, same order as ss_ids
+ * @param length number of storage servers
+ */
+void count_files_per_ss(Tree T, const u32 *ss_ids, u64 *counts, const u32 length)
+{
+  if (T->NodeInfo.IsFile)
+  {
+    for (u32 i = 0; i < length; ++i)
+    {
+      if (ss_ids[i] == T->NodeInfo.ss_id)
+        ++counts[i];
+    }
+  }
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    count_files_per_ss(trav, ss_ids, counts, length);
+  }
+}
+
+/**
+ * @brief Count the files of a subtree
+ *
+ * @param T
+ * @return u64
+ */
+u64 count_files(Tree T)
+{
+  u64 count = T->NodeInfo.IsFile;
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    count += count_files(trav);
+  }
+  return count;
+}
+
+/**
+ * @brief Plan the move of every file that is not on the storage server owning its path on the hash ring
+ *
+ * @param T
+ * @param path path of T
+ * @param plan
+ */
+void plan_sharded_moves(Tree T, const char *path, migration_plan *plan)
+{
+  if (plan->length == REBALANCE_MAX_MOVES)
+    return;
+
+  if (T->NodeInfo.IsFile)
+  {
+    const i32 owner = ring_lookup(path);
+    if (owner != -1 && (u32)owner != T->NodeInfo.ss_id && ss_connected(T->NodeInfo.ss_id))
+    {
+      migration *move = &plan->moves[plan->length++];
+      strcpy(move->path, path);
+      move->from = T->NodeInfo.ss_id;
+      move->to = owner;
+    }
+    return;
+  }
+
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    if (T == NM_Tree && is_redundant_root(trav->NodeInfo.DirectoryName))
+      continue;
+
+    char child_path[MAX_STR_LEN];
+    if (T == NM_Tree)
+      strcpy(child_path, trav->NodeInfo.DirectoryName);
+    else
+      snprintf(child_path, MAX_STR_LEN, "%s/%s", path, trav->NodeInfo.DirectoryName);
+    plan_sharded_moves(trav, child_path, plan);
+  }
+}
+
+/**
+ * @brief Check if a path is already being moved by a plan
+ *
+ * @param plan
+ * @param path
+ * @return bool
+ */
+bool is_planned(const migration_plan *plan, const char *path)
+{
+  for (u32 i = 0; i < plan->length; ++i)
+  {
+    if (strcmp(plan->moves[i].path, path) == 0)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Plan moves of top level directories from the storage server with the most files to the one with the least,
+ * until they are within REBALANCE_MIN_IMBALANCE files of each other.
+ * A directory is only moved if it is stored entirely on one storage server and moving it reduces the imbalance.
+ *
+ * @param plan
+ */
+void plan_balancing_moves(migration_plan *plan)
+{
+  u32 ss_ids[MAX_STORAGE_SERVERS];
+  u64 counts[MAX_STORAGE_SERVERS] = {0};
+  const u32 length = connected_ss_ids(ss_ids, MAX_STORAGE_SERVERS);
+  if (length < 2)
+    return;
+  count_files_per_ss(NM_Tree, ss_ids, counts, length);
+
+  while (plan->length < REBALANCE_MAX_MOVES)
+  {
+    u32 fullest = 0, emptiest = 0;
+    for (u32 i = 1; i < length; ++i)
+    {
+      if (counts[i] > counts[fullest])
+        fullest = i;
+      if (counts[i] < counts[emptiest])
+        emptiest = i;
+    }
+    const u64 gap = counts[fullest] - counts[emptiest];
+    if (gap <= REBALANCE_MIN_IMBALANCE)
+      return;
+
+    Tree best = NULL;
+    u64 best_size = 0;
+    for (Tree trav = NM_Tree->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+    {
+      if (is_redundant_root(trav->NodeInfo.DirectoryName) || is_planned(plan, trav->NodeInfo.DirectoryName))
+        continue;
+
+      u32 owners[2];
+      if (GetSubtreeOwners(trav, owners, 2) != 1 || owners[0] != ss_ids[fullest])
+        continue;
+
+      const u64 size = count_files(trav);
+      if (size == 0 || size >= gap)
+        continue;
+      const u64 distance = size > gap / 2 ? size - gap / 2 : gap / 2 - size;
+      const u64 best_distance = best_size > gap / 2 ? best_size - gap / 2 : gap / 2 - best_size;
+      if (best == NULL || distance < best_distance)
+      {
+        best = trav;
+        best_size = size;
+      }
+    }
+    if (best == NULL)
+      return;
+
+    migration *move = &plan->moves[plan->length++];
+    strcpy(move->path, best->NodeInfo.DirectoryName);
+    move->from = ss_ids[fullest];
+    move->to = ss_ids[emptiest];
+    counts[fullest] -= best_size;
+    counts[emptiest] += best_size;
+  }
+}
+
+/**
+ * @brief Move a file or folder to another storage server.
+ * Path locks are not held while clients transfer data with storage servers, so new writes are held back and the
+ * ones in flight waited for before copying, see transfers.c. Clients can keep reading while the owner of each file is
+ * switched to the new storage server as soon as it has been copied. The old copy is deleted under a writer lock once
+ * the transfers that were given its location are over.
+ *
+ * @param move
+ * @param move_file if the node was a file when the migration was checked
+ * @param from_ss
+ * @param to_ss
+ * @return enum status
+ */
+enum status migrate_node(const migration *move, const bool move_file, const storage_server_data *from_ss,
+                         storage_server_data *to_ss)
+{
+  Tree MoveTree;
+  u32 owners[2];
+  enum status code = SHARDED_PLACEMENT ? create_parent_folders(to_ss, move->path) : SUCCESS;
+  if (code != SUCCESS)
+    return code;
+
+  const enum operation op = move_file ? COPY_FILE : COPY_FOLDER;
+  hold_writes(move->path);
+  wait_for_transfers(move->path);
+  // the node may have been deleted or renamed since it was planned, the reader lock keeps it from then on
+  AcquireReaderLock(NM_Tree, move->path);
+  pthread_mutex_lock(&tree_lock);
+  MoveTree = GetTreeFromPath(NM_Tree, move->path);
+  const bool found = MoveTree != NULL && MoveTree->NodeInfo.IsFile == move_file;
+  pthread_mutex_unlock(&tree_lock);
+  if (!found)
+  {
+    ReleaseLock(NM_Tree, move->path);
+    release_writes(move->path);
+    return NOT_FOUND;
+  }
+
+  copy_sources sources = {.op = op, .length = 0};
+  const i32 to_sockfd = connect_to_port(to_ss->port_for_nm);
+  const enum copy_type ch = RECEIVER;
+  SEND(to_sockfd, op);
+  SEND(to_sockfd, ch);
+
+  copy_file_or_folder(MoveTree, move->path, move->path, &sources, to_sockfd, to_ss->port_for_nm, to_ss->UUID);
+
+  const i8 is_file = 2;
+  SEND(to_sockfd, is_file);
+  close_copy_sources(&sources);
+  RECV(to_sockfd, code);
+  close(to_sockfd);
+  ReleaseLock(NM_Tree, move->path);
+  release_writes(move->path);
+  if (code != SUCCESS)
+    return code;
+
+  AcquireWriterLock(NM_Tree, move->path);
+  // reads given the old location before the owners were switched
+  wait_for_transfers(move->path);
+  // Files that could not be copied are still owned by the old storage server, so keep its copy
+  pthread_mutex_lock(&tree_lock);
+  MoveTree = GetTreeFromPath(NM_Tree, move->path);
+  const bool moved = MoveTree != NULL && MoveTree->NodeInfo.IsFile == move_file &&
+                     GetSubtreeOwners(MoveTree, owners, 2) == 1 && owners[0] == move->to;
+  pthread_mutex_unlock(&tree_lock);
+  if (moved)
+    code = ss_path_operation(from_ss, move_file ? DELETE_FILE : DELETE_FOLDER, move->path);
+  else
+    code = MoveTree == NULL ? NOT_FOUND : UNAVAILABLE;
+  ReleaseLock(NM_Tree, move->path);
+  return code;
+}
+
+/**
+ * @brief Move a file or folder to another storage server, if it is still entirely on the one it was planned from
+ *
+ * @param move
+ * @return enum status
+ */
+enum status execute_migration(const migration *move)
+{
+  pthread_mutex_lock(&tree_lock);
+  Tree MoveTree = GetTreeFromPath(NM_Tree, move->path);
+  storage_server_data *from_ss = ss_from_ssid(move->from);
+  storage_server_data *to_ss = ss_from_ssid(move->to);
+  u32 owners[2];
+  const bool valid = MoveTree != NULL && from_ss != NULL && to_ss != NULL &&
+                     GetSubtreeOwners(MoveTree, owners, 2) == 1 && owners[0] == move->from;
+  const bool move_file = valid && MoveTree->NodeInfo.IsFile;
+  pthread_mutex_unlock(&tree_lock);
+
+  const enum status code = valid ? migrate_node(move, move_file, from_ss, to_ss) : NOT_FOUND;
+  ss_release(from_ss);
+  ss_release(to_ss);
+  return code;
+}
+
+/**
+ * @brief Thread that periodically moves data between storage servers, for when storage servers join or leave
+ *
+ * @param arg
+ * @return void*
+ */
+void *rebalancer(void *arg)
+{
+  (void)arg;
+  while (1)
+  {
+    sleep(REBALANCE_INTERVAL);
+
+    migration_plan plan = {.length = 0};
+    pthread_mutex_lock(&tree_lock);
+    if (SHARDED_PLACEMENT)
+      plan_sharded_moves(NM_Tree, "", &plan);
+    else
+      plan_balancing_moves(&plan);
+    pthread_mutex_unlock(&tree_lock);
+
+    for (u32 i = 0; i < plan.length; ++i)
+    {
+      const enum status code = execute_migration(&plan.moves[i]);
+      LOG("Migration of %s from storage server %u to %u finished with code %i\n", plan.moves[i].path,
+          plan.moves[i].from, plan.moves[i].to, code);
+      usleep(1000000 / REBALANCE_MOVES_PER_SECOND);
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,328 @@
+/**
+ * @file transfers.c
+ * @brief Transfers of clients with storage servers, for the naming server to know when a copy is not in use
+ * @details
+ * - No lock is held while a client reads or writes on a storage server, so a transfer is recorded when its location
+ *   is sent, and forgotten when the client acknowledges it, its connection closes, or after TRANSFER_TIMEOUT seconds
+ * - A transfer counts as a request in flight on the storage server it was sent to until it is forgotten, so a client
+ *   that never acknowledges does not weigh on it for good
+ * - Deleting a copy first waits for the transfers on its path that started before, including the ones on its
+ *   redundant copies, which are recorded by the path of their original
+ * - Migrations hold back new writes to a path while it is copied, so that none is lost on the old copy
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+
+typedef struct transfer
+{
+  u64 seq;
+  const void *conn;
+  u32 request_id;
+  i32 port; // client port of the storage server it is counted against, 0 until its location is sent
+  time_t started;
+  char path[MAX_STR_LEN];
+  struct transfer *next;
+} transfer;
+
+typedef struct held_path
+{
+  char path[MAX_STR_LEN];
+  struct held_path *next;
+} held_path;
+
+struct
+{
+  transfer *head;
+  held_path *held;
+  u64 last_seq;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} transfers = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief Check if a path is a prefix path or inside it
+ *
+ * @param path
+ * @param prefix
+ * @return bool
+ */
+bool path_within(const char *path, const char *prefix)
+{
+  const u64 length = strlen(prefix);
+  return strncmp(path, prefix, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+/**
+ * @brief Path of the original a path refers to: without the redundancy folder, and without the shard suffix of its
+ * top level name
+ *
+ * @param path
+ * @param original output, MAX_STR_LEN long
+ */
+void original_path(const char *path, char *original)
+{
+  const char *slash = strchr(path, '/');
+  if (strncmp(path, ".rd", 3) != 0 || slash == NULL)
+  {
+    strcpy(original, path);
+    return;
+  }
+  strcpy(original, slash + 1);
+
+  const u64 top = strcspn(original, "/");
+  u64 end = top;
+  while (end > 0 && isdigit(original[end - 1]))
+    --end;
+  const u64 suffix = strlen(SHARD_SUFFIX);
+  if (end < top && end > suffix && strncmp(original + end - suffix, SHARD_SUFFIX, suffix) == 0)
+    memmove(original + end - suffix, original + top, strlen(original + top) + 1);
+}
+
+/**
+ * @brief Check if a path is held back from writes. Must be called with transfers.lock held.
+ *
+ * @param path
+ * @return bool
+ */
+bool writes_held(const char *path)
+{
+  for (held_path *held = transfers.held; held != NULL; held = held->next)
+  {
+    if (path_within(path, held->path))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Forget the transfers matching a condition, and stop counting them as requests in flight.
+ * Must be called with transfers.lock held.
+ *
+ * @param match
+ * @param arg passed to match
+ */
+void forget_transfers(bool (*match)(const transfer *, const void *), const void *arg)
+{
+  for (transfer **t = &transfers.head; *t != NULL;)
+  {
+    if (!match(*t, arg))
+    {
+      t = &(*t)->next;
+      continue;
+    }
+    transfer *done = *t;
+    *t = done->next;
+    if (done->port != 0)
+      ss_request_ended(done->port);
+    free(done);
+  }
+  pthread_cond_broadcast(&transfers.changed);
+}
+
+/**
+ * @brief Match the transfers started TRANSFER_TIMEOUT seconds ago or more
+ *
+ * @param t
+ * @param arg unused
+ * @return bool
+ */
+bool transfer_expired(const transfer *t, const void *arg)
+{
+  (void)arg;
+  return time(NULL) >= t->started + TRANSFER_TIMEOUT;
+}
+
+/**
+ * @brief Match the transfer with a sequence number
+ *
+ * @param t
+ * @param arg u64 sequence number
+ * @return bool
+ */
+bool transfer_with_seq(const transfer *t, const void *arg)
+{
+  return t->seq == *(const u64 *)arg;
+}
+
+/**
+ * @brief Match the transfer of a request of a connection
+ *
+ * @param t
+ * @param arg transfer with the connection and request id
+ * @return bool
+ */
+bool transfer_of_request(const transfer *t, const void *arg)
+{
+  const transfer *request = arg;
+  return t->conn == request->conn && t->request_id == request->request_id;
+}
+
+/**
+ * @brief Match the transfers of a connection
+ *
+ * @param t
+ * @param arg connection
+ * @return bool
+ */
+bool transfer_of_connection(const transfer *t, const void *arg)
+{
+  return t->conn == arg;
+}
+
+/**
+ * @brief Record a transfer of a client with a storage server, before its location is looked up.
+ * A WRITE waits for the migrations holding back writes to its path first.
+ *
+ * @param conn connection of the client
+ * @param request_id id of the request, the ACK of the client has the same one
+ * @param op
+ * @param path
+ * @return u64 sequence number of the transfer
+ */
+u64 transfer_begin(const void *conn, const u32 request_id, const enum operation op, const char *path)
+{
+  transfer *t = malloc(sizeof(transfer));
+  t->conn = conn;
+  t->request_id = request_id;
+  t->port = 0;
+  original_path(path, t->path);
+
+  pthread_mutex_lock(&transfers.lock);
+  forget_transfers(transfer_expired, NULL);
+  while (op == WRITE && writes_held(t->path))
+    pthread_cond_wait(&transfers.changed, &transfers.lock);
+  t->seq = ++transfers.last_seq;
+  t->started = time(NULL);
+  t->next = transfers.head;
+  transfers.head = t;
+  pthread_mutex_unlock(&transfers.lock);
+  return t->seq;
+}
+
+/**
+ * @brief Count a transfer as a request in flight on the storage server its location is sent for
+ *
+ * @param seq
+ * @param port client port of the storage server
+ */
+void transfer_counted(const u64 seq, const i32 port)
+{
+  pthread_mutex_lock(&transfers.lock);
+  for (transfer *t = transfers.head; t != NULL; t = t->next)
+  {
+    if (t->seq == seq)
+    {
+      t->port = port;
+      ss_request_started(port);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&transfers.lock);
+}
+
+/**
+ * @brief Forget a transfer whose location was never sent
+ *
+ * @param seq
+ */
+void transfer_end(const u64 seq)
+{
+  pthread_mutex_lock(&transfers.lock);
+  forget_transfers(transfer_with_seq, &seq);
+  pthread_mutex_unlock(&transfers.lock);
+}
+
+/**
+ * @brief Forget the transfer of a request, on its ACK
+ *
+ * @param conn
+ * @param request_id
+ */
+void transfer_acknowledged(const void *conn, const u32 request_id)
+{
+  const transfer request = {.conn = conn, .request_id = request_id};
+  pthread_mutex_lock(&transfers.lock);
+  forget_transfers(transfer_of_request, &request);
+  pthread_mutex_unlock(&transfers.lock);
+}
+
+/**
+ * @brief Forget every transfer of a connection that closed
+ *
+ * @param conn
+ */
+void transfers_closed(const void *conn)
+{
+  pthread_mutex_lock(&transfers.lock);
+  forget_transfers(transfer_of_connection, conn);
+  pthread_mutex_unlock(&transfers.lock);
+}
+
+/**
+ * @brief Wait for the transfers on a path or inside it, on any of its copies, that started before now.
+ * Transfers are not waited for more than TRANSFER_TIMEOUT seconds after they started.
+ *
+ * @param path
+ */
+void wait_for_transfers(const char *path)
+{
+  char original[MAX_STR_LEN];
+  original_path(path, original);
+
+  pthread_mutex_lock(&transfers.lock);
+  const u64 last_seq = transfers.last_seq;
+  while (1)
+  {
+    const time_t now = time(NULL);
+    time_t deadline = 0;
+    for (transfer *t = transfers.head; t != NULL; t = t->next)
+    {
+      if (t->seq <= last_seq && now < t->started + TRANSFER_TIMEOUT && path_within(t->path, original) &&
+          (deadline == 0 || t->started + TRANSFER_TIMEOUT < deadline))
+        deadline = t->started + TRANSFER_TIMEOUT;
+    }
+    if (deadline == 0)
+      break;
+    const struct timespec until = {deadline, 0};
+    pthread_cond_timedwait(&transfers.changed, &transfers.lock, &until);
+  }
+  pthread_mutex_unlock(&transfers.lock);
+}
+
+/**
+ * @brief Hold back new writes to a path and inside it, until release_writes
+ *
+ * @param path
+ */
+void hold_writes(const char *path)
+{
+  held_path *held = malloc(sizeof(held_path));
+  strcpy(held->path, path);
+  pthread_mutex_lock(&transfers.lock);
+  held->next = transfers.held;
+  transfers.held = held;
+  pthread_mutex_unlock(&transfers.lock);
+}
+
+/**
+ * @brief Let writes to a path held back by hold_writes go on
+ *
+ * @param path
+ */
+void release_writes(const char *path)
+{
+  pthread_mutex_lock(&transfers.lock);
+  for (held_path **held = &transfers.held; *held != NULL; held = &(*held)->next)
+  {
+    if (strcmp((*held)->path, path) == 0)
+    {
+      held_path *released = *held;
+      *held = released->next;
+      free(released);
+      break;
+    }
+  }
+  pthread_cond_broadcast(&transfers.changed);
+  pthread_mutex_unlock(&transfers.lock);
+}
@@ -0,0 +1,136 @@
+/**
+ * @file checksum.c
+ * @brief CRC-32C checksums of the files and folders of a storage server
+ * @details
+ * - The checksum of a file is kept in an extended attribute of the file, with the size and modification time it was
+ *   computed for, and is only computed again once the file changed
+ * - On file systems without extended attributes, checksums are computed every time they are asked for
+ * - The checksum of a folder covers the names, types and checksums of everything in it but not its own name, so a
+ *   folder and its redundant copy have the same checksum
+ * - Shards stand for the file they were made from, see shards.c
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+#include <sys/xattr.h>
+
+// Checksum of a file, as stored in its CHECKSUM_XATTR attribute
+typedef struct stored_checksum
+{
+  u32 crc;
+  u64 size;
+  i64 mtime_sec;
+  i64 mtime_nsec;
+} stored_checksum;
+
+/**
+ * @brief Remember the checksum of a file, for the version of it that is on disk now
+ *
+ * @param path
+ * @param crc
+ */
+void store_checksum(const char *path, const u32 crc)
+{
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return;
+  const stored_checksum stored = {crc, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+  setxattr(path, CHECKSUM_XATTR, &stored, sizeof(stored), 0);
+}
+
+/**
+ * @brief Get the checksum of a file, computing and storing it if the stored one is missing or out of date
+ *
+ * @param path
+ * @param crc output
+ * @return enum status
+ */
+enum status file_checksum(const char *path, u32 *crc)
+{
+  struct stat st;
+  stored_checksum stored;
+  if (stat(path, &st) == 0 && getxattr(path, CHECKSUM_XATTR, &stored, sizeof(stored)) == sizeof(stored) &&
+      stored.size == (u64)st.st_size && stored.mtime_sec == st.st_mtim.tv_sec &&
+      stored.mtime_nsec == st.st_mtim.tv_nsec)
+  {
+    *crc = stored.crc;
+    return SUCCESS;
+  }
+
+  enum status code;
+  FILE *file = open_for_reading(path, &code);
+  if (file == NULL)
+    return code;
+  char buffer[SCAN_BUFFER_SIZE];
+  *crc = 0;
+  for (size_t size; (size = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+    *crc = crc32c(*crc, buffer, size);
+  // the version that was read, which a write may have replaced in the meantime
+  if (fstat(fileno(file), &st) == 0)
+  {
+    stored = (stored_checksum){*crc, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    fsetxattr(fileno(file), CHECKSUM_XATTR, &stored, sizeof(stored), 0);
+  }
+  fclose(file);
+  return SUCCESS;
+}
+
+/**
+ * @brief Get the checksum of a file or of everything in a folder
+ *
+ * @param path
+ * @param crc output
+ * @return enum status
+ */
+enum status tree_checksum(const char *path, u32 *crc)
+{
+  struct stat st;
+  if (lstat(path, &st) == -1)
+    return errno == EACCES ? READ_PERMISSION_DENIED : NOT_FOUND;
+  if (!S_ISDIR(st.st_mode))
+    return is_shard_path(path) ? shard_checksum(path, crc) : file_checksum(path, crc);
+
+  // sorted, as the order of entries on disk differs between copies
+  struct dirent **entries;
+  const i32 count = scandir(path, &entries, NULL, alphasort);
+  if (count == -1)
+    return errno == EACCES ? READ_PERMISSION_DENIED : NOT_FOUND;
+  enum status code = SUCCESS;
+  *crc = 0;
+  for (i32 i = 0; i < count; ++i)
+  {
+    const char *name = entries[i]->d_name;
+    if (code == SUCCESS && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+        strncmp(name, WRITE_TEMP_PREFIX, strlen(WRITE_TEMP_PREFIX)) != 0)
+    {
+      char child_path[MAX_STR_LEN];
+      snprintf(child_path, MAX_STR_LEN, "%s/%s", path, name);
+      u32 child_crc;
+      code = tree_checksum(child_path, &child_crc);
+      const bool is_file = entries[i]->d_type != DT_DIR;
+      *crc = crc32c(*crc, name, strlen(name) + 1);
+      *crc = crc32c(*crc, &is_file, sizeof(is_file));
+      *crc = crc32c(*crc, &child_crc, sizeof(child_crc));
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  return code;
+}
+
+/**
+ * @brief Receive a path from the naming server and send back the checksum of what is at it
+ *
+ * @param clientfd
+ * @return enum status
+ */
+enum status send_checksum(const i32 clientfd)
+{
+  char path[MAX_STR_LEN];
+  CHECK(recv(clientfd, path, sizeof(path), MSG_WAITALL), -1);
+  path[MAX_STR_LEN - 1] = '\0';
+  u32 crc = 0;
+  const enum status code = tree_checksum(path, &crc);
+  CHECK(send(clientfd, &crc, sizeof(crc), 0), -1);
+  return code;
+}
@@ -0,0 +1,574 @@
+/**
+ * @file dedup.c
+ * @brief Copies of files that only send the content the receiving storage server does not already have
+ * @details
+ * - Files are cut into chunks of CHUNK_MIN_SIZE to CHUNK_MAX_SIZE bytes with FastCDC, which cuts where a rolling hash
+ *   of the last bytes matches a mask. An edit only changes the chunks around it, and a file that shares content with
+ *   another shares most of its chunks with it, wherever that content is.
+ * - CHUNK_STORE_DIR keeps a hard link to every file of the storage server, named by the hash of its list of chunks. A
+ *   copy of a file that is already there is only linked, sharing its disk blocks. A link stays for CHUNK_STORE_RETAIN
+ *   seconds after the last file using it is removed, so that redundant copies deleted to be copied again are reused.
+ * - An index maps the hash of a chunk to a file of the store containing it. Chunks are checked against their hash
+ *   before being reused, as files may have changed since they were indexed.
+ * - The protocol is relayed by the naming server, see receive_and_transmit_chunks
+ * - Writes replace files by renaming a new version over them, which breaks the link. Files changed in place outside the
+ *   protocol change every copy linked to them, until the redundancy scrubber copies them again.
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+#include <fcntl.h>
+
+// Normalized chunking: below CHUNK_AVG_SIZE a cut needs more bits of the hash to be zero, above it fewer
+#define CHUNK_MASK_SMALL 0x0003590703530000ULL // 15 bits set
+#define CHUNK_MASK_LARGE 0x0000d90003530000ULL // 11 bits set
+#define CHUNK_BUFFER (4 * CHUNK_MAX_SIZE)
+#define CHUNK_HASH_SEED 0x636f7079 // of the second half of chunk hashes
+
+// Where the content of a chunk can be found in the chunk store
+typedef struct chunk_location
+{
+  u64 hash[2];
+  u64 file[2]; // name of the file of the store, 0 for a free entry
+  u64 offset;
+  u32 length;
+} chunk_location;
+
+// Direct mapped table of chunk locations, newer locations replacing older ones
+struct
+{
+  chunk_location *entries;
+  pthread_mutex_t lock;
+} chunk_index = {NULL, PTHREAD_MUTEX_INITIALIZER};
+
+u64 gear[256];
+pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fill the table of the rolling hash with pseudo random values, the same on every storage server
+ */
+void gear_init()
+{
+  u64 state = 0;
+  for (i32 i = 0; i < 256; ++i)
+  {
+    // splitmix64
+    u64 z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+/**
+ * @brief Find where the chunk at the start of a buffer ends
+ *
+ * @param data
+ * @param length bytes available, at least CHUNK_MAX_SIZE unless the file ends before
+ * @return u32 length of the chunk
+ */
+u32 chunk_cut(const u8 *data, u64 length)
+{
+  if (length <= CHUNK_MIN_SIZE)
+    return length;
+  if (length > CHUNK_MAX_SIZE)
+    length = CHUNK_MAX_SIZE;
+  const u64 normal = length < CHUNK_AVG_SIZE ? length : CHUNK_AVG_SIZE;
+  u64 fingerprint = 0;
+  u64 i = CHUNK_MIN_SIZE;
+  for (; i < normal; ++i)
+  {
+    fingerprint = (fingerprint << 1) + gear[data[i]];
+    if ((fingerprint & CHUNK_MASK_SMALL) == 0)
+      return i;
+  }
+  for (; i < length; ++i)
+  {
+    fingerprint = (fingerprint << 1) + gear[data[i]];
+    if ((fingerprint & CHUNK_MASK_LARGE) == 0)
+      return i;
+  }
+  return length;
+}
+
+/**
+ * @brief Describe a chunk
+ *
+ * @param data
+ * @param length
+ * @param chunk output
+ */
+void describe_chunk(const void *data, const u32 length, chunk_ref *chunk)
+{
+  chunk->hash[0] = fast_hash(data, length, 0);
+  chunk->hash[1] = fast_hash(data, length, CHUNK_HASH_SEED);
+  chunk->length = length;
+  chunk->crc = crc32c(0, data, length);
+}
+
+/**
+ * @brief Cut a file into chunks
+ *
+ * @param fd open for reading, at its start
+ * @param chunks output, to be freed
+ * @param file_crc output, CRC-32C of the whole file
+ * @return i64 number of chunks, -1 if the file could not be read or has too many
+ */
+i64 chunk_file(const i32 fd, chunk_ref **chunks, u32 *file_crc)
+{
+  pthread_once(&gear_once, gear_init);
+  u8 *buffer = malloc(CHUNK_BUFFER);
+  u64 count = 0, capacity = 64, filled = 0, start = 0;
+  bool eof = false;
+  *chunks = malloc(sizeof(chunk_ref) * capacity);
+  *file_crc = 0;
+  while (1)
+  {
+    if (!eof && filled - start < CHUNK_MAX_SIZE)
+    {
+      memmove(buffer, buffer + start, filled - start);
+      filled -= start;
+      start = 0;
+      while (!eof && filled < CHUNK_BUFFER)
+      {
+        const i64 size = read(fd, buffer + filled, CHUNK_BUFFER - filled);
+        if (size == -1)
+        {
+          free(buffer);
+          return -1;
+        }
+        eof = size == 0;
+        filled += size;
+      }
+    }
+    if (start == filled)
+      break;
+    if (count == CHUNK_MAX_PER_FILE)
+    {
+      free(buffer);
+      return -1;
+    }
+    if (count == capacity)
+    {
+      capacity *= 2;
+      *chunks = realloc(*chunks, sizeof(chunk_ref) * capacity);
+    }
+    const u32 length = chunk_cut(buffer + start, filled - start);
+    describe_chunk(buffer + start, length, &(*chunks)[count++]);
+    *file_crc = crc32c(*file_crc, buffer + start, length);
+    start += length;
+  }
+  free(buffer);
+  return count;
+}
+
+/**
+ * @brief Path in the chunk store of the file with a list of chunks
+ *
+ * @param chunks
+ * @param count
+ * @param name output, the hash of the list
+ * @param path output, MAX_STR_LEN long
+ */
+void stored_file_path(const chunk_ref *chunks, const u64 count, u64 *name, char *path)
+{
+  name[0] = count == 0 ? 1 : 0;
+  name[1] = 0;
+  for (u64 i = 0; i < count; ++i)
+  {
+    name[0] = fast_hash(chunks[i].hash, sizeof(chunks[i].hash), name[0]);
+    name[1] = fast_hash(chunks[i].hash, sizeof(chunks[i].hash), name[1] ^ CHUNK_HASH_SEED);
+  }
+  snprintf(path, MAX_STR_LEN, CHUNK_STORE_DIR "/%016lx%016lx", name[0], name[1]);
+}
+
+/**
+ * @brief Remember where the chunks of a file of the store are
+ *
+ * @param chunks
+ * @param count
+ * @param name of the file in the store
+ */
+void index_chunks(const chunk_ref *chunks, const u64 count, const u64 *name)
+{
+  if (chunk_index.entries == NULL)
+    return;
+  pthread_mutex_lock(&chunk_index.lock);
+  u64 offset = 0;
+  for (u64 i = 0; i < count; offset += chunks[i++].length)
+  {
+    chunk_location *entry = &chunk_index.entries[chunks[i].hash[0] % CHUNK_INDEX_SIZE];
+    *entry = (chunk_location){{chunks[i].hash[0], chunks[i].hash[1]}, {name[0], name[1]}, offset, chunks[i].length};
+  }
+  pthread_mutex_unlock(&chunk_index.lock);
+}
+
+// A file of the chunk store kept open while the chunks of one file are looked up, as they mostly come from the same
+typedef struct open_stored_file
+{
+  u64 name[2];
+  i32 fd;
+} open_stored_file;
+
+/**
+ * @brief Copy a chunk from the chunk store into a file, if it is there and still has the same content
+ *
+ * @param chunk
+ * @param buffer CHUNK_MAX_SIZE long
+ * @param source file of the store opened last, updated
+ * @param fd file to write to
+ * @param offset of the chunk in that file
+ * @return bool
+ */
+bool reuse_chunk(const chunk_ref *chunk, u8 *buffer, open_stored_file *source, const i32 fd, const u64 offset)
+{
+  if (chunk_index.entries == NULL)
+    return false;
+  pthread_mutex_lock(&chunk_index.lock);
+  const chunk_location location = chunk_index.entries[chunk->hash[0] % CHUNK_INDEX_SIZE];
+  pthread_mutex_unlock(&chunk_index.lock);
+  if (location.hash[0] != chunk->hash[0] || location.hash[1] != chunk->hash[1] || location.length != chunk->length)
+    return false;
+
+  if (source->fd == -1 || source->name[0] != location.file[0] || source->name[1] != location.file[1])
+  {
+    if (source->fd != -1)
+      close(source->fd);
+    char path[MAX_STR_LEN];
+    snprintf(path, MAX_STR_LEN, CHUNK_STORE_DIR "/%016lx%016lx", location.file[0], location.file[1]);
+    source->fd = open(path, O_RDONLY);
+    source->name[0] = location.file[0];
+    source->name[1] = location.file[1];
+  }
+  if (source->fd == -1 || pread(source->fd, buffer, chunk->length, location.offset) != (i64)chunk->length)
+    return false;
+  chunk_ref found;
+  describe_chunk(buffer, chunk->length, &found);
+  return found.hash[0] == chunk->hash[0] && found.hash[1] == chunk->hash[1] && found.crc == chunk->crc &&
+         pwrite(fd, buffer, chunk->length, offset) == (i64)chunk->length;
+}
+
+/**
+ * @brief Replace a path with a link to a file of the chunk store
+ *
+ * @param stored_path
+ * @param path
+ * @return bool
+ */
+bool link_stored_file(const char *stored_path, const char *path)
+{
+  unlink(path);
+  return link(stored_path, path) == 0;
+}
+
+/**
+ * @brief Send the chunks of a file the receiver asks for, see receive_and_transmit_chunks
+ *
+ * @param file
+ * @param sockfd
+ * @return enum status reported by the receiver, UNAVAILABLE if the connection broke
+ */
+enum status send_file_chunks(FILE *file, const i32 sockfd)
+{
+  const i32 fd = fileno(file);
+  chunk_ref *chunks;
+  u32 file_crc;
+  const i64 counted = chunk_file(fd, &chunks, &file_crc);
+  // a count the naming server rejects
+  const u32 count = counted == -1 ? UINT32_MAX : counted;
+  if (send(sockfd, &count, sizeof(count), MSG_NOSIGNAL) == -1)
+  {
+    free(chunks);
+    return UNAVAILABLE;
+  }
+  if (counted == -1)
+  {
+    free(chunks);
+    return NOT_FOUND;
+  }
+  if (send(sockfd, chunks, sizeof(chunk_ref) * count, MSG_NOSIGNAL) == -1 ||
+      send(sockfd, &file_crc, sizeof(file_crc), MSG_NOSIGNAL) == -1)
+  {
+    free(chunks);
+    return UNAVAILABLE;
+  }
+
+  u32 num_missing;
+  if (recv(sockfd, &num_missing, sizeof(num_missing), MSG_WAITALL) != sizeof(num_missing) || num_missing > count)
+  {
+    free(chunks);
+    return UNAVAILABLE;
+  }
+  u32 *missing = malloc(sizeof(u32) * (num_missing + 1));
+  u8 *buffer = malloc(CHUNK_MAX_SIZE);
+  enum status code = SUCCESS;
+  enum codec codec;
+  if (recv(sockfd, missing, sizeof(u32) * num_missing, MSG_WAITALL) != (i64)(sizeof(u32) * num_missing) ||
+      recv(sockfd, &codec, sizeof(codec), MSG_WAITALL) != sizeof(codec))
+    code = UNAVAILABLE;
+  u64 offset = 0;
+  for (u32 i = 0, chunk = 0; code == SUCCESS && i < num_missing; ++i)
+  {
+    for (; chunk < missing[i] && chunk < count; ++chunk)
+      offset += chunks[chunk].length;
+    if (chunk == count)
+      break;
+    // a file changed since it was cut fails the checks of the chunk
+    const i64 size = pread(fd, buffer, chunks[chunk].length, offset);
+    memset(buffer + (size > 0 ? size : 0), 0, chunks[chunk].length - (size > 0 ? size : 0));
+    const i64 sent = send_block(sockfd, buffer, chunks[chunk].length, codec);
+    if (sent == -1)
+      code = UNAVAILABLE;
+    else
+      metrics_add(METRIC_WIRE_BYTES_SAVED, chunks[chunk].length + sizeof(block_header) - sent);
+  }
+  free(buffer);
+  free(missing);
+  free(chunks);
+  if (code == SUCCESS && recv(sockfd, &code, sizeof(code), MSG_WAITALL) != sizeof(code))
+    code = UNAVAILABLE;
+  return code;
+}
+
+/**
+ * @brief Receive a file being copied to a path, reusing the chunks already in the chunk store, see
+ * receive_and_transmit_chunks. The file is put in place only once it passed every check.
+ *
+ * @param sockfd
+ * @param path already created, empty
+ * @param mode permissions of the file
+ * @return enum status CORRUPTED if a check failed
+ */
+enum status receive_file_chunks(const i32 sockfd, const char *path, const mode_t mode)
+{
+  u32 count, file_crc, num_missing = 0;
+  CHECK(recv(sockfd, &count, sizeof(count), MSG_WAITALL), -1);
+  if (count == UINT32_MAX)
+  {
+    enum status code = CORRUPTED;
+    CHECK(send(sockfd, &code, sizeof(code), 0), -1);
+    return code;
+  }
+  chunk_ref *chunks = malloc(sizeof(chunk_ref) * (count + 1));
+  CHECK(recv(sockfd, chunks, sizeof(chunk_ref) * count, MSG_WAITALL), -1);
+  CHECK(recv(sockfd, &file_crc, sizeof(file_crc), MSG_WAITALL), -1);
+
+  u64 name[2];
+  char stored_path[MAX_STR_LEN], temp_path[MAX_STR_LEN];
+  stored_file_path(chunks, count, name, stored_path);
+  u32 *missing = malloc(sizeof(u32) * (count + 1));
+  u8 *buffer = malloc(CHUNK_MAX_SIZE);
+  enum status code = SUCCESS;
+  u64 reused = 0, received = 0;
+  i32 fd = -1;
+  u32 stored_crc;
+  if (file_checksum(stored_path, &stored_crc) == SUCCESS && stored_crc == file_crc &&
+      link_stored_file(stored_path, path))
+  {
+    for (u32 i = 0; i < count; ++i)
+      reused += chunks[i].length;
+  }
+  else
+  {
+    snprintf(temp_path, MAX_STR_LEN, CHUNK_STORE_DIR "/" WRITE_TEMP_PREFIX "XXXXXX");
+    fd = mkstemp(temp_path);
+    if (fd == -1)
+      code = WRITE_PERMISSION_DENIED;
+    open_stored_file source = {{0, 0}, -1};
+    u64 offset = 0;
+    for (u32 i = 0; fd != -1 && i < count; offset += chunks[i++].length)
+    {
+      if (reuse_chunk(&chunks[i], buffer, &source, fd, offset))
+        reused += chunks[i].length;
+      else
+        missing[num_missing++] = i;
+    }
+    if (source.fd != -1)
+      close(source.fd);
+  }
+  CHECK(send(sockfd, &num_missing, sizeof(num_missing), 0), -1);
+  CHECK(send(sockfd, missing, sizeof(u32) * num_missing, 0), -1);
+  // replicas are written in the background, where ratio matters more than speed
+  const enum codec codec = strncmp(path, ".rd", 3) == 0 ? REPLICATION_CODEC : COPY_CODEC;
+  CHECK(send(sockfd, &codec, sizeof(codec), 0), -1);
+
+  u64 offset = 0;
+  for (u32 i = 0, chunk = 0; i < num_missing; ++i)
+  {
+    for (; chunk < missing[i]; ++chunk)
+      offset += chunks[chunk].length;
+    u32 length;
+    const enum status block_code = receive_block(sockfd, buffer, CHUNK_MAX_SIZE, &length);
+    if (block_code == UNAVAILABLE)
+    {
+      code = CORRUPTED;
+      break;
+    }
+    if (block_code != SUCCESS || length != chunks[chunk].length || crc32c(0, buffer, length) != chunks[chunk].crc)
+      code = CORRUPTED;
+    else if (pwrite(fd, buffer, chunks[chunk].length, offset) != (i64)chunks[chunk].length)
+      code = WRITE_PERMISSION_DENIED;
+    received += chunks[chunk].length;
+  }
+
+  if (fd != -1)
+  {
+    // the file as it is on disk, end to end
+    u32 crc = 0;
+    u64 position = 0;
+    for (i64 size; code == SUCCESS && (size = pread(fd, buffer, CHUNK_MAX_SIZE, position)) > 0; position += size)
+      crc = crc32c(crc, buffer, size);
+    if (code == SUCCESS && crc != file_crc)
+      code = CORRUPTED;
+    if (code == SUCCESS)
+    {
+      fchmod(fd, mode & 07777);
+      unlink(stored_path);
+      link(temp_path, stored_path);
+      if (rename(temp_path, path) == -1)
+        code = WRITE_PERMISSION_DENIED;
+    }
+    close(fd);
+    unlink(temp_path);
+  }
+  if (code == SUCCESS)
+  {
+    store_checksum(path, file_crc);
+    index_chunks(chunks, count, name);
+  }
+  metrics_add(METRIC_COPY_BYTES_REUSED, reused);
+  metrics_add(METRIC_COPY_BYTES_RECEIVED, received);
+
+  free(buffer);
+  free(missing);
+  free(chunks);
+  CHECK(send(sockfd, &code, sizeof(code), 0), -1);
+  return code;
+}
+
+/**
+ * @brief Cut a file into chunks, index them, and link the file into the chunk store if it is not there
+ *
+ * @param path of a file of the storage server or of the store
+ */
+void index_file(const char *path)
+{
+  const i32 fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return;
+  chunk_ref *chunks;
+  u32 file_crc;
+  const i64 count = chunk_file(fd, &chunks, &file_crc);
+  close(fd);
+  if (count != -1)
+  {
+    u64 name[2];
+    char stored_path[MAX_STR_LEN];
+    stored_file_path(chunks, count, name, stored_path);
+    // a file of the store whose content changed is named again after it
+    const bool in_store = strncmp(path, CHUNK_STORE_DIR "/", strlen(CHUNK_STORE_DIR "/")) == 0;
+    if (strcmp(path, stored_path) == 0 ||
+        (in_store ? rename(path, stored_path) == 0 : (link(path, stored_path) == 0 || errno == EEXIST)))
+      index_chunks(chunks, count, name);
+  }
+  free(chunks);
+}
+
+/**
+ * @brief Index every file inside a folder of the storage server, leaving out what is not its content
+ *
+ * @param path
+ */
+void index_folder(const char *path)
+{
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return;
+  for (struct dirent *en = readdir(dir); en != NULL; en = readdir(dir))
+  {
+    const char *name = en->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        strncmp(name, WRITE_TEMP_PREFIX, strlen(WRITE_TEMP_PREFIX)) == 0 ||
+        (strcmp(path, ".") == 0 && (strcmp(name, TRASH_DIR) == 0 || strcmp(name, CHUNK_STORE_DIR) == 0)))
+      continue;
+    char child_path[MAX_STR_LEN];
+    if (strcmp(path, ".") == 0)
+      snprintf(child_path, MAX_STR_LEN, "%s", name);
+    else
+      snprintf(child_path, MAX_STR_LEN, "%s/%s", path, name);
+    struct stat st;
+    if (lstat(child_path, &st) == -1)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      index_folder(child_path);
+    else if (S_ISREG(st.st_mode))
+      index_file(child_path);
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Remove the files of the chunk store that no file has used for CHUNK_STORE_RETAIN seconds, and unfinished
+ * copies. With index_unused, index the ones that stay.
+ *
+ * @param index_unused
+ */
+void sweep_chunk_store(const bool index_unused)
+{
+  DIR *dir = opendir(CHUNK_STORE_DIR);
+  if (dir == NULL)
+    return;
+  const time_t now = time(NULL);
+  for (struct dirent *en = readdir(dir); en != NULL; en = readdir(dir))
+  {
+    if (strcmp(en->d_name, ".") == 0 || strcmp(en->d_name, "..") == 0)
+      continue;
+    char path[MAX_STR_LEN];
+    snprintf(path, MAX_STR_LEN, CHUNK_STORE_DIR "/%s", en->d_name);
+    struct stat st;
+    // the last unlink of another name of a file changes its status time
+    if (lstat(path, &st) == -1 || st.st_nlink > 1)
+      continue;
+    if (now - st.st_ctime > CHUNK_STORE_RETAIN)
+      unlink(path);
+    else if (index_unused && strncmp(en->d_name, WRITE_TEMP_PREFIX, strlen(WRITE_TEMP_PREFIX)) != 0)
+      index_file(path);
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Thread that indexes the files of the storage server once, and then sweeps the chunk store
+ *
+ * @param arg NULL
+ * @return void* NULL
+ */
+void *chunk_indexer(void *arg)
+{
+  (void)arg;
+  sweep_chunk_store(true);
+  index_folder(".");
+  while (1)
+  {
+    sleep(CHUNK_STORE_RETAIN / 2);
+    sweep_chunk_store(false);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Create CHUNK_STORE_DIR and start indexing. Copies are received without reusing anything if it can not be
+ * created.
+ */
+void chunk_store_init()
+{
+  if (mkdir(CHUNK_STORE_DIR, 0700) == -1 && errno != EEXIST)
+  {
+    fprintf(stderr, "Unable to create %s, copies will not reuse content\n", CHUNK_STORE_DIR);
+    return;
+  }
+  chunk_index.entries = calloc(CHUNK_INDEX_SIZE, sizeof(chunk_location));
+  pthread_t indexer_thread;
+  pthread_create(&indexer_thread, NULL, chunk_indexer, NULL);
+  pthread_detach(indexer_thread);
+}
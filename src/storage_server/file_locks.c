@@ -0,0 +1,203 @@
+/**
+ * @file file_locks.c
+ * @brief Concurrency control for the files of a storage server
+ * @details
+ * - Striped table of reader/writer locks, keyed by the path of a file. Not by its inode, as every write replaces the
+ *   inode of the file, and deduplicated files share theirs with unrelated ones.
+ * - Write leases, so that one client at a time writes a file, for at most LEASE_TIMEOUT seconds
+ * - A write goes to a temporary file next to the file and is renamed over it when complete, so readers never wait for
+ *   a write to finish and always see a whole version of the file
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+
+// Locks of the files whose path hashes to the same stripe
+typedef struct lock_stripe
+{
+  pthread_rwlock_t lock; // shared while a file is opened, exclusive while it is replaced or removed
+  pthread_mutex_t lease_lock;
+  pthread_cond_t released;
+  write_lease *leases;
+} lock_stripe;
+
+lock_stripe stripes[LOCK_STRIPES];
+
+/**
+ * @brief Initialize the lock table. Called once before any client or naming server request is handled.
+ */
+void file_locks_init()
+{
+  for (i32 i = 0; i < LOCK_STRIPES; ++i)
+  {
+    pthread_rwlock_init(&stripes[i].lock, NULL);
+    pthread_mutex_init(&stripes[i].lease_lock, NULL);
+    pthread_cond_init(&stripes[i].released, NULL);
+    stripes[i].leases = NULL;
+  }
+}
+
+/**
+ * @brief Find the stripe of a file
+ *
+ * @param path
+ * @return lock_stripe*
+ */
+lock_stripe *stripe_of(const char *path)
+{
+  return &stripes[hash_string(path) % LOCK_STRIPES];
+}
+
+/**
+ * @brief Open a file for reading. The stripe is only locked while opening, so that a file being replaced or removed
+ * is either seen whole or not at all.
+ *
+ * @param path
+ * @param code output, SUCCESS or why the file could not be opened
+ * @return FILE* NULL on failure
+ */
+FILE *open_for_reading(const char *path, enum status *code)
+{
+  lock_stripe *stripe = stripe_of(path);
+  pthread_rwlock_rdlock(&stripe->lock);
+  FILE *file = fopen(path, "r");
+  pthread_rwlock_unlock(&stripe->lock);
+  if (file == NULL)
+    *code = errno == EACCES ? READ_PERMISSION_DENIED : NOT_FOUND;
+  else
+    *code = SUCCESS;
+  return file;
+}
+
+/**
+ * @brief Take the write lease of a file, waiting at most LEASE_TIMEOUT seconds for the client holding it.
+ * A client holds a lease for at most LEASE_TIMEOUT seconds too, as its socket times out after that.
+ *
+ * @param path
+ * @param lease output, to be given up with release_write_lease if SUCCESS is returned
+ * @return enum status UNAVAILABLE if the file stayed leased to another client
+ */
+enum status acquire_write_lease(const char *path, write_lease *lease)
+{
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return errno == EACCES ? WRITE_PERMISSION_DENIED : NOT_FOUND;
+  if (!S_ISREG(st.st_mode))
+    return INVALID_TYPE;
+  if (access(path, W_OK) == -1)
+    return WRITE_PERMISSION_DENIED;
+
+  if (strlen(path) >= MAX_STR_LEN)
+    return NOT_FOUND;
+  strcpy(lease->path, path);
+  lease->mode = st.st_mode;
+  lock_stripe *stripe = stripe_of(path);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += LEASE_TIMEOUT;
+
+  pthread_mutex_lock(&stripe->lease_lock);
+  while (1)
+  {
+    bool leased = false;
+    for (write_lease *trav = stripe->leases; trav != NULL && !leased; trav = trav->next)
+    {
+      leased = strcmp(trav->path, lease->path) == 0;
+    }
+    if (!leased)
+      break;
+    if (pthread_cond_timedwait(&stripe->released, &stripe->lease_lock, &deadline) == ETIMEDOUT)
+    {
+      pthread_mutex_unlock(&stripe->lease_lock);
+      return UNAVAILABLE;
+    }
+  }
+  lease->next = stripe->leases;
+  stripe->leases = lease;
+  pthread_mutex_unlock(&stripe->lease_lock);
+  return SUCCESS;
+}
+
+/**
+ * @brief Give up a write lease
+ *
+ * @param lease
+ */
+void release_write_lease(write_lease *lease)
+{
+  lock_stripe *stripe = stripe_of(lease->path);
+  pthread_mutex_lock(&stripe->lease_lock);
+  for (write_lease **trav = &stripe->leases; *trav != NULL; trav = &(*trav)->next)
+  {
+    if (*trav == lease)
+    {
+      *trav = lease->next;
+      break;
+    }
+  }
+  pthread_cond_broadcast(&stripe->released);
+  pthread_mutex_unlock(&stripe->lease_lock);
+}
+
+/**
+ * @brief Create the temporary file a new version of a leased file is written to, in the same directory as the file
+ *
+ * @param path of the leased file
+ * @param lease
+ * @param temp_path output, MAX_STR_LEN long
+ * @return FILE* NULL on failure
+ */
+FILE *create_temp_file(const char *path, const write_lease *lease, char *temp_path)
+{
+  const char *name = strrchr(path, '/');
+  const i32 dir_length = name == NULL ? 0 : name - path + 1;
+  name = name == NULL ? path : name + 1;
+  if (snprintf(temp_path, MAX_STR_LEN, "%.*s" WRITE_TEMP_PREFIX "%s.XXXXXX", dir_length, path, name) >= MAX_STR_LEN)
+    return NULL;
+
+  const i32 fd = mkstemp(temp_path);
+  if (fd == -1)
+    return NULL;
+  fchmod(fd, lease->mode & 07777);
+  return fdopen(fd, "w");
+}
+
+/**
+ * @brief Replace a leased file with the temporary file its new version was written to.
+ * If the file was removed in the meantime, the new version is dropped instead of bringing it back.
+ *
+ * @param path
+ * @param temp_path
+ * @param lease
+ * @return enum status
+ */
+enum status commit_write(const char *path, const char *temp_path, const write_lease *lease)
+{
+  lock_stripe *stripe = stripe_of(lease->path);
+  enum status code = SUCCESS;
+  pthread_rwlock_wrlock(&stripe->lock);
+  if (access(path, F_OK) == -1)
+    code = NOT_FOUND;
+  else if (rename(temp_path, path) == -1)
+    code = errno == EACCES ? WRITE_PERMISSION_DENIED : NOT_FOUND;
+  pthread_rwlock_unlock(&stripe->lock);
+  if (code != SUCCESS)
+    unlink(temp_path);
+  return code;
+}
+
+/**
+ * @brief Remove a file, while no reader is opening it
+ *
+ * @param path
+ * @return i32 0 on success, -1 with errno set otherwise
+ */
+i32 remove_file(const char *path)
+{
+  lock_stripe *stripe = stripe_of(path);
+  pthread_rwlock_wrlock(&stripe->lock);
+  const i32 res = remove(path);
+  pthread_rwlock_unlock(&stripe->lock);
+  return res;
+}
@@ -3,23 +3,81 @@
 
 #include "../common/headers.h"
 
+#define WATCH_COALESCE_MS 100 // changes on disk are sent to the naming server at most this often
+#define WATCH_MAX_BATCH 256
+#define ALIVE_TIMEOUT 45 // seconds without alive requests after which the naming server is assumed to have dropped us
+#define LEASE_TIMEOUT 10 // seconds a client may hold the write lease of a file, and wait for one
+#define LOCK_STRIPES 64
+#define DEFERRED_DELETE true // delete folders by moving them into TRASH_DIR, and remove them in the background
+#define CHECKSUM_XATTR "user.crc32c" // extended attribute the checksum of a file is stored in
+#define CHUNK_INDEX_SIZE (1 << 18)    // chunks whose place in the chunk store is remembered
+#define CHUNK_STORE_RETAIN 300        // seconds files stay in the chunk store after the last file using them is removed
+
+// Lease of a client on writing a file, keyed by its path
+typedef struct write_lease
+{
+  char path[MAX_STR_LEN];
+  mode_t mode;
+  struct write_lease *next;
+} write_lease;
+
 extern i32 port_for_client;
 extern i32 port_for_nm;
 extern i32 port_for_alive;
+extern i32 active_requests;
+extern char inaccessible_paths[MAX_CONNECTIONS][MAX_STR_LEN];
+extern i32 num_inaccessible_paths;
 
 extern sem_t client_port_created;
 extern sem_t nm_port_created;
 extern sem_t alive_port_created;
+extern sem_t registered;
 
 // ss_to_client.c
 void *client_relay(void *arg);
 void *client_init(void *arg);
+enum status get_metadata(const char *path, metadata *meta);
 
 // ss_to_nm.c
 void *init_storage_server(void *arg);
 void *alive_relay(void *arg);
 void *naming_server_relay(void *arg);
 void *nm_communication_init(void *arg);
+ss_heartbeat get_heartbeat();
+void redundancy_folder_init();
+
+// file_locks.c
+void file_locks_init();
+FILE *open_for_reading(const char *path, enum status *code);
+enum status acquire_write_lease(const char *path, write_lease *lease);
+void release_write_lease(write_lease *lease);
+FILE *create_temp_file(const char *path, const write_lease *lease, char *temp_path);
+enum status commit_write(const char *path, const char *temp_path, const write_lease *lease);
+i32 remove_file(const char *path);
+
+// remover.c
+void remover_init();
+enum status remove_folder(const char *path);
+
+// checksum.c
+void store_checksum(const char *path, const u32 crc);
+enum status file_checksum(const char *path, u32 *crc);
+enum status tree_checksum(const char *path, u32 *crc);
+enum status send_checksum(const i32 clientfd);
+
+// dedup.c
+enum status send_file_chunks(FILE *file, const i32 sockfd);
+enum status receive_file_chunks(const i32 sockfd, const char *path, const mode_t mode);
+void chunk_store_init();
+
+// shards.c
+bool is_shard_path(const char *path);
+FILE *encode_shard(FILE *file, const char *path, const shard_spec *spec);
+enum status shard_checksum(const char *path, u32 *crc);
+
+// watcher.c
+void watch_init(Tree T);
+void *watcher(void *arg);
 
 
 #endif
@@ -15,15 +15,22 @@
 i32 port_for_client = -1;
 i32 port_for_nm = -1;
 i32 port_for_alive = -1;
+i32 active_requests = 0;
+char inaccessible_paths[MAX_CONNECTIONS][MAX_STR_LEN];
+i32 num_inaccessible_paths = 0;
 sem_t client_port_created;
 sem_t nm_port_created;
 sem_t alive_port_created;
+sem_t registered;
 
 int main()
 {
   sem_init(&client_port_created, 0, 0);
   sem_init(&nm_port_created, 0, 0);
   sem_init(&alive_port_created, 0, 0);
+  sem_init(&registered, 0, 0);
+  file_locks_init();
+  remover_init();
 
   pthread_t init_storage_server_thread, client_init_thread, alive_thread, naming_server_relay_thread;
   pthread_create(&init_storage_server_thread, NULL, init_storage_server, NULL);
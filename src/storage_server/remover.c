@@ -0,0 +1,190 @@
+/**
+ * @file remover.c
+ * @brief Recursive deletion of folders on a storage server
+ * @details
+ * - Walks a folder with openat and removes its contents with unlinkat, without spawning any process
+ * - Maps the first error met to an enum status
+ * - With DEFERRED_DELETE, a folder is renamed into TRASH_DIR right away and its contents are removed by a background
+ *   thread, so the latency of a delete does not depend on the size of the folder
+ */
+
+#define _GNU_SOURCE
+#include "../common/headers.h"
+#include "headers.h"
+#include <fcntl.h>
+
+struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  u32 pending; // folders moved to the trash since the reclaimer last looked
+} trash = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+
+/**
+ * @brief Map the errno of a failed removal to a status code
+ *
+ * @param err
+ * @return enum status
+ */
+enum status delete_status(const i32 err)
+{
+  switch (err)
+  {
+  case 0:
+    return SUCCESS;
+  case ENOENT:
+    return NOT_FOUND;
+  case ENOTDIR:
+    return INVALID_TYPE;
+  case EACCES:
+  case EPERM:
+  case EROFS:
+    return DELETE_PERMISSION_DENIED;
+  case EBUSY:
+  case ENOTEMPTY: // something was added while the folder was being emptied
+    return UNAVAILABLE;
+  default:
+    return UNKNOWN_PERMISSION_DENIED;
+  }
+}
+
+/**
+ * @brief Remove everything inside a folder, continuing past failures like `rm -r` does
+ *
+ * @param dir_fd folder the folder to empty is in
+ * @param name of the folder to empty
+ * @return i32 errno of the first failure, 0 if the folder is empty now
+ */
+i32 empty_folder_at(const i32 dir_fd, const char *name)
+{
+  const i32 fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    return errno;
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL)
+  {
+    const i32 err = errno;
+    close(fd);
+    return err;
+  }
+
+  i32 first_error = 0;
+  for (struct dirent *en = readdir(dir); en != NULL; en = readdir(dir))
+  {
+    if (strcmp(en->d_name, ".") == 0 || strcmp(en->d_name, "..") == 0)
+      continue;
+
+    i32 err = 0;
+    if (en->d_type != DT_DIR && unlinkat(fd, en->d_name, 0) == -1)
+      err = errno;
+    // EISDIR when the type was not known from the directory entry
+    if (en->d_type == DT_DIR || err == EISDIR)
+    {
+      err = empty_folder_at(fd, en->d_name);
+      if (err == 0 && unlinkat(fd, en->d_name, AT_REMOVEDIR) == -1)
+        err = errno;
+    }
+    if (err != 0 && err != ENOENT && first_error == 0)
+      first_error = err;
+  }
+  closedir(dir);
+  return first_error;
+}
+
+/**
+ * @brief Remove a folder and everything in it, right away
+ *
+ * @param path
+ * @return enum status
+ */
+enum status remove_folder_now(const char *path)
+{
+  struct stat st;
+  if (lstat(path, &st) == -1)
+    return delete_status(errno);
+  if (!S_ISDIR(st.st_mode))
+    return INVALID_TYPE;
+
+  const i32 err = empty_folder_at(AT_FDCWD, path);
+  if (err != 0)
+    return delete_status(err);
+  return rmdir(path) == -1 ? delete_status(errno) : SUCCESS;
+}
+
+/**
+ * @brief Remove a folder and everything in it.
+ * With DEFERRED_DELETE the folder is only moved into TRASH_DIR, and emptied later by the reclaimer.
+ *
+ * @param path
+ * @return enum status
+ */
+enum status remove_folder(const char *path)
+{
+  if (!DEFERRED_DELETE)
+    return remove_folder_now(path);
+
+  struct stat st;
+  if (lstat(path, &st) == -1)
+    return delete_status(errno);
+  if (!S_ISDIR(st.st_mode))
+    return INVALID_TYPE;
+
+  static u32 counter = 0;
+  char trash_path[MAX_STR_LEN];
+  snprintf(trash_path, MAX_STR_LEN, TRASH_DIR "/%lx.%u", (u64)time(NULL),
+           __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+  if (rename(path, trash_path) == -1)
+  {
+    // the trash may be unusable, in which case the folder is removed right away
+    if (errno == EXDEV || errno == ENOENT)
+      return access(path, F_OK) == -1 ? NOT_FOUND : remove_folder_now(path);
+    return delete_status(errno);
+  }
+
+  pthread_mutex_lock(&trash.lock);
+  ++trash.pending;
+  pthread_cond_signal(&trash.filled);
+  pthread_mutex_unlock(&trash.lock);
+  return SUCCESS;
+}
+
+/**
+ * @brief Thread that empties TRASH_DIR whenever folders are moved into it
+ *
+ * @param arg NULL
+ * @return void* NULL
+ */
+void *trash_reclaimer(void *arg)
+{
+  (void)arg;
+  while (1)
+  {
+    const i32 err = empty_folder_at(AT_FDCWD, TRASH_DIR);
+    if (err != 0)
+      fprintf(stderr, "Unable to empty the trash, errno %i (%s)\n", err, strerror(err));
+
+    pthread_mutex_lock(&trash.lock);
+    while (trash.pending == 0)
+      pthread_cond_wait(&trash.filled, &trash.lock);
+    trash.pending = 0;
+    pthread_mutex_unlock(&trash.lock);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Create TRASH_DIR and start reclaiming it, including anything left there by an earlier run
+ */
+void remover_init()
+{
+  if (!DEFERRED_DELETE)
+    return;
+  if (mkdir(TRASH_DIR, 0700) == -1 && errno != EEXIST)
+  {
+    fprintf(stderr, "Unable to create %s, folders will be deleted right away\n", TRASH_DIR);
+    return;
+  }
+  pthread_t reclaimer_thread;
+  pthread_create(&reclaimer_thread, NULL, trash_reclaimer, NULL);
+  pthread_detach(reclaimer_thread);
+}
@@ -0,0 +1,137 @@
+/**
+ * @file shards.c
+ * @brief Shards of the erasure code of files, kept as redundant copies instead of full ones
+ * @details
+ * - A shard is made by the storage server holding the file, when the naming server copies it as one, and is sent like
+ *   any copied file. The storage server receiving it stores it as it is.
+ * - The file is cut into stripes of k units, shard i < k holds unit i of every stripe and shard k + i the parity i of
+ *   every stripe, see common/erasure.c. The last stripe is padded with zeros.
+ * - The checksum of a shard, for the redundancy scrubber, is the checksum of the file it was made from, once the shard
+ *   is found intact. So a folder of shards has the checksum of the folder it was made from.
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+
+#define STRIPE_UNIT_ALIGNMENT 64
+
+/**
+ * @brief Check if a path is inside the redundant copy of a top level node holding one of its shards
+ *
+ * @param path
+ * @return bool
+ */
+bool is_shard_path(const char *path)
+{
+  if (strncmp(path, ".rd", 3) != 0 || strchr(path, '/') == NULL)
+    return false;
+  const char *top = strchr(path, '/') + 1;
+  const char *end = strchr(top, '/') != NULL ? strchr(top, '/') : top + strlen(top);
+  const char *digits = end;
+  while (digits > top && isdigit(digits[-1]))
+    --digits;
+  const u64 suffix = strlen(SHARD_SUFFIX);
+  return digits < end && (u64)(digits - top) > suffix && strncmp(digits - suffix, SHARD_SUFFIX, suffix) == 0;
+}
+
+/**
+ * @brief Write one shard of a file to a temporary file
+ *
+ * @param file open for reading
+ * @param path of the file, for its checksum
+ * @param spec which shard
+ * @return FILE* the shard, at its start, NULL if the shard does not exist or the file can not be read
+ */
+FILE *encode_shard(FILE *file, const char *path, const shard_spec *spec)
+{
+  const u32 k = spec->data_shards, m = spec->parity_shards, index = spec->index;
+  struct stat st;
+  // the padding too, as it is checksummed
+  shard_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SHARD_MAGIC;
+  header.spec = *spec;
+  if (k == 0 || k + m > EC_MAX_SHARDS || index >= k + m || fstat(fileno(file), &st) == -1 ||
+      file_checksum(path, &header.file_crc) != SUCCESS)
+    return NULL;
+  header.file_size = st.st_size;
+  // small files are cut in smaller units, so that each shard is about 1/k of them
+  const u64 per_shard = (header.file_size + k - 1) / k;
+  header.stripe_unit = per_shard >= EC_STRIPE_UNIT ? EC_STRIPE_UNIT
+                                                   : (per_shard + STRIPE_UNIT_ALIGNMENT) / STRIPE_UNIT_ALIGNMENT *
+                                                       STRIPE_UNIT_ALIGNMENT;
+  FILE *shard = tmpfile();
+  if (shard == NULL)
+    return NULL;
+
+  const u32 unit = header.stripe_unit;
+  const u64 stripes = (header.file_size + (u64)k * unit - 1) / ((u64)k * unit);
+  u8 *data[EC_MAX_SHARDS];
+  // a data shard only needs its own unit of every stripe
+  const u32 first = index < k ? index : 0, last = index < k ? index + 1 : k;
+  for (u32 j = first; j < last; ++j)
+    data[j] = malloc(unit);
+  u8 *parity = malloc(unit);
+
+  u32 crc = crc32c(0, &header, sizeof(header));
+  bool ok = fwrite(&header, sizeof(header), 1, shard) == 1;
+  for (u64 stripe = 0; ok && stripe < stripes; ++stripe)
+  {
+    for (u32 j = first; j < last; ++j)
+    {
+      const i64 size = pread(fileno(file), data[j], unit, (stripe * k + j) * unit);
+      memset(data[j] + (size > 0 ? size : 0), 0, unit - (size > 0 ? size : 0));
+    }
+    const u8 *out = data[first];
+    if (index >= k)
+    {
+      erasure_parity(k, index - k, (const u8 *const *)data, parity, unit);
+      out = parity;
+    }
+    crc = crc32c(crc, out, unit);
+    ok = fwrite(out, unit, 1, shard) == 1;
+  }
+  ok = ok && fwrite(&crc, sizeof(crc), 1, shard) == 1 && fflush(shard) == 0;
+
+  for (u32 j = first; j < last; ++j)
+    free(data[j]);
+  free(parity);
+  if (!ok)
+  {
+    fclose(shard);
+    return NULL;
+  }
+  rewind(shard);
+  return shard;
+}
+
+/**
+ * @brief Get the checksum of the file a shard was made from, after checking the shard against its own CRC
+ *
+ * @param path
+ * @param crc output
+ * @return enum status CORRUPTED if the shard is damaged
+ */
+enum status shard_checksum(const char *path, u32 *crc)
+{
+  // the stored checksum of the whole shard is that of everything before its CRC, continued over the CRC itself
+  u32 whole;
+  enum status code = file_checksum(path, &whole);
+  if (code != SUCCESS)
+    return code;
+  FILE *file = open_for_reading(path, &code);
+  if (file == NULL)
+    return code;
+  shard_header header;
+  u32 trailer;
+  struct stat st;
+  const bool intact = fstat(fileno(file), &st) == 0 && (u64)st.st_size >= sizeof(header) + sizeof(trailer) &&
+                      pread(fileno(file), &header, sizeof(header), 0) == sizeof(header) &&
+                      pread(fileno(file), &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == sizeof(trailer) &&
+                      header.magic == SHARD_MAGIC && crc32c(trailer, &trailer, sizeof(trailer)) == whole;
+  fclose(file);
+  if (!intact)
+    return CORRUPTED;
+  *crc = header.file_crc;
+  return SUCCESS;
+}
@@ -3,6 +3,7 @@
  * @brief Communication between a storage server and a client
  * @details
  * - Handles operations sent directly to a storage server from a client
+ * - Reads never wait for writes, as a write replaces the file only once all of it has arrived
  */
 
 #include "../common/headers.h"
@@ -39,6 +40,28 @@ void *client_init(void *arg)
 
   return NULL;
 }
+
+/**
+ * @brief Get the metadata of a file or folder
+ *
+ * @param path
+ * @param meta output
+ * @return enum status
+ */
+enum status get_metadata(const char *path, metadata *meta)
+{
+  struct stat fileinfo;
+  if (stat(path, &fileinfo) == -1)
+    return errno == EACCES ? READ_PERMISSION_DENIED : NOT_FOUND;
+
+  meta->last_modified_time = fileinfo.st_mtime;
+  meta->last_access_time = fileinfo.st_atime;
+  meta->last_status_change_time = fileinfo.st_ctime;
+  meta->size = fileinfo.st_size;
+  meta->mode = fileinfo.st_mode;
+  return SUCCESS;
+}
+
 /**
  * @brief Receives operations read, write and metadata from the client.
  * @param arg integer pointer to the client file descriptor
@@ -48,79 +71,97 @@ void *client_relay(void *arg)
 {
   const i32 clientfd = *(i32 *)arg;
   free(arg);
+  __atomic_add_fetch(&active_requests, 1, __ATOMIC_RELAXED);
+  metrics_add(METRIC_CONNECTIONS, 1);
+
+  // a stuck client must not hold a write lease forever
+  const struct timeval timeout = {LEASE_TIMEOUT, 0};
+  setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
   enum operation op;
-  CHECK(recv(clientfd, &op, sizeof(op), 0), -1);
   char path[MAX_STR_LEN];
-  CHECK(recv(clientfd, path, sizeof(path), 0), -1)
+  enum codec codec; // the client wants the file read in
+  if (recv(clientfd, &op, sizeof(op), MSG_WAITALL) != sizeof(op) ||
+      recv(clientfd, path, sizeof(path), MSG_WAITALL) != sizeof(path) ||
+      recv(clientfd, &codec, sizeof(codec), MSG_WAITALL) != sizeof(codec))
+  {
+    CHECK(close(clientfd), -1);
+    metrics_add(METRIC_CONNECTIONS, -1);
+    __atomic_sub_fetch(&active_requests, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  path[MAX_STR_LEN - 1] = '\0';
   printf("Recieved path %s\n", path);
+  const u64 start = metrics_now_us();
+  metrics_add(METRIC_IN_FLIGHT, 1);
+  metrics_add(METRIC_BYTES_IN, sizeof(op) + sizeof(path) + sizeof(codec));
+  metrics_add(METRIC_BYTES_OUT, sizeof(enum status));
 
   enum status code;
   if (op == READ)
   {
-    FILE *file = fopen(path, "r");
-    if (file == NULL)
-    {
-      if (errno == EACCES)
-        code = READ_PERMISSION_DENIED;
-      else
-        code = NOT_FOUND;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
-    }
-    else
+    FILE *file = open_for_reading(path, &code);
+    CHECK(send(clientfd, &code, sizeof(code), 0), -1);
+    if (file != NULL)
     {
-      code = SUCCESS;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
-      send_file(file, clientfd);
+      const i64 sent = send_file(file, clientfd, codec);
+      struct stat st;
+      if (sent != -1 && fstat(fileno(file), &st) == 0)
+      {
+        metrics_add(METRIC_BYTES_OUT, sent);
+        // against the same blocks sent as they are, the empty last one included
+        const u64 raw = st.st_size + ((st.st_size + TRANSFER_BLOCK_SIZE - 1) / TRANSFER_BLOCK_SIZE + 1) * sizeof(block_header);
+        if (raw > (u64)sent)
+          metrics_add(METRIC_WIRE_BYTES_SAVED, raw - sent);
+      }
       fclose(file);
     }
   }
   else if (op == WRITE)
   {
-    FILE *file = fopen(path, "w");
-    if (file == NULL)
+    write_lease lease;
+    char temp_path[MAX_STR_LEN];
+    FILE *file = NULL;
+    code = acquire_write_lease(path, &lease);
+    if (code == SUCCESS && (file = create_temp_file(path, &lease, temp_path)) == NULL)
     {
-      if (errno == EACCES)
-        code = WRITE_PERMISSION_DENIED;
-      else
-        code = NOT_FOUND;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
+      code = errno == EACCES ? WRITE_PERMISSION_DENIED : CREATE_PERMISSION_DENIED;
+      release_write_lease(&lease);
     }
-    else
+    CHECK(send(clientfd, &code, sizeof(code), 0), -1);
+
+    if (code == SUCCESS)
     {
-      code = SUCCESS;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
       char buffer[MAX_STR_LEN];
-      CHECK(recv(clientfd, buffer, sizeof(buffer), 0), -1);
-      fwrite(buffer, strlen(buffer), 1, file);
-      fclose(file);
+      u32 length;
+      // a stuck client, or a damaged block, leaves the file as it was
+      const bool received = receive_block(clientfd, buffer, sizeof(buffer), &length) == SUCCESS;
+      if (received)
+      {
+        metrics_add(METRIC_BYTES_IN, sizeof(block_header) + length);
+        fwrite(buffer, length, 1, file);
+      }
+      const bool written = fclose(file) == 0;
+      if (received && written)
+        code = commit_write(path, temp_path, &lease);
+      else
+      {
+        code = UNAVAILABLE;
+        fprintf(stderr, "Write to %s abandoned\n", path);
+        unlink(temp_path);
+      }
+      release_write_lease(&lease);
     }
   }
   else if (op == METADATA)
   {
-    struct stat fileinfo;
-    i32 res = stat(path, &fileinfo);
-    if (res == -1)
-    {
-      if (errno == EACCES)
-        code = READ_PERMISSION_DENIED;
-      else
-        code = NOT_FOUND;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
-    }
-    else
+    metadata meta;
+    code = get_metadata(path, &meta);
+    CHECK(send(clientfd, &code, sizeof(code), 0), -1);
+    if (code == SUCCESS)
     {
-      code = SUCCESS;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
-
-      metadata meta;
-      meta.last_modified_time = fileinfo.st_mtime;
-      meta.last_access_time = fileinfo.st_atime;
-      meta.last_status_change_time = fileinfo.st_ctime;
-      meta.size = fileinfo.st_size;
-      meta.mode = fileinfo.st_mode;
-
       CHECK(send(clientfd, &meta, sizeof(meta), 0), -1);
+      metrics_add(METRIC_BYTES_OUT, sizeof(meta));
     }
   }
   else
@@ -129,8 +170,12 @@ void *client_relay(void *arg)
     code = INVALID_OPERATION;
     CHECK(send(clientfd, &code, sizeof(code), 0), -1);
   }
+  metrics_record(op, metrics_now_us() - start, code != SUCCESS);
+  metrics_add(METRIC_IN_FLIGHT, -1);
 
   CHECK(close(clientfd), -1);
+  metrics_add(METRIC_CONNECTIONS, -1);
+  __atomic_sub_fetch(&active_requests, 1, __ATOMIC_RELAXED);
 
   return NULL;
 }
@@ -2,13 +2,175 @@
  * @file ss_to_nm.c
  * @brief Communication between a storage server and the naming server
  * @details
- * - Informs naming server upon initialization
+ * - Informs naming server upon initialization, and of changes to the files afterwards
  * - Responds to alive requests from the naming server
  * - Handles operations received from the naming server
  */
 
 #include "../common/headers.h"
 #include "headers.h"
+#include <fcntl.h>
+#include <poll.h>
+
+/**
+ * @brief Report the free space and current load of this storage server
+ *
+ * @return ss_heartbeat
+ */
+ss_heartbeat get_heartbeat()
+{
+  ss_heartbeat heartbeat = {0};
+  struct statvfs fs;
+  if (statvfs(".", &fs) != -1)
+  {
+    heartbeat.free_bytes = (u64)fs.f_bavail * fs.f_frsize;
+    heartbeat.free_inodes = fs.f_favail;
+  }
+  heartbeat.active_requests = __atomic_load_n(&active_requests, __ATOMIC_RELAXED);
+  return heartbeat;
+}
+
+/**
+ * @brief Scan the files of this storage server, leaving out the inaccessible paths
+ *
+ * @return Tree
+ */
+Tree scan_storage_server()
+{
+  Tree SS_Tree = InitTree();
+  InitDirectory(SS_Tree);
+  for (i32 i = 0; i < num_inaccessible_paths; i++)
+  {
+    // AddAccessibleDir(filepath, SS_Tree);
+    RemoveInaccessiblePath(SS_Tree, inaccessible_paths[i]);
+  }
+  ComputeTreeHash(SS_Tree);
+  return SS_Tree;
+}
+
+/**
+ * @brief List the children of the directories the naming server asks for while it compares trees,
+ * until it is done
+ *
+ * @param sockfd socket of the naming server
+ * @param SS_Tree
+ */
+void send_tree_summaries(const i32 sockfd, Tree SS_Tree)
+{
+  i8 more;
+  RECV(sockfd, more);
+  while (more)
+  {
+    char path[MAX_STR_LEN];
+    RECV(sockfd, path);
+    Tree T = GetTreeFromPath(SS_Tree, path);
+
+    u32 count = 0;
+    for (Tree trav = T == NULL ? NULL : T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+    {
+      ++count;
+    }
+    tree_summary_entry *entries = calloc(count + 1, sizeof(tree_summary_entry));
+    u32 i = 0;
+    for (Tree trav = T == NULL ? NULL : T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling, ++i)
+    {
+      strcpy(entries[i].name, trav->NodeInfo.DirectoryName);
+      entries[i].is_file = trav->NodeInfo.IsFile;
+      entries[i].hash = trav->NodeInfo.Hash;
+    }
+    SEND(sockfd, count);
+    send_data_in_packets(entries, sockfd, sizeof(tree_summary_entry) * count);
+    free(entries);
+
+    RECV(sockfd, more);
+  }
+}
+
+/**
+ * @brief Register with the naming server by sending only the parts of the tree that changed since it last knew this
+ * storage server. The naming server compares the hashes of both trees from the root down and asks for the children
+ * of the directories that differ.
+ *
+ * @param SS_Tree
+ * @return bool false if the naming server does not remember this storage server
+ */
+bool reconnect_to_naming_server(Tree SS_Tree)
+{
+  ss_reconnect_request request = {0};
+  request.port_for_client = port_for_client;
+  request.port_for_nm = port_for_nm;
+  request.port_for_alive = port_for_alive;
+  request.heartbeat = get_heartbeat();
+  request.tree_hash = SS_Tree->NodeInfo.Hash;
+  CHECK(getcwd(request.UUID, MAX_STR_LEN), NULL);
+
+  const i32 sockfd = connect_to_port(NM_SS_PORT);
+  const enum ss_message message = SS_RECONNECT;
+  SEND(sockfd, message);
+  send_data_in_packets(&request, sockfd, sizeof(request));
+
+  enum status code;
+  RECV(sockfd, code);
+  if (code == SUCCESS)
+    send_tree_summaries(sockfd, SS_Tree);
+  CHECK(close(sockfd), -1);
+  return code == SUCCESS;
+}
+
+/**
+ * @brief Send ports and the whole tree to the naming server
+ *
+ * @param SS_Tree
+ */
+void register_with_naming_server(Tree SS_Tree)
+{
+  if (reconnect_to_naming_server(SS_Tree))
+    return;
+
+  storage_server_data *resp = malloc(sizeof(storage_server_data));
+  SendTreeData(SS_Tree, resp->ss_tree);
+
+  resp->port_for_client = port_for_client;
+  resp->port_for_nm = port_for_nm;
+  resp->port_for_alive = port_for_alive;
+  resp->heartbeat = get_heartbeat();
+  CHECK(getcwd(resp->UUID, MAX_STR_LEN), NULL);
+
+  const i32 sockfd = connect_to_port(NM_SS_PORT);
+  const enum ss_message message = SS_REGISTER;
+  SEND(sockfd, message);
+  send_data_in_packets(resp, sockfd, sizeof(storage_server_data));
+
+  CHECK(close(sockfd), -1);
+  free(resp);
+}
+
+/**
+ * @brief Create the folder redundant copies of other storage servers are kept in, unless there is one at the root.
+ * Its name is made from the UUID, so that it stays the same and differs from those of the other storage servers.
+ */
+void redundancy_folder_init()
+{
+  DIR *root = opendir(".");
+  CHECK(root, NULL);
+  struct dirent *entry;
+  while ((entry = readdir(root)) != NULL)
+  {
+    if (strncmp(entry->d_name, ".rd", 3) == 0 && entry->d_type == DT_DIR)
+    {
+      closedir(root);
+      return;
+    }
+  }
+  closedir(root);
+
+  char UUID[MAX_STR_LEN];
+  CHECK(getcwd(UUID, MAX_STR_LEN), NULL);
+  char folder[MAX_NAME_LEN];
+  snprintf(folder, sizeof(folder), ".rd%08x", (u32)hash_string(UUID));
+  if (mkdir(folder, 0755) == -1 && errno != EEXIST)
+    fprintf(stderr, "Unable to create %s, this storage server will hold no redundant copies\n", folder);
+}
 
 /**
  * @brief Send ports and accessible paths to the naming server upon this storage server's initialization
@@ -24,38 +186,36 @@ void *init_storage_server(void *arg)
   sem_wait(&nm_port_created);
   sem_wait(&alive_port_created);
 
-  storage_server_data resp;
-
-  Tree SS_Tree = InitTree();
-
   i8 numpaths;
   scanf("%hhi", &numpaths);
-  InitDirectory(SS_Tree);
   for (i8 i = 0; i < numpaths; i++)
   {
     char filepath[MAX_STR_LEN];
     scanf("%s", filepath);
-    // AddAccessibleDir(filepath, SS_Tree);
-    RemoveInaccessiblePath(SS_Tree, filepath);
+    if (num_inaccessible_paths < MAX_CONNECTIONS)
+      strcpy(inaccessible_paths[num_inaccessible_paths++], filepath);
   }
 
-  SendTreeData(SS_Tree, resp.ss_tree);
-
-  resp.port_for_client = port_for_client;
-  resp.port_for_nm = port_for_nm;
-  resp.port_for_alive = port_for_alive;
-  CHECK(getcwd(resp.UUID, MAX_STR_LEN), NULL);
-
-  const i32 sockfd = connect_to_port(NM_SS_PORT);
-  send_data_in_packets(&resp, sockfd, sizeof(resp));
+  redundancy_folder_init();
+  Tree SS_Tree = scan_storage_server();
+  watch_init(SS_Tree);
+  chunk_store_init();
+  register_with_naming_server(SS_Tree);
   PrintTree(SS_Tree, 0);
+  DeleteTree(SS_Tree);
+  sem_post(&registered);
 
-  CHECK(close(sockfd), -1);
+  // changes made on disk from now on are sent as they happen
+  pthread_t watcher_thread;
+  pthread_create(&watcher_thread, NULL, watcher, NULL);
+  pthread_join(watcher_thread, NULL);
   return NULL;
 }
 
 /**
- * @brief Accept connection requests sent periodically from the naming server to ensure storage server is alive
+ * @brief Accept connection requests sent periodically from the naming server to ensure storage server is alive.
+ * Each one is answered with a heartbeat, which the naming server uses for placing new files and folders.
+ * Registers again if the requests stop for ALIVE_TIMEOUT seconds.
  *
  * @param arg NULL
  * @return void* NULL
@@ -69,12 +229,28 @@ void *alive_relay(void *arg)
   sem_post(&alive_port_created);
 
   printf("Listening for alive on port %i\n", port_for_alive);
+  sem_wait(&registered);
   struct sockaddr_in client_addr;
+  struct pollfd fds = {serverfd, POLLIN, 0};
   while (1)
   {
+    const i32 ready = poll(&fds, 1, ALIVE_TIMEOUT * 1000);
+    CHECK(ready, -1);
+    if (ready == 0)
+    {
+      // the naming server has stopped checking on this storage server, so it must have dropped it
+      printf("Not heard from the naming server in %i seconds, registering again\n", ALIVE_TIMEOUT);
+      Tree SS_Tree = scan_storage_server();
+      register_with_naming_server(SS_Tree);
+      DeleteTree(SS_Tree);
+      continue;
+    }
+
     socklen_t addr_size = sizeof(client_addr);
     const i32 clientfd = accept(serverfd, (struct sockaddr *)&client_addr, &addr_size);
     CHECK(clientfd, -1);
+    ss_heartbeat heartbeat = get_heartbeat();
+    send(clientfd, &heartbeat, sizeof(heartbeat), MSG_NOSIGNAL);
     CHECK(close(clientfd), -1);
   }
 
@@ -115,29 +291,37 @@ enum status send_for_copy(const i32 clientfd)
   enum status code;
   i8 rec_code;
   CHECK(recv(clientfd, &rec_code, sizeof(rec_code), 0), -1);
-  while (rec_code == 1)
+  // 1 for a file, 3 for one shard of it
+  while (rec_code == 1 || rec_code == 3)
   {
     CHECK(recv(clientfd, path, MAX_STR_LEN, 0), -1);
     printf("Received %s\n", path);
+    shard_spec spec = {0};
+    if (rec_code == 3)
+      CHECK(recv(clientfd, &spec, sizeof(spec), MSG_WAITALL), -1);
 
-    FILE *file = fopen(path, "r");
-    if (file == NULL)
+    FILE *file = open_for_reading(path, &code);
+    if (file != NULL && rec_code == 3)
     {
-      if (errno == EACCES)
-        code = READ_PERMISSION_DENIED;
-      else
-        code = NOT_FOUND;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
+      FILE *shard = encode_shard(file, path, &spec);
+      fclose(file);
+      file = shard;
+      code = shard == NULL ? INVALID_OPERATION : SUCCESS;
     }
-    else
+    CHECK(send(clientfd, &code, sizeof(code), 0), -1);
+    if (file != NULL)
     {
-      code = SUCCESS;
-      CHECK(send(clientfd, &code, sizeof(code), 0), -1);
-      transmit_file_for_writing(file, clientfd);
+      code = send_file_chunks(file, clientfd);
       fclose(file);
+      if (code != SUCCESS)
+        fprintf(stderr, "Copy of %s failed, code %i\n", path, code);
+      if (code == UNAVAILABLE)
+        break;
     }
 
-    CHECK(recv(clientfd, &rec_code, sizeof(rec_code), 0), -1);
+    // the naming server hangs up without ending the copy if the stream got out of order
+    if (recv(clientfd, &rec_code, sizeof(rec_code), 0) <= 0)
+      break;
   }
 
   return code;
@@ -145,7 +329,7 @@ enum status send_for_copy(const i32 clientfd)
 
 enum status receive_from_copy(const i32 clientfd)
 {
-  enum status code;
+  enum status code, damaged = SUCCESS;
   char path[MAX_STR_LEN];
   i8 is_file;
   CHECK(recv(clientfd, &is_file, sizeof(is_file), 0), -1);
@@ -171,27 +355,172 @@ enum status receive_from_copy(const i32 clientfd)
     }
     else
     {
-      FILE *f = fopen(path, "a");
-      if (f == NULL)
+      const i32 fd = open(path, O_WRONLY | O_CREAT, 0666);
+      struct stat st;
+      if (fd == -1 || fstat(fd, &st) == -1)
       {
         if (errno == EACCES)
           code = WRITE_PERMISSION_DENIED;
         else
           code = INVALID_PATH;
+        if (fd != -1)
+          close(fd);
         CHECK(send(clientfd, &code, sizeof(code), 0), -1);
       }
       else
       {
+        close(fd);
         code = SUCCESS;
         CHECK(send(clientfd, &code, sizeof(code), 0), -1);
-        receive_and_write_file(clientfd, f);
+        code = receive_file_chunks(clientfd, path, st.st_mode);
+        if (code != SUCCESS)
+        {
+          fprintf(stderr, "Dropping %s as it was damaged in transfer\n", path);
+          unlink(path);
+          damaged = code;
+        }
       }
     }
     CHECK(recv(clientfd, &is_file, sizeof(is_file), 0), -1);
   }
+  return damaged != SUCCESS ? damaged : code;
+}
+
+/**
+ * @brief Create or delete a file or folder
+ *
+ * @param op CREATE_FILE, DELETE_FILE, CREATE_FOLDER or DELETE_FOLDER
+ * @param path
+ * @return enum status
+ */
+enum status path_operation(const enum operation op, char *path)
+{
+  enum status code = INVALID_OPERATION;
+  if (op == CREATE_FILE)
+  {
+    FILE *f = fopen(path, "a");
+    if (f == NULL)
+    {
+      if (errno == EACCES)
+        code = WRITE_PERMISSION_DENIED;
+      else
+        code = NOT_FOUND;
+    }
+    else
+    {
+      code = SUCCESS;
+      fclose(f);
+    }
+  }
+  else if (op == DELETE_FILE)
+  {
+    i32 res = remove_file(path);
+    if (res == -1)
+    {
+      if (errno == EACCES)
+        code = DELETE_PERMISSION_DENIED;
+      else if (errno == EBUSY)
+        code = UNAVAILABLE;
+      else
+        code = NOT_FOUND;
+    }
+    else
+    {
+      code = SUCCESS;
+    }
+  }
+  else if (op == CREATE_FOLDER)
+  {
+    i32 res = mkdir(path, 0777);
+    if (res == -1)
+    {
+      if (errno == EACCES)
+        code = CREATE_PERMISSION_DENIED;
+      else if (errno == EEXIST)
+        code = ALREADY_EXISTS;
+      else
+        code = NOT_FOUND;
+    }
+    else
+    {
+      code = SUCCESS;
+    }
+  }
+  else if (op == DELETE_FOLDER)
+  {
+    code = remove_folder(path);
+  }
   return code;
 }
 
+/**
+ * @brief Create the missing parent folders of a path
+ *
+ * @param path
+ */
+void make_parent_folders(const char *path)
+{
+  char prefix[MAX_STR_LEN];
+  for (const char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+  {
+    strncpy(prefix, path, slash - path);
+    prefix[slash - path] = '\0';
+    mkdir(prefix, 0777);
+  }
+}
+
+/**
+ * @brief Perform a batch of operations sent by the naming server in order, and send back the result of each
+ *
+ * @param clientfd socket of the naming server
+ * @return enum status
+ */
+enum status batch_operation(const i32 clientfd)
+{
+  u32 count;
+  CHECK(recv(clientfd, &count, sizeof(count), MSG_WAITALL), -1);
+  if (count > MAX_BATCH_SIZE)
+    return INVALID_OPERATION;
+
+  batch_entry *entries = malloc(sizeof(batch_entry) * (count + 1));
+  batch_result *results = calloc(count + 1, sizeof(batch_result));
+  receive_data_in_packets(entries, clientfd, sizeof(batch_entry) * count);
+  for (u32 i = 0; i < count; ++i)
+  {
+    if (entries[i].op == METADATA)
+    {
+      results[i].code = get_metadata(entries[i].path, &results[i].meta);
+      continue;
+    }
+    if (entries[i].parents)
+      make_parent_folders(entries[i].path);
+    results[i].code = path_operation(entries[i].op, entries[i].path);
+  }
+  send_data_in_packets(results, clientfd, sizeof(batch_result) * count);
+
+  free(entries);
+  free(results);
+  return SUCCESS;
+}
+
+/**
+ * @brief Send the metrics of the storage server as text, preceded by its length
+ *
+ * @param clientfd socket of the naming server
+ * @return enum status
+ */
+enum status send_stats(const i32 clientfd)
+{
+  char labels[MAX_NAME_LEN];
+  snprintf(labels, sizeof(labels), "server=\"storage\",ssid=\"%i\"", port_for_nm);
+  message stats = {0};
+  metrics_render(&stats, labels);
+  CHECK(send(clientfd, &stats.length, sizeof(stats.length), 0), -1);
+  send_data_in_packets(stats.data, clientfd, stats.length);
+  message_free(&stats);
+  return SUCCESS;
+}
+
 /**
  * @brief Handles operations sent via the naming server. Sends back a status code to the naming server.
  *
@@ -202,102 +531,32 @@ void *naming_server_relay(void *arg)
 {
   const i32 clientfd = *(i32 *)arg;
   free(arg);
+  __atomic_add_fetch(&active_requests, 1, __ATOMIC_RELAXED);
 
   enum operation op;
   CHECK(recv(clientfd, &op, sizeof(op), 0), -1);
+  const u64 start = metrics_now_us();
+  metrics_add(METRIC_CONNECTIONS, 1);
+  metrics_add(METRIC_IN_FLIGHT, 1);
 
   enum status code;
   if (op == CREATE_FILE || op == DELETE_FILE || op == CREATE_FOLDER || op == DELETE_FOLDER)
   {
     char path[MAX_STR_LEN];
     CHECK(recv(clientfd, path, sizeof(path), 0), -1);
-    if (op == CREATE_FILE)
-    {
-      FILE *f = fopen(path, "a");
-      if (f == NULL)
-      {
-        if (errno == EACCES)
-          code = WRITE_PERMISSION_DENIED;
-        else
-          code = NOT_FOUND;
-      }
-      else
-      {
-        code = SUCCESS;
-        fclose(f);
-      }
-    }
-    else if (op == DELETE_FILE)
-    {
-      i32 res = remove(path);
-      if (res == -1)
-      {
-        if (errno == EACCES)
-          code = DELETE_PERMISSION_DENIED;
-        else if (errno == EBUSY)
-          code = UNAVAILABLE;
-        else
-          code = NOT_FOUND;
-      }
-      else
-      {
-        code = SUCCESS;
-      }
-    }
-    else if (op == CREATE_FOLDER)
-    {
-      i32 res = mkdir(path, 0777);
-      if (res == -1)
-      {
-        if (errno == EACCES)
-          code = CREATE_PERMISSION_DENIED;
-        else if (errno == EEXIST)
-          code = ALREADY_EXISTS;
-        else
-          code = NOT_FOUND;
-      }
-      else
-      {
-        code = SUCCESS;
-      }
-    }
-    else if (op == DELETE_FOLDER)
-    {
-      pid_t pid = fork();
-      CHECK(pid, -1);
-      if (pid == 0)
-      {
-        char *args[] = {"rm", "-r", path, NULL};
-        execvp("rm", args);
-        exit(1); // this line won't be reached if execvp succeeds
-      }
-      i32 status;
-      CHECK(wait(&status), -1);
-      if (WIFEXITED(status))
-      {
-        switch (WEXITSTATUS(status))
-        {
-        case 0:
-          code = SUCCESS;
-          break;
-        case 1:  // Operation not permitted
-        case 13: // Permission denied
-        case 30: // Read-only file system
-          code = DELETE_PERMISSION_DENIED;
-          break;
-        case 16: // Resource busy
-          code = UNAVAILABLE;
-          break;
-        default:
-          code = NOT_FOUND;
-          break;
-        }
-      }
-      else
-      {
-        code = UNKNOWN_PERMISSION_DENIED;
-      }
-    }
+    code = path_operation(op, path);
+  }
+  else if (op == BATCH)
+  {
+    code = batch_operation(clientfd);
+  }
+  else if (op == STATS)
+  {
+    code = send_stats(clientfd);
+  }
+  else if (op == CHECKSUM)
+  {
+    code = send_checksum(clientfd);
   }
   else if (op == COPY_FILE || op == COPY_FOLDER)
   {
@@ -323,9 +582,14 @@ void *naming_server_relay(void *arg)
     code = INVALID_OPERATION;
   }
 
-  CHECK(send(clientfd, &code, sizeof(code), 0), -1);
+  // a naming server that hung up in the middle of a copy has no use for the code
+  send(clientfd, &code, sizeof(code), MSG_NOSIGNAL);
+  metrics_record(op, metrics_now_us() - start, code != SUCCESS);
+  metrics_add(METRIC_IN_FLIGHT, -1);
 
   CHECK(close(clientfd), -1);
+  metrics_add(METRIC_CONNECTIONS, -1);
+  __atomic_sub_fetch(&active_requests, 1, __ATOMIC_RELAXED);
 
   return NULL;
 }
@@ -0,0 +1,405 @@
+/**
+ * @file watcher.c
+ * @brief Live sync of changes made directly on disk to the naming server
+ * @details
+ * - Watches every directory of the storage server with inotify
+ * - Turns events into additions, removals and renames of paths, merging the ones that cancel out
+ * - Sends them to the naming server in batches, at most once every WATCH_COALESCE_MS
+ * - Skips redundant copies and the paths that were made inaccessible
+ */
+
+#include "../common/headers.h"
+#include "headers.h"
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_ONLYDIR)
+
+typedef struct delta_batch
+{
+  tree_delta deltas[WATCH_MAX_BATCH];
+  u32 cookies[WATCH_MAX_BATCH]; // of removals that may still turn out to be renames
+  u32 length;
+} delta_batch;
+
+struct
+{
+  i32 fd;
+  char **paths; // path of the directory of each watch descriptor
+  i32 capacity;
+} watches = {-1, NULL, 0};
+
+/**
+ * @brief Check if a path is inside another one
+ *
+ * @param path
+ * @param prefix
+ * @return bool
+ */
+bool is_under(const char *path, const char *prefix)
+{
+  const size_t length = strlen(prefix);
+  return strncmp(path, prefix, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+/**
+ * @brief Check if changes to a path should be sent to the naming server
+ *
+ * @param path
+ * @return bool
+ */
+bool is_synced_path(const char *path)
+{
+  if (strncmp(path, ".rd", 3) == 0 || is_under(path, TRASH_DIR) || is_under(path, CHUNK_STORE_DIR))
+    return false;
+  for (i32 i = 0; i < num_inaccessible_paths; ++i)
+  {
+    if (is_under(path, inaccessible_paths[i]))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Start watching a directory
+ *
+ * @param path relative to the storage server's directory, empty for the directory itself
+ */
+void add_watch(const char *path)
+{
+  const i32 wd = inotify_add_watch(watches.fd, path[0] == '\0' ? "." : path, WATCH_MASK);
+  if (wd == -1)
+  {
+    fprintf(stderr, "Unable to watch directory: %s\n", path);
+    return;
+  }
+  if (wd >= watches.capacity)
+  {
+    const i32 capacity = wd * 2 + 16;
+    watches.paths = realloc(watches.paths, sizeof(char *) * capacity);
+    memset(watches.paths + watches.capacity, 0, sizeof(char *) * (capacity - watches.capacity));
+    watches.capacity = capacity;
+  }
+  free(watches.paths[wd]);
+  watches.paths[wd] = strdup(path);
+}
+
+/**
+ * @brief Give the watches of a directory and its subdirectories a new path after it was renamed
+ *
+ * @param old_path
+ * @param new_path
+ */
+void rename_watches(const char *old_path, const char *new_path)
+{
+  for (i32 wd = 0; wd < watches.capacity; ++wd)
+  {
+    if (watches.paths[wd] == NULL || !is_under(watches.paths[wd], old_path))
+      continue;
+    char path[MAX_STR_LEN];
+    snprintf(path, MAX_STR_LEN, "%s%s", new_path, watches.paths[wd] + strlen(old_path));
+    free(watches.paths[wd]);
+    watches.paths[wd] = strdup(path);
+  }
+}
+
+/**
+ * @brief Stop watching a directory and its subdirectories, after they were moved out of the storage server
+ *
+ * @param path
+ */
+void remove_watches(const char *path)
+{
+  for (i32 wd = 0; wd < watches.capacity; ++wd)
+  {
+    if (watches.paths[wd] != NULL && is_under(watches.paths[wd], path))
+    {
+      inotify_rm_watch(watches.fd, wd);
+      free(watches.paths[wd]);
+      watches.paths[wd] = NULL;
+    }
+  }
+}
+
+/**
+ * @brief Watch every directory of a tree
+ *
+ * @param T
+ * @param path path of T, empty for the root
+ */
+void watch_tree(Tree T, const char *path)
+{
+  add_watch(path);
+  for (Tree trav = T->ChildDirectoryLL; trav != NULL; trav = trav->NextSibling)
+  {
+    if (trav->NodeInfo.IsFile)
+      continue;
+    char child_path[MAX_STR_LEN];
+    snprintf(child_path, MAX_STR_LEN, path[0] == '\0' ? "%s%s" : "%s/%s", path, trav->NodeInfo.DirectoryName);
+    if (is_synced_path(child_path))
+      watch_tree(trav, child_path);
+  }
+}
+
+/**
+ * @brief Send the changes collected so far to the naming server, and wait for them to be applied
+ *
+ * @param batch
+ */
+void send_delta_batch(delta_batch *batch)
+{
+  if (batch->length == 0)
+    return;
+
+  const i32 sockfd = try_connect_to_port(NM_SS_PORT);
+  if (sockfd == -1)
+  {
+    fprintf(stderr, "Unable to send %u changes to the naming server\n", batch->length);
+    batch->length = 0;
+    return;
+  }
+
+  const enum ss_message message = SS_TREE_DELTA;
+  const tree_delta_header header = {port_for_nm, batch->length};
+  SEND(sockfd, message);
+  SEND(sockfd, header);
+  send_data_in_packets(batch->deltas, sockfd, sizeof(tree_delta) * batch->length);
+  enum status code;
+  RECV(sockfd, code);
+  if (code != SUCCESS)
+    fprintf(stderr, "Naming server could not apply all changes, code %i\n", code);
+  close(sockfd);
+  batch->length = 0;
+}
+
+/**
+ * @brief Remove a change from a batch
+ *
+ * @param batch
+ * @param index
+ */
+void drop_delta(delta_batch *batch, const u32 index)
+{
+  --batch->length;
+  memmove(&batch->deltas[index], &batch->deltas[index + 1], sizeof(tree_delta) * (batch->length - index));
+  memmove(&batch->cookies[index], &batch->cookies[index + 1], sizeof(u32) * (batch->length - index));
+}
+
+/**
+ * @brief Add a change to a batch, merging it with the earlier changes to the same path.
+ * The batch is sent first if it is full.
+ *
+ * @param batch
+ * @param type
+ * @param is_file
+ * @param path
+ * @param cookie inotify cookie of a removal by a rename, 0 otherwise
+ */
+void push_delta(delta_batch *batch, const enum delta_type type, const bool is_file, const char *path, const u32 cookie)
+{
+  i32 last = -1;
+  for (u32 i = 0; i < batch->length; ++i)
+  {
+    if (strcmp(batch->deltas[i].path, path) == 0 ||
+        (batch->deltas[i].type == DELTA_RENAME && strcmp(batch->deltas[i].new_path, path) == 0))
+      last = i;
+  }
+
+  if (type == DELTA_ADD && last != -1 && batch->deltas[last].type == DELTA_ADD)
+    return;
+
+  if (type == DELTA_REMOVE)
+  {
+    // nothing inside a removed directory matters anymore
+    for (u32 i = 0; i < batch->length;)
+    {
+      if (batch->deltas[i].type == DELTA_ADD && is_under(batch->deltas[i].path, path) &&
+          strcmp(batch->deltas[i].path, path) != 0)
+      {
+        drop_delta(batch, i);
+        if ((i32)i < last)
+          --last;
+      }
+      else
+        ++i;
+    }
+    // a path added and removed within the same batch never has to reach the naming server
+    if (last != -1 && batch->deltas[last].type == DELTA_ADD && cookie == 0)
+    {
+      drop_delta(batch, last);
+      return;
+    }
+  }
+
+  if (batch->length == WATCH_MAX_BATCH)
+    send_delta_batch(batch);
+
+  tree_delta *delta = &batch->deltas[batch->length];
+  delta->type = type;
+  delta->is_file = is_file;
+  strcpy(delta->path, path);
+  delta->new_path[0] = '\0';
+  batch->cookies[batch->length] = cookie;
+  ++batch->length;
+}
+
+/**
+ * @brief Report everything inside a directory that appeared on the storage server as added, and watch it
+ *
+ * @param batch
+ * @param path
+ */
+void add_new_directory(delta_batch *batch, const char *path)
+{
+  add_watch(path);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return;
+  for (struct dirent *en = readdir(dir); en != NULL; en = readdir(dir))
+  {
+    if (strcmp(en->d_name, ".") == 0 || strcmp(en->d_name, "..") == 0)
+      continue;
+    char child_path[MAX_STR_LEN];
+    snprintf(child_path, MAX_STR_LEN, "%s/%s", path, en->d_name);
+    struct stat st;
+    if (lstat(child_path, &st) == -1)
+      continue;
+    push_delta(batch, DELTA_ADD, !S_ISDIR(st.st_mode), child_path, 0);
+    if (S_ISDIR(st.st_mode))
+      add_new_directory(batch, child_path);
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Turn one inotify event into changes
+ *
+ * @param batch
+ * @param event
+ */
+void handle_event(delta_batch *batch, const struct inotify_event *event)
+{
+  if (event->mask & IN_IGNORED)
+  {
+    if (event->wd < watches.capacity)
+    {
+      free(watches.paths[event->wd]);
+      watches.paths[event->wd] = NULL;
+    }
+    return;
+  }
+  if (event->len == 0 || event->wd >= watches.capacity || watches.paths[event->wd] == NULL)
+    return;
+  // a write in progress, the file it replaces stays the same as far as the naming server is concerned
+  if (strncmp(event->name, WRITE_TEMP_PREFIX, strlen(WRITE_TEMP_PREFIX)) == 0)
+    return;
+
+  char path[MAX_STR_LEN];
+  const char *dir_path = watches.paths[event->wd];
+  snprintf(path, MAX_STR_LEN, dir_path[0] == '\0' ? "%s%s" : "%s/%s", dir_path, event->name);
+  const bool is_file = !(event->mask & IN_ISDIR);
+
+  if (event->mask & IN_MOVED_TO)
+  {
+    for (u32 i = 0; i < batch->length; ++i)
+    {
+      if (batch->cookies[i] != event->cookie)
+        continue;
+      batch->cookies[i] = 0;
+      if (!is_synced_path(path))
+        return; // moved out of sight, the removal stands
+      batch->deltas[i].type = DELTA_RENAME;
+      strcpy(batch->deltas[i].new_path, path);
+      if (!is_file)
+        rename_watches(batch->deltas[i].path, path);
+      return;
+    }
+  }
+
+  if (!is_synced_path(path))
+    return;
+
+  if (event->mask & (IN_CREATE | IN_MOVED_TO))
+  {
+    push_delta(batch, DELTA_ADD, is_file, path, 0);
+    if (!is_file)
+      add_new_directory(batch, path);
+  }
+  else if (event->mask & IN_MOVED_FROM)
+    push_delta(batch, DELTA_REMOVE, is_file, path, event->cookie);
+  else if (event->mask & IN_DELETE)
+    push_delta(batch, DELTA_REMOVE, is_file, path, 0);
+}
+
+/**
+ * @brief Start watching the storage server's directories. Called once the initial tree is scanned.
+ *
+ * @param T tree of the storage server
+ */
+void watch_init(Tree T)
+{
+  watches.fd = inotify_init1(IN_CLOEXEC);
+  if (watches.fd == -1)
+  {
+    fprintf(stderr, "Unable to watch for changes, errno %i (%s)\n", errno, strerror(errno));
+    return;
+  }
+  watch_tree(T, "");
+}
+
+/**
+ * @brief Send changes made to the storage server's directories to the naming server as they happen
+ *
+ * @param arg NULL
+ * @return void* NULL
+ */
+void *watcher(void *arg)
+{
+  (void)arg;
+  if (watches.fd == -1)
+    return NULL;
+
+  static delta_batch batch = {.length = 0};
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds = {watches.fd, POLLIN, 0};
+  // changes are collected for WATCH_COALESCE_MS after the first one of a batch, then sent together
+  u64 deadline = 0;
+  while (1)
+  {
+    i32 timeout = -1;
+    if (batch.length > 0)
+    {
+      const u64 now = metrics_now_us();
+      timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
+    }
+    if (timeout == 0)
+    {
+      for (u32 i = 0; i < batch.length; ++i)
+      {
+        if (batch.cookies[i] != 0 && !batch.deltas[i].is_file)
+          remove_watches(batch.deltas[i].path);
+        batch.cookies[i] = 0;
+      }
+      send_delta_batch(&batch);
+      continue;
+    }
+
+    const i32 ready = poll(&fds, 1, timeout);
+    CHECK(ready, -1);
+    if (ready == 0)
+      continue;
+
+    const bool empty = batch.length == 0;
+    const i64 size = read(watches.fd, buffer, sizeof(buffer));
+    CHECK(size, -1);
+    for (i64 offset = 0; offset < size;)
+    {
+      const struct inotify_event *event = (const struct inotify_event *)&buffer[offset];
+      handle_event(&batch, event);
+      offset += sizeof(struct inotify_event) + event->len;
+    }
+    if (empty)
+      deadline = metrics_now_us() + WATCH_COALESCE_MS * 1000;
+  }
+  return NULL;
+}